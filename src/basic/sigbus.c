@@ -26,8 +26,6 @@
 #include "sigbus.h"
 #include "util.h"
 
-#define SIGBUS_QUEUE_MAX 64
-
 static struct sigaction old_sigaction;
 static unsigned n_installed = 0;
 
@@ -39,7 +37,7 @@ static unsigned n_installed = 0;
 static void* volatile sigbus_queue[SIGBUS_QUEUE_MAX];
 static volatile sig_atomic_t n_sigbus_queue = 0;
 
-static void sigbus_push(void *addr) {
+void sigbus_push(void *addr) {
         unsigned u;
 
         assert(addr);
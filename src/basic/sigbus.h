@@ -19,7 +19,10 @@
   along with systemd; If not, see <http://www.gnu.org/licenses/>.
 ***/
 
+#define SIGBUS_QUEUE_MAX 64
+
 void sigbus_install(void);
 void sigbus_reset(void);
 
+void sigbus_push(void *addr);
 int sigbus_pop(void **ret);
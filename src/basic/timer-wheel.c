@@ -0,0 +1,302 @@
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+/*
+ * Hierarchical Timer Wheel
+ *
+ * Keeps entries ordered by an usec_t key, like a prioq would, but
+ * insertion and removal are O(1), which matters when many timeouts
+ * are re-armed all the time. Finding the smallest key is
+ * O(levels), and popping entries in order costs O(levels) amortized
+ * per entry.
+ *
+ * Time is cut into ticks of TICK_USEC. Each level has 64 slots, the
+ * slots of level 0 are one tick wide, those of every further level
+ * 64 times as wide as the ones of the level below. An entry goes into
+ * the lowest level where it is less than 64 slots ahead of the
+ * current tick. When the current tick reaches the start of a slot of
+ * a higher level, the entries of that slot are cascaded down, so that
+ * each entry moves at most once per level during its life.
+ *
+ * Unlike the usual timer wheel this does not round keys: every slot
+ * caches the smallest key in it, so that timer_wheel_peek() returns
+ * the exact minimum, and timer_wheel_pop() only returns entries whose
+ * key has really been reached.
+ */
+
+#include <stdlib.h>
+
+#include "alloc-util.h"
+#include "timer-wheel.h"
+
+#define TICK_BITS 10
+#define TICK_USEC (1ULL << TICK_BITS)
+
+#define LEVEL_BITS 6
+#define LEVEL_SLOTS (1U << LEVEL_BITS)
+#define LEVEL_MASK ((uint64_t) LEVEL_SLOTS - 1)
+
+/* Enough levels to cover all 64bit keys */
+#define LEVELS ((64 - TICK_BITS + LEVEL_BITS - 1) / LEVEL_BITS)
+
+struct timer_wheel_slot {
+        LIST_HEAD(TimerWheelEntry, entries);
+        usec_t min;
+        bool min_valid;
+};
+
+struct TimerWheel {
+        /* The current tick, everything in earlier ticks has been
+         * popped already */
+        uint64_t clk;
+        unsigned n_entries;
+
+        uint64_t occupied[LEVELS];
+        struct timer_wheel_slot slots[LEVELS * LEVEL_SLOTS];
+};
+
+TimerWheel *timer_wheel_new(usec_t now) {
+        TimerWheel *w;
+
+        w = new0(TimerWheel, 1);
+        if (!w)
+                return NULL;
+
+        w->clk = now >> TICK_BITS;
+        return w;
+}
+
+TimerWheel *timer_wheel_free(TimerWheel *w) {
+        free(w);
+        return NULL;
+}
+
+static unsigned level_shift(unsigned level) {
+        return level * LEVEL_BITS;
+}
+
+static unsigned level_current(TimerWheel *w, unsigned level) {
+        return (w->clk >> level_shift(level)) & LEVEL_MASK;
+}
+
+/* Returns how many slots after the current one the first occupied
+ * slot of the level is, or -1 if the level is empty. */
+static int level_first(TimerWheel *w, unsigned level, unsigned skip) {
+        uint64_t m;
+        unsigned c;
+
+        m = w->occupied[level];
+        c = level_current(w, level);
+        if (c > 0)
+                m = (m >> c) | (m << (LEVEL_SLOTS - c));
+
+        m &= ~(uint64_t) 0 << skip;
+        if (m == 0)
+                return -1;
+
+        return __builtin_ctzll(m);
+}
+
+static void slot_add(TimerWheel *w, TimerWheelEntry *e) {
+        struct timer_wheel_slot *s;
+        uint64_t tick;
+        unsigned level;
+
+        tick = MAX(e->key >> TICK_BITS, w->clk);
+
+        for (level = 0; level < LEVELS - 1; level++)
+                if ((tick >> level_shift(level)) - (w->clk >> level_shift(level)) < LEVEL_SLOTS)
+                        break;
+
+        e->slot = level * LEVEL_SLOTS + ((tick >> level_shift(level)) & LEVEL_MASK);
+        s = w->slots + e->slot;
+
+        if (!s->entries) {
+                s->min = e->key;
+                s->min_valid = true;
+                w->occupied[level] |= (uint64_t) 1 << (e->slot % LEVEL_SLOTS);
+        } else if (s->min_valid && e->key < s->min)
+                s->min = e->key;
+
+        LIST_PREPEND(entries, s->entries, e);
+        w->n_entries++;
+}
+
+void timer_wheel_put(TimerWheel *w, TimerWheelEntry *e, usec_t key) {
+        assert(w);
+        assert(e);
+
+        timer_wheel_remove(w, e);
+
+        e->key = key;
+        slot_add(w, e);
+}
+
+void timer_wheel_remove(TimerWheel *w, TimerWheelEntry *e) {
+        struct timer_wheel_slot *s;
+
+        assert(w);
+        assert(e);
+
+        if (e->slot == TIMER_WHEEL_IDX_NULL)
+                return;
+
+        assert(e->slot < LEVELS * LEVEL_SLOTS);
+        assert(w->n_entries > 0);
+
+        s = w->slots + e->slot;
+        LIST_REMOVE(entries, s->entries, e);
+
+        if (!s->entries) {
+                s->min_valid = false;
+                w->occupied[e->slot / LEVEL_SLOTS] &= ~((uint64_t) 1 << (e->slot % LEVEL_SLOTS));
+        } else if (s->min_valid && e->key == s->min)
+                s->min_valid = false;
+
+        e->slot = TIMER_WHEEL_IDX_NULL;
+        w->n_entries--;
+}
+
+static usec_t slot_min(struct timer_wheel_slot *s) {
+        TimerWheelEntry *e;
+
+        if (s->min_valid)
+                return s->min;
+
+        assert(s->entries);
+
+        s->min = USEC_INFINITY;
+        LIST_FOREACH(entries, e, s->entries)
+                s->min = MIN(s->min, e->key);
+
+        s->min_valid = true;
+        return s->min;
+}
+
+usec_t timer_wheel_peek(TimerWheel *w) {
+        usec_t m = USEC_INFINITY;
+        unsigned level;
+
+        if (!w || w->n_entries == 0)
+                return USEC_INFINITY;
+
+        /* Within each level the slots are ordered by time, starting
+         * with the current one, hence only the first occupied slot of
+         * each level needs to be looked at. */
+        for (level = 0; level < LEVELS; level++) {
+                int d;
+
+                d = level_first(w, level, 0);
+                if (d < 0)
+                        continue;
+
+                m = MIN(m, slot_min(w->slots + level * LEVEL_SLOTS + ((level_current(w, level) + d) & LEVEL_MASK)));
+        }
+
+        return m;
+}
+
+static uint64_t next_tick(TimerWheel *w) {
+        uint64_t t = UINT64_MAX;
+        unsigned level;
+
+        /* The first tick after the current one at which either a slot
+         * of level 0 is due, or a slot of a higher level needs to be
+         * cascaded */
+        for (level = 0; level < LEVELS; level++) {
+                int d;
+
+                d = level_first(w, level, 1);
+                if (d < 0)
+                        continue;
+
+                t = MIN(t, ((w->clk >> level_shift(level)) + d) << level_shift(level));
+        }
+
+        return t;
+}
+
+static void cascade(TimerWheel *w, unsigned level) {
+        struct timer_wheel_slot *s;
+        TimerWheelEntry *e, *n;
+        unsigned i;
+
+        i = level_current(w, level);
+        s = w->slots + level * LEVEL_SLOTS + i;
+
+        e = s->entries;
+        if (!e)
+                return;
+
+        s->entries = NULL;
+        s->min_valid = false;
+        w->occupied[level] &= ~((uint64_t) 1 << i);
+
+        for (; e; e = n) {
+                n = e->entries_next;
+
+                w->n_entries--;
+                slot_add(w, e);
+        }
+}
+
+TimerWheelEntry *timer_wheel_pop(TimerWheel *w, usec_t now) {
+        uint64_t target;
+
+        if (!w)
+                return NULL;
+
+        target = now >> TICK_BITS;
+
+        for (;;) {
+                TimerWheelEntry *e;
+                unsigned level;
+
+                LIST_FOREACH(entries, e, w->slots[w->clk & LEVEL_MASK].entries)
+                        if (e->key <= now) {
+                                timer_wheel_remove(w, e);
+                                return e;
+                        }
+
+                if (w->clk >= target)
+                        return NULL;
+
+                if (w->n_entries == 0) {
+                        w->clk = target;
+                        return NULL;
+                }
+
+                /* Nothing left in the current tick, move on to the
+                 * next one where there is something to do */
+                w->clk = MIN(next_tick(w), target);
+
+                for (level = LEVELS - 1; level > 0; level--)
+                        if ((w->clk & ((UINT64_C(1) << level_shift(level)) - 1)) == 0)
+                                cascade(w, level);
+        }
+}
+
+unsigned timer_wheel_size(TimerWheel *w) {
+        if (!w)
+                return 0;
+
+        return w->n_entries;
+}
+
+bool timer_wheel_isempty(TimerWheel *w) {
+        return timer_wheel_size(w) == 0;
+}
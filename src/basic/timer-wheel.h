@@ -0,0 +1,54 @@
+#pragma once
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <stdbool.h>
+
+#include "list.h"
+#include "macro.h"
+#include "time-util.h"
+
+typedef struct TimerWheel TimerWheel;
+typedef struct TimerWheelEntry TimerWheelEntry;
+
+#define TIMER_WHEEL_IDX_NULL ((unsigned) -1)
+
+/* Embed this in the object to keep in the wheel, and get back to the
+ * object with container_of(). */
+struct TimerWheelEntry {
+        usec_t key;
+        unsigned slot;
+        LIST_FIELDS(TimerWheelEntry, entries);
+};
+
+static inline void timer_wheel_entry_init(TimerWheelEntry *e) {
+        e->slot = TIMER_WHEEL_IDX_NULL;
+        e->entries_next = e->entries_prev = NULL;
+}
+
+TimerWheel *timer_wheel_new(usec_t now);
+TimerWheel *timer_wheel_free(TimerWheel *w);
+
+void timer_wheel_put(TimerWheel *w, TimerWheelEntry *e, usec_t key);
+void timer_wheel_remove(TimerWheel *w, TimerWheelEntry *e);
+
+usec_t timer_wheel_peek(TimerWheel *w);
+TimerWheelEntry *timer_wheel_pop(TimerWheel *w, usec_t now);
+
+unsigned timer_wheel_size(TimerWheel *w) _pure_;
+bool timer_wheel_isempty(TimerWheel *w) _pure_;
@@ -23,6 +23,7 @@
 #include <gnutls/gnutls.h>
 #endif
 #include <microhttpd.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -41,16 +42,34 @@
 #include "microhttpd-util.h"
 #include "parse-util.h"
 #include "sigbus.h"
+#include "string-util.h"
 #include "util.h"
 
 #define JOURNAL_WAIT_TIMEOUT (10*USEC_PER_SEC)
 
+/* Responses with entries or fields are generated in blocks of this
+ * size, each filled with as many items as fit */
+#define RESPONSE_BLOCK_SIZE (64*1024)
+
+/* Opening the journal means finding and mapping all journal files,
+ * which is the most expensive part of a small request. Hence, keep
+ * a few around after the requests that used them are finished. */
+#define JOURNAL_POOL_MAX 16
+
+/* Paging through the journal with "Range: entries=CURSOR:SKIP:N"
+ * makes us skip over SKIP entries for each page. Remember for a while
+ * where those skips ended up, so that the same page can be found
+ * again with a plain seek. */
+#define CURSOR_CACHE_MAX 64
+#define CURSOR_CACHE_USEC (60*USEC_PER_SEC)
+
 static char *arg_key_pem = NULL;
 static char *arg_cert_pem = NULL;
 static char *arg_trust_pem = NULL;
 
 typedef struct RequestMeta {
         sd_journal *journal;
+        bool journal_reusable;
 
         OutputMode mode;
 
@@ -59,7 +78,13 @@ typedef struct RequestMeta {
         uint64_t n_entries;
         bool n_entries_set;
 
+        char *matches;     /* the matches that were added, for the cursor cache */
+        char *cache_key;   /* set if the result of the skip should be cached */
+
+        /* The last serialized item, in memory */
         FILE *tmp;
+        char *tmp_buf;
+        size_t tmp_buf_size;
         uint64_t delta, size;
 
         int argument_parse_error;
@@ -71,6 +96,20 @@ typedef struct RequestMeta {
         bool n_fields_set;
 } RequestMeta;
 
+typedef struct CursorCacheEntry {
+        char *key;
+        char *cursor;
+        usec_t timestamp;
+} CursorCacheEntry;
+
+/* Requests are handled in a thread for each connection */
+static pthread_mutex_t journal_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static sd_journal *journal_pool[JOURNAL_POOL_MAX];
+static unsigned journal_pool_n = 0;
+
+static pthread_mutex_t cursor_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static CursorCacheEntry cursor_cache[CURSOR_CACHE_MAX];
+
 static const char* const mime_types[_OUTPUT_MODE_MAX] = {
         [OUTPUT_SHORT] = "text/plain",
         [OUTPUT_JSON] = "application/json",
@@ -93,6 +132,27 @@ static RequestMeta *request_meta(void **connection_cls) {
         return m;
 }
 
+static void release_journal(RequestMeta *m) {
+        assert(m);
+
+        if (!m->journal)
+                return;
+
+        if (m->journal_reusable) {
+                sd_journal_flush_matches(m->journal);
+
+                assert_se(pthread_mutex_lock(&journal_pool_mutex) == 0);
+                if (journal_pool_n < JOURNAL_POOL_MAX) {
+                        journal_pool[journal_pool_n++] = m->journal;
+                        m->journal = NULL;
+                }
+                assert_se(pthread_mutex_unlock(&journal_pool_mutex) == 0);
+        }
+
+        sd_journal_close(m->journal);
+        m->journal = NULL;
+}
+
 static void request_meta_free(
                 void *cls,
                 struct MHD_Connection *connection,
@@ -104,21 +164,115 @@ static void request_meta_free(
         if (!m)
                 return;
 
-        sd_journal_close(m->journal);
+        release_journal(m);
 
         safe_fclose(m->tmp);
+        free(m->tmp_buf);
 
         free(m->cursor);
+        free(m->matches);
+        free(m->cache_key);
         free(m);
 }
 
 static int open_journal(RequestMeta *m) {
+        sd_journal *j = NULL;
+        int r;
+
         assert(m);
 
         if (m->journal)
                 return 0;
 
-        return sd_journal_open(&m->journal, SD_JOURNAL_LOCAL_ONLY|SD_JOURNAL_SYSTEM);
+        assert_se(pthread_mutex_lock(&journal_pool_mutex) == 0);
+        if (journal_pool_n > 0)
+                j = journal_pool[--journal_pool_n];
+        assert_se(pthread_mutex_unlock(&journal_pool_mutex) == 0);
+
+        if (j) {
+                /* Pick up files that were added or rotated meanwhile */
+                r = sd_journal_process(j);
+                if (r >= 0) {
+                        m->journal = j;
+                        m->journal_reusable = true;
+                        return 0;
+                }
+
+                log_debug_errno(r, "Failed to process pooled journal, opening a new one: %m");
+                sd_journal_close(j);
+        }
+
+        r = sd_journal_open(&m->journal, SD_JOURNAL_LOCAL_ONLY|SD_JOURNAL_SYSTEM);
+        if (r < 0)
+                return r;
+
+        /* Only a journal that watches its directories can be reused
+         * later on, since it would miss new files otherwise */
+        m->journal_reusable = sd_journal_get_fd(m->journal) >= 0;
+
+        return 0;
+}
+
+static int cursor_cache_get(const char *key, char **ret) {
+        usec_t n;
+        unsigned i;
+        int r = 0;
+
+        assert(key);
+        assert(ret);
+
+        n = now(CLOCK_MONOTONIC);
+
+        assert_se(pthread_mutex_lock(&cursor_cache_mutex) == 0);
+
+        for (i = 0; i < CURSOR_CACHE_MAX; i++) {
+                CursorCacheEntry *e = cursor_cache + i;
+
+                if (!e->key || !streq(e->key, key))
+                        continue;
+
+                if (e->timestamp + CURSOR_CACHE_USEC < n)
+                        break;
+
+                *ret = strdup(e->cursor);
+                r = *ret ? 1 : -ENOMEM;
+                break;
+        }
+
+        assert_se(pthread_mutex_unlock(&cursor_cache_mutex) == 0);
+
+        return r;
+}
+
+static void cursor_cache_put(char *key, char *cursor) {
+        CursorCacheEntry *e = NULL;
+        unsigned i;
+
+        assert(key);
+        assert(cursor);
+
+        assert_se(pthread_mutex_lock(&cursor_cache_mutex) == 0);
+
+        /* Replace the same key, or an empty slot, or the oldest one */
+        for (i = 0; i < CURSOR_CACHE_MAX; i++) {
+                CursorCacheEntry *c = cursor_cache + i;
+
+                if (!c->key || streq(c->key, key)) {
+                        e = c;
+                        break;
+                }
+
+                if (!e || c->timestamp < e->timestamp)
+                        e = c;
+        }
+
+        free(e->key);
+        free(e->cursor);
+        e->key = key;
+        e->cursor = cursor;
+        e->timestamp = now(CLOCK_MONOTONIC);
+
+        assert_se(pthread_mutex_unlock(&cursor_cache_mutex) == 0);
 }
 
 static int request_meta_ensure_tmp(RequestMeta *m) {
@@ -127,20 +281,67 @@ static int request_meta_ensure_tmp(RequestMeta *m) {
         if (m->tmp)
                 rewind(m->tmp);
         else {
-                int fd;
+                m->tmp = open_memstream(&m->tmp_buf, &m->tmp_buf_size);
+                if (!m->tmp)
+                        return -errno;
+        }
 
-                fd = open_tmpfile_unlinkable("/tmp", O_RDWR|O_CLOEXEC);
-                if (fd < 0)
-                        return fd;
+        return 0;
+}
 
-                m->tmp = fdopen(fd, "w+");
-                if (!m->tmp) {
-                        safe_close(fd);
-                        return -errno;
+static int request_meta_finish_tmp(RequestMeta *m) {
+        off_t sz;
+        int r;
+
+        assert(m);
+        assert(m->tmp);
+
+        /* This updates tmp_buf, too */
+        r = fflush_and_check(m->tmp);
+        if (r < 0)
+                return r;
+
+        sz = ftello(m->tmp);
+        if (sz == (off_t) -1)
+                return -errno;
+
+        m->size = (uint64_t) sz;
+        return 0;
+}
+
+/* Copies what is left of the last serialized item into buf */
+static size_t request_meta_copy_tmp(RequestMeta *m, uint64_t pos, char *buf, size_t max) {
+        size_t n;
+
+        assert(m);
+        assert(pos <= m->size);
+
+        n = MIN(m->size - pos, (uint64_t) max);
+        if (n > 0)
+                memcpy(buf, m->tmp_buf + pos, n);
+
+        return n;
+}
+
+static void request_meta_cache_skip(RequestMeta *m, int r) {
+        char *cursor;
+        int k;
+
+        assert(m);
+        assert(m->cache_key);
+
+        /* Only remember skips that went all the way, those that ran
+         * into the end of the journal will end up elsewhere later */
+        if (r == (int) (m->n_skip < 0 ? -m->n_skip : m->n_skip) + 1) {
+                k = sd_journal_get_cursor(m->journal, &cursor);
+                if (k >= 0) {
+                        cursor_cache_put(m->cache_key, cursor);
+                        m->cache_key = NULL;
+                        return;
                 }
         }
 
-        return 0;
+        m->cache_key = mfree(m->cache_key);
 }
 
 static ssize_t request_reader_entries(
@@ -150,8 +351,8 @@ static ssize_t request_reader_entries(
                 size_t max) {
 
         RequestMeta *m = cls;
+        size_t n = 0;
         int r;
-        size_t n, k;
 
         assert(m);
         assert(buf);
@@ -160,15 +361,22 @@ static ssize_t request_reader_entries(
 
         pos -= m->delta;
 
-        while (pos >= m->size) {
-                off_t sz;
+        for (;;) {
+                size_t k;
+
+                k = request_meta_copy_tmp(m, pos, buf + n, max - n);
+                pos += k;
+                n += k;
+
+                if (n >= max)
+                        return (ssize_t) n;
 
                 /* End of this entry, so let's serialize the next
                  * one */
 
                 if (m->n_entries_set &&
                     m->n_entries <= 0)
-                        return MHD_CONTENT_READER_END_OF_STREAM;
+                        break;
 
                 if (m->n_skip < 0)
                         r = sd_journal_previous_skip(m->journal, (uint64_t) -m->n_skip + 1);
@@ -180,7 +388,15 @@ static ssize_t request_reader_entries(
                 if (r < 0) {
                         log_error_errno(r, "Failed to advance journal pointer: %m");
                         return MHD_CONTENT_READER_END_WITH_ERROR;
-                } else if (r == 0) {
+                }
+
+                if (m->cache_key)
+                        request_meta_cache_skip(m, r);
+
+                if (r == 0) {
+                        /* Pass on what we have before waiting for more */
+                        if (n > 0)
+                                return (ssize_t) n;
 
                         if (m->follow) {
                                 r = sd_journal_wait(m->journal, (uint64_t) JOURNAL_WAIT_TIMEOUT);
@@ -189,12 +405,12 @@ static ssize_t request_reader_entries(
                                         return MHD_CONTENT_READER_END_WITH_ERROR;
                                 }
                                 if (r == SD_JOURNAL_NOP)
-                                        break;
+                                        return 0;
 
                                 continue;
                         }
 
-                        return MHD_CONTENT_READER_END_OF_STREAM;
+                        break;
                 }
 
                 if (m->discrete) {
@@ -207,7 +423,7 @@ static ssize_t request_reader_entries(
                         }
 
                         if (r == 0)
-                                return MHD_CONTENT_READER_END_OF_STREAM;
+                                break;
                 }
 
                 pos -= m->size;
@@ -220,7 +436,7 @@ static ssize_t request_reader_entries(
 
                 r = request_meta_ensure_tmp(m);
                 if (r < 0) {
-                        log_error_errno(r, "Failed to create temporary file: %m");
+                        log_error_errno(r, "Failed to create temporary buffer: %m");
                         return MHD_CONTENT_READER_END_WITH_ERROR;
                 }
 
@@ -230,34 +446,55 @@ static ssize_t request_reader_entries(
                         return MHD_CONTENT_READER_END_WITH_ERROR;
                 }
 
-                sz = ftello(m->tmp);
-                if (sz == (off_t) -1) {
-                        log_error_errno(errno, "Failed to retrieve file position: %m");
+                r = request_meta_finish_tmp(m);
+                if (r < 0) {
+                        log_error_errno(r, "Failed to serialize item: %m");
                         return MHD_CONTENT_READER_END_WITH_ERROR;
                 }
-
-                m->size = (uint64_t) sz;
         }
 
-        if (fseeko(m->tmp, pos, SEEK_SET) < 0) {
-                log_error_errno(errno, "Failed to seek to position: %m");
-                return MHD_CONTENT_READER_END_WITH_ERROR;
-        }
+        return n > 0 ? (ssize_t) n : MHD_CONTENT_READER_END_OF_STREAM;
+}
 
-        n = m->size - pos;
-        if (n < 1)
-                return 0;
-        if (n > max)
-                n = max;
-
-        errno = 0;
-        k = fread(buf, 1, n, m->tmp);
-        if (k != n) {
-                log_error("Failed to read from file: %s", errno ? strerror(errno) : "Premature EOF");
-                return MHD_CONTENT_READER_END_WITH_ERROR;
+/* Looks up where the skip of this request ended up last time, and if
+ * that entry is still there, seeks to it. Otherwise, prepares for
+ * remembering the outcome of this request. */
+static int request_meta_seek_cached(RequestMeta *m) {
+        _cleanup_free_ char *key = NULL, *cursor = NULL;
+        int r;
+
+        assert(m);
+        assert(m->cursor);
+
+        if (asprintf(&key, "%s:%"PRIi64":%s", m->cursor, m->n_skip, strempty(m->matches)) < 0)
+                return -ENOMEM;
+
+        r = cursor_cache_get(key, &cursor);
+        if (r < 0)
+                return r;
+        if (r > 0) {
+                r = sd_journal_seek_cursor(m->journal, cursor);
+                if (r >= 0)
+                        r = sd_journal_next(m->journal);
+                if (r > 0)
+                        r = sd_journal_test_cursor(m->journal, cursor);
+                if (r > 0) {
+                        /* Go back to just before the entry, the first
+                         * read moves onto it */
+                        r = sd_journal_seek_cursor(m->journal, cursor);
+                        if (r >= 0) {
+                                m->n_skip = 0;
+                                return 1;
+                        }
+                }
+
+                log_debug("Cached cursor %s is not valid anymore.", cursor);
         }
 
-        return (ssize_t) k;
+        m->cache_key = key;
+        key = NULL;
+
+        return 0;
 }
 
 static int request_parse_accept(
@@ -425,6 +662,11 @@ static int request_parse_arguments_iterator(
                                 m->argument_parse_error = r;
                                 return MHD_NO;
                         }
+
+                        if (!strextend(&m->matches, match, "\n", NULL)) {
+                                m->argument_parse_error = log_oom();
+                                return MHD_NO;
+                        }
                 }
 
                 return MHD_YES;
@@ -442,6 +684,11 @@ static int request_parse_arguments_iterator(
                 return MHD_NO;
         }
 
+        if (!strextend(&m->matches, p, "\n", NULL)) {
+                m->argument_parse_error = log_oom();
+                return MHD_NO;
+        }
+
         return MHD_YES;
 }
 
@@ -490,7 +737,17 @@ static int request_handler_entries(
                 m->n_entries_set = true;
         }
 
-        if (m->cursor)
+        if (m->cursor && m->n_skip != 0 && !m->discrete) {
+                r = request_meta_seek_cached(m);
+                if (r < 0)
+                        return respond_oom(connection);
+        } else
+                r = 0;
+
+        if (r > 0)
+                /* Already where the skip ends up */
+                r = 0;
+        else if (m->cursor)
                 r = sd_journal_seek_cursor(m->journal, m->cursor);
         else if (m->n_skip >= 0)
                 r = sd_journal_seek_head(m->journal);
@@ -499,7 +756,7 @@ static int request_handler_entries(
         if (r < 0)
                 return mhd_respond(connection, MHD_HTTP_BAD_REQUEST, "Failed to seek in journal.\n");
 
-        response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 4*1024, request_reader_entries, m, NULL);
+        response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, RESPONSE_BLOCK_SIZE, request_reader_entries, m, NULL);
         if (!response)
                 return respond_oom(connection);
 
@@ -540,8 +797,8 @@ static ssize_t request_reader_fields(
                 size_t max) {
 
         RequestMeta *m = cls;
+        size_t n = 0;
         int r;
-        size_t n, k;
 
         assert(m);
         assert(buf);
@@ -550,24 +807,30 @@ static ssize_t request_reader_fields(
 
         pos -= m->delta;
 
-        while (pos >= m->size) {
-                off_t sz;
+        for (;;) {
                 const void *d;
-                size_t l;
+                size_t k, l;
+
+                k = request_meta_copy_tmp(m, pos, buf + n, max - n);
+                pos += k;
+                n += k;
+
+                if (n >= max)
+                        return (ssize_t) n;
 
                 /* End of this field, so let's serialize the next
                  * one */
 
                 if (m->n_fields_set &&
                     m->n_fields <= 0)
-                        return MHD_CONTENT_READER_END_OF_STREAM;
+                        break;
 
                 r = sd_journal_enumerate_unique(m->journal, &d, &l);
                 if (r < 0) {
                         log_error_errno(r, "Failed to advance field index: %m");
                         return MHD_CONTENT_READER_END_WITH_ERROR;
                 } else if (r == 0)
-                        return MHD_CONTENT_READER_END_OF_STREAM;
+                        break;
 
                 pos -= m->size;
                 m->delta += m->size;
@@ -577,7 +840,7 @@ static ssize_t request_reader_fields(
 
                 r = request_meta_ensure_tmp(m);
                 if (r < 0) {
-                        log_error_errno(r, "Failed to create temporary file: %m");
+                        log_error_errno(r, "Failed to create temporary buffer: %m");
                         return MHD_CONTENT_READER_END_WITH_ERROR;
                 }
 
@@ -587,32 +850,14 @@ static ssize_t request_reader_fields(
                         return MHD_CONTENT_READER_END_WITH_ERROR;
                 }
 
-                sz = ftello(m->tmp);
-                if (sz == (off_t) -1) {
-                        log_error_errno(errno, "Failed to retrieve file position: %m");
+                r = request_meta_finish_tmp(m);
+                if (r < 0) {
+                        log_error_errno(r, "Failed to serialize item: %m");
                         return MHD_CONTENT_READER_END_WITH_ERROR;
                 }
-
-                m->size = (uint64_t) sz;
-        }
-
-        if (fseeko(m->tmp, pos, SEEK_SET) < 0) {
-                log_error_errno(errno, "Failed to seek to position: %m");
-                return MHD_CONTENT_READER_END_WITH_ERROR;
-        }
-
-        n = m->size - pos;
-        if (n > max)
-                n = max;
-
-        errno = 0;
-        k = fread(buf, 1, n, m->tmp);
-        if (k != n) {
-                log_error("Failed to read from file: %s", errno ? strerror(errno) : "Premature EOF");
-                return MHD_CONTENT_READER_END_WITH_ERROR;
         }
 
-        return (ssize_t) k;
+        return n > 0 ? (ssize_t) n : MHD_CONTENT_READER_END_OF_STREAM;
 }
 
 static int request_handler_fields(
@@ -638,7 +883,7 @@ static int request_handler_fields(
         if (r < 0)
                 return mhd_respond(connection, MHD_HTTP_BAD_REQUEST, "Failed to query unique fields.\n");
 
-        response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 4*1024, request_reader_fields, m, NULL);
+        response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, RESPONSE_BLOCK_SIZE, request_reader_fields, m, NULL);
         if (!response)
                 return respond_oom(connection);
 
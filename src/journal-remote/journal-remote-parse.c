@@ -26,6 +26,16 @@
 
 #define LINE_CHUNK 8*1024u
 
+/* Data is read in chunks of at least this size, so that a single read()
+ * usually brings in a good number of entries, which are then parsed in
+ * place. */
+#define READ_CHUNK (128*1024u)
+
+/* Compressed uploads may refer back at most 8 MiB, which is what zstd
+ * uses up to level 19. Without a limit a single connection could make
+ * us allocate a window of 128 MiB. */
+#define ZSTD_WINDOW_LOG_MAX 23
+
 void source_free(RemoteSource *source) {
         if (!source)
                 return;
@@ -39,8 +49,14 @@ void source_free(RemoteSource *source) {
         free(source->buf);
         iovw_free_contents(&source->iovw);
 
-        log_debug("Writer ref count %i", source->writer->n_ref);
-        writer_unref(source->writer);
+#ifdef HAVE_ZSTD
+        ZSTD_freeDStream(source->zstd);
+#endif
+
+        if (source->writer) {
+                log_debug("Writer ref count %i", source->writer->n_ref);
+                writer_unref(source->writer);
+        }
 
         sd_event_source_unref(source->event);
         sd_event_source_unref(source->buffer_event);
@@ -85,9 +101,77 @@ static char* realloc_buffer(RemoteSource *source, size_t size) {
         return b;
 }
 
-static int get_line(RemoteSource *source, char **line, size_t *size) {
+static int make_room(RemoteSource *source, size_t room) {
+        size_t live;
+
+        assert(source);
+
+        /* Never store more than a single entry may take, whatever the
+         * other side sends us. */
+        live = source->filled - source->entry_start;
+        if (room > ENTRY_SIZE_MAX - live) {
+                log_error("Entry is bigger than %u bytes.", ENTRY_SIZE_MAX);
+                return -E2BIG;
+        }
+
+        if (source->size - source->filled >= room)
+                return 0;
+
+        /* Everything before the entry we are working on has been
+         * dealt with already. If that makes enough room, move the
+         * rest to the front of the buffer, so that only the fields
+         * of the current entry read so far are copied. */
+        if (source->entry_start > 0 && source->size - live >= room) {
+                memmove(source->buf, source->buf + source->entry_start, live);
+                iovw_rebase(&source->iovw, source->buf + source->entry_start, source->buf);
+
+                source->offset -= source->entry_start;
+                source->scanned = source->scanned > source->entry_start ? source->scanned - source->entry_start : 0;
+                source->filled = live;
+                source->entry_start = 0;
+
+                return 0;
+        }
+
+        if (!realloc_buffer(source, source->filled + MAX(room, READ_CHUNK)))
+                return -ENOMEM;
+
+        return 0;
+}
+
+static int read_data(RemoteSource *source, size_t room) {
         ssize_t n;
+        int r;
+
+        assert(source);
+        assert(!source->passive_fd);
+
+        r = make_room(source, room);
+        if (r == -ENOMEM)
+                return log_oom();
+        if (r < 0)
+                return r;
+
+        n = read(source->fd,
+                 source->buf + source->filled,
+                 source->size - source->filled);
+        if (n < 0) {
+                if (errno != EAGAIN)
+                        log_error_errno(errno, "read(%d, ..., %zu): %m",
+                                        source->fd,
+                                        source->size - source->filled);
+                return -errno;
+        } else if (n == 0)
+                return 0;
+
+        source->filled += n;
+
+        return 1;
+}
+
+static int get_line(RemoteSource *source, char **line, size_t *size) {
         char *c = NULL;
+        int r;
 
         assert(source);
         assert(source->state == STATE_LINE);
@@ -107,7 +191,7 @@ static int get_line(RemoteSource *source, char **line, size_t *size) {
                 }
 
                 source->scanned = source->filled;
-                if (source->scanned >= DATA_SIZE_MAX) {
+                if (source->filled - source->offset >= DATA_SIZE_MAX) {
                         log_error("Entry is bigger than %u bytes.", DATA_SIZE_MAX);
                         return -E2BIG;
                 }
@@ -116,30 +200,9 @@ static int get_line(RemoteSource *source, char **line, size_t *size) {
                         /* we have to wait for some data to come to us */
                         return -EAGAIN;
 
-                /* We know that source->filled is at most DATA_SIZE_MAX, so if
-                   we reallocate it, we'll increase the size at least a bit. */
-                assert_cc(DATA_SIZE_MAX < ENTRY_SIZE_MAX);
-                if (source->size - source->filled < LINE_CHUNK &&
-                    !realloc_buffer(source, MIN(source->filled + LINE_CHUNK, ENTRY_SIZE_MAX)))
-                                return log_oom();
-
-                assert(source->buf);
-                assert(source->size - source->filled >= LINE_CHUNK ||
-                       source->size == ENTRY_SIZE_MAX);
-
-                n = read(source->fd,
-                         source->buf + source->filled,
-                         source->size - source->filled);
-                if (n < 0) {
-                        if (errno != EAGAIN)
-                                log_error_errno(errno, "read(%d, ..., %zu): %m",
-                                                source->fd,
-                                                source->size - source->filled);
-                        return -errno;
-                } else if (n == 0)
-                        return 0;
-
-                source->filled += n;
+                r = read_data(source, LINE_CHUNK);
+                if (r <= 0)
+                        return r;
         }
 
         *line = source->buf + source->offset;
@@ -149,24 +212,123 @@ static int get_line(RemoteSource *source, char **line, size_t *size) {
         return 1;
 }
 
-int push_data(RemoteSource *source, const char *data, size_t size) {
+bool source_encoding_supported(const char *encoding) {
+        if (!encoding || strcaseeq(encoding, "identity"))
+                return true;
+
+#ifdef HAVE_ZSTD
+        if (strcaseeq(encoding, "zstd"))
+                return true;
+#endif
+
+        return false;
+}
+
+int source_set_encoding(RemoteSource *source, const char *encoding) {
+        assert(source);
+        assert(source->passive_fd);
+
+        if (!source_encoding_supported(encoding))
+                return -EPROTONOSUPPORT;
+
+#ifdef HAVE_ZSTD
+        if (encoding && strcaseeq(encoding, "zstd")) {
+                size_t k;
+
+                if (!source->zstd) {
+                        source->zstd = ZSTD_createDStream();
+                        if (!source->zstd)
+                                return -ENOMEM;
+                }
+
+                k = ZSTD_initDStream(source->zstd);
+                if (ZSTD_isError(k))
+                        return -ENOMEM;
+
+                k = ZSTD_DCtx_setParameter(source->zstd, ZSTD_d_windowLogMax, ZSTD_WINDOW_LOG_MAX);
+                if (ZSTD_isError(k))
+                        return -EINVAL;
+        }
+#endif
+
+        return 0;
+}
+
+#ifdef HAVE_ZSTD
+static int push_data_zstd(RemoteSource *source, const char **data, size_t *size) {
+        ZSTD_inBuffer in = {
+                .src = *data,
+                .size = *size,
+        };
+        ZSTD_outBuffer out;
+        size_t k;
+        int r;
+
+        /* Decompress at most one chunk at a time, so that a small
+         * upload cannot make us allocate arbitrary amounts of memory
+         * before the entries in it have been processed. */
+
+        r = make_room(source, READ_CHUNK);
+        if (r < 0)
+                return r;
+
+        out = (ZSTD_outBuffer) {
+                .dst = source->buf + source->filled,
+                .size = MIN(source->size - source->filled, READ_CHUNK),
+        };
+
+        k = ZSTD_decompressStream(source->zstd, &out, &in);
+        if (ZSTD_isError(k)) {
+                log_error("Failed to decompress received data: %s", ZSTD_getErrorName(k));
+                return -EBADMSG;
+        }
+
+        source->filled += out.pos;
+        *data += in.pos;
+        *size -= in.pos;
+
+        /* If the output buffer was filled up, the decompressor might
+         * be holding on to more output even if all input was used. */
+        return *size > 0 || out.pos == out.size;
+}
+#endif
+
+/* Feeds received data into the source. Compressed data is only
+ * decompressed partially, hence as long as this returns a positive
+ * value, it needs to be called again after processing the entries
+ * pushed so far. */
+int push_data(RemoteSource *source, const char **data, size_t *size) {
+        int r;
+
         assert(source);
         assert(source->state != STATE_EOF);
+        assert(data);
+        assert(size);
+
+#ifdef HAVE_ZSTD
+        if (source->zstd)
+                return push_data_zstd(source, data, size);
+#endif
 
-        if (!realloc_buffer(source, source->filled + size)) {
+        r = make_room(source, *size);
+        if (r < 0) {
                 log_error("Failed to store received data of size %zu "
                           "(in addition to existing %zu bytes with %zu filled): %s",
-                          size, source->size, source->filled, strerror(ENOMEM));
-                return -ENOMEM;
+                          *size, source->size, source->filled, strerror(-r));
+                return r;
         }
 
-        memcpy(source->buf + source->filled, data, size);
-        source->filled += size;
+        memcpy(source->buf + source->filled, *data, *size);
+        source->filled += *size;
+
+        *data += *size;
+        *size = 0;
 
         return 0;
 }
 
 static int fill_fixed_size(RemoteSource *source, void **data, size_t size) {
+        int r;
 
         assert(source);
         assert(source->state == STATE_DATA_START ||
@@ -181,26 +343,13 @@ static int fill_fixed_size(RemoteSource *source, void **data, size_t size) {
         assert(data);
 
         while (source->filled - source->offset < size) {
-                int n;
-
                 if (source->passive_fd)
                         /* we have to wait for some data to come to us */
                         return -EAGAIN;
 
-                if (!realloc_buffer(source, source->offset + size))
-                        return log_oom();
-
-                n = read(source->fd, source->buf + source->filled,
-                         source->size - source->filled);
-                if (n < 0) {
-                        if (errno != EAGAIN)
-                                log_error_errno(errno, "read(%d, ..., %zu): %m", source->fd,
-                                                source->size - source->filled);
-                        return -errno;
-                } else if (n == 0)
-                        return 0;
-
-                source->filled += n;
+                r = read_data(source, size - (source->filled - source->offset));
+                if (r <= 0)
+                        return r;
         }
 
         *data = source->buf + source->offset;
@@ -439,53 +588,32 @@ static int process_data(RemoteSource *source) {
         }
 }
 
-int process_source(RemoteSource *source, bool compress, bool seal) {
-        size_t remain, target;
+int source_parse_entry(RemoteSource *source) {
         int r;
 
         assert(source);
-        assert(source->writer);
 
-        r = process_data(source);
-        if (r <= 0)
-                return r;
+        do
+                r = process_data(source);
+        while (r == 0 && source->state != STATE_EOF);
 
-        /* We have a full event */
-        log_trace("Received full event from source@%p fd:%d (%s)",
-                  source, source->fd, source->name);
-
-        if (!source->iovw.count) {
-                log_warning("Entry with no payload, skipping");
-                goto freeing;
-        }
-
-        assert(source->iovw.iovec);
-        assert(source->iovw.count);
+        return r;
+}
 
-        r = writer_write(source->writer, &source->iovw, &source->ts, compress, seal);
-        if (r < 0)
-                log_error_errno(r, "Failed to write entry of %zu bytes: %m",
-                                iovw_size(&source->iovw));
-        else
-                r = 1;
+void source_finish_entry(RemoteSource *source) {
+        size_t target;
 
- freeing:
-        iovw_free_contents(&source->iovw);
+        assert(source);
 
-        /* possibly reset buffer position */
-        remain = source->filled - source->offset;
+        /* Keep the iovec array around for the next entry */
+        source->iovw.count = 0;
 
-        if (remain == 0) /* no brainer */
+        if (source->offset == source->filled)
                 source->offset = source->scanned = source->filled = 0;
-        else if (source->offset > source->size - source->filled &&
-                 source->offset > remain) {
-                memcpy(source->buf, source->buf + source->offset, remain);
-                source->offset = source->scanned = 0;
-                source->filled = remain;
-        }
+        source->entry_start = source->offset;
 
         target = source->size;
-        while (target > 16 * LINE_CHUNK && source->filled < target / 2)
+        while (target > 4 * READ_CHUNK && source->filled < target / 2)
                 target /= 2;
         if (target < source->size) {
                 char *tmp;
@@ -501,6 +629,39 @@ int process_source(RemoteSource *source, bool compress, bool seal) {
                         source->size = target;
                 }
         }
+}
+
+int process_source(RemoteSource *source, bool compress, bool seal) {
+        int r;
+
+        assert(source);
+        assert(source->writer);
+
+        r = source_parse_entry(source);
+        if (r <= 0)
+                return r;
+
+        /* We have a full event */
+        log_trace("Received full event from source@%p fd:%d (%s)",
+                  source, source->fd, source->name);
+
+        if (!source->iovw.count) {
+                log_warning("Entry with no payload, skipping");
+                goto finish;
+        }
+
+        assert(source->iovw.iovec);
+        assert(source->iovw.count);
+
+        r = writer_write(source->writer, &source->iovw, &source->ts, compress, seal);
+        if (r < 0)
+                log_error_errno(r, "Failed to write entry of %zu bytes: %m",
+                                iovw_size(&source->iovw));
+        else
+                r = 1;
+
+ finish:
+        source_finish_entry(source);
 
         return r;
 }
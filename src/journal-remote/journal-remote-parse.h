@@ -19,6 +19,10 @@
   along with systemd; If not, see <http://www.gnu.org/licenses/>.
 ***/
 
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
 #include "sd-event.h"
 
 #include "journal-remote-write.h"
@@ -39,6 +43,7 @@ typedef struct RemoteSource {
         char *buf;
         size_t size;       /* total size of the buffer */
         size_t offset;     /* offset to the beginning of live data in the buffer */
+        size_t entry_start; /* offset to the beginning of the entry being parsed */
         size_t scanned;    /* number of bytes since the beginning of data without a newline */
         size_t filled;     /* total number of bytes in the buffer */
 
@@ -47,6 +52,10 @@ typedef struct RemoteSource {
 
         struct iovec_wrapper iovw;
 
+#ifdef HAVE_ZSTD
+        ZSTD_DStream *zstd; /* set if pushed data is zstd compressed */
+#endif
+
         source_state state;
         dual_timestamp ts;
 
@@ -61,9 +70,21 @@ RemoteSource* source_new(int fd, bool passive_fd, char *name, Writer *writer);
 static inline size_t source_non_empty(RemoteSource *source) {
         assert(source);
 
-        return source->filled;
+        return source->filled - source->entry_start;
 }
 
 void source_free(RemoteSource *source);
-int push_data(RemoteSource *source, const char *data, size_t size);
+/* The content codings that can be used for data pushed to a source,
+ * in the format of the Accept-Encoding header */
+#ifdef HAVE_ZSTD
+#  define SOURCE_ACCEPT_ENCODING "zstd, identity"
+#else
+#  define SOURCE_ACCEPT_ENCODING "identity"
+#endif
+
+int source_set_encoding(RemoteSource *source, const char *encoding);
+bool source_encoding_supported(const char *encoding);
+int push_data(RemoteSource *source, const char **data, size_t *size);
+int source_parse_entry(RemoteSource *source);
+void source_finish_entry(RemoteSource *source);
 int process_source(RemoteSource *source, bool compress, bool seal);
@@ -20,6 +20,10 @@
 #include "alloc-util.h"
 #include "journal-remote.h"
 
+/* Limits on the entries writer_write() collects before writing them */
+#define WRITER_BATCH_MAX 64U
+#define WRITER_BATCH_SIZE_MAX (4U*1024U*1024U)
+
 int iovw_put(struct iovec_wrapper *iovw, void* data, size_t len) {
         if (!GREEDY_REALLOC(iovw->iovec, iovw->size_bytes, iovw->count + 1))
                 return log_oom();
@@ -90,6 +94,9 @@ Writer* writer_free(Writer *w) {
         if (!w)
                 return NULL;
 
+        (void) writer_flush(w);
+        free(w->batch);
+
         if (w->journal) {
                 log_debug("Closing journal file %s.", w->journal->path);
                 journal_file_close(w->journal);
@@ -122,47 +129,155 @@ Writer* writer_ref(Writer *w) {
         return w;
 }
 
+static void writer_batch_pop(Writer *w, size_t n) {
+        size_t i;
+
+        assert(w);
+        assert(n <= w->n_batch);
+
+        for (i = 0; i < n; i++) {
+                w->batch_size -= w->batch[i].size;
+                free(w->batch[i].iovec);
+        }
+
+        memmove(w->batch, w->batch + n, (w->n_batch - n) * sizeof(WriterEntry));
+        w->n_batch -= n;
+}
+
+static void writer_count(Writer *w, size_t n) {
+        size_t i;
+
+        assert(w);
+
+        if (!w->server)
+                return;
+
+        w->server->event_count += n;
+        for (i = 0; i < n; i++)
+                w->server->byte_count += w->batch[i].size;
+}
+
+int writer_flush(Writer *w) {
+        JournalEntry entries[WRITER_BATCH_MAX];
+        bool rotated = false;
+        int r, ret = 0;
+        size_t i;
+
+        assert(w);
+
+        /* Writes out the entries collected by writer_write(). If
+         * writing fails half-way we rotate once and continue with the
+         * entries that weren't written yet. Entries that can't be
+         * written at all are dropped one by one. */
+
+        if (w->n_batch == 0)
+                return 0;
+
+        assert(w->journal);
+
+        if (journal_file_rotate_suggested(w->journal, 0)) {
+                log_info("%s: Journal header limits reached or header out-of-date, rotating",
+                         w->journal->path);
+                r = do_rotate(&w->journal, w->compress, w->seal);
+                if (r < 0)
+                        goto fail;
+
+                rotated = true;
+        }
+
+        while (w->n_batch > 0) {
+                unsigned n_written = 0;
+
+                for (i = 0; i < w->n_batch; i++)
+                        entries[i] = (JournalEntry) {
+                                .ts = &w->batch[i].ts,
+                                .iovec = w->batch[i].iovec,
+                                .n_iovec = w->batch[i].n_iovec,
+                        };
+
+                r = journal_file_append_entries(w->journal, entries, w->n_batch, &w->seqnum, &n_written);
+
+                writer_count(w, n_written);
+                writer_batch_pop(w, n_written);
+
+                if (r >= 0)
+                        break;
+
+                if (!rotated) {
+                        log_debug_errno(r, "%s: Write failed, rotating: %m", w->journal->path);
+                        r = do_rotate(&w->journal, w->compress, w->seal);
+                        if (r < 0)
+                                goto fail;
+
+                        log_debug("%s: Successfully rotated journal", w->journal->path);
+                        rotated = true;
+
+                        log_debug("Retrying write.");
+                        continue;
+                }
+
+                log_error_errno(r, "Failed to write entry of %zu bytes, ignoring: %m", w->batch[0].size);
+                writer_batch_pop(w, 1);
+                ret = r;
+        }
+
+        return ret;
+
+fail:
+        /* Without a journal file there is nothing we can do */
+        writer_batch_pop(w, w->n_batch);
+        return r;
+}
+
 int writer_write(Writer *w,
                  struct iovec_wrapper *iovw,
                  dual_timestamp *ts,
                  bool compress,
                  bool seal) {
-        int r;
+        WriterEntry *e;
+        size_t size, i;
+        uint8_t *p;
 
         assert(w);
         assert(iovw);
         assert(iovw->count > 0);
 
-        if (journal_file_rotate_suggested(w->journal, 0)) {
-                log_info("%s: Journal header limits reached or header out-of-date, rotating",
-                         w->journal->path);
-                r = do_rotate(&w->journal, compress, seal);
-                if (r < 0)
-                        return r;
-        }
+        /* Copies the entry into the batch, the parser reuses its
+         * buffer for the next one. The batch is written once it is
+         * full, or when writer_flush() is called, which the callers
+         * do after each chunk of input. */
+
+        if (!GREEDY_REALLOC(w->batch, w->n_batch_allocated, w->n_batch + 1))
+                return log_oom();
+
+        size = iovw_size(iovw);
 
-        r = journal_file_append_entry(w->journal, ts, iovw->iovec, iovw->count,
-                                      &w->seqnum, NULL, NULL);
-        if (r >= 0) {
-                if (w->server)
-                        w->server->event_count += 1;
-                return 1;
+        e = w->batch + w->n_batch;
+        e->iovec = malloc(sizeof(struct iovec) * iovw->count + size);
+        if (!e->iovec)
+                return log_oom();
+
+        p = (uint8_t*) (e->iovec + iovw->count);
+        for (i = 0; i < iovw->count; i++) {
+                e->iovec[i].iov_base = p;
+                e->iovec[i].iov_len = iovw->iovec[i].iov_len;
+                p = mempcpy(p, iovw->iovec[i].iov_base, iovw->iovec[i].iov_len);
         }
 
-        log_debug_errno(r, "%s: Write failed, rotating: %m", w->journal->path);
-        r = do_rotate(&w->journal, compress, seal);
-        if (r < 0)
-                return r;
+        e->n_iovec = iovw->count;
+        e->size = size;
+        if (ts)
+                e->ts = *ts;
         else
-                log_debug("%s: Successfully rotated journal", w->journal->path);
+                dual_timestamp_get(&e->ts);
+
+        w->n_batch++;
+        w->batch_size += size;
+        w->compress = compress;
+        w->seal = seal;
 
-        log_debug("Retrying write.");
-        r = journal_file_append_entry(w->journal, ts, iovw->iovec, iovw->count,
-                                      &w->seqnum, NULL, NULL);
-        if (r < 0)
-                return r;
+        if (w->n_batch >= WRITER_BATCH_MAX || w->batch_size >= WRITER_BATCH_SIZE_MAX)
+                return writer_flush(w);
 
-        if (w->server)
-                w->server->event_count += 1;
         return 1;
 }
@@ -34,6 +34,14 @@ void iovw_free_contents(struct iovec_wrapper *iovw);
 size_t iovw_size(struct iovec_wrapper *iovw);
 void iovw_rebase(struct iovec_wrapper *iovw, char *old, char *new);
 
+/* An entry that was parsed, but not written yet */
+typedef struct WriterEntry {
+        dual_timestamp ts;
+        struct iovec *iovec; /* followed by a copy of the data */
+        size_t n_iovec;
+        size_t size;
+} WriterEntry;
+
 typedef struct Writer {
         JournalFile *journal;
         JournalMetrics metrics;
@@ -44,6 +52,13 @@ typedef struct Writer {
 
         uint64_t seqnum;
 
+        /* Entries are collected here by writer_write(), and
+         * written together by writer_flush() */
+        WriterEntry *batch;
+        size_t n_batch, n_batch_allocated;
+        size_t batch_size;
+        bool compress, seal;
+
         int n_ref;
 } Writer;
 
@@ -61,6 +76,7 @@ int writer_write(Writer *s,
                  dual_timestamp *ts,
                  bool compress,
                  bool seal);
+int writer_flush(Writer *w);
 
 typedef enum JournalWriteSplitMode {
         JOURNAL_WRITE_SPLIT_NONE,
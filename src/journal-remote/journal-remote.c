@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/prctl.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -45,7 +46,9 @@
 #include "journald-native.h"
 #include "macro.h"
 #include "parse-util.h"
+#include "random-util.h"
 #include "signal-util.h"
+#include "siphash24.h"
 #include "socket-util.h"
 #include "stat-util.h"
 #include "stdio-util.h"
@@ -55,6 +58,16 @@
 
 #define REMOTE_JOURNAL_PATH "/var/log/journal/remote"
 
+/* The maximum number of shards in sharded mode */
+#define REMOTE_THREADS_MAX 256U
+
+/* The number of entries to process from one source before returning
+ * to the event loop */
+#define ENTRIES_PER_ITERATION 64U
+
+/* The period to insert between posting changes for coalescing */
+#define POST_CHANGE_TIMER_INTERVAL_USEC (250*USEC_PER_MSEC)
+
 #define PRIV_KEY_FILE CERTIFICATE_ROOT "/private/journal-remote.pem"
 #define CERT_FILE     CERTIFICATE_ROOT "/certs/journal-remote.pem"
 #define TRUST_FILE    CERTIFICATE_ROOT "/ca/trusted.pem"
@@ -73,6 +86,8 @@ static char** arg_gnutls_log = NULL;
 static JournalWriteSplitMode arg_split_mode = JOURNAL_WRITE_SPLIT_HOST;
 static char* arg_output = NULL;
 
+static unsigned arg_threads = 1;
+
 static char *arg_key = NULL;
 static char *arg_cert = NULL;
 static char *arg_trust = NULL;
@@ -206,11 +221,21 @@ static int open_output(Writer *w, const char* host) {
                                        w->mmap, NULL,
                                        NULL, &w->journal);
         if (r < 0)
-                log_error_errno(r, "Failed to open output journal %s: %m",
-                                output);
-        else
-                log_debug("Opened output file %s", w->journal->path);
-        return r;
+                return log_error_errno(r, "Failed to open output journal %s: %m",
+                                       output);
+
+        log_debug("Opened output file %s", w->journal->path);
+
+        /* Coalesce the change notifications for readers, instead of
+         * issuing one for each entry we write */
+        if (w->server && w->server->events) {
+                r = journal_file_enable_post_change_timer(w->journal, w->server->events, POST_CHANGE_TIMER_INTERVAL_USEC);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to enable change notification timer for %s: %m",
+                                               w->journal->path);
+        }
+
+        return 0;
 }
 
 /**********************************************************************
@@ -280,6 +305,472 @@ static int get_writer(RemoteServer *s, const char *host,
         return 0;
 }
 
+/**********************************************************************
+ **********************************************************************
+ **********************************************************************/
+
+static RemoteServer* server_for_host(RemoteServer *s, const char *host) {
+        uint64_t h;
+
+        assert(s);
+
+        if (s->n_shards == 0 || !host)
+                return s;
+
+        h = siphash24(host, strlen(host), s->shard_hash_key);
+        return &s->shards[h % s->n_shards].server;
+}
+
+static RemoteServer* source_server(RemoteSource *source) {
+        assert(source);
+        assert(source->writer);
+
+        /* Writers are created by the (shard) server whose thread
+         * processes the source. */
+        return source->writer->server;
+}
+
+/* The state of an HTTP upload, kept as µhttpd connection metadata.
+ * Chunks of data are handed to the shard of the source, and the
+ * connection is suspended until the shard is done with them. The
+ * source is created by the shard along with the first chunk, and
+ * freed by it after the connection is gone. */
+struct RemoteRequest {
+        struct MHD_Connection *connection;
+
+        /* The (shard) server the source belongs to */
+        RemoteServer *server;
+        RemoteSource *source;
+
+        /* What the source is created from */
+        int fd;
+        char *hostname;
+        char *encoding;
+
+        /* The chunk being processed by the shard */
+        char *data;
+        size_t size;
+
+        bool pending;
+        bool finished;
+        bool push_failed;
+        bool terminated;
+        int result;
+
+        LIST_FIELDS(RemoteRequest, uploads);
+};
+
+static void request_free(RemoteRequest *req) {
+        if (!req)
+                return;
+
+        source_free(req->source);
+        free(req->hostname);
+        free(req->encoding);
+        free(req->data);
+        free(req);
+}
+
+static void process_http_upload_call(RemoteServer *s, RemoteRequest *req);
+
+static void uploads_done(RemoteServer *parent, RemoteRequest *list) {
+        RemoteRequest *req;
+
+        assert(parent);
+
+        /* Called by the shard threads, passes the uploads back to
+         * the main thread */
+
+        if (!list)
+                return;
+
+        assert_se(pthread_mutex_lock(&parent->uploads_mutex) == 0);
+
+        while ((req = list)) {
+                LIST_REMOVE(uploads, list, req);
+                LIST_APPEND(uploads, parent->uploads_done, req);
+        }
+
+        assert_se(pthread_mutex_unlock(&parent->uploads_mutex) == 0);
+
+        (void) eventfd_write(parent->uploads_done_fd, 1);
+}
+
+static int shard_call(RemoteServer *s,
+                      int (*call)(RemoteServer *s, void *userdata),
+                      void *userdata) {
+        RemoteShard *shard;
+        int r;
+
+        assert(s);
+        assert(call);
+
+        /* Runs call() in the thread of the shard s belongs to, and
+         * waits for it to finish. Calls are only issued by the main
+         * thread, hence there's at most one pending per shard. */
+
+        shard = s->shard;
+        if (!shard || !shard->thread_running)
+                return call(s, userdata);
+
+        assert_se(pthread_mutex_lock(&shard->call_mutex) == 0);
+
+        if (shard->dead) {
+                assert_se(pthread_mutex_unlock(&shard->call_mutex) == 0);
+                return -ESHUTDOWN;
+        }
+
+        shard->call = call;
+        shard->call_userdata = userdata;
+        shard->call_done = false;
+
+        if (eventfd_write(shard->call_fd, 1) < 0)
+                r = -errno;
+        else {
+                while (!shard->call_done)
+                        assert_se(pthread_cond_wait(&shard->call_cond, &shard->call_mutex) == 0);
+
+                r = shard->call_result;
+        }
+
+        shard->call = NULL;
+        shard->call_userdata = NULL;
+
+        assert_se(pthread_mutex_unlock(&shard->call_mutex) == 0);
+
+        return r;
+}
+
+static int shard_queue_upload(RemoteServer *s, RemoteRequest *req) {
+        RemoteShard *shard;
+        int r = 1;
+
+        assert(s);
+        assert(req);
+        assert(!req->pending);
+
+        /* Hands the upload to the thread of the shard s belongs to.
+         * Returns 0 if it was processed right away, and > 0 if it
+         * was queued, in which case the connection is resumed by
+         * the main thread once the shard is done with it. */
+
+        shard = s->shard;
+        if (!shard || !shard->thread_running) {
+                process_http_upload_call(s, req);
+                return 0;
+        }
+
+        assert_se(pthread_mutex_lock(&shard->call_mutex) == 0);
+
+        if (shard->dead)
+                r = -ESHUTDOWN;
+        else if (eventfd_write(shard->call_fd, 1) < 0)
+                r = -errno;
+        else {
+                req->pending = true;
+                LIST_APPEND(uploads, shard->uploads, req);
+        }
+
+        assert_se(pthread_mutex_unlock(&shard->call_mutex) == 0);
+
+        return r;
+}
+
+static void shard_queue_free(RemoteRequest *req) {
+        RemoteShard *shard;
+        bool dead;
+
+        assert(req);
+        assert(req->server);
+        assert(!req->pending);
+
+        /* The source belongs to the shard, hence is freed by its
+         * thread. Like uploads this is only queued, so that µhttpd
+         * doesn't wait for a busy shard. */
+
+        shard = req->server->shard;
+        if (!req->source || !shard || !shard->thread_running) {
+                request_free(req);
+                return;
+        }
+
+        assert_se(pthread_mutex_lock(&shard->call_mutex) == 0);
+
+        dead = shard->dead;
+        if (!dead) {
+                req->terminated = true;
+                LIST_APPEND(uploads, shard->uploads, req);
+                (void) eventfd_write(shard->call_fd, 1);
+        }
+
+        assert_se(pthread_mutex_unlock(&shard->call_mutex) == 0);
+
+        /* Nobody touches the sources of a shard whose event loop is
+         * gone anymore */
+        if (dead)
+                request_free(req);
+}
+
+static void shard_free_terminated(RemoteRequest **uploads) {
+        RemoteRequest *req, *n;
+
+        assert(uploads);
+
+        LIST_FOREACH_SAFE(uploads, req, n, *uploads)
+                if (req->terminated) {
+                        LIST_REMOVE(uploads, *uploads, req);
+                        request_free(req);
+                }
+}
+
+static int dispatch_shard_call(sd_event_source *event,
+                               int fd,
+                               uint32_t revents,
+                               void *userdata) {
+        RemoteShard *shard = userdata;
+        RemoteRequest *uploads, *req;
+        eventfd_t x;
+
+        assert(shard);
+
+        (void) eventfd_read(fd, &x);
+
+        assert_se(pthread_mutex_lock(&shard->call_mutex) == 0);
+
+        if (shard->call && !shard->call_done) {
+                shard->call_result = shard->call(&shard->server, shard->call_userdata);
+                shard->call_done = true;
+                assert_se(pthread_cond_signal(&shard->call_cond) == 0);
+        }
+
+        uploads = shard->uploads;
+        shard->uploads = NULL;
+
+        assert_se(pthread_mutex_unlock(&shard->call_mutex) == 0);
+
+        /* The connections of the uploads are suspended, or gone, so
+         * nobody else touches them until they are passed back */
+        shard_free_terminated(&uploads);
+
+        LIST_FOREACH(uploads, req, uploads)
+                process_http_upload_call(&shard->server, req);
+
+        uploads_done(shard->parent, uploads);
+
+        return 0;
+}
+
+static int shard_exit(RemoteServer *s, void *userdata) {
+        return sd_event_exit(s->events, 0);
+}
+
+static void* shard_thread(void *p) {
+        RemoteShard *shard = p;
+        RemoteRequest *uploads, *req;
+        int r;
+
+        r = sd_event_loop(shard->server.events);
+        if (r < 0)
+                log_error_errno(r, "Event loop of shard %u failed: %m", shard->index);
+
+        /* Don't leave the main thread waiting for calls that will
+         * never be answered, neither now nor later */
+        assert_se(pthread_mutex_lock(&shard->call_mutex) == 0);
+        shard->dead = true;
+        shard->call_result = -ESHUTDOWN;
+        shard->call_done = true;
+        assert_se(pthread_cond_signal(&shard->call_cond) == 0);
+        uploads = shard->uploads;
+        shard->uploads = NULL;
+        assert_se(pthread_mutex_unlock(&shard->call_mutex) == 0);
+
+        shard_free_terminated(&uploads);
+
+        LIST_FOREACH(uploads, req, uploads)
+                req->result = -ESHUTDOWN;
+
+        uploads_done(shard->parent, uploads);
+
+        return NULL;
+}
+
+static void resume_uploads(RemoteServer *s) {
+        RemoteRequest *uploads, *req;
+
+        assert(s);
+
+        assert_se(pthread_mutex_lock(&s->uploads_mutex) == 0);
+        uploads = s->uploads_done;
+        s->uploads_done = NULL;
+        assert_se(pthread_mutex_unlock(&s->uploads_mutex) == 0);
+
+        while ((req = uploads)) {
+                LIST_REMOVE(uploads, uploads, req);
+
+                assert(req->pending);
+                req->pending = false;
+                MHD_resume_connection(req->connection);
+        }
+}
+
+static int dispatch_uploads_done(sd_event_source *event,
+                                 int fd,
+                                 uint32_t revents,
+                                 void *userdata) {
+        RemoteServer *s = userdata;
+        MHDDaemonWrapper *d;
+        Iterator i;
+        eventfd_t x;
+
+        assert(s);
+
+        (void) eventfd_read(fd, &x);
+
+        resume_uploads(s);
+
+        /* µhttpd only looks at resumed connections when it runs */
+        HASHMAP_FOREACH(d, s->daemons, i)
+                if (MHD_run(d->daemon) == MHD_NO)
+                        log_error("MHD_run failed!");
+
+        return 0;
+}
+
+static int setup_shards(RemoteServer *s, unsigned n) {
+        unsigned i;
+        int r;
+
+        assert(s);
+        assert(n > 1);
+
+        s->shards = new0(RemoteShard, n);
+        if (!s->shards)
+                return log_oom();
+
+        random_bytes(s->shard_hash_key, sizeof(s->shard_hash_key));
+
+        s->uploads_done_fd = -1;
+        assert_se(pthread_mutex_init(&s->uploads_mutex, NULL) == 0);
+
+        s->uploads_done_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if (s->uploads_done_fd < 0)
+                return log_error_errno(errno, "Failed to create eventfd for uploads: %m");
+
+        r = sd_event_add_io(s->events, &s->uploads_done_event,
+                            s->uploads_done_fd, EPOLLIN,
+                            dispatch_uploads_done, s);
+        if (r < 0)
+                return log_error_errno(r, "Failed to add event source for uploads: %m");
+
+        for (i = 0; i < n; i++) {
+                RemoteShard *shard = s->shards + i;
+
+                shard->parent = s;
+                shard->index = i;
+                shard->server.shard = shard;
+                shard->call_fd = -1;
+                assert_se(pthread_mutex_init(&shard->call_mutex, NULL) == 0);
+                assert_se(pthread_cond_init(&shard->call_cond, NULL) == 0);
+                s->n_shards++;
+
+                r = sd_event_new(&shard->server.events);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to allocate event loop for shard %u: %m", i);
+
+                r = init_writer_hashmap(&shard->server);
+                if (r < 0)
+                        return r;
+
+                shard->call_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+                if (shard->call_fd < 0)
+                        return log_error_errno(errno, "Failed to create eventfd for shard %u: %m", i);
+
+                r = sd_event_add_io(shard->server.events, &shard->call_event,
+                                    shard->call_fd, EPOLLIN,
+                                    dispatch_shard_call, shard);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to add event source for shard %u: %m", i);
+
+                /* Don't let the main thread wait behind the sources */
+                r = sd_event_source_set_priority(shard->call_event, SD_EVENT_PRIORITY_IMPORTANT);
+                if (r < 0)
+                        return log_error_errno(r, "Failed to set priority of shard %u: %m", i);
+
+                r = pthread_create(&shard->thread, NULL, shard_thread, shard);
+                if (r != 0)
+                        return log_error_errno(r, "Failed to start thread for shard %u: %m", i);
+
+                shard->thread_running = true;
+        }
+
+        log_debug("Distributing sources over %u shards.", n);
+
+        return 0;
+}
+
+static void stop_shards(RemoteServer *s) {
+        unsigned i;
+
+        assert(s);
+
+        for (i = 0; i < s->n_shards; i++) {
+                RemoteShard *shard = s->shards + i;
+
+                if (!shard->thread_running)
+                        continue;
+
+                (void) shard_call(&shard->server, shard_exit, NULL);
+                assert_se(pthread_join(shard->thread, NULL) == 0);
+                shard->thread_running = false;
+        }
+}
+
+static int log_stats(RemoteServer *s, void *userdata) {
+        char buf[FORMAT_BYTES_MAX];
+
+        assert(s);
+
+        if (s->shard)
+                log_info("Shard %u: %zu sources active, %"PRIu64" total, %"PRIu64" entries, %s written.",
+                         s->shard->index, s->active, s->source_count, s->event_count,
+                         format_bytes(buf, sizeof(buf), s->byte_count));
+        else
+                log_info("%"PRIu64" sources total, %"PRIu64" entries, %s written.",
+                         s->source_count, s->event_count,
+                         format_bytes(buf, sizeof(buf), s->byte_count));
+
+        return 0;
+}
+
+static void server_log_stats(RemoteServer *s) {
+        unsigned i;
+
+        assert(s);
+
+        if (s->n_shards == 0) {
+                (void) log_stats(s, NULL);
+                return;
+        }
+
+        for (i = 0; i < s->n_shards; i++)
+                (void) shard_call(&s->shards[i].server, log_stats, NULL);
+}
+
+static uint64_t server_event_count(RemoteServer *s) {
+        uint64_t n;
+        unsigned i;
+
+        assert(s);
+
+        /* Only valid once the shards have been stopped */
+
+        n = s->event_count;
+        for (i = 0; i < s->n_shards; i++)
+                n += s->shards[i].server.event_count;
+
+        return n;
+}
+
 /**********************************************************************
  **********************************************************************
  **********************************************************************/
@@ -330,6 +821,7 @@ static int get_source_for_fd(RemoteServer *s,
                 }
 
                 s->active++;
+                s->source_count++;
         }
 
         *source = s->sources[fd];
@@ -353,6 +845,20 @@ static int remove_source(RemoteServer *s, int fd) {
         return 0;
 }
 
+typedef struct AddSourceCall {
+        int fd;
+        char *name;
+        bool own_name;
+} AddSourceCall;
+
+static int add_source(RemoteServer *s, int fd, char* name, bool own_name);
+
+static int add_source_call(RemoteServer *s, void *userdata) {
+        AddSourceCall *c = userdata;
+
+        return add_source(s, c->fd, c->name, c->own_name);
+}
+
 static int add_source(RemoteServer *s, int fd, char* name, bool own_name) {
 
         RemoteSource *source = NULL;
@@ -364,6 +870,16 @@ static int add_source(RemoteServer *s, int fd, char* name, bool own_name) {
         assert(fd >= 0);
         assert(name);
 
+        if (s->n_shards > 0) {
+                AddSourceCall c = {
+                        .fd = fd,
+                        .name = name,
+                        .own_name = own_name,
+                };
+
+                return shard_call(server_for_host(s, name), add_source_call, &c);
+        }
+
         if (!own_name) {
                 name = strdup(name);
                 if (!name)
@@ -452,29 +968,73 @@ static int setup_raw_socket(RemoteServer *s, const char *address) {
  **********************************************************************
  **********************************************************************/
 
-static int request_meta(void **connection_cls, int fd, char *hostname) {
-        RemoteSource *source;
+/* HTTP connections are handled by µhttpd in the main thread, but their
+ * sources and writers belong to the shard of their host. They are
+ * created, used and freed in the thread of the shard, see
+ * shard_queue_upload() and shard_queue_free(). */
+
+static int request_source_new(RemoteServer *s, RemoteRequest *req) {
         Writer *writer;
         int r;
 
-        assert(connection_cls);
-        if (*connection_cls)
-                return 0;
+        assert(s);
+        assert(req);
+        assert(!req->source);
 
-        r = get_writer(server, hostname, &writer);
+        r = get_writer(s, req->hostname, &writer);
         if (r < 0)
                 return log_warning_errno(r, "Failed to get writer for source %s: %m",
-                                         hostname);
+                                         req->hostname);
 
-        source = source_new(fd, true, hostname, writer);
-        if (!source) {
+        req->source = source_new(req->fd, true, req->hostname, writer);
+        if (!req->source) {
                 writer_unref(writer);
                 return log_oom();
         }
 
-        log_debug("Added RemoteSource as connection metadata %p", source);
+        /* The source owns the name now */
+        req->hostname = NULL;
+
+        r = source_set_encoding(req->source, req->encoding);
+        if (r < 0) {
+                source_free(req->source);
+                req->source = NULL;
+                return r;
+        }
 
-        *connection_cls = source;
+        s->source_count++;
+        return 0;
+}
+
+static int request_meta(void **connection_cls,
+                        struct MHD_Connection *connection,
+                        int fd, char *hostname, const char *encoding) {
+        RemoteRequest *req;
+
+        assert(connection_cls);
+        if (*connection_cls)
+                return 0;
+
+        req = new0(RemoteRequest, 1);
+        if (!req)
+                return -ENOMEM;
+
+        if (encoding) {
+                req->encoding = strdup(encoding);
+                if (!req->encoding) {
+                        free(req);
+                        return -ENOMEM;
+                }
+        }
+
+        req->connection = connection;
+        req->server = server_for_host(server, hostname);
+        req->fd = fd;
+        req->hostname = hostname;
+
+        log_debug("Added RemoteRequest as connection metadata %p", req);
+
+        *connection_cls = req;
         return 0;
 }
 
@@ -482,68 +1042,107 @@ static void request_meta_free(void *cls,
                               struct MHD_Connection *connection,
                               void **connection_cls,
                               enum MHD_RequestTerminationCode toe) {
-        RemoteSource *s;
+        RemoteRequest *req;
 
         assert(connection_cls);
-        s = *connection_cls;
+        req = *connection_cls;
 
-        if (s) {
-                log_debug("Cleaning up connection metadata %p", s);
-                source_free(s);
+        if (req) {
+                log_debug("Cleaning up connection metadata %p", req);
+
+                /* Suspended connections are never terminated */
+                assert(!req->pending);
+
+                shard_queue_free(req);
                 *connection_cls = NULL;
         }
 }
 
-static int process_http_upload(
-                struct MHD_Connection *connection,
-                const char *upload_data,
-                size_t *upload_data_size,
-                RemoteSource *source) {
-
-        bool finished = false;
-        size_t remaining;
+static void process_http_upload_call(RemoteServer *s, RemoteRequest *req) {
+        const char *data = req->data;
+        bool more = req->size > 0;
         int r;
 
-        assert(source);
+        assert(s);
+        assert(req);
 
-        log_trace("%s: connection %p, %zu bytes",
-                  __func__, connection, *upload_data_size);
+        if (!req->source) {
+                r = request_source_new(s, req);
+                if (r < 0) {
+                        req->push_failed = r == -ENOMEM;
+                        req->data = mfree(req->data);
+                        req->size = 0;
+                        req->result = r;
+                        return;
+                }
+        }
 
-        if (*upload_data_size) {
-                log_trace("Received %zu bytes", *upload_data_size);
+        for (;;) {
+                if (more) {
+                        r = push_data(req->source, &data, &req->size);
+                        if (r < 0) {
+                                req->push_failed = r == -ENOMEM;
+                                goto finish;
+                        }
 
-                r = push_data(source, upload_data, *upload_data_size);
-                if (r < 0)
-                        return mhd_respond_oom(connection);
+                        more = r > 0;
+                }
 
-                *upload_data_size = 0;
-        } else
-                finished = true;
+                for (;;) {
+                        r = process_source(req->source, arg_compress, arg_seal);
+                        if (r == -EAGAIN)
+                                break;
+                        else if (r < 0)
+                                goto finish;
+                }
 
-        for (;;) {
-                r = process_source(source, arg_compress, arg_seal);
-                if (r == -EAGAIN)
-                        break;
-                else if (r < 0) {
-                        log_warning("Failed to process data for connection %p", connection);
-                        if (r == -E2BIG)
-                                return mhd_respondf(connection,
-                                                    MHD_HTTP_REQUEST_ENTITY_TOO_LARGE,
-                                                    "Entry is too large, maximum is %u bytes.\n",
-                                                    DATA_SIZE_MAX);
-                        else
-                                return mhd_respondf(connection,
-                                                    MHD_HTTP_UNPROCESSABLE_ENTITY,
-                                                    "Processing failed: %s.", strerror(-r));
+                if (!more) {
+                        r = 0;
+                        goto finish;
                 }
         }
 
-        if (!finished)
+finish:
+        /* Write what we got from this chunk in one go */
+        (void) writer_flush(req->source->writer);
+
+        req->data = mfree(req->data);
+        req->size = 0;
+        req->result = r;
+}
+
+static int respond_http_upload(struct MHD_Connection *connection,
+                               RemoteRequest *req) {
+        size_t remaining;
+
+        assert(req);
+
+        if (req->push_failed)
+                return mhd_respond_oom(connection);
+
+        if (!req->source)
+                return mhd_respond(connection, MHD_HTTP_INTERNAL_SERVER_ERROR,
+                                   strerror(-req->result));
+
+        if (req->result < 0) {
+                log_warning("Failed to process data for connection %p", connection);
+                if (req->result == -E2BIG)
+                        return mhd_respondf(connection,
+                                            MHD_HTTP_REQUEST_ENTITY_TOO_LARGE,
+                                            "Entry is too large, maximum is %u bytes.\n",
+                                            DATA_SIZE_MAX);
+                else
+                        return mhd_respondf(connection,
+                                            MHD_HTTP_UNPROCESSABLE_ENTITY,
+                                            "Processing failed: %s.", strerror(-req->result));
+        }
+
+        if (!req->finished)
                 return MHD_YES;
 
         /* The upload is finished */
 
-        remaining = source_non_empty(source);
+        remaining = source_non_empty(req->source);
         if (remaining > 0) {
                 log_warning("Premature EOFbyte. %zu bytes lost.", remaining);
                 return mhd_respondf(connection, MHD_HTTP_EXPECTATION_FAILED,
@@ -551,7 +1150,57 @@ static int process_http_upload(
                                     remaining);
         }
 
-        return mhd_respond(connection, MHD_HTTP_ACCEPTED, "OK.\n");
+        /* The client may compress the following uploads once it
+         * learns that we accept that */
+        return mhd_respond_accept_encoding(connection, MHD_HTTP_ACCEPTED,
+                                           SOURCE_ACCEPT_ENCODING, "OK.\n");
+}
+
+static int process_http_upload(
+                struct MHD_Connection *connection,
+                const char *upload_data,
+                size_t *upload_data_size,
+                RemoteRequest *req) {
+
+        int r;
+
+        assert(req);
+        assert(!req->pending);
+
+        log_trace("%s: connection %p, %zu bytes",
+                  __func__, connection, *upload_data_size);
+
+        /* We are called again after the connection was resumed, once
+         * more data arrived or the upload is complete. Report errors
+         * of the previous chunk, or the result of the upload. */
+        if (req->result < 0 || req->finished)
+                return respond_http_upload(connection, req);
+
+        if (*upload_data_size) {
+                log_trace("Received %zu bytes", *upload_data_size);
+
+                /* µhttpd reuses its buffer once we return */
+                req->data = memdup(upload_data, *upload_data_size);
+                if (!req->data)
+                        return respond_oom(connection);
+
+                req->size = *upload_data_size;
+        } else
+                req->finished = true;
+
+        *upload_data_size = 0;
+
+        r = shard_queue_upload(req->server, req);
+        if (r > 0) {
+                MHD_suspend_connection(connection);
+                return MHD_YES;
+        }
+        if (r < 0) {
+                req->data = mfree(req->data);
+                req->result = r;
+        }
+
+        return respond_http_upload(connection, req);
 };
 
 static int request_handler(
@@ -564,7 +1213,7 @@ static int request_handler(
                 size_t *upload_data_size,
                 void **connection_cls) {
 
-        const char *header;
+        const char *header, *encoding;
         int r, code, fd;
         _cleanup_free_ char *hostname = NULL;
 
@@ -595,6 +1244,13 @@ static int request_handler(
                                    "Content-Type: application/vnd.fdo.journal"
                                    " is required.\n");
 
+        encoding = MHD_lookup_connection_value(connection,
+                                               MHD_HEADER_KIND, "Content-Encoding");
+        if (!source_encoding_supported(encoding))
+                return mhd_respond_accept_encoding(connection, MHD_HTTP_UNSUPPORTED_MEDIA_TYPE,
+                                                   SOURCE_ACCEPT_ENCODING,
+                                                   "Unsupported Content-Encoding.\n");
+
         {
                 const union MHD_ConnectionInfo *ci;
 
@@ -623,7 +1279,7 @@ static int request_handler(
 
         assert(hostname);
 
-        r = request_meta(connection_cls, fd, hostname);
+        r = request_meta(connection_cls, connection, fd, hostname, encoding);
         if (r == -ENOMEM)
                 return respond_oom(connection);
         else if (r < 0)
@@ -654,7 +1310,8 @@ static int setup_microhttpd_server(RemoteServer *s,
                 MHD_USE_DUAL_STACK |
                 MHD_USE_EPOLL_LINUX_ONLY |
                 MHD_USE_PEDANTIC_CHECKS |
-                MHD_USE_PIPE_FOR_SHUTDOWN;
+                MHD_USE_PIPE_FOR_SHUTDOWN |
+                MHD_USE_SUSPEND_RESUME;
 
         const union MHD_DaemonInfo *info;
         int r, epoll_fd;
@@ -789,12 +1446,23 @@ static int dispatch_http_event(sd_event_source *event,
  **********************************************************************
  **********************************************************************/
 
+static int dispatch_sigusr1(sd_event_source *event,
+                            const struct signalfd_siginfo *si,
+                            void *userdata) {
+        RemoteServer *s = userdata;
+
+        assert(s);
+
+        server_log_stats(s);
+        return 0;
+}
+
 static int setup_signals(RemoteServer *s) {
         int r;
 
         assert(s);
 
-        assert_se(sigprocmask_many(SIG_SETMASK, NULL, SIGINT, SIGTERM, -1) >= 0);
+        assert_se(sigprocmask_many(SIG_SETMASK, NULL, SIGINT, SIGTERM, SIGUSR1, -1) >= 0);
 
         r = sd_event_add_signal(s->events, &s->sigterm_event, SIGTERM, NULL, s);
         if (r < 0)
@@ -804,6 +1472,10 @@ static int setup_signals(RemoteServer *s) {
         if (r < 0)
                 return r;
 
+        r = sd_event_add_signal(s->events, &s->sigusr1_event, SIGUSR1, dispatch_sigusr1, s);
+        if (r < 0)
+                return r;
+
         return 0;
 }
 
@@ -855,6 +1527,24 @@ static int remoteserver_init(RemoteServer *s,
         else
                 log_debug("Received %d descriptors", n);
 
+        if (arg_threads > 1 && arg_split_mode == JOURNAL_WRITE_SPLIT_HOST) {
+                bool listening;
+
+                /* We only exit when the main thread runs out of
+                 * sources, so sharding only makes sense if we are
+                 * listening for connections */
+                listening = arg_listen_raw || arg_listen_http || arg_listen_https;
+                for (fd = SD_LISTEN_FDS_START; fd < SD_LISTEN_FDS_START + n && !listening; fd++)
+                        listening = sd_is_socket(fd, AF_UNSPEC, 0, true) > 0;
+
+                if (listening) {
+                        r = setup_shards(s, arg_threads);
+                        if (r < 0)
+                                return r;
+                } else
+                        log_debug("Not listening for connections, ignoring Threads=%u.", arg_threads);
+        }
+
         if (MAX(http_socket, https_socket) >= SD_LISTEN_FDS_START + n) {
                 log_error("Received fewer sockets than expected");
                 return -EBADFD;
@@ -994,10 +1684,32 @@ static int remoteserver_init(RemoteServer *s,
         return 0;
 }
 
+static void server_destroy(RemoteServer *s);
+
+static void shard_destroy(RemoteShard *shard) {
+        assert(shard);
+        assert(!shard->thread_running);
+
+        sd_event_source_unref(shard->call_event);
+        safe_close(shard->call_fd);
+
+        server_destroy(&shard->server);
+
+        pthread_mutex_destroy(&shard->call_mutex);
+        pthread_cond_destroy(&shard->call_cond);
+}
+
 static void server_destroy(RemoteServer *s) {
         size_t i;
         MHDDaemonWrapper *d;
 
+        stop_shards(s);
+
+        /* The shards are gone, let µhttpd have the connections of
+         * any uploads they failed */
+        if (s->shards)
+                resume_uploads(s);
+
         while ((d = hashmap_steal_first(s->daemons))) {
                 MHD_stop_daemon(d->daemon);
                 sd_event_source_unref(d->event);
@@ -1006,6 +1718,16 @@ static void server_destroy(RemoteServer *s) {
 
         hashmap_free(s->daemons);
 
+        for (i = 0; i < s->n_shards; i++)
+                shard_destroy(s->shards + i);
+
+        if (s->shards) {
+                sd_event_source_unref(s->uploads_done_event);
+                safe_close(s->uploads_done_fd);
+                pthread_mutex_destroy(&s->uploads_mutex);
+                free(s->shards);
+        }
+
         assert(s->sources_size == 0 || s->sources);
         for (i = 0; i < s->sources_size; i++)
                 remove_source(s, i);
@@ -1016,6 +1738,7 @@ static void server_destroy(RemoteServer *s) {
 
         sd_event_source_unref(s->sigterm_event);
         sd_event_source_unref(s->sigint_event);
+        sd_event_source_unref(s->sigusr1_event);
         sd_event_source_unref(s->listen_event);
         sd_event_unref(s->events);
 
@@ -1032,6 +1755,7 @@ static int handle_raw_source(sd_event_source *event,
                              RemoteServer *s) {
 
         RemoteSource *source;
+        unsigned n = 0;
         int r;
 
         /* Returns 1 if there might be more data pending,
@@ -1042,7 +1766,15 @@ static int handle_raw_source(sd_event_source *event,
         source = s->sources[fd];
         assert(source->fd == fd);
 
-        r = process_source(source, arg_compress, arg_seal);
+        /* Process a batch of entries at a time, but don't starve
+         * the other sources */
+        do
+                r = process_source(source, arg_compress, arg_seal);
+        while (r == 1 && ++n < ENTRIES_PER_ITERATION);
+
+        /* Write what we got in this iteration in one go */
+        (void) writer_flush(source->writer);
+
         if (source->state == STATE_EOF) {
                 size_t remaining;
 
@@ -1062,7 +1794,7 @@ static int handle_raw_source(sd_event_source *event,
                 return 0;
         } else if (r < 0) {
                 log_debug_errno(r, "Closing connection: %m");
-                remove_source(server, fd);
+                remove_source(s, fd);
                 return 0;
         } else
                 return 1;
@@ -1076,7 +1808,7 @@ static int dispatch_raw_source_until_block(sd_event_source *event,
         /* Make sure event stays around even if source is destroyed */
         sd_event_source_ref(event);
 
-        r = handle_raw_source(event, source->fd, EPOLLIN, server);
+        r = handle_raw_source(event, source->fd, EPOLLIN, source_server(source));
         if (r != 1)
                 /* No more data for now */
                 sd_event_source_set_enabled(event, SD_EVENT_OFF);
@@ -1096,7 +1828,7 @@ static int dispatch_raw_source_event(sd_event_source *event,
         assert(source->event);
         assert(source->buffer_event);
 
-        r = handle_raw_source(event, fd, EPOLLIN, server);
+        r = handle_raw_source(event, fd, EPOLLIN, source_server(source));
         if (r == 1)
                 /* Might have more data. We need to rerun the handler
                  * until we are sure the buffer is exhausted. */
@@ -1109,7 +1841,7 @@ static int dispatch_blocking_source_event(sd_event_source *event,
                                           void *userdata) {
         RemoteSource *source = userdata;
 
-        return handle_raw_source(event, source->fd, EPOLLIN, server);
+        return handle_raw_source(event, source->fd, EPOLLIN, source_server(source));
 }
 
 static int accept_connection(const char* type, int fd,
@@ -1197,6 +1929,7 @@ static int parse_config(void) {
         const ConfigTableItem items[] = {
                 { "Remote",  "Seal",                   config_parse_bool,             0, &arg_seal       },
                 { "Remote",  "SplitMode",              config_parse_write_split_mode, 0, &arg_split_mode },
+                { "Remote",  "Threads",                config_parse_unsigned,         0, &arg_threads    },
                 { "Remote",  "ServerKeyFile",          config_parse_path,             0, &arg_key        },
                 { "Remote",  "ServerCertificateFile",  config_parse_path,             0, &arg_cert       },
                 { "Remote",  "TrustedCertificateFile", config_parse_path,             0, &arg_trust      },
@@ -1230,6 +1963,7 @@ static void help(void) {
                "     --gnutls-log=CATEGORY...\n"
                "                            Specify a list of gnutls logging categories\n"
                "     --split-mode=none|host How many output files to create\n"
+               "     --threads=N            Distribute hosts over N threads (default: 1)\n"
                "\n"
                "Note: file descriptors from sd_listen_fds() will be consumed, too.\n"
                , program_invocation_short_name);
@@ -1244,6 +1978,7 @@ static int parse_argv(int argc, char *argv[]) {
                 ARG_LISTEN_HTTPS,
                 ARG_GETTER,
                 ARG_SPLIT_MODE,
+                ARG_THREADS,
                 ARG_COMPRESS,
                 ARG_SEAL,
                 ARG_KEY,
@@ -1262,6 +1997,7 @@ static int parse_argv(int argc, char *argv[]) {
                 { "listen-https", required_argument, NULL, ARG_LISTEN_HTTPS },
                 { "output",       required_argument, NULL, 'o'              },
                 { "split-mode",   required_argument, NULL, ARG_SPLIT_MODE   },
+                { "threads",      required_argument, NULL, ARG_THREADS      },
                 { "compress",     optional_argument, NULL, ARG_COMPRESS     },
                 { "seal",         optional_argument, NULL, ARG_SEAL         },
                 { "key",          required_argument, NULL, ARG_KEY          },
@@ -1402,6 +2138,14 @@ static int parse_argv(int argc, char *argv[]) {
                         }
                         break;
 
+                case ARG_THREADS:
+                        r = safe_atou(optarg, &arg_threads);
+                        if (r < 0) {
+                                log_error("Failed to parse --threads= parameter.");
+                                return -EINVAL;
+                        }
+                        break;
+
                 case ARG_COMPRESS:
                         if (optarg) {
                                 r = parse_boolean(optarg);
@@ -1496,8 +2240,18 @@ static int parse_argv(int argc, char *argv[]) {
                 return -EINVAL;
         }
 
-        log_debug("Full config: SplitMode=%s Key=%s Cert=%s Trust=%s",
+        if (arg_threads == 0) {
+                long ncpus;
+
+                ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+                arg_threads = ncpus > 0 ? (unsigned) ncpus : 1;
+        }
+
+        arg_threads = MIN(arg_threads, REMOTE_THREADS_MAX);
+
+        log_debug("Full config: SplitMode=%s Threads=%u Key=%s Cert=%s Trust=%s",
                   journal_write_split_mode_to_string(arg_split_mode),
+                  arg_threads,
                   strna(arg_key),
                   strna(arg_cert),
                   strna(arg_trust));
@@ -1586,10 +2340,14 @@ int main(int argc, char **argv) {
                 }
         }
 
+        stop_shards(&s);
+        if (s.n_shards > 0)
+                server_log_stats(&s);
+
         sd_notifyf(false,
                    "STOPPING=1\n"
-                   "STATUS=Shutting down after writing %" PRIu64 " entries...", s.event_count);
-        log_info("Finishing after writing %" PRIu64 " entries", s.event_count);
+                   "STATUS=Shutting down after writing %" PRIu64 " entries...", server_event_count(&s));
+        log_info("Finishing after writing %" PRIu64 " entries", server_event_count(&s));
 
         server_destroy(&s);
 
@@ -19,11 +19,14 @@
   along with systemd; If not, see <http://www.gnu.org/licenses/>.
 ***/
 
+#include <pthread.h>
+
 #include "sd-event.h"
 
 #include "hashmap.h"
 #include "journal-remote-parse.h"
 #include "journal-remote-write.h"
+#include "list.h"
 #include "microhttpd-util.h"
 
 typedef struct MHDDaemonWrapper MHDDaemonWrapper;
@@ -35,18 +38,69 @@ struct MHDDaemonWrapper {
         sd_event_source *event;
 };
 
+typedef struct RemoteShard RemoteShard;
+typedef struct RemoteRequest RemoteRequest;
+
 struct RemoteServer {
         RemoteSource **sources;
         size_t sources_size;
         size_t active;
 
         sd_event *events;
-        sd_event_source *sigterm_event, *sigint_event, *listen_event;
+        sd_event_source *sigterm_event, *sigint_event, *sigusr1_event, *listen_event;
 
         Hashmap *writers;
         Writer *_single_writer;
         uint64_t event_count;
+        uint64_t byte_count;
+        uint64_t source_count;
 
         bool check_trust;
         Hashmap *daemons;
+
+        /* In sharded mode, sources are assigned to shards by the hash
+         * of their host name. Each shard is a RemoteServer of its own,
+         * with its own event loop, sources and writers, run by a
+         * thread of its own. */
+        RemoteShard *shards;
+        unsigned n_shards;
+        uint8_t shard_hash_key[16];
+
+        /* Set for the RemoteServer objects of shards */
+        RemoteShard *shard;
+
+        /* HTTP uploads processed by the shards, waiting for their
+         * connection to be resumed by the main thread */
+        int uploads_done_fd;
+        sd_event_source *uploads_done_event;
+        pthread_mutex_t uploads_mutex;
+        LIST_HEAD(RemoteRequest, uploads_done);
+};
+
+struct RemoteShard {
+        RemoteServer server;
+        RemoteServer *parent;
+        unsigned index;
+
+        pthread_t thread;
+        bool thread_running;
+
+        /* Calls from the main thread, see shard_call() */
+        int call_fd;
+        sd_event_source *call_event;
+        pthread_mutex_t call_mutex;
+        pthread_cond_t call_cond;
+        int (*call)(RemoteServer *s, void *userdata);
+        void *call_userdata;
+        int call_result;
+        bool call_done;
+
+        /* HTTP uploads queued by the main thread, and requests whose
+         * connection is gone and whose source is to be freed, also
+         * protected by call_mutex */
+        LIST_HEAD(RemoteRequest, uploads);
+
+        /* Set once the event loop of the shard is gone, calls fail
+         * with -ESHUTDOWN from then on */
+        bool dead;
 };
@@ -233,6 +233,7 @@ static ssize_t write_entry(char *buf, size_t size, Uploader *u) {
                         buf[pos++] = '\n';
                         u->entry_state++;
                         u->entries_sent++;
+                        u->batch_entries++;
 
                         return pos;
 
@@ -275,18 +276,24 @@ static size_t journal_input_callback(void *buf, size_t size, size_t nmemb, void
 
         while (j && filled < size * nmemb) {
                 if (u->entry_state == ENTRY_DONE) {
+                        if (u->batch_entries >= JOURNAL_UPLOAD_BATCH_ENTRIES) {
+                                /* End this upload, so that the server
+                                 * acknowledges what we sent so far. The
+                                 * rest follows in the next one. */
+                                u->uploading = false;
+                                u->batch_full = true;
+                                break;
+                        }
+
                         r = sd_journal_next(j);
                         if (r < 0) {
                                 log_error_errno(r, "Failed to move to next entry in journal: %m");
                                 return CURL_READFUNC_ABORT;
                         } else if (r == 0) {
-                                if (u->input_event)
-                                        log_debug("No more entries, waiting for journal.");
-                                else {
-                                        log_info("No more entries, closing journal.");
-                                        close_journal_input(u);
-                                }
-
+                                /* Without following the journal, it is
+                                 * closed once this upload went through,
+                                 * see process_journal_input() */
+                                log_debug("No more entries.");
                                 u->uploading = false;
 
                                 break;
@@ -332,19 +339,57 @@ static int process_journal_input(Uploader *u, int skip) {
         if (u->uploading)
                 return 0;
 
+        u->batch_full = false;
+
         r = sd_journal_next_skip(u->journal, skip);
         if (r < 0)
                 return log_error_errno(r, "Failed to skip to next entry: %m");
-        else if (r < skip)
+        else if (r < skip) {
+                if (u->input_event)
+                        log_debug("No more entries, waiting for journal.");
+                else {
+                        log_info("No more entries, closing journal.");
+                        close_journal_input(u);
+                }
+
                 return 0;
+        }
+
+        /* have data, remember where it starts in case the upload has
+         * to be repeated */
+        u->batch_cursor = mfree(u->batch_cursor);
+        r = sd_journal_get_cursor(u->journal, &u->batch_cursor);
+        if (r < 0)
+                return log_error_errno(r, "Failed to get cursor: %m");
 
-        /* have data */
         u->entry_state = ENTRY_CURSOR;
+        u->batch_entries = 0;
         return start_upload(u, journal_input_callback, u);
 }
 
+/* Sends the entries of the last upload once more */
+int restart_journal_input(Uploader *u) {
+        int r;
+
+        assert(u);
+
+        if (!u->journal || !u->batch_cursor)
+                return -ESTALE;
+
+        r = sd_journal_seek_cursor(u->journal, u->batch_cursor);
+        if (r < 0)
+                return log_error_errno(r, "Failed to seek to cursor %s: %m",
+                                       u->batch_cursor);
+
+        u->entries_sent -= u->batch_entries;
+        u->uploading = false;
+
+        return process_journal_input(u, 1);
+}
+
 int check_journal_input(Uploader *u) {
-        if (u->input_event) {
+        /* After a full batch, carry on without waiting for changes */
+        if (u->input_event && !u->batch_full) {
                 int r;
 
                 r = sd_journal_process(u->journal);
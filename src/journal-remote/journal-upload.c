@@ -59,6 +59,7 @@ static const char *arg_machine = NULL;
 static bool arg_merge = false;
 static int arg_follow = -1;
 static const char *arg_save_state = NULL;
+static bool arg_compress = true;
 
 static void close_fd_input(Uploader *u);
 
@@ -66,6 +67,9 @@ static void close_fd_input(Uploader *u);
 
 #define STATE_FILE "/var/lib/systemd/journal-upload/state"
 
+/* Uploads are compressed on the fly, hence favour speed over ratio */
+#define UPLOAD_ZSTD_LEVEL 1
+
 #define easy_setopt(curl, opt, value, level, cmd)                       \
         do {                                                            \
                 code = curl_easy_setopt(curl, opt, value);              \
@@ -98,6 +102,154 @@ static size_t output_callback(char *buf,
         return size * nmemb;
 }
 
+static size_t header_callback(char *buf,
+                              size_t size,
+                              size_t nmemb,
+                              void *userp) {
+        Uploader *u = userp;
+        _cleanup_free_ char *h = NULL;
+        const char *value, *word, *state;
+        bool zstd = false;
+        size_t l;
+
+        assert(u);
+
+        /* The server lists the content codings it accepts for
+         * uploads in its answers, see RFC 7694. That list replaces
+         * whatever it told us before. */
+
+        h = strndup(buf, size * nmemb);
+        if (!h)
+                return size * nmemb;
+
+        value = startswith_no_case(h, "Accept-Encoding:");
+        if (!value)
+                return size * nmemb;
+
+        FOREACH_WORD_SEPARATOR(word, l, value, ", \t\r\n", state)
+                if (l == 4 && strncasecmp(word, "zstd", l) == 0)
+                        zstd = true;
+
+        if (zstd != u->accepts_zstd)
+                log_debug("Server %s zstd compressed uploads.",
+                          zstd ? "accepts" : "no longer accepts");
+
+        u->accepts_zstd = zstd;
+
+        return size * nmemb;
+}
+
+static size_t upload_input_callback(void *buf,
+                                    size_t size,
+                                    size_t nmemb,
+                                    void *userp) {
+        Uploader *u = userp;
+#ifdef HAVE_ZSTD
+        ZSTD_outBuffer out = {
+                .dst = buf,
+                .size = size * nmemb,
+        };
+        size_t k;
+#endif
+
+        assert(u);
+
+        if (!u->compressing)
+                return u->input_callback(buf, size, nmemb, u->input_data);
+
+#ifdef HAVE_ZSTD
+        if (u->compress_done)
+                return 0;
+
+        for (;;) {
+                if (u->compress_in.pos == u->compress_in.size && !u->compress_eof) {
+                        size_t n;
+
+                        n = u->input_callback(u->compress_buffer, 1, u->compress_buffer_size, u->input_data);
+                        if (n == CURL_READFUNC_ABORT)
+                                return CURL_READFUNC_ABORT;
+
+                        u->compress_in = (ZSTD_inBuffer) {
+                                .src = u->compress_buffer,
+                                .size = n,
+                        };
+                        u->compress_eof = n == 0;
+
+                        /* If the input did not fill the buffer, there
+                         * might not be more for a while, so do not sit
+                         * on what we have. */
+                        u->compress_flush = n < u->compress_buffer_size;
+                }
+
+                if (u->compress_eof) {
+                        k = ZSTD_endStream(u->zstd, &out);
+                        if (ZSTD_isError(k))
+                                goto fail;
+                        if (k == 0) {
+                                u->compress_done = true;
+                                return out.pos;
+                        }
+                } else {
+                        k = ZSTD_compressStream(u->zstd, &out, &u->compress_in);
+                        if (ZSTD_isError(k))
+                                goto fail;
+
+                        if (u->compress_flush && u->compress_in.pos == u->compress_in.size) {
+                                k = ZSTD_flushStream(u->zstd, &out);
+                                if (ZSTD_isError(k))
+                                        goto fail;
+                                if (k == 0)
+                                        u->compress_flush = false;
+                        }
+                }
+
+                /* Return as soon as the buffer is full, or when
+                 * getting more input would mean waiting for it */
+                if (out.pos == out.size ||
+                    (out.pos > 0 && u->compress_in.pos == u->compress_in.size && !u->compress_flush))
+                        return out.pos;
+        }
+
+fail:
+        log_error("Failed to compress upload: %s", ZSTD_getErrorName(k));
+        return CURL_READFUNC_ABORT;
+#else
+        assert_not_reached("Compressed upload without zstd support.");
+#endif
+}
+
+static int setup_compression(Uploader *u) {
+#ifdef HAVE_ZSTD
+        size_t k;
+
+        assert(u);
+
+        if (!u->zstd) {
+                u->zstd = ZSTD_createCStream();
+                if (!u->zstd)
+                        return log_oom();
+
+                u->compress_buffer_size = ZSTD_CStreamInSize();
+                u->compress_buffer = malloc(u->compress_buffer_size);
+                if (!u->compress_buffer)
+                        return log_oom();
+        }
+
+        k = ZSTD_initCStream(u->zstd, UPLOAD_ZSTD_LEVEL);
+        if (ZSTD_isError(k)) {
+                log_error("Failed to initialize compression: %s", ZSTD_getErrorName(k));
+                return -EIO;
+        }
+
+        u->compress_in = (ZSTD_inBuffer) {};
+        u->compress_flush = u->compress_eof = u->compress_done = false;
+
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
 static int check_cursor_updating(Uploader *u) {
         _cleanup_free_ char *temp_path = NULL;
         _cleanup_fclose_ FILE *f = NULL;
@@ -187,6 +339,7 @@ int start_upload(Uploader *u,
                                           void *userdata),
                  void *data) {
         CURLcode code;
+        int r;
 
         assert(u);
         assert(input_callback);
@@ -213,6 +366,34 @@ int start_upload(Uploader *u,
                 u->header = h;
         }
 
+#ifdef HAVE_ZSTD
+        u->compressing = arg_compress && u->accepts_zstd;
+#endif
+        if (u->compressing && !u->header_zstd) {
+                struct curl_slist *h = NULL, *i;
+
+                for (i = u->header; i; i = i->next) {
+                        h = curl_slist_append(h, i->data);
+                        if (!h)
+                                return log_oom();
+                }
+
+                h = curl_slist_append(h, "Content-Encoding: zstd");
+                if (!h)
+                        return log_oom();
+
+                u->header_zstd = h;
+        }
+
+        if (u->compressing) {
+                r = setup_compression(u);
+                if (r < 0)
+                        return r;
+        }
+
+        u->input_callback = input_callback;
+        u->input_data = data;
+
         if (!u->easy) {
                 CURL *curl;
 
@@ -236,15 +417,18 @@ int start_upload(Uploader *u,
                 easy_setopt(curl, CURLOPT_WRITEDATA, data,
                             LOG_ERR, return -EXFULL);
 
-                /* set where to read from */
-                easy_setopt(curl, CURLOPT_READFUNCTION, input_callback,
+                /* learn what the server accepts from the headers */
+                easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback,
                             LOG_ERR, return -EXFULL);
 
-                easy_setopt(curl, CURLOPT_READDATA, data,
+                easy_setopt(curl, CURLOPT_HEADERDATA, u,
                             LOG_ERR, return -EXFULL);
 
-                /* use our special own mime type and chunked transfer */
-                easy_setopt(curl, CURLOPT_HTTPHEADER, u->header,
+                /* set where to read from, possibly through the compressor */
+                easy_setopt(curl, CURLOPT_READFUNCTION, upload_input_callback,
+                            LOG_ERR, return -EXFULL);
+
+                easy_setopt(curl, CURLOPT_READDATA, u,
                             LOG_ERR, return -EXFULL);
 
                 if (_unlikely_(log_get_max_level() >= LOG_DEBUG))
@@ -282,6 +466,15 @@ int start_upload(Uploader *u,
                 u->answer = 0;
         }
 
+        /* use our special own mime type and chunked transfer */
+        code = curl_easy_setopt(u->easy, CURLOPT_HTTPHEADER,
+                                u->compressing ? u->header_zstd : u->header);
+        if (code) {
+                log_error("curl_easy_setopt CURLOPT_HTTPHEADER failed: %s",
+                          curl_easy_strerror(code));
+                return -EXFULL;
+        }
+
         /* upload to this place */
         code = curl_easy_setopt(u->easy, CURLOPT_URL, u->url);
         if (code) {
@@ -473,10 +666,17 @@ static void destroy_uploader(Uploader *u) {
 
         curl_easy_cleanup(u->easy);
         curl_slist_free_all(u->header);
+        curl_slist_free_all(u->header_zstd);
         free(u->answer);
 
+#ifdef HAVE_ZSTD
+        ZSTD_freeCStream(u->zstd);
+        free(u->compress_buffer);
+#endif
+
         free(u->last_cursor);
         free(u->current_cursor);
+        free(u->batch_cursor);
 
         free(u->url);
 
@@ -515,6 +715,19 @@ static int perform_upload(Uploader *u) {
                 return -EUCLEAN;
         }
 
+        if (status == 415 && u->compressing) {
+                /* The server, or a proxy in front of it, doesn't take
+                 * compressed uploads (anymore). Stop compressing, and
+                 * send the entries once more if we still can. */
+                u->accepts_zstd = false;
+
+                if (restart_journal_input(u) >= 0 && u->uploading) {
+                        log_notice("Server at %s refused compressed upload, sending it uncompressed.",
+                                   u->url);
+                        return perform_upload(u);
+                }
+        }
+
         if (status >= 300) {
                 log_error("Upload to %s failed with code %ld: %s",
                           u->url, status, strna(u->answer));
@@ -540,6 +753,7 @@ static int parse_config(void) {
                 { "Upload",  "ServerKeyFile",          config_parse_path,   0, &arg_key    },
                 { "Upload",  "ServerCertificateFile",  config_parse_path,   0, &arg_cert   },
                 { "Upload",  "TrustedCertificateFile", config_parse_path,   0, &arg_trust  },
+                { "Upload",  "Compression",            config_parse_bool,   0, &arg_compress },
                 {}};
 
         return config_parse_many(PKGSYSCONFDIR "/journal-upload.conf",
@@ -572,6 +786,7 @@ static void help(void) {
                "     --follow[=BOOL]        Do [not] wait for input\n"
                "     --save-state[=FILE]    Save uploaded cursors (default \n"
                "                            " STATE_FILE ")\n"
+               "     --compress[=BOOL]      Compress uploads if the server supports it\n"
                "  -h --help                 Show this help and exit\n"
                "     --version              Print version string and exit\n"
                , program_invocation_short_name);
@@ -590,6 +805,7 @@ static int parse_argv(int argc, char *argv[]) {
                 ARG_AFTER_CURSOR,
                 ARG_FOLLOW,
                 ARG_SAVE_STATE,
+                ARG_COMPRESS,
         };
 
         static const struct option options[] = {
@@ -609,6 +825,7 @@ static int parse_argv(int argc, char *argv[]) {
                 { "after-cursor", required_argument, NULL, ARG_AFTER_CURSOR   },
                 { "follow",       optional_argument, NULL, ARG_FOLLOW         },
                 { "save-state",   optional_argument, NULL, ARG_SAVE_STATE     },
+                { "compress",     optional_argument, NULL, ARG_COMPRESS       },
                 {}
         };
 
@@ -737,6 +954,20 @@ static int parse_argv(int argc, char *argv[]) {
                         arg_save_state = optarg ?: STATE_FILE;
                         break;
 
+                case ARG_COMPRESS:
+                        if (optarg) {
+                                r = parse_boolean(optarg);
+                                if (r < 0) {
+                                        log_error("Failed to parse --compress= parameter.");
+                                        return -EINVAL;
+                                }
+
+                                arg_compress = !!r;
+                        } else
+                                arg_compress = true;
+
+                        break;
+
                 case '?':
                         log_error("Unknown option %s.", argv[optind-1]);
                         return -EINVAL;
@@ -861,7 +1092,7 @@ int main(int argc, char **argv) {
                                 break;
                 }
 
-                r = sd_event_run(u.events, u.timeout);
+                r = sd_event_run(u.events, u.batch_full ? 0 : u.timeout);
                 if (r < 0) {
                         log_error_errno(r, "Failed to run event loop: %m");
                         break;
@@ -2,6 +2,10 @@
 
 #include <inttypes.h>
 
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
 #include "sd-event.h"
 #include "sd-journal.h"
 #include "time-util.h"
@@ -28,9 +32,23 @@ typedef struct Uploader {
         CURL *easy;
         bool uploading;
         char error[CURL_ERROR_SIZE];
-        struct curl_slist *header;
+        struct curl_slist *header, *header_zstd;
         char *answer;
 
+        size_t (*input_callback)(void *ptr, size_t size, size_t nmemb, void *userdata);
+        void *input_data;
+
+        /* compression of the uploaded data */
+        bool accepts_zstd;          /* the server told us it accepts zstd */
+        bool compressing;           /* the current upload is compressed */
+#ifdef HAVE_ZSTD
+        ZSTD_CStream *zstd;
+        ZSTD_inBuffer compress_in;
+        void *compress_buffer;
+        size_t compress_buffer_size;
+        bool compress_flush, compress_eof, compress_done;
+#endif
+
         sd_event_source *input_event;
         uint64_t timeout;
 
@@ -48,13 +66,20 @@ typedef struct Uploader {
         const char *state_file;
 
         size_t entries_sent;
+        size_t batch_entries;       /* entries sent in the current upload */
+        bool batch_full;            /* the current upload was cut off, more entries follow */
         char *last_cursor, *current_cursor;
+        char *batch_cursor;         /* first entry of the current upload */
         usec_t watchdog_timestamp;
         usec_t watchdog_usec;
 } Uploader;
 
 #define JOURNAL_UPLOAD_POLL_TIMEOUT (10 * USEC_PER_SEC)
 
+/* Entries are sent in uploads of at most this many entries. The state
+ * file is updated once the server acknowledged an upload. */
+#define JOURNAL_UPLOAD_BATCH_ENTRIES 4096U
+
 int start_upload(Uploader *u,
                  size_t (*input_callback)(void *ptr,
                                           size_t size,
@@ -69,3 +94,4 @@ int open_journal_for_upload(Uploader *u,
                             bool follow);
 void close_journal_input(Uploader *u);
 int check_journal_input(Uploader *u);
+int restart_journal_input(Uploader *u);
@@ -48,6 +48,7 @@ void microhttpd_logger(void *arg, const char *fmt, va_list ap) {
 
 static int mhd_respond_internal(struct MHD_Connection *connection,
                                 enum MHD_RequestTerminationCode code,
+                                const char *accept_encoding,
                                 char *buffer,
                                 size_t size,
                                 enum MHD_ResponseMemoryMode mode) {
@@ -62,6 +63,8 @@ static int mhd_respond_internal(struct MHD_Connection *connection,
 
         log_debug("Queing response %u: %s", code, buffer);
         MHD_add_response_header(response, "Content-Type", "text/plain");
+        if (accept_encoding)
+                MHD_add_response_header(response, "Accept-Encoding", accept_encoding);
         r = MHD_queue_response(connection, code, response);
         MHD_destroy_response(response);
 
@@ -72,7 +75,17 @@ int mhd_respond(struct MHD_Connection *connection,
                 enum MHD_RequestTerminationCode code,
                 const char *message) {
 
-        return mhd_respond_internal(connection, code,
+        return mhd_respond_internal(connection, code, NULL,
+                                    (char*) message, strlen(message),
+                                    MHD_RESPMEM_PERSISTENT);
+}
+
+int mhd_respond_accept_encoding(struct MHD_Connection *connection,
+                                enum MHD_RequestTerminationCode code,
+                                const char *accept_encoding,
+                                const char *message) {
+
+        return mhd_respond_internal(connection, code, accept_encoding,
                                     (char*) message, strlen(message),
                                     MHD_RESPMEM_PERSISTENT);
 }
@@ -99,7 +112,7 @@ int mhd_respondf(struct MHD_Connection *connection,
         if (r < 0)
                 return respond_oom(connection);
 
-        return mhd_respond_internal(connection, code, m, r, MHD_RESPMEM_MUST_FREE);
+        return mhd_respond_internal(connection, code, NULL, m, r, MHD_RESPMEM_MUST_FREE);
 }
 
 #ifdef HAVE_GNUTLS
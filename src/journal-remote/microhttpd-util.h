@@ -33,6 +33,11 @@
 #define MHD_create_response_from_fd_at_offset64 MHD_create_response_from_fd_at_offset
 #endif
 
+/* libmicrohttpd < 0.9.44 allowed suspending connections without a flag */
+#if MHD_VERSION < 0x00094400
+#define MHD_USE_SUSPEND_RESUME 0
+#endif
+
 void microhttpd_logger(void *arg, const char *fmt, va_list ap) _printf_(2, 0);
 
 /* respond_oom() must be usable with return, hence this form. */
@@ -46,6 +51,13 @@ int mhd_respond(struct MHD_Connection *connection,
                 unsigned code,
                 const char *message);
 
+/* Like mhd_respond(), but also tells the client which content codings
+ * it may use for request bodies, see RFC 7694. */
+int mhd_respond_accept_encoding(struct MHD_Connection *connection,
+                                unsigned code,
+                                const char *accept_encoding,
+                                const char *message);
+
 int mhd_respond_oom(struct MHD_Connection *connection);
 
 int check_permissions(struct MHD_Connection *connection, int *code, char **hostname);
@@ -0,0 +1,263 @@
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "alloc-util.h"
+#include "dirent-util.h"
+#include "fd-util.h"
+#include "io-util.h"
+#include "journal-remote-parse.h"
+#include "macro.h"
+#include "parse-util.h"
+#include "process-util.h"
+#include "rm-rf.h"
+#include "string-util.h"
+#include "util.h"
+
+/* Feeds an export format stream of the given size (default: 64M,
+ * pass e.g. "4G" for a longer run) through a pipe into the parser,
+ * and reports how many entries per second it gets through. Then
+ * does the same for a smaller stream which is also written to a
+ * journal file. */
+
+#define N_BLOCK_ENTRIES 1024U
+#define BINARY_EVERY 16U
+#define N_TEXT_FIELDS 10U
+
+static const char binary_message[] = "first line\nsecond line";
+
+static char* make_block(size_t *size) {
+        char *block = NULL;
+        size_t allocated = 0, n = 0;
+        unsigned i;
+
+        for (i = 0; i < N_BLOCK_ENTRIES; i++) {
+                char entry[1024];
+                int k;
+
+                k = snprintf(entry, sizeof(entry),
+                             "__CURSOR=s=6a8e0c3b1a7c4c2f9e8d7c6b5a493827;i=%x;b=1dc39a9c7a2e4f1b8f2a3b4c5d6e7f80;m=%x;t=%x;x=%x\n"
+                             "__REALTIME_TIMESTAMP=%llu\n"
+                             "__MONOTONIC_TIMESTAMP=%u\n"
+                             "_BOOT_ID=1dc39a9c7a2e4f1b8f2a3b4c5d6e7f80\n"
+                             "PRIORITY=%u\n"
+                             "_UID=0\n"
+                             "_GID=0\n"
+                             "_TRANSPORT=syslog\n"
+                             "_PID=%u\n"
+                             "_COMM=benchmark\n"
+                             "_HOSTNAME=host-%u.example.com\n"
+                             "_SYSTEMD_UNIT=benchmark-%u.service\n"
+                             "SYSLOG_IDENTIFIER=benchmark\n",
+                             i, i * 7, i * 13, i * 17,
+                             1460000000000000ULL + i,
+                             1000000 + i,
+                             i % 8,
+                             100 + i,
+                             i % 32,
+                             i % 64);
+                assert_se(k > 0 && (size_t) k < sizeof(entry));
+
+                assert_se(GREEDY_REALLOC(block, allocated, n + k + 64 + sizeof(binary_message)));
+                memcpy(block + n, entry, k);
+                n += k;
+
+                if (i % BINARY_EVERY == 0) {
+                        uint64_t le = htole64(sizeof(binary_message) - 1);
+
+                        n += sprintf(block + n, "MESSAGE\n");
+                        memcpy(block + n, &le, sizeof(le));
+                        n += sizeof(le);
+                        memcpy(block + n, binary_message, sizeof(binary_message) - 1);
+                        n += sizeof(binary_message) - 1;
+                        block[n++] = '\n';
+                } else
+                        n += sprintf(block + n, "MESSAGE=Entry number %u of the benchmark\n", i);
+
+                block[n++] = '\n';
+        }
+
+        *size = n;
+        return block;
+}
+
+static pid_t feed(int fd[2], const char *block, size_t block_size, uint64_t n_blocks) {
+        pid_t pid;
+
+        assert_se(pipe2(fd, O_CLOEXEC) >= 0);
+
+        pid = fork();
+        assert_se(pid >= 0);
+
+        if (pid == 0) {
+                uint64_t i;
+
+                safe_close(fd[0]);
+
+                for (i = 0; i < n_blocks; i++)
+                        if (loop_write(fd[1], block, block_size, false) < 0)
+                                _exit(EXIT_FAILURE);
+
+                _exit(EXIT_SUCCESS);
+        }
+
+        safe_close(fd[1]);
+        return pid;
+}
+
+static void test_write(const char *block, size_t block_size) {
+        char t[] = "/tmp/journal-remote-XXXXXX", b[FORMAT_TIMESPAN_MAX];
+        _cleanup_free_ char *fn = NULL;
+        uint64_t n_blocks = 16, n_entries = 0, n_read = 0;
+        _cleanup_closedir_ DIR *d = NULL;
+        struct dirent *de;
+        RemoteSource *source;
+        Writer *w;
+        usec_t start, ts;
+        int fd[2], r;
+        pid_t pid;
+
+        assert_se(mkdtemp(t));
+        assert_se(fn = strappend(t, "/test.journal"));
+
+        assert_se(w = writer_new(NULL));
+        assert_se(journal_file_open(-1, fn, O_RDWR|O_CREAT, 0644, true, false, NULL, w->mmap, NULL, NULL, &w->journal) >= 0);
+
+        pid = feed(fd, block, block_size, n_blocks);
+
+        source = source_new(fd[0], false, strdup("benchmark"), w);
+        assert_se(source);
+
+        start = now(CLOCK_MONOTONIC);
+
+        for (;;) {
+                r = process_source(source, true, false);
+                assert_se(r >= 0 || r == -EAGAIN);
+
+                if (source->state == STATE_EOF)
+                        break;
+                if (r == 1)
+                        n_entries++;
+
+                /* Flush after each block worth of input, like
+                 * journal-remote does after each chunk */
+                if (n_entries % N_BLOCK_ENTRIES == 0)
+                        assert_se(writer_flush(w) >= 0);
+        }
+
+        assert_se(writer_flush(w) >= 0);
+        ts = now(CLOCK_MONOTONIC) - start;
+
+        assert_se(n_entries == n_blocks * N_BLOCK_ENTRIES);
+
+        log_info("Wrote %"PRIu64" entries in %s: %.0f entries/s",
+                 n_entries,
+                 format_timespan(b, sizeof(b), ts, USEC_PER_MSEC),
+                 (double) n_entries * USEC_PER_SEC / MAX(ts, 1U));
+
+        source_free(source);
+        assert_se(wait_for_terminate_and_warn("writer", pid, false) == 0);
+
+        /* All of it made it into the journal, across rotations. (The
+         * blocks repeat, hence sd_journal would merge the entries of
+         * different files.) */
+        assert_se(d = opendir(t));
+        FOREACH_DIRENT(de, d, assert_se(false)) {
+                _cleanup_free_ char *p = NULL;
+                JournalFile *f;
+
+                assert_se(p = strjoin(t, "/", de->d_name, NULL));
+                assert_se(journal_file_open(-1, p, O_RDONLY, 0, false, false, NULL, NULL, NULL, NULL, &f) >= 0);
+                n_read += le64toh(f->header->n_entries);
+                journal_file_close(f);
+        }
+        assert_se(n_read == n_entries);
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+}
+
+int main(int argc, char *argv[]) {
+        _cleanup_free_ char *block = NULL;
+        char a[FORMAT_BYTES_MAX], b[FORMAT_TIMESPAN_MAX];
+        uint64_t size = 64 * 1024 * 1024, n_blocks, n_entries = 0, n_binary = 0;
+        size_t block_size;
+        RemoteSource *source;
+        usec_t start, t;
+        int fd[2], r;
+        pid_t pid;
+
+        log_set_max_level(LOG_INFO);
+
+        if (argc >= 2)
+                assert_se(parse_size(argv[1], 1024, &size) >= 0);
+
+        block = make_block(&block_size);
+        n_blocks = DIV_ROUND_UP(size, block_size);
+
+        pid = feed(fd, block, block_size, n_blocks);
+
+        source = source_new(fd[0], false, strdup("benchmark"), NULL);
+        assert_se(source);
+
+        start = now(CLOCK_MONOTONIC);
+
+        for (;;) {
+                r = source_parse_entry(source);
+                assert_se(r >= 0);
+
+                if (source->state == STATE_EOF)
+                        break;
+                if (r == 0)
+                        continue;
+
+                n_entries++;
+
+                assert_se(source->iovw.count == N_TEXT_FIELDS + 1);
+                if (source->iovw.iovec[N_TEXT_FIELDS].iov_len == strlen("MESSAGE=") + sizeof(binary_message) - 1) {
+                        assert_se(memcmp(source->iovw.iovec[N_TEXT_FIELDS].iov_base, "MESSAGE=", 8) == 0);
+                        assert_se(memcmp((char*) source->iovw.iovec[N_TEXT_FIELDS].iov_base + 8,
+                                         binary_message, sizeof(binary_message) - 1) == 0);
+                        n_binary++;
+                }
+
+                source_finish_entry(source);
+        }
+
+        t = now(CLOCK_MONOTONIC) - start;
+
+        assert_se(source_non_empty(source) == 0);
+        assert_se(n_entries == n_blocks * N_BLOCK_ENTRIES);
+        assert_se(n_binary == n_blocks * DIV_ROUND_UP(N_BLOCK_ENTRIES, BINARY_EVERY));
+
+        log_info("Parsed %"PRIu64" entries (%s) in %s: %.0f entries/s, %.1f MB/s",
+                 n_entries,
+                 format_bytes(a, sizeof(a), n_blocks * block_size),
+                 format_timespan(b, sizeof(b), t, USEC_PER_MSEC),
+                 (double) n_entries * USEC_PER_SEC / MAX(t, 1U),
+                 (double) (n_blocks * block_size) / MAX(t, 1U));
+
+        source_free(source);
+        assert_se(wait_for_terminate_and_warn("writer", pid, false) == 0);
+
+        test_write(block, block_size);
+
+        return 0;
+}
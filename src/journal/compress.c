@@ -32,6 +32,11 @@
 #include <lz4frame.h>
 #endif
 
+#ifdef HAVE_ZSTD
+#include <zdict.h>
+#include <zstd.h>
+#endif
+
 #include "alloc-util.h"
 #include "compress.h"
 #include "fd-util.h"
@@ -48,15 +53,103 @@ DEFINE_TRIVIAL_CLEANUP_FUNC(LZ4F_compressionContext_t, LZ4F_freeCompressionConte
 DEFINE_TRIVIAL_CLEANUP_FUNC(LZ4F_decompressionContext_t, LZ4F_freeDecompressionContext);
 #endif
 
+#ifdef HAVE_ZSTD
+DEFINE_TRIVIAL_CLEANUP_FUNC(ZSTD_DCtx*, ZSTD_freeDCtx);
+#endif
+
 #define ALIGN_8(l) ALIGN_TO(l, sizeof(size_t))
 
+/* Data objects are compressed as they are written, hence favour speed
+ * over ratio */
+#define COMPRESS_ZSTD_LEVEL 1
+
+struct CompressDictionary {
+        void *data;
+        size_t size;
+
+#ifdef HAVE_ZSTD
+        ZSTD_CDict *cdict;
+        ZSTD_DDict *ddict;
+        ZSTD_CCtx *cctx;
+        ZSTD_DCtx *dctx;
+#endif
+};
+
 static const char* const object_compressed_table[_OBJECT_COMPRESSED_MAX] = {
         [OBJECT_COMPRESSED_XZ] = "XZ",
         [OBJECT_COMPRESSED_LZ4] = "LZ4",
+        [OBJECT_COMPRESSED_ZSTD] = "ZSTD",
 };
 
 DEFINE_STRING_TABLE_LOOKUP(object_compressed, int);
 
+int compress_dictionary_new(const void *data, size_t size, CompressDictionary **ret) {
+#ifdef HAVE_ZSTD
+        CompressDictionary *d;
+
+        assert(data);
+        assert(size > 0);
+        assert(ret);
+
+        d = new0(CompressDictionary, 1);
+        if (!d)
+                return -ENOMEM;
+
+        d->data = memdup(data, size);
+        if (!d->data) {
+                free(d);
+                return -ENOMEM;
+        }
+
+        d->size = size;
+
+        *ret = d;
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
+CompressDictionary* compress_dictionary_free(CompressDictionary *d) {
+        if (!d)
+                return NULL;
+
+#ifdef HAVE_ZSTD
+        ZSTD_freeCDict(d->cdict);
+        ZSTD_freeDDict(d->ddict);
+        ZSTD_freeCCtx(d->cctx);
+        ZSTD_freeDCtx(d->dctx);
+#endif
+
+        free(d->data);
+        return mfree(d);
+}
+
+int compress_dictionary_train(const void *samples, const size_t sample_sizes[], unsigned n_samples,
+                              void *dst, size_t dst_alloc_size, size_t *dst_size) {
+#ifdef HAVE_ZSTD
+        size_t k;
+
+        assert(samples);
+        assert(sample_sizes);
+        assert(dst);
+        assert(dst_alloc_size > 0);
+        assert(dst_size);
+
+        /* Training fails if there are too few samples, or if they
+         * have nothing in common worth putting in a dictionary */
+
+        k = ZDICT_trainFromBuffer(dst, dst_alloc_size, samples, sample_sizes, n_samples);
+        if (ZDICT_isError(k))
+                return -ENODATA;
+
+        *dst_size = k;
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
 int compress_blob_xz(const void *src, uint64_t src_size,
                      void *dst, size_t dst_alloc_size, size_t *dst_size) {
 #ifdef HAVE_XZ
@@ -125,6 +218,69 @@ int compress_blob_lz4(const void *src, uint64_t src_size,
 #endif
 }
 
+int compress_blob_zstd(const void *src, uint64_t src_size,
+                       void *dst, size_t dst_alloc_size, size_t *dst_size,
+                       CompressDictionary *dict) {
+#ifdef HAVE_ZSTD
+        size_t k;
+
+        assert(src);
+        assert(src_size > 0);
+        assert(dst);
+        assert(dst_alloc_size > 0);
+        assert(dst_size);
+
+        /* Returns < 0 if we couldn't compress the data or the
+         * compressed result is longer than the original */
+
+        if (dict) {
+                if (!dict->cdict) {
+                        dict->cdict = ZSTD_createCDict(dict->data, dict->size, COMPRESS_ZSTD_LEVEL);
+                        if (!dict->cdict)
+                                return -ENOMEM;
+                }
+
+                if (!dict->cctx) {
+                        dict->cctx = ZSTD_createCCtx();
+                        if (!dict->cctx)
+                                return -ENOMEM;
+                }
+
+                k = ZSTD_compress_usingCDict(dict->cctx, dst, dst_alloc_size, src, src_size, dict->cdict);
+        } else
+                k = ZSTD_compress(dst, dst_alloc_size, src, src_size, COMPRESS_ZSTD_LEVEL);
+        if (ZSTD_isError(k))
+                return -ENOBUFS;
+
+        *dst_size = k;
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
+int compress_blob(int compression,
+                  const void *src, uint64_t src_size,
+                  void *dst, size_t dst_alloc_size, size_t *dst_size,
+                  CompressDictionary *dict) {
+        int r;
+
+        /* Returns the codec used on success, which is always the one
+         * asked for */
+
+        if (compression == OBJECT_COMPRESSED_XZ)
+                r = compress_blob_xz(src, src_size, dst, dst_alloc_size, dst_size);
+        else if (compression == OBJECT_COMPRESSED_LZ4)
+                r = compress_blob_lz4(src, src_size, dst, dst_alloc_size, dst_size);
+        else if (compression == OBJECT_COMPRESSED_ZSTD)
+                r = compress_blob_zstd(src, src_size, dst, dst_alloc_size, dst_size, dict);
+        else
+                return -EOPNOTSUPP;
+        if (r < 0)
+                return r;
+
+        return compression;
+}
 
 int decompress_blob_xz(const void *src, uint64_t src_size,
                        void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max) {
@@ -226,15 +382,123 @@ int decompress_blob_lz4(const void *src, uint64_t src_size,
 #endif
 }
 
+int decompress_blob_zstd(const void *src, uint64_t src_size,
+                         void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max,
+                         CompressDictionary *dict) {
+
+#ifdef HAVE_ZSTD
+        unsigned long long size;
+        size_t space, k;
+        bool use_dict;
+
+        assert(src);
+        assert(src_size > 0);
+        assert(dst);
+        assert(dst_alloc_size);
+        assert(dst_size);
+        assert(*dst_alloc_size == 0 || *dst);
+
+        /* We always compress whole blobs, hence the frame header
+         * tells us how much space we need */
+        size = ZSTD_getFrameContentSize(src, src_size);
+        if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN)
+                return -EBADMSG;
+        if ((size_t) size != size)
+                return -EFBIG;
+
+        /* Don't allocate more than the caller asked for, the frame
+         * header might be lying, and callers with a data threshold
+         * only want the beginning of large blobs anyway */
+        space = dst_max > 0 ? MIN((size_t) size, dst_max) : (size_t) size;
+
+        if (!greedy_realloc(dst, dst_alloc_size, MAX(space, 1u), 1))
+                return -ENOMEM;
+
+        /* Blobs compressed ahead of time don't use the dictionary,
+         * which the frame header tells us */
+        use_dict = dict && ZSTD_getDictID_fromFrame(src, src_size) != 0;
+        if (use_dict) {
+                if (!dict->ddict) {
+                        dict->ddict = ZSTD_createDDict(dict->data, dict->size);
+                        if (!dict->ddict)
+                                return -ENOMEM;
+                }
+
+                if (!dict->dctx) {
+                        dict->dctx = ZSTD_createDCtx();
+                        if (!dict->dctx)
+                                return -ENOMEM;
+                }
+        }
+
+        if (space < size) {
+                _cleanup_(ZSTD_freeDCtxp) ZSTD_DCtx *dctx = NULL;
+                ZSTD_inBuffer input = {
+                        .src = src,
+                        .size = src_size,
+                };
+                ZSTD_outBuffer output = {
+                        .dst = *dst,
+                        .size = space,
+                };
+
+                /* Decode only as much as fits, the rest of the frame
+                 * is never looked at */
+                if (use_dict) {
+                        k = ZSTD_DCtx_reset(dict->dctx, ZSTD_reset_session_only);
+                        if (!ZSTD_isError(k))
+                                k = ZSTD_DCtx_refDDict(dict->dctx, dict->ddict);
+                        if (ZSTD_isError(k))
+                                return -ENOMEM;
+                } else {
+                        dctx = ZSTD_createDCtx();
+                        if (!dctx)
+                                return -ENOMEM;
+                }
+
+                while (output.pos < output.size) {
+                        k = ZSTD_decompressStream(use_dict ? dict->dctx : dctx, &output, &input);
+                        if (ZSTD_isError(k))
+                                return -EBADMSG;
+
+                        /* The frame ended or was cut off before
+                         * reaching the size it claims */
+                        if (output.pos < output.size && (k == 0 || input.pos >= input.size))
+                                return -EBADMSG;
+                }
+
+                *dst_size = space;
+                return 0;
+        }
+
+        if (use_dict)
+                k = ZSTD_decompress_usingDDict(dict->dctx, *dst, size, src, src_size, dict->ddict);
+        else
+                k = ZSTD_decompress(*dst, size, src, src_size);
+        if (ZSTD_isError(k) || k != size)
+                return -EBADMSG;
+
+        *dst_size = size;
+        return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
 int decompress_blob(int compression,
                     const void *src, uint64_t src_size,
-                    void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max) {
+                    void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max,
+                    CompressDictionary *dict) {
         if (compression == OBJECT_COMPRESSED_XZ)
                 return decompress_blob_xz(src, src_size,
                                           dst, dst_alloc_size, dst_size, dst_max);
         else if (compression == OBJECT_COMPRESSED_LZ4)
                 return decompress_blob_lz4(src, src_size,
                                            dst, dst_alloc_size, dst_size, dst_max);
+        else if (compression == OBJECT_COMPRESSED_ZSTD)
+                return decompress_blob_zstd(src, src_size,
+                                            dst, dst_alloc_size, dst_size, dst_max,
+                                            dict);
         else
                 return -EBADMSG;
 }
@@ -348,11 +612,48 @@ int decompress_startswith_lz4(const void *src, uint64_t src_size,
 #endif
 }
 
+int decompress_startswith_zstd(const void *src, uint64_t src_size,
+                               void **buffer, size_t *buffer_size,
+                               const void *prefix, size_t prefix_len,
+                               uint8_t extra,
+                               CompressDictionary *dict) {
+#ifdef HAVE_ZSTD
+        /* Checks whether the decompressed blob starts with the
+         * mentioned prefix. The byte extra needs to follow the
+         * prefix */
+
+        size_t size;
+        int r;
+
+        assert(src);
+        assert(src_size > 0);
+        assert(buffer);
+        assert(buffer_size);
+        assert(prefix);
+        assert(*buffer_size == 0 || *buffer);
+
+        /* Data objects are small enough that there's little point in
+         * decompressing them only partially */
+        r = decompress_blob_zstd(src, src_size, buffer, buffer_size, &size, 0, dict);
+        if (r < 0)
+                return r;
+
+        if (size >= prefix_len + 1)
+                return memcmp(*buffer, prefix, prefix_len) == 0 &&
+                        ((const uint8_t*) *buffer)[prefix_len] == extra;
+        else
+                return 0;
+#else
+        return -EPROTONOSUPPORT;
+#endif
+}
+
 int decompress_startswith(int compression,
                           const void *src, uint64_t src_size,
                           void **buffer, size_t *buffer_size,
                           const void *prefix, size_t prefix_len,
-                          uint8_t extra) {
+                          uint8_t extra,
+                          CompressDictionary *dict) {
         if (compression == OBJECT_COMPRESSED_XZ)
                 return decompress_startswith_xz(src, src_size,
                                                 buffer, buffer_size,
@@ -363,6 +664,12 @@ int decompress_startswith(int compression,
                                                  buffer, buffer_size,
                                                  prefix, prefix_len,
                                                  extra);
+        else if (compression == OBJECT_COMPRESSED_ZSTD)
+                return decompress_startswith_zstd(src, src_size,
+                                                  buffer, buffer_size,
+                                                  prefix, prefix_len,
+                                                  extra,
+                                                  dict);
         else
                 return -EBADMSG;
 }
@@ -26,33 +26,50 @@
 const char* object_compressed_to_string(int compression);
 int object_compressed_from_string(const char *compression);
 
+/* A zstd dictionary, together with the compression and decompression
+ * state that is bound to it */
+typedef struct CompressDictionary CompressDictionary;
+
+int compress_dictionary_new(const void *data, size_t size, CompressDictionary **ret);
+CompressDictionary* compress_dictionary_free(CompressDictionary *d);
+int compress_dictionary_train(const void *samples, const size_t sample_sizes[], unsigned n_samples,
+                              void *dst, size_t dst_alloc_size, size_t *dst_size);
+
 int compress_blob_xz(const void *src, uint64_t src_size,
                      void *dst, size_t dst_alloc_size, size_t *dst_size);
 int compress_blob_lz4(const void *src, uint64_t src_size,
                       void *dst, size_t dst_alloc_size, size_t *dst_size);
-
-static inline int compress_blob(const void *src, uint64_t src_size,
-                                void *dst, size_t dst_alloc_size, size_t *dst_size) {
-        int r;
-#ifdef HAVE_LZ4
-        r = compress_blob_lz4(src, src_size, dst, dst_alloc_size, dst_size);
-        if (r == 0)
-                return OBJECT_COMPRESSED_LZ4;
+int compress_blob_zstd(const void *src, uint64_t src_size,
+                       void *dst, size_t dst_alloc_size, size_t *dst_size,
+                       CompressDictionary *dict);
+
+int compress_blob(int compression,
+                  const void *src, uint64_t src_size,
+                  void *dst, size_t dst_alloc_size, size_t *dst_size,
+                  CompressDictionary *dict);
+
+/* The codec new journal files are compressed with */
+#if defined(HAVE_ZSTD)
+#  define OBJECT_COMPRESSED_DEFAULT OBJECT_COMPRESSED_ZSTD
+#elif defined(HAVE_LZ4)
+#  define OBJECT_COMPRESSED_DEFAULT OBJECT_COMPRESSED_LZ4
+#elif defined(HAVE_XZ)
+#  define OBJECT_COMPRESSED_DEFAULT OBJECT_COMPRESSED_XZ
 #else
-        r = compress_blob_xz(src, src_size, dst, dst_alloc_size, dst_size);
-        if (r == 0)
-                return OBJECT_COMPRESSED_XZ;
+#  define OBJECT_COMPRESSED_DEFAULT 0
 #endif
-        return r;
-}
 
 int decompress_blob_xz(const void *src, uint64_t src_size,
                        void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max);
 int decompress_blob_lz4(const void *src, uint64_t src_size,
                         void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max);
+int decompress_blob_zstd(const void *src, uint64_t src_size,
+                         void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max,
+                         CompressDictionary *dict);
 int decompress_blob(int compression,
                     const void *src, uint64_t src_size,
-                    void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max);
+                    void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max,
+                    CompressDictionary *dict);
 
 int decompress_startswith_xz(const void *src, uint64_t src_size,
                              void **buffer, size_t *buffer_size,
@@ -62,11 +79,17 @@ int decompress_startswith_lz4(const void *src, uint64_t src_size,
                               void **buffer, size_t *buffer_size,
                               const void *prefix, size_t prefix_len,
                               uint8_t extra);
+int decompress_startswith_zstd(const void *src, uint64_t src_size,
+                               void **buffer, size_t *buffer_size,
+                               const void *prefix, size_t prefix_len,
+                               uint8_t extra,
+                               CompressDictionary *dict);
 int decompress_startswith(int compression,
                           const void *src, uint64_t src_size,
                           void **buffer, size_t *buffer_size,
                           const void *prefix, size_t prefix_len,
-                          uint8_t extra);
+                          uint8_t extra,
+                          CompressDictionary *dict);
 
 int compress_stream_xz(int fdf, int fdt, uint64_t max_bytes);
 int compress_stream_lz4(int fdf, int fdt, uint64_t max_bytes);
@@ -0,0 +1,506 @@
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "alloc-util.h"
+#include "dirent-util.h"
+#include "fd-util.h"
+#include "fileio.h"
+#include "journal-boot-index.h"
+#include "journal-def.h"
+#include "log.h"
+#include "mmap-cache.h"
+#include "sparse-endian.h"
+#include "string-util.h"
+#include "util.h"
+
+/* Listing the boots contained in a journal used to require seeking
+ * through the entire journal, boot by boot. Archived journal files
+ * never change however, hence we record the boots each of them
+ * contains in a small index file next to them, keyed by the file
+ * ID. The index is refreshed by journald whenever it rotates or
+ * vacuums, and is purely an optimization: files that are not listed
+ * in it are simply scanned directly. */
+
+#define BOOT_INDEX_SIGNATURE (uint8_t[]) { 'J', 'B', 'O', 'O', 'T', 'I', 'D', 'X' }
+
+typedef struct BootIndexHeader {
+        uint8_t signature[8];  /* "JBOOTIDX" */
+        le32_t compatible_flags;
+        le32_t incompatible_flags;
+        le64_t header_size;
+        le64_t n_items;
+        le64_t item_size;
+} BootIndexHeader;
+
+typedef struct BootIndexItem {
+        sd_id128_t file_id;
+        sd_id128_t boot_id;
+        le64_t first_realtime;
+        le64_t last_realtime;
+        le64_t first_monotonic;
+        le64_t last_monotonic;
+} BootIndexItem;
+
+struct BootIndex {
+        char *data;
+        size_t size;
+
+        const uint8_t *items;
+        uint64_t n_items;
+        uint64_t item_size;
+};
+
+static int boot_index_item_compare(const void *a, const void *b) {
+        const BootIndexItem *x = a, *y = b;
+        int r;
+
+        r = memcmp(&x->file_id, &y->file_id, sizeof(x->file_id));
+        if (r != 0)
+                return r;
+
+        if (le64toh(x->first_realtime) < le64toh(y->first_realtime))
+                return -1;
+        if (le64toh(x->first_realtime) > le64toh(y->first_realtime))
+                return 1;
+
+        return 0;
+}
+
+static int get_boot_from_data(JournalFile *f, uint64_t data_offset, JournalBoot *ret) {
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(ret);
+
+        r = journal_file_next_entry_for_data(f, NULL, 0, data_offset, DIRECTION_DOWN, &o, NULL);
+        if (r <= 0)
+                return r;
+
+        ret->id = o->entry.boot_id;
+        ret->first_realtime = le64toh(o->entry.realtime);
+        ret->first_monotonic = le64toh(o->entry.monotonic);
+
+        r = journal_file_next_entry_for_data(f, NULL, 0, data_offset, DIRECTION_UP, &o, NULL);
+        if (r <= 0)
+                return r < 0 ? r : -EBADMSG;
+
+        ret->last_realtime = le64toh(o->entry.realtime);
+        ret->last_monotonic = le64toh(o->entry.monotonic);
+
+        return 1;
+}
+
+static int get_boots_from_entries(JournalFile *f, JournalBoot **boots, size_t *n_allocated, size_t *n_boots) {
+        JournalBoot *b = NULL;
+        uint64_t p = 0;
+        Object *o;
+        int r;
+
+        assert(f);
+
+        /* Files not written by journald might lack the _BOOT_ID=
+         * field, hence look at the boot ID every entry carries in
+         * its header. This is slow, but such files are rare. */
+
+        for (;;) {
+                r = journal_file_next_entry(f, p, DIRECTION_DOWN, &o, &p);
+                if (r <= 0)
+                        return r;
+
+                if (!b || !sd_id128_equal(b->id, o->entry.boot_id)) {
+                        if (!GREEDY_REALLOC(*boots, *n_allocated, *n_boots + 1))
+                                return -ENOMEM;
+
+                        b = *boots + (*n_boots)++;
+                        b->id = o->entry.boot_id;
+                        b->first_realtime = le64toh(o->entry.realtime);
+                        b->first_monotonic = le64toh(o->entry.monotonic);
+                }
+
+                b->last_realtime = le64toh(o->entry.realtime);
+                b->last_monotonic = le64toh(o->entry.monotonic);
+        }
+}
+
+int journal_file_get_boots(JournalFile *f, JournalBoot **boots, size_t *n_allocated, size_t *n_boots) {
+        uint64_t p, n_objects, k = 0;
+        Object *o;
+        int r;
+
+        assert(f);
+        assert(boots);
+        assert(n_allocated);
+        assert(n_boots);
+
+        /* Every boot ID is stored exactly once as data object in a
+         * file, and all of them are linked from the _BOOT_ID field
+         * object. The first and last entry referencing each of them
+         * tell us the boundaries of the boot, without having to look
+         * at any other entry. */
+
+        r = journal_file_find_field_object(f, "_BOOT_ID", strlen("_BOOT_ID"), &o, NULL);
+        if (r < 0)
+                return r;
+        if (r == 0)
+                return get_boots_from_entries(f, boots, n_allocated, n_boots);
+
+        n_objects = le64toh(f->header->n_objects);
+
+        p = le64toh(o->field.head_data_offset);
+        while (p != 0) {
+                uint64_t next;
+
+                /* Don't loop forever on corrupted files */
+                if (k++ >= n_objects)
+                        return -EBADMSG;
+
+                r = journal_file_move_to_object(f, OBJECT_DATA, p, &o);
+                if (r < 0)
+                        return r;
+
+                /* Looking up the entries might move the window, read the link first */
+                next = le64toh(o->data.next_field_offset);
+
+                if (!GREEDY_REALLOC(*boots, *n_allocated, *n_boots + 1))
+                        return -ENOMEM;
+
+                r = get_boot_from_data(f, p, *boots + *n_boots);
+                if (r < 0)
+                        return r;
+                if (r > 0)
+                        (*n_boots)++;
+
+                p = next;
+        }
+
+        return 0;
+}
+
+int boot_index_load(const char *directory, BootIndex **ret) {
+        _cleanup_(boot_index_freep) BootIndex *b = NULL;
+        const BootIndexHeader *h;
+        const char *fn;
+        uint64_t header_size;
+        int r;
+
+        assert(directory);
+        assert(ret);
+
+        b = new0(BootIndex, 1);
+        if (!b)
+                return -ENOMEM;
+
+        fn = strjoina(directory, "/" BOOT_INDEX_FILE);
+        r = read_full_file(fn, &b->data, &b->size);
+        if (r < 0)
+                return r;
+
+        if (b->size < sizeof(BootIndexHeader))
+                return -EBADMSG;
+
+        h = (const BootIndexHeader*) b->data;
+        if (memcmp(h->signature, BOOT_INDEX_SIGNATURE, sizeof(h->signature)) != 0)
+                return -EBADMSG;
+
+        if (le32toh(h->incompatible_flags) != 0)
+                return -EPROTONOSUPPORT;
+
+        header_size = le64toh(h->header_size);
+        b->n_items = le64toh(h->n_items);
+        b->item_size = le64toh(h->item_size);
+
+        if (header_size < sizeof(BootIndexHeader) || header_size > b->size)
+                return -EBADMSG;
+        if (b->item_size < sizeof(BootIndexItem))
+                return -EBADMSG;
+        if (b->n_items > (b->size - header_size) / b->item_size)
+                return -EBADMSG;
+
+        b->items = (const uint8_t*) b->data + header_size;
+
+        *ret = b;
+        b = NULL;
+
+        return 0;
+}
+
+BootIndex* boot_index_free(BootIndex *b) {
+        if (!b)
+                return NULL;
+
+        free(b->data);
+        return mfree(b);
+}
+
+static const BootIndexItem* boot_index_item(BootIndex *b, uint64_t i) {
+        return (const BootIndexItem*) (b->items + i * b->item_size);
+}
+
+int boot_index_get(BootIndex *b, sd_id128_t file_id, JournalBoot **boots, size_t *n_allocated, size_t *n_boots) {
+        uint64_t left, right;
+
+        assert(b);
+        assert(boots);
+        assert(n_allocated);
+        assert(n_boots);
+
+        /* Returns 0 if the file is not known to the index, 1
+         * otherwise. Files without any boot are recorded too, with a
+         * null boot ID. */
+
+        left = 0;
+        right = b->n_items;
+        while (left < right) {
+                uint64_t mid = left + (right - left) / 2;
+
+                if (memcmp(&boot_index_item(b, mid)->file_id, &file_id, sizeof(file_id)) < 0)
+                        left = mid + 1;
+                else
+                        right = mid;
+        }
+
+        if (left >= b->n_items || !sd_id128_equal(boot_index_item(b, left)->file_id, file_id))
+                return 0;
+
+        for (; left < b->n_items; left++) {
+                const BootIndexItem *i = boot_index_item(b, left);
+
+                if (!sd_id128_equal(i->file_id, file_id))
+                        break;
+
+                if (sd_id128_is_null(i->boot_id))
+                        continue;
+
+                if (!GREEDY_REALLOC(*boots, *n_allocated, *n_boots + 1))
+                        return -ENOMEM;
+
+                (*boots)[(*n_boots)++] = (JournalBoot) {
+                        .id = i->boot_id,
+                        .first_realtime = le64toh(i->first_realtime),
+                        .last_realtime = le64toh(i->last_realtime),
+                        .first_monotonic = le64toh(i->first_monotonic),
+                        .last_monotonic = le64toh(i->last_monotonic),
+                };
+        }
+
+        return 1;
+}
+
+static int read_archived_file_id(int dfd, const char *fn, sd_id128_t *ret) {
+        _cleanup_close_ int fd = -1;
+        Header h;
+        ssize_t n;
+
+        assert(dfd >= 0);
+        assert(fn);
+        assert(ret);
+
+        /* Only look at the fixed part of the header, we just want to
+         * know whether the file is an archived journal file */
+
+        fd = openat(dfd, fn, O_RDONLY|O_CLOEXEC|O_NOCTTY|O_NOFOLLOW);
+        if (fd < 0)
+                return -errno;
+
+        n = pread(fd, &h, offsetof(Header, machine_id), 0);
+        if (n < 0)
+                return -errno;
+        if (n != offsetof(Header, machine_id))
+                return 0;
+
+        if (memcmp(h.signature, HEADER_SIGNATURE, sizeof(h.signature)) != 0)
+                return 0;
+
+        if (h.state != STATE_ARCHIVED)
+                return 0;
+
+        *ret = h.file_id;
+        return 1;
+}
+
+static int append_item(BootIndexItem **items, size_t *n_allocated, size_t *n_items, sd_id128_t file_id, const JournalBoot *boot) {
+        BootIndexItem *i;
+
+        if (!GREEDY_REALLOC(*items, *n_allocated, *n_items + 1))
+                return -ENOMEM;
+
+        i = *items + (*n_items)++;
+        zero(*i);
+        i->file_id = file_id;
+
+        if (boot) {
+                i->boot_id = boot->id;
+                i->first_realtime = htole64(boot->first_realtime);
+                i->last_realtime = htole64(boot->last_realtime);
+                i->first_monotonic = htole64(boot->first_monotonic);
+                i->last_monotonic = htole64(boot->last_monotonic);
+        }
+
+        return 0;
+}
+
+static int index_file(
+                const char *directory,
+                const char *fn,
+                sd_id128_t file_id,
+                BootIndex *old,
+                MMapCache *m,
+                BootIndexItem **items, size_t *n_allocated, size_t *n_items) {
+
+        _cleanup_free_ JournalBoot *boots = NULL;
+        size_t n_boots = 0, n_boots_allocated = 0, k;
+        int r;
+
+        r = old ? boot_index_get(old, file_id, &boots, &n_boots_allocated, &n_boots) : 0;
+        if (r < 0)
+                return r;
+        if (r == 0) {
+                JournalFile *f = NULL;
+                const char *path;
+
+                path = strjoina(directory, "/", fn);
+
+                r = journal_file_open(-1, path, O_RDONLY, 0, false, false, NULL, m, NULL, NULL, &f);
+                if (r < 0)
+                        return r;
+
+                r = journal_file_get_boots(f, &boots, &n_boots_allocated, &n_boots);
+                (void) journal_file_close(f);
+                if (r < 0)
+                        return r;
+        }
+
+        /* Remember files without any entries too, so that we don't
+         * have to open them again next time */
+        if (n_boots == 0)
+                return append_item(items, n_allocated, n_items, file_id, NULL);
+
+        for (k = 0; k < n_boots; k++) {
+                r = append_item(items, n_allocated, n_items, file_id, boots + k);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+static int write_boot_index(const char *directory, const BootIndexItem *items, size_t n) {
+        _cleanup_fclose_ FILE *w = NULL;
+        _cleanup_free_ char *p = NULL;
+        BootIndexHeader header;
+        const char *fn;
+        int r;
+
+        fn = strjoina(directory, "/" BOOT_INDEX_FILE);
+
+        r = fopen_temporary(fn, &w, &p);
+        if (r < 0)
+                return r;
+
+        zero(header);
+        memcpy(header.signature, BOOT_INDEX_SIGNATURE, sizeof(header.signature));
+        header.header_size = htole64(sizeof(BootIndexHeader));
+        header.n_items = htole64(n);
+        header.item_size = htole64(sizeof(BootIndexItem));
+
+        fwrite(&header, 1, sizeof(header), w);
+        fwrite(items, sizeof(BootIndexItem), n, w);
+
+        r = fflush_and_check(w);
+        if (r < 0)
+                goto fail;
+
+        (void) fchmod(fileno(w), 0640);
+
+        if (rename(p, fn) < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        return 0;
+
+fail:
+        (void) unlink(p);
+        return r;
+}
+
+int boot_index_update(const char *directory) {
+        _cleanup_(boot_index_freep) BootIndex *old = NULL;
+        _cleanup_free_ BootIndexItem *items = NULL;
+        size_t n_items = 0, n_allocated = 0;
+        _cleanup_closedir_ DIR *d = NULL;
+        MMapCache *m = NULL;
+        struct dirent *de;
+        int r;
+
+        assert(directory);
+
+        r = boot_index_load(directory, &old);
+        if (r < 0 && r != -ENOENT)
+                log_debug_errno(r, "Failed to load boot index of %s, rebuilding: %m", directory);
+
+        d = opendir(directory);
+        if (!d)
+                return -errno;
+
+        FOREACH_DIRENT_ALL(de, d, r = -errno; goto finish) {
+                sd_id128_t file_id;
+
+                if (!dirent_is_file_with_suffix(de, ".journal") &&
+                    !dirent_is_file_with_suffix(de, ".journal~"))
+                        continue;
+
+                r = read_archived_file_id(dirfd(d), de->d_name, &file_id);
+                if (r < 0)
+                        log_debug_errno(r, "Failed to read header of %s/%s, ignoring: %m", directory, de->d_name);
+                if (r <= 0)
+                        continue;
+
+                if (!m) {
+                        m = mmap_cache_new();
+                        if (!m) {
+                                r = -ENOMEM;
+                                goto finish;
+                        }
+                }
+
+                r = index_file(directory, de->d_name, file_id, old, m, &items, &n_allocated, &n_items);
+                if (r == -ENOMEM)
+                        goto finish;
+                if (r < 0)
+                        log_debug_errno(r, "Failed to determine boots of %s/%s, ignoring: %m", directory, de->d_name);
+        }
+
+        qsort_safe(items, n_items, sizeof(BootIndexItem), boot_index_item_compare);
+
+        r = write_boot_index(directory, items, n_items);
+
+finish:
+        if (m)
+                mmap_cache_unref(m);
+
+        return r;
+}
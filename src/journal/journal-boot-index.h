@@ -0,0 +1,47 @@
+#pragma once
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#include "sd-id128.h"
+
+#include "journal-file.h"
+#include "macro.h"
+#include "time-util.h"
+
+typedef struct JournalBoot {
+        sd_id128_t id;
+        usec_t first_realtime, last_realtime;
+        usec_t first_monotonic, last_monotonic;
+} JournalBoot;
+
+typedef struct BootIndex BootIndex;
+
+#define BOOT_INDEX_FILE "boot-index"
+
+int journal_file_get_boots(JournalFile *f, JournalBoot **boots, size_t *n_allocated, size_t *n_boots);
+
+int boot_index_load(const char *directory, BootIndex **ret);
+BootIndex* boot_index_free(BootIndex *b);
+DEFINE_TRIVIAL_CLEANUP_FUNC(BootIndex*, boot_index_free);
+
+int boot_index_get(BootIndex *b, sd_id128_t file_id, JournalBoot **boots, size_t *n_allocated, size_t *n_boots);
+
+int boot_index_update(const char *directory);
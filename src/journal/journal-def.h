@@ -42,6 +42,7 @@ typedef struct EntryObject EntryObject;
 typedef struct HashTableObject HashTableObject;
 typedef struct EntryArrayObject EntryArrayObject;
 typedef struct TagObject TagObject;
+typedef struct DictionaryObject DictionaryObject;
 
 typedef struct EntryItem EntryItem;
 typedef struct HashItem HashItem;
@@ -58,6 +59,7 @@ typedef enum ObjectType {
         OBJECT_FIELD_HASH_TABLE,
         OBJECT_ENTRY_ARRAY,
         OBJECT_TAG,
+        OBJECT_DICTIONARY,
         _OBJECT_TYPE_MAX
 } ObjectType;
 
@@ -65,10 +67,11 @@ typedef enum ObjectType {
 enum {
         OBJECT_COMPRESSED_XZ = 1 << 0,
         OBJECT_COMPRESSED_LZ4 = 1 << 1,
+        OBJECT_COMPRESSED_ZSTD = 1 << 2,
         _OBJECT_COMPRESSED_MAX
 };
 
-#define OBJECT_COMPRESSION_MASK (OBJECT_COMPRESSED_XZ | OBJECT_COMPRESSED_LZ4)
+#define OBJECT_COMPRESSION_MASK (OBJECT_COMPRESSED_XZ | OBJECT_COMPRESSED_LZ4 | OBJECT_COMPRESSED_ZSTD)
 
 struct ObjectHeader {
         uint8_t type;
@@ -109,7 +112,13 @@ struct EntryObject {
         le64_t monotonic;
         sd_id128_t boot_id;
         le64_t xor_hash;
-        EntryItem items[];
+        union {
+                /* Regular files store the offset of each data object
+                 * together with its hash, compact files only the
+                 * 32-bit offset, the hash is in the data object anyway */
+                EntryItem regular[0];
+                le32_t compact[0];
+        } _packed_ items;
 } _packed_;
 
 struct HashItem {
@@ -125,7 +134,10 @@ struct HashTableObject {
 struct EntryArrayObject {
         ObjectHeader object;
         le64_t next_entry_array_offset;
-        le64_t items[];
+        union {
+                le64_t regular[0];
+                le32_t compact[0];
+        } _packed_ items;
 } _packed_;
 
 #define TAG_LENGTH (256/8)
@@ -137,6 +149,13 @@ struct TagObject {
         uint8_t tag[TAG_LENGTH]; /* SHA-256 HMAC */
 } _packed_;
 
+/* A zstd dictionary trained on the data of the previous file, which
+ * all ZSTD compressed data objects of this file are compressed with */
+struct DictionaryObject {
+        ObjectHeader object;
+        uint8_t payload[];
+} _packed_;
+
 union Object {
         ObjectHeader object;
         DataObject data;
@@ -145,6 +164,7 @@ union Object {
         HashTableObject hash_table;
         EntryArrayObject entry_array;
         TagObject tag;
+        DictionaryObject dictionary;
 };
 
 enum {
@@ -158,20 +178,44 @@ enum {
 enum {
         HEADER_INCOMPATIBLE_COMPRESSED_XZ = 1 << 0,
         HEADER_INCOMPATIBLE_COMPRESSED_LZ4 = 1 << 1,
+        /* Bits 2 to 4 are used by other journal implementations for
+         * formats of their own, which would be misread rather than
+         * refused if we reused them. Hence our formats take bits
+         * from the top end. Our zstd objects may need a dictionary
+         * from the file, which those implementations don't know. */
+        HEADER_INCOMPATIBLE_COMPACT = 1 << 30,
+        HEADER_INCOMPATIBLE_COMPRESSED_ZSTD = 1 << 29,
 };
 
-#define HEADER_INCOMPATIBLE_ANY (HEADER_INCOMPATIBLE_COMPRESSED_XZ|HEADER_INCOMPATIBLE_COMPRESSED_LZ4)
+#define HEADER_INCOMPATIBLE_ANY (HEADER_INCOMPATIBLE_COMPRESSED_XZ|HEADER_INCOMPATIBLE_COMPRESSED_LZ4|HEADER_INCOMPATIBLE_COMPACT|HEADER_INCOMPATIBLE_COMPRESSED_ZSTD)
+
+#ifdef HAVE_XZ
+#  define HEADER_INCOMPATIBLE_XZ_SUPPORTED HEADER_INCOMPATIBLE_COMPRESSED_XZ
+#else
+#  define HEADER_INCOMPATIBLE_XZ_SUPPORTED 0
+#endif
+
+#ifdef HAVE_LZ4
+#  define HEADER_INCOMPATIBLE_LZ4_SUPPORTED HEADER_INCOMPATIBLE_COMPRESSED_LZ4
+#else
+#  define HEADER_INCOMPATIBLE_LZ4_SUPPORTED 0
+#endif
 
-#if defined(HAVE_XZ) && defined(HAVE_LZ4)
-#  define HEADER_INCOMPATIBLE_SUPPORTED HEADER_INCOMPATIBLE_ANY
-#elif defined(HAVE_XZ)
-#  define HEADER_INCOMPATIBLE_SUPPORTED HEADER_INCOMPATIBLE_COMPRESSED_XZ
-#elif defined(HAVE_LZ4)
-#  define HEADER_INCOMPATIBLE_SUPPORTED HEADER_INCOMPATIBLE_COMPRESSED_LZ4
+#ifdef HAVE_ZSTD
+#  define HEADER_INCOMPATIBLE_ZSTD_SUPPORTED HEADER_INCOMPATIBLE_COMPRESSED_ZSTD
 #else
-#  define HEADER_INCOMPATIBLE_SUPPORTED 0
+#  define HEADER_INCOMPATIBLE_ZSTD_SUPPORTED 0
 #endif
 
+#define HEADER_INCOMPATIBLE_SUPPORTED                                   \
+        (HEADER_INCOMPATIBLE_XZ_SUPPORTED |                             \
+         HEADER_INCOMPATIBLE_LZ4_SUPPORTED |                            \
+         HEADER_INCOMPATIBLE_ZSTD_SUPPORTED |                           \
+         HEADER_INCOMPATIBLE_COMPACT)
+
+/* Compact files store 32-bit offsets, hence may not grow beyond 4G */
+#define JOURNAL_COMPACT_SIZE_MAX ((uint64_t) UINT32_MAX)
+
 enum {
         HEADER_COMPATIBLE_SEALED = 1
 };
@@ -216,8 +260,12 @@ struct Header {
         /* Added in 189 */
         le64_t n_tags;
         le64_t n_entry_arrays;
+        /* Other journal implementations keep fields of their own
+         * at offsets 240 to 271, stay clear of them */
+        le64_t reserved_other[4];
+        le64_t dictionary_offset;
 
-        /* Size: 240 */
+        /* Size: 280 */
 } _packed_;
 
 #define FSS_HEADER_SIGNATURE ((char[]) { 'K', 'S', 'H', 'H', 'R', 'H', 'L', 'P' })
@@ -31,6 +31,7 @@
 #include "btrfs-util.h"
 #include "chattr-util.h"
 #include "compress.h"
+#include "env-util.h"
 #include "fd-util.h"
 #include "journal-authenticate.h"
 #include "journal-def.h"
@@ -49,6 +50,74 @@
 
 #define COMPRESSION_SIZE_THRESHOLD (512ULL)
 
+/* With a dictionary even short fields compress well */
+#define COMPRESSION_SIZE_THRESHOLD_DICTIONARY (64ULL)
+
+/* How much of the data we write we keep around to train the
+ * dictionary of the next file, and how large that may get */
+#define DICTIONARY_SAMPLES_SIZE_MAX (512ULL*1024ULL)           /* 512 KiB */
+#define DICTIONARY_SAMPLE_SIZE_MAX (4096ULL)
+#define DICTIONARY_SAMPLES_MIN 64U
+#define DICTIONARY_SIZE_MAX (16ULL*1024ULL)                    /* 16 KiB */
+
+#ifdef HAVE_ZSTD
+/* Training a dictionary takes a while, hence it is done in a thread of
+ * its own, which shares this with the file the dictionary is for.
+ * Whoever drops the last reference frees it. */
+struct DictionaryTraining {
+        unsigned n_ref;
+
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        bool done;
+
+        void *samples;
+        size_t *sample_sizes;
+        unsigned n_samples;
+
+        void *dictionary;
+        size_t size;
+        int result;
+};
+
+static DictionaryTraining* dictionary_training_unref(DictionaryTraining *t) {
+        if (!t)
+                return NULL;
+
+        if (__sync_sub_and_fetch(&t->n_ref, 1) > 0)
+                return NULL;
+
+        pthread_mutex_destroy(&t->mutex);
+        pthread_cond_destroy(&t->cond);
+        free(t->samples);
+        free(t->sample_sizes);
+        free(t->dictionary);
+        free(t);
+
+        return NULL;
+}
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(DictionaryTraining*, dictionary_training_unref);
+
+static void* dictionary_training_thread(void *p) {
+        DictionaryTraining *t = p;
+        int r;
+
+        r = compress_dictionary_train(t->samples, t->sample_sizes, t->n_samples,
+                                      t->dictionary, DICTIONARY_SIZE_MAX, &t->size);
+
+        assert_se(pthread_mutex_lock(&t->mutex) == 0);
+        t->result = r;
+        t->done = true;
+        assert_se(pthread_cond_broadcast(&t->cond) == 0);
+        assert_se(pthread_mutex_unlock(&t->mutex) == 0);
+
+        dictionary_training_unref(t);
+
+        return NULL;
+}
+#endif
+
 /* This is the minimum journal file size */
 #define JOURNAL_FILE_SIZE_MIN (512ULL*1024ULL)                 /* 512 KiB */
 
@@ -89,6 +158,45 @@
 /* The mmap context to use for the header we pick as one above the last defined typed */
 #define CONTEXT_HEADER _OBJECT_TYPE_MAX
 
+typedef struct ChainArray {
+        uint64_t array; /* the entry array */
+        uint64_t begin; /* the first item in the array */
+        uint64_t total; /* the total number of items in all arrays before this one in the chain */
+} ChainArray;
+
+typedef struct ChainCacheItem {
+        uint64_t first; /* the array at the beginning of the chain */
+        uint64_t array; /* the cached array */
+        uint64_t begin; /* the first item in the cached array */
+        uint64_t total; /* the total number of items in all arrays before this one in the chain */
+        uint64_t last_index; /* the last index we looked at, to optimize locality when bisecting */
+
+        /* All arrays of the chain we came across so far, in chain
+         * order. This serves as an in-memory index over the chain, so
+         * that we can bisect over the arrays instead of following the
+         * chain link by link each time. */
+        ChainArray *arrays;
+        size_t n_arrays;
+        size_t n_arrays_allocated;
+} ChainCacheItem;
+
+static ChainCacheItem* chain_cache_item_free(ChainCacheItem *ci) {
+        if (!ci)
+                return NULL;
+
+        free(ci->arrays);
+        return mfree(ci);
+}
+
+static void chain_cache_free(OrderedHashmap *h) {
+        ChainCacheItem *ci;
+
+        while ((ci = ordered_hashmap_steal_first(h)))
+                chain_cache_item_free(ci);
+
+        ordered_hashmap_free(h);
+}
+
 /* This may be called from a separate thread to prevent blocking the caller for the duration of fsync().
  * As a result we use atomic operations on f->offline_state for inter-thread communications with
  * journal_file_set_offline() and journal_file_set_online(). */
@@ -371,12 +479,20 @@ JournalFile* journal_file_close(JournalFile *f) {
 
         mmap_cache_unref(f->mmap);
 
-        ordered_hashmap_free_free(f->chain_cache);
+        chain_cache_free(f->chain_cache);
 
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
         free(f->compress_buffer);
 #endif
 
+        compress_dictionary_free(f->compress_dictionary);
+
+#ifdef HAVE_ZSTD
+        dictionary_training_unref(f->dictionary_training);
+        free(f->dictionary_samples);
+        free(f->dictionary_sample_sizes);
+#endif
+
 #ifdef HAVE_GCRYPT
         if (f->fss_file)
                 munmap(f->fss_file, PAGE_ALIGN(f->fss_file_size));
@@ -414,7 +530,9 @@ static int journal_file_init_header(JournalFile *f, JournalFile *template) {
 
         h.incompatible_flags |= htole32(
                 f->compress_xz * HEADER_INCOMPATIBLE_COMPRESSED_XZ |
-                f->compress_lz4 * HEADER_INCOMPATIBLE_COMPRESSED_LZ4);
+                f->compress_lz4 * HEADER_INCOMPATIBLE_COMPRESSED_LZ4 |
+                f->compress_zstd * HEADER_INCOMPATIBLE_COMPRESSED_ZSTD |
+                f->compact * HEADER_INCOMPATIBLE_COMPACT);
 
         h.compatible_flags = htole32(
                 f->seal * HEADER_COMPATIBLE_SEALED);
@@ -550,6 +668,11 @@ static int journal_file_verify_header(JournalFile *f) {
         if (JOURNAL_HEADER_SEALED(f->header) && !JOURNAL_HEADER_CONTAINS(f->header, n_entry_arrays))
                 return -EBADMSG;
 
+        /* Compact files cannot address anything beyond 4G */
+        if (JOURNAL_HEADER_COMPACT(f->header) &&
+            le64toh(f->header->header_size) + le64toh(f->header->arena_size) > JOURNAL_COMPACT_SIZE_MAX)
+                return -EBADMSG;
+
         if ((le64toh(f->header->header_size) + le64toh(f->header->arena_size)) > (uint64_t) f->last_stat.st_size)
                 return -ENODATA;
 
@@ -562,6 +685,10 @@ static int journal_file_verify_header(JournalFile *f) {
             !VALID64(le64toh(f->header->entry_array_offset)))
                 return -ENODATA;
 
+        if (JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset) &&
+            !VALID64(le64toh(f->header->dictionary_offset)))
+                return -ENODATA;
+
         if (f->writable) {
                 uint8_t state;
                 sd_id128_t machine_id;
@@ -589,6 +716,8 @@ static int journal_file_verify_header(JournalFile *f) {
 
         f->compress_xz = JOURNAL_HEADER_COMPRESSED_XZ(f->header);
         f->compress_lz4 = JOURNAL_HEADER_COMPRESSED_LZ4(f->header);
+        f->compress_zstd = JOURNAL_HEADER_COMPRESSED_ZSTD(f->header);
+        f->compact = JOURNAL_HEADER_COMPACT(f->header);
 
         f->seal = JOURNAL_HEADER_SEALED(f->header);
 
@@ -652,6 +781,10 @@ static int journal_file_allocate(JournalFile *f, uint64_t offset, uint64_t size)
         if (f->metrics.max_size > 0 && new_size > f->metrics.max_size)
                 return -E2BIG;
 
+        /* Compact files store 32-bit offsets, hence need rotation at 4G */
+        if (f->compact && new_size > JOURNAL_COMPACT_SIZE_MAX)
+                return -E2BIG;
+
         if (new_size > f->metrics.min_size && f->metrics.keep_free > 0) {
                 struct statvfs svfs;
 
@@ -669,6 +802,8 @@ static int journal_file_allocate(JournalFile *f, uint64_t offset, uint64_t size)
         new_size = ((new_size+FILE_SIZE_INCREASE-1) / FILE_SIZE_INCREASE) * FILE_SIZE_INCREASE;
         if (f->metrics.max_size > 0 && new_size > f->metrics.max_size)
                 new_size = f->metrics.max_size;
+        if (f->compact && new_size > JOURNAL_COMPACT_SIZE_MAX)
+                new_size = JOURNAL_COMPACT_SIZE_MAX;
 
         /* Note that the glibc fallocate() fallback is very
            inefficient, hence we try to minimize the allocation area
@@ -724,6 +859,7 @@ static uint64_t minimum_header_size(Object *o) {
                 [OBJECT_FIELD_HASH_TABLE] = sizeof(HashTableObject),
                 [OBJECT_ENTRY_ARRAY] = sizeof(EntryArrayObject),
                 [OBJECT_TAG] = sizeof(TagObject),
+                [OBJECT_DICTIONARY] = sizeof(DictionaryObject),
         };
 
         if (o->object.type >= ELEMENTSOF(table) || table[o->object.type] <= 0)
@@ -1180,7 +1316,7 @@ int journal_file_find_data_object_with_hash(
                         goto next;
 
                 if (o->object.flags & OBJECT_COMPRESSION_MASK) {
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
                         uint64_t l;
                         size_t rsize = 0;
 
@@ -1191,7 +1327,8 @@ int journal_file_find_data_object_with_hash(
                         l -= offsetof(Object, data.payload);
 
                         r = decompress_blob(o->object.flags & OBJECT_COMPRESSION_MASK,
-                                            o->data.payload, l, &f->compress_buffer, &f->compress_buffer_size, &rsize, 0);
+                                            o->data.payload, l, &f->compress_buffer, &f->compress_buffer_size, &rsize, 0,
+                                            journal_file_compress_dictionary(f));
                         if (r < 0)
                                 return r;
 
@@ -1307,9 +1444,134 @@ static int journal_file_append_field(
         return 0;
 }
 
+static void journal_file_add_dictionary_sample(JournalFile *f, const void *data, uint64_t size) {
+#ifdef HAVE_ZSTD
+        assert(f);
+
+        if (!f->compress_zstd)
+                return;
+
+        if (size <= 0 || size > DICTIONARY_SAMPLE_SIZE_MAX)
+                return;
+
+        if (f->dictionary_samples_size + size > DICTIONARY_SAMPLES_SIZE_MAX)
+                return;
+
+        /* This is best effort only, hence ignore OOM */
+        if (!GREEDY_REALLOC(f->dictionary_samples, f->dictionary_samples_allocated, f->dictionary_samples_size + size))
+                return;
+
+        if (!GREEDY_REALLOC(f->dictionary_sample_sizes, f->dictionary_sample_sizes_allocated, f->n_dictionary_samples + 1))
+                return;
+
+        memcpy((uint8_t*) f->dictionary_samples + f->dictionary_samples_size, data, size);
+        f->dictionary_samples_size += size;
+        f->dictionary_sample_sizes[f->n_dictionary_samples++] = size;
+#endif
+}
+
+static int journal_file_install_dictionary(JournalFile *f, bool wait) {
+#ifdef HAVE_ZSTD
+        _cleanup_(dictionary_training_unrefp) DictionaryTraining *t = NULL;
+        bool done;
+        uint64_t p;
+        Object *o;
+        int r;
+
+        assert(f);
+
+        if (!f->dictionary_training)
+                return 0;
+
+        assert_se(pthread_mutex_lock(&f->dictionary_training->mutex) == 0);
+        if (wait)
+                while (!f->dictionary_training->done)
+                        assert_se(pthread_cond_wait(&f->dictionary_training->cond, &f->dictionary_training->mutex) == 0);
+        done = f->dictionary_training->done;
+        assert_se(pthread_mutex_unlock(&f->dictionary_training->mutex) == 0);
+
+        if (!done)
+                return 0;
+
+        t = f->dictionary_training;
+        f->dictionary_training = NULL;
+
+        if (t->result < 0) {
+                log_debug_errno(t->result, "Failed to train compression dictionary for %s, not using one: %m", f->path);
+                return 0;
+        }
+
+        r = journal_file_append_object(f, OBJECT_DICTIONARY,
+                                       offsetof(Object, dictionary.payload) + t->size,
+                                       &o, &p);
+        if (r < 0)
+                return r;
+
+        memcpy(o->dictionary.payload, t->dictionary, t->size);
+
+#ifdef HAVE_GCRYPT
+        r = journal_file_hmac_put_object(f, OBJECT_DICTIONARY, o, p);
+        if (r < 0)
+                return r;
+#endif
+
+        r = compress_dictionary_new(t->dictionary, t->size, &f->compress_dictionary);
+        if (r < 0)
+                return r;
+
+        /* Only now readers may pick it up */
+        f->header->dictionary_offset = htole64(p);
+
+        log_debug("Embedded %zu byte compression dictionary trained on %u samples into %s.",
+                  t->size, t->n_samples, f->path);
+#endif
+
+        return 0;
+}
+
+int journal_file_wait_for_dictionary(JournalFile *f) {
+        return journal_file_install_dictionary(f, true);
+}
+
+static bool journal_file_compression_allowed(JournalFile *f, int compression) {
+        assert(f);
+
+        switch (compression) {
+
+        case OBJECT_COMPRESSED_XZ:
+                return f->compress_xz;
+
+        case OBJECT_COMPRESSED_LZ4:
+                return f->compress_lz4;
+
+        case OBJECT_COMPRESSED_ZSTD:
+                return f->compress_zstd;
+
+        default:
+                return false;
+        }
+}
+
+static int journal_file_compression(JournalFile *f) {
+        assert(f);
+
+        /* The codec is a property of the file, as recorded in its
+         * header, not of what we happen to be built with */
+
+        if (f->compress_zstd)
+                return OBJECT_COMPRESSED_ZSTD;
+        if (f->compress_lz4)
+                return OBJECT_COMPRESSED_LZ4;
+        if (f->compress_xz)
+                return OBJECT_COMPRESSED_XZ;
+
+        return 0;
+}
+
 static int journal_file_append_data(
                 JournalFile *f,
                 const void *data, uint64_t size,
+                const JournalPrecompressed *pc,
                 Object **ret, uint64_t *offset) {
 
         uint64_t hash, p;
@@ -1321,7 +1583,14 @@ static int journal_file_append_data(
         assert(f);
         assert(data || size == 0);
 
-        hash = hash64(data, size);
+        if (pc && !pc->valid)
+                pc = NULL;
+
+        r = journal_file_install_dictionary(f, false);
+        if (r < 0)
+                return r;
+
+        hash = pc ? pc->hash : hash64(data, size);
 
         r = journal_file_find_data_object_with_hash(f, data, size, hash, &o, &p);
         if (r < 0)
@@ -1344,13 +1613,24 @@ static int journal_file_append_data(
 
         o->data.hash = htole64(hash);
 
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
-        if (JOURNAL_FILE_COMPRESS(f) && size >= COMPRESSION_SIZE_THRESHOLD) {
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
+        if (pc && pc->compression > 0 && journal_file_compression_allowed(f, pc->compression)) {
+                /* The caller already did the work for us */
+                assert(pc->size < size);
+
+                memcpy(o->data.payload, pc->payload, pc->size);
+                o->object.size = htole64(offsetof(Object, data.payload) + pc->size);
+                o->object.flags |= pc->compression;
+                compression = pc->compression;
+
+        } else if (JOURNAL_FILE_COMPRESS(f) &&
+                   (!pc || pc->compression > 0) && /* Don't try again if it didn't help before */
+                   size >= (f->compress_dictionary ? COMPRESSION_SIZE_THRESHOLD_DICTIONARY : COMPRESSION_SIZE_THRESHOLD)) {
                 size_t rsize = 0;
 
-                compression = compress_blob(data, size, o->data.payload, size - 1, &rsize);
+                compression = compress_blob(journal_file_compression(f), data, size, o->data.payload, size - 1, &rsize, f->compress_dictionary);
 
-                if (compression >= 0) {
+                if (compression > 0 && journal_file_compression_allowed(f, compression)) {
                         o->object.size = htole64(offsetof(Object, data.payload) + rsize);
                         o->object.flags |= compression;
 
@@ -1365,6 +1645,8 @@ static int journal_file_append_data(
         if (compression == 0)
                 memcpy_safe(o->data.payload, data, size);
 
+        journal_file_add_dictionary_sample(f, data, size);
+
         r = journal_file_link_data(f, o, p, hash);
         if (r < 0)
                 return r;
@@ -1408,22 +1690,35 @@ static int journal_file_append_data(
         return 0;
 }
 
-uint64_t journal_file_entry_n_items(Object *o) {
+uint64_t journal_file_entry_n_items(JournalFile *f, Object *o) {
+        assert(f);
         assert(o);
 
         if (o->object.type != OBJECT_ENTRY)
                 return 0;
 
-        return (le64toh(o->object.size) - offsetof(Object, entry.items)) / sizeof(EntryItem);
+        return (le64toh(o->object.size) - offsetof(Object, entry.items)) / journal_file_entry_item_size(f);
 }
 
-uint64_t journal_file_entry_array_n_items(Object *o) {
+uint64_t journal_file_entry_array_n_items(JournalFile *f, Object *o) {
+        assert(f);
         assert(o);
 
         if (o->object.type != OBJECT_ENTRY_ARRAY)
                 return 0;
 
-        return (le64toh(o->object.size) - offsetof(Object, entry_array.items)) / sizeof(uint64_t);
+        return (le64toh(o->object.size) - offsetof(Object, entry_array.items)) / journal_file_entry_array_item_size(f);
+}
+
+static void journal_file_entry_array_set_item(JournalFile *f, Object *o, uint64_t i, uint64_t p) {
+        assert(f);
+        assert(o);
+
+        if (f->compact) {
+                assert(p <= JOURNAL_COMPACT_SIZE_MAX);
+                o->entry_array.items.compact[i] = htole32((uint32_t) p);
+        } else
+                o->entry_array.items.regular[i] = htole64(p);
 }
 
 uint64_t journal_file_hash_table_n_items(Object *o) {
@@ -1439,6 +1734,7 @@ uint64_t journal_file_hash_table_n_items(Object *o) {
 static int link_entry_into_array(JournalFile *f,
                                  le64_t *first,
                                  le64_t *idx,
+                                 EntryArrayTail *tail,
                                  uint64_t p) {
         int r;
         uint64_t n = 0, ap = 0, q, i, a, hidx;
@@ -1452,16 +1748,29 @@ static int link_entry_into_array(JournalFile *f,
 
         a = le64toh(*first);
         i = hidx = le64toh(*idx);
+
+        /* If we know where the chain ends, skip right to it */
+        if (tail && tail->offset > 0 && hidx >= tail->begin) {
+                a = tail->offset;
+                i = hidx - tail->begin;
+        }
+
         while (a > 0) {
 
                 r = journal_file_move_to_object(f, OBJECT_ENTRY_ARRAY, a, &o);
                 if (r < 0)
                         return r;
 
-                n = journal_file_entry_array_n_items(o);
+                n = journal_file_entry_array_n_items(f, o);
                 if (i < n) {
-                        o->entry_array.items[i] = htole64(p);
+                        journal_file_entry_array_set_item(f, o, i, p);
                         *idx = htole64(hidx + 1);
+
+                        if (tail) {
+                                tail->offset = a;
+                                tail->begin = hidx - i;
+                        }
+
                         return 0;
                 }
 
@@ -1479,7 +1788,7 @@ static int link_entry_into_array(JournalFile *f,
                 n = 4;
 
         r = journal_file_append_object(f, OBJECT_ENTRY_ARRAY,
-                                       offsetof(Object, entry_array.items) + n * sizeof(uint64_t),
+                                       offsetof(Object, entry_array.items) + n * journal_file_entry_array_item_size(f),
                                        &o, &q);
         if (r < 0)
                 return r;
@@ -1490,7 +1799,7 @@ static int link_entry_into_array(JournalFile *f,
                 return r;
 #endif
 
-        o->entry_array.items[i] = htole64(p);
+        journal_file_entry_array_set_item(f, o, i, p);
 
         if (ap == 0)
                 *first = htole64(q);
@@ -1507,6 +1816,11 @@ static int link_entry_into_array(JournalFile *f,
 
         *idx = htole64(hidx + 1);
 
+        if (tail) {
+                tail->offset = q;
+                tail->begin = hidx - i;
+        }
+
         return 0;
 }
 
@@ -1530,7 +1844,7 @@ static int link_entry_into_array_plus_one(JournalFile *f,
                 le64_t i;
 
                 i = htole64(le64toh(*idx) - 1);
-                r = link_entry_into_array(f, first, &i, p);
+                r = link_entry_into_array(f, first, &i, NULL, p);
                 if (r < 0)
                         return r;
         }
@@ -1546,7 +1860,7 @@ static int journal_file_link_entry_item(JournalFile *f, Object *o, uint64_t offs
         assert(o);
         assert(offset > 0);
 
-        p = le64toh(o->entry.items[i].object_offset);
+        p = journal_file_entry_item_object_offset(f, o, i);
         if (p == 0)
                 return -EINVAL;
 
@@ -1579,6 +1893,7 @@ static int journal_file_link_entry(JournalFile *f, Object *o, uint64_t offset) {
         r = link_entry_into_array(f,
                                   &f->header->entry_array_offset,
                                   &f->header->n_entries,
+                                  &f->entry_array_tail,
                                   offset);
         if (r < 0)
                 return r;
@@ -1594,7 +1909,7 @@ static int journal_file_link_entry(JournalFile *f, Object *o, uint64_t offset) {
         f->tail_entry_monotonic_valid = true;
 
         /* Link up the items */
-        n = journal_file_entry_n_items(o);
+        n = journal_file_entry_n_items(f, o);
         for (i = 0; i < n; i++) {
                 r = journal_file_link_entry_item(f, o, offset, i);
                 if (r < 0)
@@ -1613,6 +1928,7 @@ static int journal_file_append_entry_internal(
                 Object **ret, uint64_t *offset) {
         uint64_t np;
         uint64_t osize;
+        unsigned i;
         Object *o;
         int r;
 
@@ -1621,14 +1937,20 @@ static int journal_file_append_entry_internal(
         assert(items || n_items == 0);
         assert(ts);
 
-        osize = offsetof(Object, entry.items) + (n_items * sizeof(EntryItem));
+        osize = offsetof(Object, entry.items) + (n_items * journal_file_entry_item_size(f));
 
         r = journal_file_append_object(f, OBJECT_ENTRY, osize, &o, &np);
         if (r < 0)
                 return r;
 
         o->entry.seqnum = htole64(journal_file_entry_seqnum(f, seqnum));
-        memcpy_safe(o->entry.items, items, n_items * sizeof(EntryItem));
+        if (f->compact)
+                for (i = 0; i < n_items; i++) {
+                        assert(le64toh(items[i].object_offset) <= JOURNAL_COMPACT_SIZE_MAX);
+                        o->entry.items.compact[i] = htole32((uint32_t) le64toh(items[i].object_offset));
+                }
+        else
+                memcpy_safe(o->entry.items.regular, items, n_items * sizeof(EntryItem));
         o->entry.realtime = htole64(ts->realtime);
         o->entry.monotonic = htole64(ts->monotonic);
         o->entry.xor_hash = htole64(xor_hash);
@@ -1754,7 +2076,13 @@ static int entry_item_cmp(const void *_a, const void *_b) {
         return 0;
 }
 
-int journal_file_append_entry(JournalFile *f, const dual_timestamp *ts, const struct iovec iovec[], unsigned n_iovec, uint64_t *seqnum, Object **ret, uint64_t *offset) {
+static int journal_file_append_entry_one(
+                JournalFile *f,
+                const dual_timestamp *ts,
+                const struct iovec iovec[], const JournalPrecompressed precompressed[], unsigned n_iovec,
+                uint64_t *seqnum,
+                Object **ret, uint64_t *offset) {
+
         unsigned i;
         EntryItem *items;
         int r;
@@ -1783,7 +2111,7 @@ int journal_file_append_entry(JournalFile *f, const dual_timestamp *ts, const st
                 uint64_t p;
                 Object *o;
 
-                r = journal_file_append_data(f, iovec[i].iov_base, iovec[i].iov_len, &o, &p);
+                r = journal_file_append_data(f, iovec[i].iov_base, iovec[i].iov_len, precompressed ? precompressed + i : NULL, &o, &p);
                 if (r < 0)
                         return r;
 
@@ -1796,7 +2124,11 @@ int journal_file_append_entry(JournalFile *f, const dual_timestamp *ts, const st
          * times for rotating media. */
         qsort_safe(items, n_iovec, sizeof(EntryItem), entry_item_cmp);
 
-        r = journal_file_append_entry_internal(f, ts, xor_hash, items, n_iovec, seqnum, ret, offset);
+        return journal_file_append_entry_internal(f, ts, xor_hash, items, n_iovec, seqnum, ret, offset);
+}
+
+static int journal_file_append_finish(JournalFile *f, int r) {
+        assert(f);
 
         /* If the memory mapping triggered a SIGBUS then we return an
          * IO error and ignore the error code passed down to us, since
@@ -1814,13 +2146,100 @@ int journal_file_append_entry(JournalFile *f, const dual_timestamp *ts, const st
         return r;
 }
 
-typedef struct ChainCacheItem {
-        uint64_t first; /* the array at the beginning of the chain */
-        uint64_t array; /* the cached array */
-        uint64_t begin; /* the first item in the cached array */
-        uint64_t total; /* the total number of items in all arrays before this one in the chain */
-        uint64_t last_index; /* the last index we looked at, to optimize locality when bisecting */
-} ChainCacheItem;
+int journal_file_append_entry(JournalFile *f, const dual_timestamp *ts, const struct iovec iovec[], unsigned n_iovec, uint64_t *seqnum, Object **ret, uint64_t *offset) {
+        int r;
+
+        assert(f);
+
+        r = journal_file_append_entry_one(f, ts, iovec, NULL, n_iovec, seqnum, ret, offset);
+
+        return journal_file_append_finish(f, r);
+}
+
+int journal_file_append_entries(JournalFile *f, const JournalEntry entries[], unsigned n_entries, uint64_t *seqnum, unsigned *n_written) {
+        unsigned i;
+        int r = 0;
+
+        assert(f);
+        assert(entries || n_entries == 0);
+
+        /* Appends a batch of entries, in order. The SIGBUS check and
+         * the change notification are done once for the whole batch
+         * rather than for each entry. Returns the number of entries
+         * actually written in n_written, which on failure is the index
+         * of the entry that couldn't be written. */
+
+        for (i = 0; i < n_entries; i++) {
+                r = journal_file_append_entry_one(f, entries[i].ts, entries[i].iovec, entries[i].precompressed, entries[i].n_iovec, seqnum, NULL, NULL);
+                if (r < 0)
+                        break;
+        }
+
+        if (n_written)
+                *n_written = i;
+
+        if (n_entries == 0)
+                return 0;
+
+        r = journal_file_append_finish(f, r);
+        if (r < 0 && n_written && i == n_entries)
+                /* The SIGBUS check failed, hence none of the batch is trustworthy */
+                *n_written = 0;
+
+        return r;
+}
+
+int journal_precompress(const void *data, uint64_t size, JournalPrecompressed *ret) {
+        _cleanup_free_ void *payload = NULL;
+        size_t rsize = 0;
+        int compression = 0;
+
+        assert(data || size == 0);
+        assert(ret);
+
+        /* Calculates the hash and the compressed form of a data
+         * payload, so that journal_file_append_entries() doesn't have
+         * to. This doesn't touch any JournalFile, and hence may be
+         * called from any thread. Note that no compression dictionary
+         * is used, and that the default codec is used. Files which
+         * use a different one compress the data again when it is
+         * appended. */
+
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
+        if (size >= COMPRESSION_SIZE_THRESHOLD) {
+                payload = malloc(size - 1);
+                if (!payload)
+                        return -ENOMEM;
+
+                compression = compress_blob(OBJECT_COMPRESSED_DEFAULT, data, size, payload, size - 1, &rsize, NULL);
+                if (compression < 0) {
+                        compression = 0;
+                        payload = mfree(payload);
+                        rsize = 0;
+                }
+        }
+#endif
+
+        *ret = (JournalPrecompressed) {
+                .valid = true,
+                .hash = hash64(data, size),
+                .compression = compression,
+                .payload = payload,
+                .size = rsize,
+        };
+        payload = NULL;
+
+        return 0;
+}
+
+void journal_precompressed_done(JournalPrecompressed *p) {
+        assert(p);
+
+        p->payload = mfree(p->payload);
+        p->size = 0;
+        p->compression = 0;
+        p->valid = false;
+}
 
 static void chain_cache_put(
                 OrderedHashmap *h,
@@ -1840,8 +2259,10 @@ static void chain_cache_put(
                 if (ordered_hashmap_size(h) >= CHAIN_CACHE_MAX) {
                         ci = ordered_hashmap_steal_first(h);
                         assert(ci);
+
+                        ci->n_arrays = 0;
                 } else {
-                        ci = new(ChainCacheItem, 1);
+                        ci = new0(ChainCacheItem, 1);
                         if (!ci)
                                 return;
                 }
@@ -1849,7 +2270,7 @@ static void chain_cache_put(
                 ci->first = first;
 
                 if (ordered_hashmap_put(h, &ci->first, ci) < 0) {
-                        free(ci);
+                        chain_cache_item_free(ci);
                         return;
                 }
         } else
@@ -1861,6 +2282,58 @@ static void chain_cache_put(
         ci->last_index = last_index;
 }
 
+static void chain_cache_learn(ChainCacheItem *ci, uint64_t array, uint64_t begin, uint64_t total) {
+
+        /* Called for each array we visit while walking a chain
+         * forward, starting from an array we already know. Hence, the
+         * first array beyond the ones we know is the direct successor
+         * of the last one we know. */
+
+        if (!ci)
+                return;
+
+        if (ci->n_arrays == 0) {
+                if (array != ci->first)
+                        return;
+        } else if (total <= ci->arrays[ci->n_arrays - 1].total)
+                return;
+
+        if (begin <= 0)
+                return;
+
+        if (!GREEDY_REALLOC(ci->arrays, ci->n_arrays_allocated, ci->n_arrays + 1))
+                return;
+
+        ci->arrays[ci->n_arrays++] = (ChainArray) {
+                .array = array,
+                .begin = begin,
+                .total = total,
+        };
+}
+
+static const ChainArray* chain_cache_find_index(ChainCacheItem *ci, uint64_t i) {
+        size_t left, right;
+
+        /* Find the last known array of the chain that starts at or
+         * before index i */
+
+        if (!ci || ci->n_arrays == 0)
+                return NULL;
+
+        left = 0;
+        right = ci->n_arrays;
+        while (right - left > 1) {
+                size_t m = (left + right) / 2;
+
+                if (ci->arrays[m].total <= i)
+                        left = m;
+                else
+                        right = m;
+        }
+
+        return ci->arrays + left;
+}
+
 static int generic_array_get(
                 JournalFile *f,
                 uint64_t first,
@@ -1876,12 +2349,18 @@ static int generic_array_get(
 
         a = first;
 
-        /* Try the chain cache first */
+        /* Try the chain cache first, and jump straight to the right
+         * array if we know it */
         ci = ordered_hashmap_get(f->chain_cache, &first);
-        if (ci && i > ci->total) {
-                a = ci->array;
-                i -= ci->total;
-                t = ci->total;
+        if (ci) {
+                const ChainArray *ca;
+
+                ca = chain_cache_find_index(ci, i);
+                if (ca) {
+                        a = ca->array;
+                        i -= ca->total;
+                        t = ca->total;
+                }
         }
 
         while (a > 0) {
@@ -1891,9 +2370,11 @@ static int generic_array_get(
                 if (r < 0)
                         return r;
 
-                k = journal_file_entry_array_n_items(o);
+                chain_cache_learn(ci, a, journal_file_entry_array_item(f, o, 0), t);
+
+                k = journal_file_entry_array_n_items(f, o);
                 if (i < k) {
-                        p = le64toh(o->entry_array.items[i]);
+                        p = journal_file_entry_array_item(f, o, i);
                         goto found;
                 }
 
@@ -1906,7 +2387,7 @@ static int generic_array_get(
 
 found:
         /* Let's cache this item for the next invocation */
-        chain_cache_put(f->chain_cache, ci, first, a, le64toh(o->entry_array.items[0]), t, i);
+        chain_cache_put(f->chain_cache, ci, first, a, journal_file_entry_array_item(f, o, 0), t, i);
 
         r = journal_file_move_to_object(f, OBJECT_ENTRY, p, &o);
         if (r < 0)
@@ -1981,27 +2462,42 @@ static int generic_array_bisect(
         a = first;
 
         ci = ordered_hashmap_get(f->chain_cache, &first);
-        if (ci && n > ci->total) {
+        if (ci && ci->n_arrays > 1) {
+                size_t left = 0, right = ci->n_arrays;
+
                 /* Ah, we have iterated this bisection array chain
-                 * previously! Let's see if we can skip ahead in the
-                 * chain, as far as the last time. But we can't jump
-                 * backwards in the chain, so let's check that
-                 * first. */
+                 * previously! Let's bisect over the arrays we know
+                 * to find the last one whose first item is left of
+                 * what we are looking for, and jump straight to it,
+                 * instead of testing each array of the chain in
+                 * turn. */
 
-                r = test_object(f, ci->begin, needle);
-                if (r < 0)
-                        return r;
+                while (right > 1 && ci->arrays[right - 1].total >= n)
+                        right--;
+
+                while (right - left > 1) {
+                        size_t m = (left + right) / 2;
+
+                        r = test_object(f, ci->arrays[m].begin, needle);
+                        if (r < 0)
+                                return r;
+
+                        if (r == TEST_LEFT)
+                                left = m;
+                        else
+                                right = m;
+                }
 
-                if (r == TEST_LEFT) {
-                        /* OK, what we are looking for is right of the
-                         * begin of this EntryArray, so let's jump
-                         * straight to previously cached array in the
-                         * chain */
+                if (left > 0) {
+                        a = ci->arrays[left].array;
+                        n -= ci->arrays[left].total;
+                        t = ci->arrays[left].total;
 
-                        a = ci->array;
-                        n -= ci->total;
-                        t = ci->total;
-                        last_index = ci->last_index;
+                        /* If we ended up in the same array as last
+                         * time, we can make use of the index we
+                         * looked at then, too */
+                        if (a == ci->array && t == ci->total)
+                                last_index = ci->last_index;
                 }
         }
 
@@ -2012,13 +2508,15 @@ static int generic_array_bisect(
                 if (r < 0)
                         return r;
 
-                k = journal_file_entry_array_n_items(array);
+                chain_cache_learn(ci, a, journal_file_entry_array_item(f, array, 0), t);
+
+                k = journal_file_entry_array_n_items(f, array);
                 right = MIN(k, n);
                 if (right <= 0)
                         return 0;
 
                 i = right - 1;
-                lp = p = le64toh(array->entry_array.items[i]);
+                lp = p = journal_file_entry_array_item(f, array, i);
                 if (p <= 0)
                         r = -EBADMSG;
                 else
@@ -2051,7 +2549,7 @@ static int generic_array_bisect(
                                 if (last_index > 0) {
                                         uint64_t x = last_index - 1;
 
-                                        p = le64toh(array->entry_array.items[x]);
+                                        p = journal_file_entry_array_item(f, array, x);
                                         if (p <= 0)
                                                 return -EBADMSG;
 
@@ -2071,7 +2569,7 @@ static int generic_array_bisect(
                                 if (last_index < right) {
                                         uint64_t y = last_index + 1;
 
-                                        p = le64toh(array->entry_array.items[y]);
+                                        p = journal_file_entry_array_item(f, array, y);
                                         if (p <= 0)
                                                 return -EBADMSG;
 
@@ -2101,7 +2599,7 @@ static int generic_array_bisect(
                                 assert(left < right);
                                 i = (left + right) / 2;
 
-                                p = le64toh(array->entry_array.items[i]);
+                                p = journal_file_entry_array_item(f, array, i);
                                 if (p <= 0)
                                         r = -EBADMSG;
                                 else
@@ -2149,14 +2647,14 @@ found:
                 return 0;
 
         /* Let's cache this item for the next invocation */
-        chain_cache_put(f->chain_cache, ci, first, a, le64toh(array->entry_array.items[0]), t, subtract_one ? (i > 0 ? i-1 : (uint64_t) -1) : i);
+        chain_cache_put(f->chain_cache, ci, first, a, journal_file_entry_array_item(f, array, 0), t, subtract_one ? (i > 0 ? i-1 : (uint64_t) -1) : i);
 
         if (subtract_one && i == 0)
                 p = last_p;
         else if (subtract_one)
-                p = le64toh(array->entry_array.items[i-1]);
+                p = journal_file_entry_array_item(f, array, i-1);
         else
-                p = le64toh(array->entry_array.items[i]);
+                p = journal_file_entry_array_item(f, array, i);
 
         r = journal_file_move_to_object(f, OBJECT_ENTRY, p, &o);
         if (r < 0)
@@ -2315,6 +2813,21 @@ static int test_object_realtime(JournalFile *f, uint64_t p, uint64_t needle) {
                 return TEST_RIGHT;
 }
 
+static bool journal_file_realtime_beyond(JournalFile *f, uint64_t realtime, direction_t direction) {
+        assert(f);
+        assert(f->header);
+
+        /* The header tells us the timestamps of the first and the
+         * last entry, hence we can tell that there's nothing to find
+         * without bisecting the entry array, which might mean reading
+         * a number of pages from disk. */
+
+        if (direction == DIRECTION_DOWN)
+                return realtime > le64toh(f->header->tail_entry_realtime);
+        else
+                return realtime < le64toh(f->header->head_entry_realtime);
+}
+
 int journal_file_move_to_entry_by_realtime(
                 JournalFile *f,
                 uint64_t realtime,
@@ -2324,6 +2837,9 @@ int journal_file_move_to_entry_by_realtime(
         assert(f);
         assert(f->header);
 
+        if (journal_file_realtime_beyond(f, realtime, direction))
+                return 0;
+
         return generic_array_bisect(f,
                                     le64toh(f->header->entry_array_offset),
                                     le64toh(f->header->n_entries),
@@ -2745,6 +3261,9 @@ int journal_file_move_to_entry_by_realtime_for_data(
 
         assert(f);
 
+        if (journal_file_realtime_beyond(f, realtime, direction))
+                return 0;
+
         r = journal_file_move_to_object(f, OBJECT_DATA, data_offset, &d);
         if (r < 0)
                 return r;
@@ -2814,6 +3333,11 @@ void journal_file_dump(JournalFile *f) {
                                le64toh(o->tag.epoch));
                         break;
 
+                case OBJECT_DICTIONARY:
+                        printf("Type: OBJECT_DICTIONARY size=%"PRIu64"\n",
+                               le64toh(o->object.size) - offsetof(Object, dictionary.payload));
+                        break;
+
                 default:
                         printf("Type: unknown (%i)\n", o->object.type);
                         break;
@@ -2859,7 +3383,7 @@ void journal_file_print_header(JournalFile *f) {
                "Sequential Number ID: %s\n"
                "State: %s\n"
                "Compatible Flags:%s%s\n"
-               "Incompatible Flags:%s%s%s\n"
+               "Incompatible Flags:%s%s%s%s%s\n"
                "Header size: %"PRIu64"\n"
                "Arena size: %"PRIu64"\n"
                "Data Hash Table Size: %"PRIu64"\n"
@@ -2884,6 +3408,8 @@ void journal_file_print_header(JournalFile *f) {
                (le32toh(f->header->compatible_flags) & ~HEADER_COMPATIBLE_ANY) ? " ???" : "",
                JOURNAL_HEADER_COMPRESSED_XZ(f->header) ? " COMPRESSED-XZ" : "",
                JOURNAL_HEADER_COMPRESSED_LZ4(f->header) ? " COMPRESSED-LZ4" : "",
+               JOURNAL_HEADER_COMPRESSED_ZSTD(f->header) ? " COMPRESSED-ZSTD" : "",
+               JOURNAL_HEADER_COMPACT(f->header) ? " COMPACT" : "",
                (le32toh(f->header->incompatible_flags) & ~HEADER_INCOMPATIBLE_ANY) ? " ???" : "",
                le64toh(f->header->header_size),
                le64toh(f->header->arena_size),
@@ -2956,6 +3482,116 @@ static int journal_file_warn_btrfs(JournalFile *f) {
         return 1;
 }
 
+static int journal_file_setup_dictionary(JournalFile *f, JournalFile *template) {
+#ifdef HAVE_ZSTD
+        _cleanup_(dictionary_training_unrefp) DictionaryTraining *t = NULL;
+        pthread_attr_t attr;
+        pthread_t thread;
+        int r;
+
+        assert(f);
+
+        /* If the file we replace collected enough data, train a
+         * dictionary on it, which is embedded in the new file once
+         * ready, see journal_file_install_dictionary(). The new file
+         * is hopefully going to contain something very similar. This
+         * happens in a thread, so that rotating doesn't stall the
+         * caller. */
+
+        if (!f->compress_zstd || !template)
+                return 0;
+
+        if (template->n_dictionary_samples < DICTIONARY_SAMPLES_MIN)
+                return 0;
+
+        t = new0(DictionaryTraining, 1);
+        if (!t)
+                return -ENOMEM;
+
+        t->n_ref = 1;
+        assert_se(pthread_mutex_init(&t->mutex, NULL) == 0);
+        assert_se(pthread_cond_init(&t->cond, NULL) == 0);
+
+        t->dictionary = malloc(DICTIONARY_SIZE_MAX);
+        if (!t->dictionary)
+                return -ENOMEM;
+
+        /* The file we replace has no use for its samples anymore */
+        t->samples = template->dictionary_samples;
+        t->sample_sizes = template->dictionary_sample_sizes;
+        t->n_samples = template->n_dictionary_samples;
+        template->dictionary_samples = NULL;
+        template->dictionary_sample_sizes = NULL;
+        template->dictionary_samples_size = template->dictionary_samples_allocated = 0;
+        template->dictionary_sample_sizes_allocated = 0;
+        template->n_dictionary_samples = 0;
+
+        r = pthread_attr_init(&attr);
+        if (r != 0)
+                return -r;
+
+        r = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (r == 0) {
+                t->n_ref++;
+
+                r = pthread_create(&thread, &attr, dictionary_training_thread, t);
+                if (r != 0)
+                        t->n_ref--;
+        }
+
+        pthread_attr_destroy(&attr);
+
+        if (r != 0) {
+                log_debug_errno(r, "Failed to start training compression dictionary for %s, not using one: %m", f->path);
+                return 0;
+        }
+
+        f->dictionary_training = t;
+        t = NULL;
+#endif
+
+        return 0;
+}
+
+static int journal_file_load_dictionary(JournalFile *f) {
+        uint64_t p, l;
+        Object *o;
+        int r;
+
+        assert(f);
+
+        if (!f->compress_zstd)
+                return 0;
+
+        if (!JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset))
+                return 0;
+
+        p = le64toh(f->header->dictionary_offset);
+        if (p == 0)
+                return 0;
+
+        r = journal_file_move_to_object(f, OBJECT_DICTIONARY, p, &o);
+        if (r < 0)
+                return r;
+
+        l = le64toh(o->object.size) - offsetof(Object, dictionary.payload);
+        if (l <= 0)
+                return -EBADMSG;
+
+        return compress_dictionary_new(o->dictionary.payload, l, &f->compress_dictionary);
+}
+
+CompressDictionary* journal_file_compress_dictionary(JournalFile *f) {
+        assert(f);
+
+        /* The dictionary is appended to a file while it is written
+         * already, hence readers look for it until they find it */
+        if (!f->compress_dictionary && !f->writable)
+                (void) journal_file_load_dictionary(f);
+
+        return f->compress_dictionary;
+}
+
 int journal_file_open(
                 int fd,
                 const char *fname,
@@ -2997,7 +3633,9 @@ int journal_file_open(
         f->flags = flags;
         f->prot = prot_from_flags(flags);
         f->writable = (flags & O_ACCMODE) != O_RDONLY;
-#if defined(HAVE_LZ4)
+#if defined(HAVE_ZSTD)
+        f->compress_zstd = compress;
+#elif defined(HAVE_LZ4)
         f->compress_lz4 = compress;
 #elif defined(HAVE_XZ)
         f->compress_xz = compress;
@@ -3062,6 +3700,11 @@ int journal_file_open(
 
                 fd_setcrtime(f->fd, 0);
 
+                /* The compact format is more space efficient, but
+                 * cannot be read by older versions, hence it needs to
+                 * be requested explicitly */
+                f->compact = getenv_bool("SYSTEMD_JOURNAL_COMPACT") > 0;
+
 #ifdef HAVE_GCRYPT
                 /* Try to load the FSPRG state, and if we can't, then
                  * just don't do sealing */
@@ -3143,6 +3786,14 @@ int journal_file_open(
                 if (r < 0)
                         goto fail;
 #endif
+
+                r = journal_file_setup_dictionary(f, template);
+                if (r < 0)
+                        goto fail;
+        } else {
+                r = journal_file_load_dictionary(f);
+                if (r < 0)
+                        goto fail;
         }
 
         if (mmap_cache_got_sigbus(f->mmap, f->fd)) {
@@ -3301,6 +3952,33 @@ int journal_file_open_reliably(
         return journal_file_open(-1, fname, flags, mode, compress, seal, metrics, mmap_cache, deferred_closes, template, ret);
 }
 
+int journal_file_open_duplicate(JournalFile *f, JournalFile **ret) {
+        int fd, r;
+
+        assert(f);
+        assert(ret);
+
+        /* Opens a second, read-only instance of an already opened
+         * file, with an mmap cache of its own, so that it may be read
+         * from another thread. */
+
+        fd = fcntl(f->fd, F_DUPFD_CLOEXEC, 3);
+        if (fd < 0)
+                return -errno;
+
+        r = journal_file_open(fd, f->path, O_RDONLY, 0, false, false, NULL, NULL, NULL, NULL, ret);
+        if (r < 0) {
+                safe_close(fd);
+                return r;
+        }
+
+        /* journal_file_open() took possession of the duplicated fd,
+         * it is closed together with the copy */
+        assert((*ret)->close_fd);
+
+        return 0;
+}
+
 int journal_file_copy_entry(JournalFile *from, JournalFile *to, Object *o, uint64_t p, uint64_t *seqnum, Object **ret, uint64_t *offset) {
         uint64_t i, n;
         uint64_t q, xor_hash = 0;
@@ -3319,25 +3997,26 @@ int journal_file_copy_entry(JournalFile *from, JournalFile *to, Object *o, uint6
         ts.monotonic = le64toh(o->entry.monotonic);
         ts.realtime = le64toh(o->entry.realtime);
 
-        n = journal_file_entry_n_items(o);
+        n = journal_file_entry_n_items(from, o);
         /* alloca() can't take 0, hence let's allocate at least one */
         items = alloca(sizeof(EntryItem) * MAX(1u, n));
 
         for (i = 0; i < n; i++) {
                 uint64_t l, h;
-                le64_t le_hash;
+                le64_t le_hash = 0;
                 size_t t;
                 void *data;
                 Object *u;
 
-                q = le64toh(o->entry.items[i].object_offset);
-                le_hash = o->entry.items[i].hash;
+                q = journal_file_entry_item_object_offset(from, o, i);
+                if (!from->compact)
+                        le_hash = o->entry.items.regular[i].hash;
 
                 r = journal_file_move_to_object(from, OBJECT_DATA, q, &o);
                 if (r < 0)
                         return r;
 
-                if (le_hash != o->data.hash)
+                if (!from->compact && le_hash != o->data.hash)
                         return -EBADMSG;
 
                 l = le64toh(o->object.size) - offsetof(Object, data.payload);
@@ -3348,11 +4027,12 @@ int journal_file_copy_entry(JournalFile *from, JournalFile *to, Object *o, uint6
                         return -E2BIG;
 
                 if (o->object.flags & OBJECT_COMPRESSION_MASK) {
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
                         size_t rsize = 0;
 
                         r = decompress_blob(o->object.flags & OBJECT_COMPRESSION_MASK,
-                                            o->data.payload, l, &from->compress_buffer, &from->compress_buffer_size, &rsize, 0);
+                                            o->data.payload, l, &from->compress_buffer, &from->compress_buffer_size, &rsize, 0,
+                                            journal_file_compress_dictionary(from));
                         if (r < 0)
                                 return r;
 
@@ -3364,7 +4044,7 @@ int journal_file_copy_entry(JournalFile *from, JournalFile *to, Object *o, uint6
                 } else
                         data = o->data.payload;
 
-                r = journal_file_append_data(to, data, l, &u, &h);
+                r = journal_file_append_data(to, data, l, NULL, &u, &h);
                 if (r < 0)
                         return r;
 
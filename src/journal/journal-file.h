@@ -27,6 +27,7 @@
 
 #include "sd-id128.h"
 
+#include "compress.h"
 #include "hashmap.h"
 #include "journal-def.h"
 #include "macro.h"
@@ -73,6 +74,36 @@ typedef enum OfflineState {
         OFFLINE_DONE
 } OfflineState;
 
+/* Where the last entry array of a chain is located, and the index of
+ * its first item in the chain, so that appending doesn't need to
+ * walk the chain from the beginning each time. */
+typedef struct EntryArrayTail {
+        uint64_t offset;
+        uint64_t begin;
+} EntryArrayTail;
+
+/* A data payload that has been hashed and compressed ahead of time,
+ * possibly in a different thread, see journal_precompress(). */
+typedef struct JournalPrecompressed {
+        bool valid;
+        uint64_t hash;
+        int compression; /* OBJECT_COMPRESSED_* flag, or 0 if compression didn't help */
+        void *payload;
+        size_t size;
+} JournalPrecompressed;
+
+/* An entry to write with journal_file_append_entries() */
+typedef struct JournalEntry {
+        const dual_timestamp *ts;
+        const struct iovec *iovec;
+        unsigned n_iovec;
+
+        /* Optional, if not NULL one for each item in iovec */
+        const JournalPrecompressed *precompressed;
+} JournalEntry;
+
+typedef struct DictionaryTraining DictionaryTraining;
+
 typedef struct JournalFile {
         int fd;
 
@@ -83,6 +114,8 @@ typedef struct JournalFile {
         bool writable:1;
         bool compress_xz:1;
         bool compress_lz4:1;
+        bool compress_zstd:1;
+        bool compact:1;
         bool seal:1;
         bool defrag_on_close:1;
         bool close_fd:1;
@@ -93,6 +126,7 @@ typedef struct JournalFile {
         direction_t last_direction;
         LocationType location_type;
         uint64_t last_n_entries;
+        unsigned prioq_idx;
 
         char *path;
         struct stat last_stat;
@@ -116,15 +150,33 @@ typedef struct JournalFile {
         usec_t post_change_timer_period;
 
         OrderedHashmap *chain_cache;
+        EntryArrayTail entry_array_tail;
 
         pthread_t offline_thread;
         volatile OfflineState offline_state;
 
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
         void *compress_buffer;
         size_t compress_buffer_size;
 #endif
 
+        /* The dictionary ZSTD data objects of this file are compressed with */
+        CompressDictionary *compress_dictionary;
+
+#ifdef HAVE_ZSTD
+        /* The dictionary for this file, while it is being trained */
+        DictionaryTraining *dictionary_training;
+
+        /* Data we wrote, to train the dictionary of the file that
+         * will replace this one when we rotate */
+        void *dictionary_samples;
+        size_t dictionary_samples_size;
+        size_t dictionary_samples_allocated;
+        size_t *dictionary_sample_sizes;
+        size_t dictionary_sample_sizes_allocated;
+        unsigned n_dictionary_samples;
+#endif
+
 #ifdef HAVE_GCRYPT
         gcry_md_hd_t hmac;
         bool hmac_running;
@@ -173,6 +225,8 @@ int journal_file_open_reliably(
                 JournalFile *template,
                 JournalFile **ret);
 
+int journal_file_open_duplicate(JournalFile *f, JournalFile **ret);
+
 #define ALIGN64(x) (((x) + 7ULL) & ~7ULL)
 #define VALID64(x) (((x) & 7ULL) == 0ULL)
 
@@ -207,14 +261,46 @@ static inline bool VALID_EPOCH(uint64_t u) {
 #define JOURNAL_HEADER_COMPRESSED_LZ4(h) \
         (!!(le32toh((h)->incompatible_flags) & HEADER_INCOMPATIBLE_COMPRESSED_LZ4))
 
+#define JOURNAL_HEADER_COMPRESSED_ZSTD(h) \
+        (!!(le32toh((h)->incompatible_flags) & HEADER_INCOMPATIBLE_COMPRESSED_ZSTD))
+
+#define JOURNAL_HEADER_COMPACT(h) \
+        (!!(le32toh((h)->incompatible_flags) & HEADER_INCOMPATIBLE_COMPACT))
+
 int journal_file_move_to_object(JournalFile *f, ObjectType type, uint64_t offset, Object **ret);
 
-uint64_t journal_file_entry_n_items(Object *o) _pure_;
-uint64_t journal_file_entry_array_n_items(Object *o) _pure_;
+uint64_t journal_file_entry_n_items(JournalFile *f, Object *o) _pure_;
+uint64_t journal_file_entry_array_n_items(JournalFile *f, Object *o) _pure_;
 uint64_t journal_file_hash_table_n_items(Object *o) _pure_;
 
+static inline size_t journal_file_entry_item_size(JournalFile *f) {
+        assert(f);
+        return f->compact ? sizeof(le32_t) : sizeof(EntryItem);
+}
+
+static inline size_t journal_file_entry_array_item_size(JournalFile *f) {
+        assert(f);
+        return f->compact ? sizeof(le32_t) : sizeof(le64_t);
+}
+
+static inline uint64_t journal_file_entry_item_object_offset(JournalFile *f, Object *o, uint64_t i) {
+        assert(f);
+        assert(o);
+        return f->compact ? le32toh(o->entry.items.compact[i]) : le64toh(o->entry.items.regular[i].object_offset);
+}
+
+static inline uint64_t journal_file_entry_array_item(JournalFile *f, Object *o, uint64_t i) {
+        assert(f);
+        assert(o);
+        return f->compact ? le32toh(o->entry_array.items.compact[i]) : le64toh(o->entry_array.items.regular[i]);
+}
+
 int journal_file_append_object(JournalFile *f, ObjectType type, uint64_t size, Object **ret, uint64_t *offset);
 int journal_file_append_entry(JournalFile *f, const dual_timestamp *ts, const struct iovec iovec[], unsigned n_iovec, uint64_t *seqno, Object **ret, uint64_t *offset);
+int journal_file_append_entries(JournalFile *f, const JournalEntry entries[], unsigned n_entries, uint64_t *seqno, unsigned *n_written);
+
+int journal_precompress(const void *data, uint64_t size, JournalPrecompressed *ret);
+void journal_precompressed_done(JournalPrecompressed *p);
 
 int journal_file_find_data_object(JournalFile *f, const void *data, uint64_t size, Object **ret, uint64_t *offset);
 int journal_file_find_data_object_with_hash(JournalFile *f, const void *data, uint64_t size, uint64_t hash, Object **ret, uint64_t *offset);
@@ -244,6 +330,9 @@ void journal_file_dump(JournalFile *f);
 void journal_file_print_header(JournalFile *f);
 
 int journal_file_rotate(JournalFile **f, bool compress, bool seal, Set *deferred_closes);
+int journal_file_wait_for_dictionary(JournalFile *f);
+
+CompressDictionary* journal_file_compress_dictionary(JournalFile *f);
 
 void journal_file_post_change(JournalFile *f);
 int journal_file_enable_post_change_timer(JournalFile *f, sd_event *e, usec_t t);
@@ -261,5 +350,5 @@ int journal_file_map_field_hash_table(JournalFile *f);
 
 static inline bool JOURNAL_FILE_COMPRESS(JournalFile *f) {
         assert(f);
-        return f->compress_xz || f->compress_lz4;
+        return f->compress_xz || f->compress_lz4 || f->compress_zstd;
 }
@@ -27,14 +27,17 @@
 #include "sd-journal.h"
 
 #include "hashmap.h"
+#include "journal-boot-index.h"
 #include "journal-def.h"
 #include "journal-file.h"
 #include "list.h"
+#include "prioq.h"
 #include "set.h"
 
 typedef struct Match Match;
 typedef struct Location Location;
 typedef struct Directory Directory;
+typedef struct UniqueValue UniqueValue;
 
 typedef enum MatchType {
         MATCH_DISCRETE,
@@ -95,6 +98,14 @@ struct sd_journal {
         JournalFile *current_file;
         uint64_t current_field;
 
+        /* The files that have a candidate entry beyond the current
+         * location, ordered by that entry, so that finding the next
+         * entry doesn't need to look at every file. Live files that
+         * hit their end are kept aside, as they might grow again. */
+        Prioq *files_prioq;
+        direction_t files_prioq_direction;
+        Set *files_at_tail;
+
         Match *level0, *level1, *level2;
 
         pid_t original_pid;
@@ -108,6 +119,13 @@ struct sd_journal {
         JournalFile *unique_file;
         uint64_t unique_offset;
 
+        /* The data values of the unique field seen so far, indexed
+         * by their hash, so that they can be skipped quickly when
+         * they show up again in later files */
+        Hashmap *unique_values;
+        LIST_HEAD(UniqueValue, unique_values_list);
+        UniqueValue *unique_values_tail, *unique_values_next;
+
         /* Iterating through known fields */
         JournalFile *fields_file;
         uint64_t fields_offset;
@@ -124,12 +142,18 @@ struct sd_journal {
                                     removed, and there were no more
                                     files, so sd_j_enumerate_unique
                                     will return a value equal to 0. */
+        bool unique_counted:1;   /* Values are enumerated with their counts */
+        bool unique_values_complete:1;
         bool fields_file_lost:1;
         bool has_runtime_files:1;
         bool has_persistent_files:1;
 
         size_t data_threshold;
 
+        /* Archived files which cannot contain entries in this
+         * realtime range are ignored, see journal_restrict_realtime() */
+        usec_t realtime_since, realtime_until;
+
         Hashmap *directories_by_path;
         Hashmap *directories_by_wd;
 
@@ -138,6 +162,8 @@ struct sd_journal {
 
 char *journal_make_match_string(sd_journal *j);
 void journal_print_header(sd_journal *j);
+void journal_restrict_realtime(sd_journal *j, usec_t since, usec_t until);
+int journal_get_boots(sd_journal *j, JournalBoot **ret, size_t *ret_n);
 
 #define JOURNAL_FOREACH_DATA_RETVAL(j, data, l, retval)                     \
         for (sd_journal_restart_data(j); ((retval) = sd_journal_enumerate_data((j), &(data), &(l))) > 0; )
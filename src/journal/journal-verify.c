@@ -18,6 +18,7 @@
 ***/
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <sys/mman.h>
 #include <unistd.h>
@@ -123,7 +124,7 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
          * possible field values. It does not follow any references to
          * other objects. */
 
-        if ((o->object.flags & OBJECT_COMPRESSED_XZ) &&
+        if ((o->object.flags & OBJECT_COMPRESSION_MASK) &&
             o->object.type != OBJECT_DATA) {
                 error(offset, "Found compressed object that isn't of type DATA, which is not allowed.");
                 return -EBADMSG;
@@ -160,7 +161,8 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                         r = decompress_blob(compression,
                                             o->data.payload,
                                             le64toh(o->object.size) - offsetof(Object, data.payload),
-                                            &b, &alloc, &b_size, 0);
+                                            &b, &alloc, &b_size, 0,
+                                            journal_file_compress_dictionary(f));
                         if (r < 0) {
                                 error(offset, "%s decompression failed: %s",
                                       object_compressed_to_string(compression), strerror(-r));
@@ -211,7 +213,7 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                 break;
 
         case OBJECT_ENTRY:
-                if ((le64toh(o->object.size) - offsetof(EntryObject, items)) % sizeof(EntryItem) != 0) {
+                if ((le64toh(o->object.size) - offsetof(EntryObject, items)) % journal_file_entry_item_size(f) != 0) {
                         error(offset,
                               "Bad entry size (<= %zu): %"PRIu64,
                               offsetof(EntryObject, items),
@@ -219,10 +221,10 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                         return -EBADMSG;
                 }
 
-                if ((le64toh(o->object.size) - offsetof(EntryObject, items)) / sizeof(EntryItem) <= 0) {
+                if (journal_file_entry_n_items(f, o) <= 0) {
                         error(offset,
                               "Invalid number items in entry: %"PRIu64,
-                              (le64toh(o->object.size) - offsetof(EntryObject, items)) / sizeof(EntryItem));
+                              journal_file_entry_n_items(f, o));
                         return -EBADMSG;
                 }
 
@@ -247,13 +249,13 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                         return -EBADMSG;
                 }
 
-                for (i = 0; i < journal_file_entry_n_items(o); i++) {
-                        if (o->entry.items[i].object_offset == 0 ||
-                            !VALID64(o->entry.items[i].object_offset)) {
+                for (i = 0; i < journal_file_entry_n_items(f, o); i++) {
+                        if (journal_file_entry_item_object_offset(f, o, i) == 0 ||
+                            !VALID64(journal_file_entry_item_object_offset(f, o, i))) {
                                 error(offset,
                                       "Invalid entry item (%"PRIu64"/%"PRIu64" offset: "OFSfmt,
-                                      i, journal_file_entry_n_items(o),
-                                      o->entry.items[i].object_offset);
+                                      i, journal_file_entry_n_items(f, o),
+                                      journal_file_entry_item_object_offset(f, o, i));
                                 return -EBADMSG;
                         }
                 }
@@ -306,8 +308,8 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                 break;
 
         case OBJECT_ENTRY_ARRAY:
-                if ((le64toh(o->object.size) - offsetof(EntryArrayObject, items)) % sizeof(le64_t) != 0 ||
-                    (le64toh(o->object.size) - offsetof(EntryArrayObject, items)) / sizeof(le64_t) <= 0) {
+                if ((le64toh(o->object.size) - offsetof(EntryArrayObject, items)) % journal_file_entry_array_item_size(f) != 0 ||
+                    journal_file_entry_array_n_items(f, o) <= 0) {
                         error(offset,
                               "Invalid object entry array size: %"PRIu64,
                               le64toh(o->object.size));
@@ -321,13 +323,13 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                         return -EBADMSG;
                 }
 
-                for (i = 0; i < journal_file_entry_array_n_items(o); i++)
-                        if (le64toh(o->entry_array.items[i]) != 0 &&
-                            !VALID64(le64toh(o->entry_array.items[i]))) {
+                for (i = 0; i < journal_file_entry_array_n_items(f, o); i++)
+                        if (journal_file_entry_array_item(f, o, i) != 0 &&
+                            !VALID64(journal_file_entry_array_item(f, o, i))) {
                                 error(offset,
                                       "Invalid object entry array item (%"PRIu64"/%"PRIu64"): "OFSfmt,
-                                      i, journal_file_entry_array_n_items(o),
-                                      le64toh(o->entry_array.items[i]));
+                                      i, journal_file_entry_array_n_items(f, o),
+                                      journal_file_entry_array_item(f, o, i));
                                 return -EBADMSG;
                         }
 
@@ -348,6 +350,16 @@ static int journal_file_object_verify(JournalFile *f, uint64_t offset, Object *o
                         return -EBADMSG;
                 }
 
+                break;
+
+        case OBJECT_DICTIONARY:
+                if (le64toh(o->object.size) <= offsetof(DictionaryObject, payload)) {
+                        error(offset,
+                              "Invalid object dictionary size: %"PRIu64,
+                              le64toh(o->object.size));
+                        return -EBADMSG;
+                }
+
                 break;
         }
 
@@ -424,9 +436,9 @@ static int entry_points_to_data(
         if (r < 0)
                 return r;
 
-        n = journal_file_entry_n_items(o);
+        n = journal_file_entry_n_items(f, o);
         for (i = 0; i < n; i++)
-                if (le64toh(o->entry.items[i].object_offset) == data_p) {
+                if (journal_file_entry_item_object_offset(f, o, i) == data_p) {
                         found = true;
                         break;
                 }
@@ -451,10 +463,10 @@ static int entry_points_to_data(
                 if (r < 0)
                         return r;
 
-                m = journal_file_entry_array_n_items(o);
+                m = journal_file_entry_array_n_items(f, o);
                 u = MIN(n - i, m);
 
-                if (entry_p <= le64toh(o->entry_array.items[u-1])) {
+                if (entry_p <= journal_file_entry_array_item(f, o, u-1)) {
                         uint64_t x, y, z;
 
                         x = 0;
@@ -463,13 +475,13 @@ static int entry_points_to_data(
                         while (x < y) {
                                 z = (x + y) / 2;
 
-                                if (le64toh(o->entry_array.items[z]) == entry_p)
+                                if (journal_file_entry_array_item(f, o, z) == entry_p)
                                         return 0;
 
                                 if (x + 1 >= y)
                                         break;
 
-                                if (entry_p < le64toh(o->entry_array.items[z]))
+                                if (entry_p < journal_file_entry_array_item(f, o, z))
                                         y = z;
                                 else
                                         x = z;
@@ -544,10 +556,10 @@ static int verify_data(
                         return -EBADMSG;
                 }
 
-                m = journal_file_entry_array_n_items(o);
+                m = journal_file_entry_array_n_items(f, o);
                 for (j = 0; i < n && j < m; i++, j++) {
 
-                        q = le64toh(o->entry_array.items[j]);
+                        q = journal_file_entry_array_item(f, o, j);
                         if (q <= last) {
                                 error(p, "Data object's entry array not sorted");
                                 return -EBADMSG;
@@ -687,13 +699,15 @@ static int verify_entry(
         assert(o);
         assert(data_fd >= 0);
 
-        n = journal_file_entry_n_items(o);
+        n = journal_file_entry_n_items(f, o);
         for (i = 0; i < n; i++) {
                 uint64_t q, h;
                 Object *u;
 
-                q = le64toh(o->entry.items[i].object_offset);
-                h = le64toh(o->entry.items[i].hash);
+                q = journal_file_entry_item_object_offset(f, o, i);
+
+                /* Compact files don't store the hash in the entry */
+                h = f->compact ? 0 : le64toh(o->entry.items.regular[i].hash);
 
                 if (!contains_uint64(f->mmap, data_fd, n_data, q)) {
                         error(p, "Invalid data object of entry");
@@ -704,7 +718,9 @@ static int verify_entry(
                 if (r < 0)
                         return r;
 
-                if (le64toh(u->data.hash) != h) {
+                if (f->compact)
+                        h = le64toh(u->data.hash);
+                else if (le64toh(u->data.hash) != h) {
                         error(p, "Hash mismatch for data object of entry");
                         return -EBADMSG;
                 }
@@ -767,11 +783,11 @@ static int verify_entry_array(
                         return -EBADMSG;
                 }
 
-                m = journal_file_entry_array_n_items(o);
+                m = journal_file_entry_array_n_items(f, o);
                 for (j = 0; i < n && j < m; i++, j++) {
                         uint64_t p;
 
-                        p = le64toh(o->entry_array.items[j]);
+                        p = journal_file_entry_array_item(f, o, j);
                         if (p <= last) {
                                 error(a, "Entry array not sorted at %"PRIu64" of %"PRIu64, i, n);
                                 return -EBADMSG;
@@ -803,6 +819,102 @@ static int verify_entry_array(
         return 0;
 }
 
+typedef struct HashTableWork {
+        JournalFile *f;
+        int data_fd, entry_fd, entry_array_fd;
+        uint64_t n_data, n_entries, n_entry_arrays;
+        int r;
+} HashTableWork;
+
+static void* verify_hash_table_thread(void *p) {
+        HashTableWork *w = p;
+        usec_t last_usec = 0;
+
+        w->r = verify_hash_table(w->f,
+                                 w->data_fd, w->n_data,
+                                 w->entry_fd, w->n_entries,
+                                 w->entry_array_fd, w->n_entry_arrays,
+                                 &last_usec,
+                                 false);
+
+        mmap_cache_close_fd(w->f->mmap, w->data_fd);
+        mmap_cache_close_fd(w->f->mmap, w->entry_fd);
+        mmap_cache_close_fd(w->f->mmap, w->entry_array_fd);
+
+        return NULL;
+}
+
+static int verify_references(
+                JournalFile *f,
+                int data_fd, uint64_t n_data,
+                int entry_fd, uint64_t n_entries,
+                int entry_array_fd, uint64_t n_entry_arrays,
+                usec_t *last_usec,
+                bool show_progress) {
+
+        HashTableWork w = {
+                .data_fd = data_fd,
+                .entry_fd = entry_fd,
+                .entry_array_fd = entry_array_fd,
+                .n_data = n_data,
+                .n_entries = n_entries,
+                .n_entry_arrays = n_entry_arrays,
+        };
+        pthread_t t;
+        int r;
+
+        assert(f);
+
+        /* The walk along the entry array and the walk along the data
+         * hash table only read the file and the offset lists collected
+         * by the object scan, hence they can run in parallel. The
+         * mmap cache is not thread-safe however, so the hash table is
+         * checked through a second, read-only instance of the file,
+         * with a cache of its own. A file that is still being written
+         * to might change under our feet, and we'd see two different
+         * versions of it, so we only do this for files that are
+         * offline. If anything goes wrong setting this up, we simply
+         * do both walks one after the other. */
+
+        if (!f->writable && f->header->state != STATE_ONLINE &&
+            journal_file_open_duplicate(f, &w.f) >= 0) {
+
+                r = pthread_create(&t, NULL, verify_hash_table_thread, &w);
+                if (r == 0) {
+                        r = verify_entry_array(f,
+                                               data_fd, n_data,
+                                               entry_fd, n_entries,
+                                               entry_array_fd, n_entry_arrays,
+                                               last_usec,
+                                               show_progress);
+
+                        assert_se(pthread_join(t, NULL) == 0);
+                        journal_file_close(w.f);
+
+                        return r < 0 ? r : w.r;
+                }
+
+                log_debug_errno(r, "Failed to start hash table verification thread, verifying sequentially: %m");
+                journal_file_close(w.f);
+        }
+
+        r = verify_entry_array(f,
+                               data_fd, n_data,
+                               entry_fd, n_entries,
+                               entry_array_fd, n_entry_arrays,
+                               last_usec,
+                               show_progress);
+        if (r < 0)
+                return r;
+
+        return verify_hash_table(f,
+                                 data_fd, n_data,
+                                 entry_fd, n_entries,
+                                 entry_array_fd, n_entry_arrays,
+                                 last_usec,
+                                 show_progress);
+}
+
 int journal_file_verify(
                 JournalFile *f,
                 const char *key,
@@ -902,8 +1014,8 @@ int journal_file_verify(
                         goto fail;
                 }
 
-                if ((o->object.flags & OBJECT_COMPRESSED_XZ) &&
-                    (o->object.flags & OBJECT_COMPRESSED_LZ4)) {
+                if (!IN_SET(o->object.flags & OBJECT_COMPRESSION_MASK,
+                            0, OBJECT_COMPRESSED_XZ, OBJECT_COMPRESSED_LZ4, OBJECT_COMPRESSED_ZSTD)) {
                         error(p, "Objected with double compression");
                         r = -EINVAL;
                         goto fail;
@@ -921,6 +1033,12 @@ int journal_file_verify(
                         goto fail;
                 }
 
+                if ((o->object.flags & OBJECT_COMPRESSED_ZSTD) && !JOURNAL_HEADER_COMPRESSED_ZSTD(f->header)) {
+                        error(p, "ZSTD compressed object in file without ZSTD compression");
+                        r = -EBADMSG;
+                        goto fail;
+                }
+
                 switch (o->object.type) {
 
                 case OBJECT_DATA:
@@ -1134,6 +1252,16 @@ int journal_file_verify(
                         n_tags++;
                         break;
 
+                case OBJECT_DICTIONARY:
+                        if (!JOURNAL_HEADER_CONTAINS(f->header, dictionary_offset) ||
+                            le64toh(f->header->dictionary_offset) != p) {
+                                error(p, "Dictionary object not referenced by header");
+                                r = -EBADMSG;
+                                goto fail;
+                        }
+
+                        break;
+
                 default:
                         n_weird++;
                 }
@@ -1227,16 +1355,7 @@ int journal_file_verify(
          * unreferenced objects. We only care that everything that is
          * referenced is consistent. */
 
-        r = verify_entry_array(f,
-                               data_fd, n_data,
-                               entry_fd, n_entries,
-                               entry_array_fd, n_entry_arrays,
-                               &last_usec,
-                               show_progress);
-        if (r < 0)
-                goto fail;
-
-        r = verify_hash_table(f,
+        r = verify_references(f,
                               data_fd, n_data,
                               entry_fd, n_entries,
                               entry_array_fd, n_entry_arrays,
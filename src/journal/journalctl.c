@@ -24,6 +24,7 @@
 #include <linux/fs.h>
 #include <locale.h>
 #include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -142,13 +143,6 @@ static enum {
         ACTION_LIST_FIELD_NAMES,
 } arg_action = ACTION_SHOW;
 
-typedef struct BootId {
-        sd_id128_t id;
-        uint64_t first;
-        uint64_t last;
-        LIST_FIELDS(struct BootId, boot_list);
-} BootId;
-
 static int add_matches_for_device(sd_journal *j, const char *devpath) {
         int r;
         _cleanup_udev_unref_ struct udev *udev = NULL;
@@ -1000,252 +994,77 @@ static int add_matches(sd_journal *j, char **args) {
         return 0;
 }
 
-static void boot_id_free_all(BootId *l) {
-
-        while (l) {
-                BootId *i = l;
-                LIST_REMOVE(boot_list, l, i);
-                free(i);
-        }
-}
-
-static int discover_next_boot(sd_journal *j,
-                sd_id128_t previous_boot_id,
-                bool advance_older,
-                BootId **ret) {
-
-        _cleanup_free_ BootId *next_boot = NULL;
-        char match[9+32+1] = "_BOOT_ID=";
-        sd_id128_t boot_id;
-        int r;
+static int list_boots(sd_journal *j) {
+        _cleanup_free_ JournalBoot *boots = NULL;
+        size_t n_boots, i;
+        int w, r;
 
         assert(j);
-        assert(ret);
-
-        /* We expect the journal to be on the last position of a boot
-         * (in relation to the direction we are going), so that the next
-         * invocation of sd_journal_next/previous will be from a different
-         * boot. We then collect any information we desire and then jump
-         * to the last location of the new boot by using a _BOOT_ID match
-         * coming from the other journal direction. */
-
-        /* Make sure we aren't restricted by any _BOOT_ID matches, so that
-         * we can actually advance to a *different* boot. */
-        sd_journal_flush_matches(j);
-
-        do {
-                if (advance_older)
-                        r = sd_journal_previous(j);
-                else
-                        r = sd_journal_next(j);
-                if (r < 0)
-                        return r;
-                else if (r == 0)
-                        return 0; /* End of journal, yay. */
-
-                r = sd_journal_get_monotonic_usec(j, NULL, &boot_id);
-                if (r < 0)
-                        return r;
 
-                /* We iterate through this in a loop, until the boot ID differs from the previous one. Note that
-                 * normally, this will only require a single iteration, as we seeked to the last entry of the previous
-                 * boot entry already. However, it might happen that the per-journal-field entry arrays are less
-                 * complete than the main entry array, and hence might reference an entry that's not actually the last
-                 * one of the boot ID as last one. Let's hence use the per-field array is initial seek position to
-                 * speed things up, but let's not trust that it is complete, and hence, manually advance as
-                 * necessary. */
-
-        } while (sd_id128_equal(boot_id, previous_boot_id));
-
-        next_boot = new0(BootId, 1);
-        if (!next_boot)
-                return -ENOMEM;
-
-        next_boot->id = boot_id;
-
-        r = sd_journal_get_realtime_usec(j, &next_boot->first);
+        r = journal_get_boots(j, &boots, &n_boots);
         if (r < 0)
-                return r;
-
-        /* Now seek to the last occurrence of this boot ID. */
-        sd_id128_to_string(next_boot->id, match + 9);
-        r = sd_journal_add_match(j, match, sizeof(match) - 1);
-        if (r < 0)
-                return r;
+                return log_error_errno(r, "Failed to determine boots: %m");
+        if (n_boots == 0)
+                return 0;
 
-        if (advance_older)
-                r = sd_journal_seek_head(j);
-        else
-                r = sd_journal_seek_tail(j);
-        if (r < 0)
-                return r;
+        pager_open(arg_no_pager, arg_pager_end);
 
-        if (advance_older)
-                r = sd_journal_next(j);
-        else
-                r = sd_journal_previous(j);
-        if (r < 0)
-                return r;
-        else if (r == 0)
-                return -ENODATA; /* This shouldn't happen. We just came from this very boot ID. */
+        /* numbers are one less, but we need an extra char for the sign */
+        w = DECIMAL_STR_WIDTH(n_boots - 1) + 1;
 
-        r = sd_journal_get_realtime_usec(j, &next_boot->last);
-        if (r < 0)
-                return r;
+        for (i = 0; i < n_boots; i++) {
+                char a[FORMAT_TIMESTAMP_MAX], b[FORMAT_TIMESTAMP_MAX];
 
-        *ret = next_boot;
-        next_boot = NULL;
+                printf("% *i " SD_ID128_FORMAT_STR " %s—%s\n",
+                       w, (int) i - (int) n_boots + 1,
+                       SD_ID128_FORMAT_VAL(boots[i].id),
+                       format_timestamp_maybe_utc(a, sizeof(a), boots[i].first_realtime),
+                       format_timestamp_maybe_utc(b, sizeof(b), boots[i].last_realtime));
+        }
 
         return 0;
 }
 
-static int get_boots(
-                sd_journal *j,
-                BootId **boots,
-                sd_id128_t *query_ref_boot,
-                int ref_boot_offset) {
-
-        bool skip_once;
-        int r, count = 0;
-        BootId *head = NULL, *tail = NULL;
-        const bool advance_older = query_ref_boot && ref_boot_offset <= 0;
-        sd_id128_t previous_boot_id;
+static int find_boot(sd_journal *j, sd_id128_t ref_boot_id, int offset, sd_id128_t *ret) {
+        _cleanup_free_ JournalBoot *boots = NULL;
+        size_t n_boots, k;
+        int r;
 
         assert(j);
+        assert(ret);
 
-        /* Adjust for the asymmetry that offset 0 is
-         * the last (and current) boot, while 1 is considered the
-         * (chronological) first boot in the journal. */
-        skip_once = query_ref_boot && sd_id128_is_null(*query_ref_boot) && ref_boot_offset < 0;
-
-        /* Advance to the earliest/latest occurrence of our reference
-         * boot ID (taking our lookup direction into account), so that
-         * discover_next_boot() can do its job.
-         * If no reference is given, the journal head/tail will do,
-         * they're "virtual" boots after all. */
-        if (query_ref_boot && !sd_id128_is_null(*query_ref_boot)) {
-                char match[9+32+1] = "_BOOT_ID=";
-
-                sd_journal_flush_matches(j);
-
-                sd_id128_to_string(*query_ref_boot, match + 9);
-                r = sd_journal_add_match(j, match, sizeof(match) - 1);
-                if (r < 0)
-                        return r;
-
-                if (advance_older)
-                        r = sd_journal_seek_head(j); /* seek to oldest */
-                else
-                        r = sd_journal_seek_tail(j); /* seek to newest */
-                if (r < 0)
-                        return r;
+        r = journal_get_boots(j, &boots, &n_boots);
+        if (r < 0)
+                return r;
 
-                if (advance_older)
-                        r = sd_journal_next(j);     /* read the oldest entry */
+        if (sd_id128_is_null(ref_boot_id)) {
+                /* Offset 0 is the last (and current) boot, while 1
+                 * is considered the (chronological) first boot in the
+                 * journal. */
+                if (offset > 0)
+                        k = offset - 1;
+                else if ((size_t) -offset < n_boots)
+                        k = n_boots - 1 + offset;
                 else
-                        r = sd_journal_previous(j); /* read the most recently added entry */
-                if (r < 0)
-                        return r;
-                else if (r == 0)
-                        goto finish;
-                else if (ref_boot_offset == 0) {
-                        count = 1;
-                        goto finish;
-                }
-
-                /* At this point the read pointer is positioned at the oldest/newest occurence of the reference boot
-                 * ID. After flushing the matches, one more invocation of _previous()/_next() will hence place us at
-                 * the following entry, which must then have an older/newer boot ID */
+                        return 0;
         } else {
-
-                if (advance_older)
-                        r = sd_journal_seek_tail(j); /* seek to newest */
-                else
-                        r = sd_journal_seek_head(j); /* seek to oldest */
-                if (r < 0)
-                        return r;
-
-                /* No sd_journal_next()/_previous() here.
-                 *
-                 * At this point the read pointer is positioned after the newest/before the oldest entry in the whole
-                 * journal. The next invocation of _previous()/_next() will hence position us at the newest/oldest
-                 * entry we have. */
-        }
-
-        previous_boot_id = SD_ID128_NULL;
-        for (;;) {
-                _cleanup_free_ BootId *current = NULL;
-
-                r = discover_next_boot(j, previous_boot_id, advance_older, &current);
-                if (r < 0) {
-                        boot_id_free_all(head);
-                        return r;
-                }
-
-                if (!current)
-                        break;
-
-                previous_boot_id = current->id;
-
-                if (query_ref_boot) {
-                        if (!skip_once)
-                                ref_boot_offset += advance_older ? 1 : -1;
-                        skip_once = false;
-
-                        if (ref_boot_offset == 0) {
-                                count = 1;
-                                *query_ref_boot = current->id;
+                for (k = 0; k < n_boots; k++)
+                        if (sd_id128_equal(boots[k].id, ref_boot_id))
                                 break;
-                        }
-                } else {
-                        LIST_INSERT_AFTER(boot_list, head, tail, current);
-                        tail = current;
-                        current = NULL;
-                        count++;
-                }
-        }
-
-finish:
-        if (boots)
-                *boots = head;
-
-        sd_journal_flush_matches(j);
-
-        return count;
-}
-
-static int list_boots(sd_journal *j) {
-        int w, i, count;
-        BootId *id, *all_ids;
-
-        assert(j);
-
-        count = get_boots(j, &all_ids, NULL, 0);
-        if (count < 0)
-                return log_error_errno(count, "Failed to determine boots: %m");
-        if (count == 0)
-                return count;
-
-        pager_open(arg_no_pager, arg_pager_end);
-
-        /* numbers are one less, but we need an extra char for the sign */
-        w = DECIMAL_STR_WIDTH(count - 1) + 1;
+                if (k >= n_boots)
+                        return 0;
 
-        i = 0;
-        LIST_FOREACH(boot_list, id, all_ids) {
-                char a[FORMAT_TIMESTAMP_MAX], b[FORMAT_TIMESTAMP_MAX];
+                if (offset < 0 && (size_t) -offset > k)
+                        return 0;
 
-                printf("% *i " SD_ID128_FORMAT_STR " %s—%s\n",
-                       w, i - count + 1,
-                       SD_ID128_FORMAT_VAL(id->id),
-                       format_timestamp_maybe_utc(a, sizeof(a), id->first),
-                       format_timestamp_maybe_utc(b, sizeof(b), id->last));
-                i++;
+                k += offset;
         }
 
-        boot_id_free_all(all_ids);
+        if (k >= n_boots)
+                return 0;
 
-        return 0;
+        *ret = boots[k].id;
+        return 1;
 }
 
 static int add_boot(sd_journal *j) {
@@ -1261,9 +1080,7 @@ static int add_boot(sd_journal *j) {
         if (arg_boot_offset == 0 && sd_id128_equal(arg_boot_id, SD_ID128_NULL))
                 return add_match_this_boot(j, arg_machine);
 
-        ref_boot_id = arg_boot_id;
-        r = get_boots(j, NULL, &ref_boot_id, arg_boot_offset);
-        assert(r <= 1);
+        r = find_boot(j, arg_boot_id, arg_boot_offset, &ref_boot_id);
         if (r <= 0) {
                 const char *reason = (r == 0) ? "No such boot ID in journal" : strerror(-r);
 
@@ -1728,50 +1545,161 @@ finish:
 #endif
 }
 
+typedef struct VerifyJob {
+        JournalFile *f;
+        usec_t first, validated, last;
+        int r;
+} VerifyJob;
+
+typedef struct VerifyPool {
+        pthread_mutex_t mutex;
+        VerifyJob *jobs;
+        size_t n_jobs, next;
+        bool invalid_key;
+} VerifyPool;
+
+#define VERIFY_THREADS_MAX 16
+
+static void *verify_thread(void *p) {
+        VerifyPool *pool = p;
+
+        for (;;) {
+                JournalFile *copy;
+                VerifyJob *job;
+
+                assert_se(pthread_mutex_lock(&pool->mutex) == 0);
+                if (pool->invalid_key || pool->next >= pool->n_jobs) {
+                        assert_se(pthread_mutex_unlock(&pool->mutex) == 0);
+                        return NULL;
+                }
+                job = pool->jobs + pool->next++;
+                assert_se(pthread_mutex_unlock(&pool->mutex) == 0);
+
+                /* The mmap cache of the sd_journal object is not
+                 * thread-safe, hence verify through a private
+                 * instance of the file. */
+                job->r = journal_file_open_duplicate(job->f, &copy);
+                if (job->r < 0)
+                        continue;
+
+                job->r = journal_file_verify(copy, arg_verify_key, &job->first, &job->validated, &job->last, false);
+                journal_file_close(copy);
+
+                if (job->r == -EINVAL) {
+                        assert_se(pthread_mutex_lock(&pool->mutex) == 0);
+                        pool->invalid_key = true;
+                        assert_se(pthread_mutex_unlock(&pool->mutex) == 0);
+                }
+        }
+}
+
 static int verify(sd_journal *j) {
-        int r = 0;
+        _cleanup_free_ VerifyJob *jobs = NULL;
+        pthread_t threads[VERIFY_THREADS_MAX];
+        VerifyPool pool = {
+                .mutex = PTHREAD_MUTEX_INITIALIZER,
+        };
+        char a[FORMAT_TIMESTAMP_MAX], b[FORMAT_TIMESTAMP_MAX], c[FORMAT_TIMESPAN_MAX];
+        unsigned n_threads = 0, u;
+        uint64_t total = 0;
+        usec_t start;
+        long ncpus;
+        size_t n = 0, k;
         Iterator i;
         JournalFile *f;
+        int r = 0;
 
         assert(j);
 
         log_show_color(true);
 
+        jobs = new0(VerifyJob, ordered_hashmap_size(j->files));
+        if (!jobs)
+                return log_oom();
+
         ORDERED_HASHMAP_FOREACH(f, j->files, i) {
-                int k;
-                usec_t first = 0, validated = 0, last = 0;
+                jobs[n++].f = f;
+                total += f->last_stat.st_size;
+        }
+
+        start = now(CLOCK_MONOTONIC);
+
+        /* Files are verified independently of each other, so spread
+         * them over one thread per CPU. With a single CPU or a single
+         * file, verify in-line, so that we can show progress. */
+        ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (ncpus > 1 && n > 1) {
+                unsigned m;
+
+                m = MIN((unsigned) MIN(ncpus, VERIFY_THREADS_MAX), (unsigned) n);
+
+                pool.jobs = jobs;
+                pool.n_jobs = n;
+
+                for (n_threads = 0; n_threads < m; n_threads++) {
+                        r = pthread_create(threads + n_threads, NULL, verify_thread, &pool);
+                        if (r != 0) {
+                                log_debug_errno(r, "Failed to start verification thread: %m");
+                                break;
+                        }
+                }
+
+                r = 0;
+
+                /* If we couldn't start any threads, the jobs will be
+                 * run in-line below. */
+                for (u = 0; u < n_threads; u++)
+                        assert_se(pthread_join(threads[u], NULL) == 0);
+        }
+
+        for (k = 0; k < n; k++) {
+                VerifyJob *job = jobs + k;
 
 #ifdef HAVE_GCRYPT
-                if (!arg_verify_key && JOURNAL_HEADER_SEALED(f->header))
-                        log_notice("Journal file %s has sealing enabled but verification key has not been passed using --verify-key=.", f->path);
+                if (!arg_verify_key && JOURNAL_HEADER_SEALED(job->f->header))
+                        log_notice("Journal file %s has sealing enabled but verification key has not been passed using --verify-key=.", job->f->path);
 #endif
 
-                k = journal_file_verify(f, arg_verify_key, &first, &validated, &last, true);
-                if (k == -EINVAL) {
+                if (n_threads == 0)
+                        job->r = journal_file_verify(job->f, arg_verify_key, &job->first, &job->validated, &job->last, true);
+
+                if (job->r == -EINVAL) {
                         /* If the key was invalid give up right-away. */
-                        return k;
-                } else if (k < 0) {
-                        log_warning_errno(k, "FAIL: %s (%m)", f->path);
-                        r = k;
+                        return job->r;
+                } else if (job->r < 0) {
+                        log_warning_errno(job->r, "FAIL: %s (%m)", job->f->path);
+                        r = job->r;
                 } else {
-                        char a[FORMAT_TIMESTAMP_MAX], b[FORMAT_TIMESTAMP_MAX], c[FORMAT_TIMESPAN_MAX];
-                        log_info("PASS: %s", f->path);
+                        log_info("PASS: %s", job->f->path);
 
-                        if (arg_verify_key && JOURNAL_HEADER_SEALED(f->header)) {
-                                if (validated > 0) {
+                        if (arg_verify_key && JOURNAL_HEADER_SEALED(job->f->header)) {
+                                if (job->validated > 0) {
                                         log_info("=> Validated from %s to %s, final %s entries not sealed.",
-                                                 format_timestamp_maybe_utc(a, sizeof(a), first),
-                                                 format_timestamp_maybe_utc(b, sizeof(b), validated),
-                                                 format_timespan(c, sizeof(c), last > validated ? last - validated : 0, 0));
-                                } else if (last > 0)
+                                                 format_timestamp_maybe_utc(a, sizeof(a), job->first),
+                                                 format_timestamp_maybe_utc(b, sizeof(b), job->validated),
+                                                 format_timespan(c, sizeof(c), job->last > job->validated ? job->last - job->validated : 0, 0));
+                                } else if (job->last > 0)
                                         log_info("=> No sealing yet, %s of entries not sealed.",
-                                                 format_timespan(c, sizeof(c), last - first, 0));
+                                                 format_timespan(c, sizeof(c), job->last - job->first, 0));
                                 else
                                         log_info("=> No sealing yet, no entries in file.");
                         }
                 }
         }
 
+        if (n > 0) {
+                char s[FORMAT_BYTES_MAX];
+                usec_t t;
+
+                t = now(CLOCK_MONOTONIC) - start;
+
+                log_info("Verified %zu files (%s) in %s, %.1f MB/s.",
+                         n,
+                         format_bytes(s, sizeof(s), total),
+                         format_timespan(c, sizeof(c), t, USEC_PER_MSEC),
+                         t > 0 ? (double) total / t : 0.0);
+        }
+
         return r;
 }
 
@@ -2386,6 +2314,10 @@ int main(int argc, char *argv[]) {
                 }
         }
 
+        /* Don't bother with archived files outside of the range we show */
+        if (arg_since_set || arg_until_set)
+                journal_restrict_realtime(j, arg_since_set ? arg_since : 0, arg_until_set ? arg_until : USEC_INFINITY);
+
         if (arg_cursor || arg_after_cursor) {
                 r = sd_journal_seek_cursor(j, arg_cursor ?: arg_after_cursor);
                 if (r < 0) {
@@ -0,0 +1,523 @@
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "alloc-util.h"
+#include "fd-util.h"
+#include "io-util.h"
+#include "journal-file.h"
+#include "journald-compress.h"
+#include "list.h"
+#include "log.h"
+
+/* Compressing a large payload, such as a stack trace or a core dump,
+ * can take a while, and while we do that we don't read from any of
+ * our sockets. Hence, entries that contain large fields are handed
+ * to a small pool of worker threads which calculate the hash and the
+ * compressed form of these fields with journal_precompress(). The
+ * entry is then written from the main thread once that's done.
+ *
+ * Entries are written in the order they were received in: as long as
+ * there's an entry queued, all following entries are queued behind
+ * it, even if they have nothing that needs compressing. The queue is
+ * bounded, and when it is full we wait for the oldest entry, which
+ * means we stop reading from the sockets until the workers caught
+ * up.
+ *
+ * The same queue is used to write the entries from one batch of
+ * datagrams or one read from a stream together: between
+ * compress_queue_batch_begin() and compress_queue_batch_end() all
+ * entries are queued, and consecutive ones that are ready are then
+ * written with a single server_write_entries() call. */
+
+/* Fields this large are compressed in a worker thread */
+#define COMPRESS_OFFLOAD_SIZE_MIN (16U*1024U)
+
+/* Limits on what may be queued, before we wait for the workers */
+#define COMPRESS_QUEUE_ENTRIES_MAX 1024U
+#define COMPRESS_QUEUE_BYTES_MAX (64U*1024U*1024U)
+
+#define COMPRESS_THREADS_MAX 4U
+
+/* How many ready entries to write out at once */
+#define COMPRESS_WRITE_BATCH_MAX 64U
+
+typedef struct PendingEntry PendingEntry;
+
+struct PendingEntry {
+        uid_t uid;
+        int priority;
+        dual_timestamp ts;
+
+        struct iovec *iovec;
+        JournalPrecompressed *precompressed;
+        unsigned n_iovec;
+        size_t size;
+
+        /* Protected by the mutex */
+        bool done;
+
+        /* Only accessed by the main thread */
+        LIST_FIELDS(PendingEntry, queue);
+
+        /* Protected by the mutex */
+        LIST_FIELDS(PendingEntry, jobs);
+};
+
+struct CompressQueue {
+        pthread_mutex_t mutex;
+        pthread_cond_t work_cond;
+        pthread_cond_t done_cond;
+
+        pthread_t threads[COMPRESS_THREADS_MAX];
+        unsigned n_threads;
+
+        /* Protected by the mutex */
+        LIST_HEAD(PendingEntry, jobs);
+        PendingEntry *jobs_tail;
+        bool shutdown;
+
+        /* Only accessed by the main thread */
+        LIST_HEAD(PendingEntry, queue);
+        PendingEntry *queue_tail;
+        unsigned n_queued;
+        size_t queued_size;
+
+        int notify_fd;
+        sd_event_source *notify_event_source;
+};
+
+static PendingEntry* pending_entry_free(PendingEntry *e) {
+        unsigned i;
+
+        if (!e)
+                return NULL;
+
+        if (e->precompressed)
+                for (i = 0; i < e->n_iovec; i++)
+                        journal_precompressed_done(e->precompressed + i);
+
+        free(e->precompressed);
+        free(e->iovec);
+
+        return mfree(e);
+}
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(PendingEntry*, pending_entry_free);
+
+static int pending_entry_new(uid_t uid, const struct iovec *iovec, unsigned n, int priority, bool needs_work, PendingEntry **ret) {
+        _cleanup_(pending_entry_freep) PendingEntry *e = NULL;
+        size_t size;
+        uint8_t *p;
+        unsigned i;
+
+        assert(iovec || n == 0);
+        assert(ret);
+
+        size = IOVEC_TOTAL_SIZE(iovec, n);
+
+        e = new0(PendingEntry, 1);
+        if (!e)
+                return -ENOMEM;
+
+        e->uid = uid;
+        e->priority = priority;
+        e->size = size;
+        dual_timestamp_get(&e->ts);
+
+        if (needs_work) {
+                e->precompressed = new0(JournalPrecompressed, n);
+                if (!e->precompressed)
+                        return -ENOMEM;
+        }
+
+        /* The iovec array and a copy of all the data it points to,
+         * as the caller's buffers are reused for the next message */
+        e->iovec = malloc(sizeof(struct iovec) * n + size);
+        if (!e->iovec)
+                return -ENOMEM;
+
+        e->n_iovec = n;
+
+        p = (uint8_t*) (e->iovec + n);
+        for (i = 0; i < n; i++) {
+                e->iovec[i].iov_base = p;
+                e->iovec[i].iov_len = iovec[i].iov_len;
+                p = mempcpy(p, iovec[i].iov_base, iovec[i].iov_len);
+        }
+
+        *ret = e;
+        e = NULL;
+
+        return 0;
+}
+
+static bool pending_entry_needs_work(const struct iovec *iovec, unsigned n) {
+        unsigned i;
+
+        for (i = 0; i < n; i++)
+                if (iovec[i].iov_len >= COMPRESS_OFFLOAD_SIZE_MIN)
+                        return true;
+
+        return false;
+}
+
+static void* compress_thread(void *userdata) {
+        CompressQueue *q = userdata;
+
+        assert(q);
+
+        assert_se(pthread_mutex_lock(&q->mutex) == 0);
+
+        for (;;) {
+                PendingEntry *e;
+                unsigned i;
+
+                while (!q->jobs && !q->shutdown)
+                        assert_se(pthread_cond_wait(&q->work_cond, &q->mutex) == 0);
+
+                if (!q->jobs)
+                        break;
+
+                /* Take the oldest job, new ones are prepended */
+                e = q->jobs_tail;
+                q->jobs_tail = e->jobs_prev;
+                LIST_REMOVE(jobs, q->jobs, e);
+
+                assert_se(pthread_mutex_unlock(&q->mutex) == 0);
+
+                /* If this fails the entry is simply compressed
+                 * inline, later on */
+                for (i = 0; i < e->n_iovec; i++)
+                        if (e->iovec[i].iov_len >= COMPRESS_OFFLOAD_SIZE_MIN)
+                                (void) journal_precompress(e->iovec[i].iov_base, e->iovec[i].iov_len, e->precompressed + i);
+
+                assert_se(pthread_mutex_lock(&q->mutex) == 0);
+
+                e->done = true;
+                assert_se(pthread_cond_broadcast(&q->done_cond) == 0);
+
+                (void) eventfd_write(q->notify_fd, 1);
+        }
+
+        assert_se(pthread_mutex_unlock(&q->mutex) == 0);
+
+        return NULL;
+}
+
+static void compress_queue_dispatch(Server *s, bool wait_all) {
+        CompressQueue *q;
+
+        assert(s);
+
+        q = s->compress_queue;
+        if (!q)
+                return;
+
+        /* Writes out queued entries in order, as long as they are
+         * ready, or all of them if wait_all is true. Consecutive
+         * entries of the same user are written as one batch. Note
+         * that writing an entry might queue another one, e.g. if it
+         * caused a rotation that we log about. */
+
+        while (q->queue) {
+                PendingEntry *batch[COMPRESS_WRITE_BATCH_MAX], *e;
+                JournalEntry entries[COMPRESS_WRITE_BATCH_MAX];
+                int priority = LOG_DEBUG;
+                unsigned n = 0, i;
+
+                assert_se(pthread_mutex_lock(&q->mutex) == 0);
+                while (wait_all && !q->queue->done)
+                        assert_se(pthread_cond_wait(&q->done_cond, &q->mutex) == 0);
+                for (e = q->queue; e && e->done && e->uid == q->queue->uid && n < COMPRESS_WRITE_BATCH_MAX; e = e->queue_next)
+                        batch[n++] = e;
+                assert_se(pthread_mutex_unlock(&q->mutex) == 0);
+
+                if (n == 0)
+                        break;
+
+                for (i = 0; i < n; i++) {
+                        e = batch[i];
+
+                        LIST_REMOVE(queue, q->queue, e);
+                        if (q->queue_tail == e)
+                                q->queue_tail = NULL;
+                        q->n_queued--;
+                        q->queued_size -= e->size;
+
+                        entries[i] = (JournalEntry) {
+                                .ts = &e->ts,
+                                .iovec = e->iovec,
+                                .n_iovec = e->n_iovec,
+                                .precompressed = e->precompressed,
+                        };
+
+                        priority = MIN(priority, e->priority);
+                }
+
+                server_write_entries(s, batch[0]->uid, entries, n, priority);
+
+                for (i = 0; i < n; i++)
+                        pending_entry_free(batch[i]);
+        }
+}
+
+static void compress_queue_wait_head(Server *s) {
+        CompressQueue *q;
+        PendingEntry *e;
+
+        assert(s);
+
+        q = s->compress_queue;
+        if (!q || !q->queue)
+                return;
+
+        e = q->queue;
+
+        assert_se(pthread_mutex_lock(&q->mutex) == 0);
+        while (!e->done)
+                assert_se(pthread_cond_wait(&q->done_cond, &q->mutex) == 0);
+        assert_se(pthread_mutex_unlock(&q->mutex) == 0);
+
+        compress_queue_dispatch(s, false);
+}
+
+static int dispatch_compress_notify(sd_event_source *es, int fd, uint32_t revents, void *userdata) {
+        Server *s = userdata;
+        eventfd_t v;
+
+        assert(s);
+
+        (void) eventfd_read(fd, &v);
+
+        compress_queue_dispatch(s, false);
+        return 0;
+}
+
+static int compress_queue_new(Server *s) {
+        CompressQueue *q;
+        int r;
+
+        assert(s);
+
+        if (s->compress_queue)
+                return 0;
+
+        q = new0(CompressQueue, 1);
+        if (!q)
+                return -ENOMEM;
+
+        assert_se(pthread_mutex_init(&q->mutex, NULL) == 0);
+        assert_se(pthread_cond_init(&q->work_cond, NULL) == 0);
+        assert_se(pthread_cond_init(&q->done_cond, NULL) == 0);
+        q->notify_fd = -1;
+
+        s->compress_queue = q;
+
+        q->notify_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if (q->notify_fd < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        r = sd_event_add_io(s->event, &q->notify_event_source, q->notify_fd, EPOLLIN, dispatch_compress_notify, s);
+        if (r < 0)
+                goto fail;
+
+        return 0;
+
+fail:
+        compress_queue_free(s);
+        return r;
+}
+
+static int compress_queue_start_threads(CompressQueue *q) {
+        long ncpus;
+        unsigned n;
+        int r;
+
+        assert(q);
+
+        if (q->n_threads > 0)
+                return 0;
+
+        /* Leave a CPU for the main thread, if we can */
+        ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n = ncpus > 2 ? (unsigned) ncpus - 1 : 1;
+        n = MIN(n, COMPRESS_THREADS_MAX);
+
+        while (q->n_threads < n) {
+                r = pthread_create(q->threads + q->n_threads, NULL, compress_thread, q);
+                if (r > 0) {
+                        if (q->n_threads > 0)
+                                break;
+
+                        return -r;
+                }
+
+                q->n_threads++;
+        }
+
+        log_debug("Started %u compression threads.", q->n_threads);
+        return 0;
+}
+
+int compress_queue_offer(Server *s, uid_t uid, const struct iovec *iovec, unsigned n, int priority) {
+        CompressQueue *q;
+        PendingEntry *e;
+        bool needs_work;
+        size_t size;
+        int r;
+
+        assert(s);
+        assert(iovec || n == 0);
+
+        /* Queues an entry for writing, if it needs compressing in a
+         * worker thread, if earlier entries are still being worked
+         * on, or if we are in a batch. Returns > 0 if the entry was
+         * queued, 0 if the caller should write it right away. */
+
+        q = s->compress_queue;
+        needs_work = s->compress && pending_entry_needs_work(iovec, n);
+
+        if (!needs_work && s->write_batch == 0 && (!q || !q->queue))
+                return 0;
+
+        size = IOVEC_TOTAL_SIZE(iovec, n);
+
+        /* Back-pressure: wait for the workers while the queue is
+         * full. Entries that wouldn't fit into an empty queue are
+         * written inline, without making a copy. */
+        while (q && q->queue &&
+               (q->n_queued >= COMPRESS_QUEUE_ENTRIES_MAX ||
+                q->queued_size + size > COMPRESS_QUEUE_BYTES_MAX))
+                compress_queue_wait_head(s);
+
+        if (size > COMPRESS_QUEUE_BYTES_MAX)
+                return 0;
+
+        if (!needs_work && s->write_batch == 0 && (!q || !q->queue))
+                /* Waiting above might have emptied the queue */
+                return 0;
+
+        r = compress_queue_new(s);
+        if (r < 0) {
+                log_warning_errno(r, "Failed to allocate write queue, writing inline: %m");
+                return 0;
+        }
+
+        q = s->compress_queue;
+
+        if (needs_work) {
+                r = compress_queue_start_threads(q);
+                if (r < 0) {
+                        log_warning_errno(r, "Failed to start compression threads, compressing inline: %m");
+                        needs_work = false;
+
+                        if (s->write_batch == 0 && !q->queue)
+                                return 0;
+                }
+        }
+
+        r = pending_entry_new(uid, iovec, n, priority, needs_work, &e);
+        if (r < 0) {
+                log_oom();
+                compress_queue_flush(s);
+                return 0;
+        }
+
+        LIST_INSERT_AFTER(queue, q->queue, q->queue_tail, e);
+        q->queue_tail = e;
+        q->n_queued++;
+        q->queued_size += size;
+
+        assert_se(pthread_mutex_lock(&q->mutex) == 0);
+
+        if (needs_work) {
+                LIST_PREPEND(jobs, q->jobs, e);
+                if (!q->jobs_tail)
+                        q->jobs_tail = e;
+
+                assert_se(pthread_cond_signal(&q->work_cond) == 0);
+        } else
+                e->done = true;
+
+        assert_se(pthread_mutex_unlock(&q->mutex) == 0);
+
+        return 1;
+}
+
+void compress_queue_batch_begin(Server *s) {
+        assert(s);
+
+        s->write_batch++;
+}
+
+void compress_queue_batch_end(Server *s) {
+        assert(s);
+        assert(s->write_batch > 0);
+
+        if (--s->write_batch > 0)
+                return;
+
+        /* Write out what is ready, entries that are still being
+         * compressed are written once that is done, as usual */
+        compress_queue_dispatch(s, false);
+}
+
+void compress_queue_flush(Server *s) {
+        assert(s);
+
+        compress_queue_dispatch(s, true);
+}
+
+void compress_queue_free(Server *s) {
+        CompressQueue *q;
+        unsigned i;
+
+        assert(s);
+
+        q = s->compress_queue;
+        if (!q)
+                return;
+
+        compress_queue_dispatch(s, true);
+
+        assert_se(pthread_mutex_lock(&q->mutex) == 0);
+        q->shutdown = true;
+        assert_se(pthread_cond_broadcast(&q->work_cond) == 0);
+        assert_se(pthread_mutex_unlock(&q->mutex) == 0);
+
+        for (i = 0; i < q->n_threads; i++)
+                assert_se(pthread_join(q->threads[i], NULL) == 0);
+
+        assert(!q->jobs);
+        assert(!q->queue);
+
+        sd_event_source_unref(q->notify_event_source);
+        safe_close(q->notify_fd);
+
+        assert_se(pthread_cond_destroy(&q->done_cond) == 0);
+        assert_se(pthread_cond_destroy(&q->work_cond) == 0);
+        assert_se(pthread_mutex_destroy(&q->mutex) == 0);
+
+        s->compress_queue = mfree(q);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+typedef struct CompressQueue CompressQueue;
+
+#include "journald-server.h"
+
+int compress_queue_offer(Server *s, uid_t uid, const struct iovec *iovec, unsigned n, int priority);
+void compress_queue_batch_begin(Server *s);
+void compress_queue_batch_end(Server *s);
+void compress_queue_flush(Server *s);
+void compress_queue_free(Server *s);
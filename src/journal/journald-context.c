@@ -0,0 +1,413 @@
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#ifdef HAVE_SELINUX
+#include <selinux/selinux.h>
+#endif
+
+#include <sys/stat.h>
+
+#include "alloc-util.h"
+#include "audit-util.h"
+#include "cgroup-util.h"
+#include "def.h"
+#include "hashmap.h"
+#include "journald-context.h"
+#include "journald-rate-limit.h"
+#include "log.h"
+#include "prioq.h"
+#include "process-util.h"
+#include "selinux-util.h"
+#include "string-util.h"
+#include "user-util.h"
+
+/* This implements a cache of per-process metadata. Whenever we
+ * receive a message from a client we need to attach _COMM=, _EXE=,
+ * _CMDLINE=, _SYSTEMD_CGROUP= and friends to it. Reading these from
+ * /proc every single time is expensive for chatty clients, hence we
+ * keep the data around for a short while, and only refresh it when
+ * it got too old, or when the PID got reused, which we notice by the
+ * process start time, or the sender's credentials changing, or when
+ * the process moved to a different cgroup. The credentials come with
+ * each message for free, while checking the start time and the cgroup
+ * needs two reads, hence we do the latter at most once per
+ * CLIENT_CONTEXT_VALIDATE_USEC.
+ *
+ * The cache is bounded: when it is full we drop the entry that was
+ * collected longest ago, which we track in a priority queue. */
+
+static int client_context_compare(const void *a, const void *b) {
+        const ClientContext *x = a, *y = b;
+
+        if (x->timestamp < y->timestamp)
+                return -1;
+        if (x->timestamp > y->timestamp)
+                return 1;
+
+        if (x->pid < y->pid)
+                return -1;
+        if (x->pid > y->pid)
+                return 1;
+
+        return 0;
+}
+
+static void client_context_reset(ClientContext *c) {
+        assert(c);
+
+        c->uid = UID_INVALID;
+        c->gid = GID_INVALID;
+        c->starttime = 0;
+        c->timestamp = USEC_INFINITY;
+        c->validated = USEC_INFINITY;
+
+        c->comm = mfree(c->comm);
+        c->exe = mfree(c->exe);
+        c->cmdline = mfree(c->cmdline);
+        c->capeff = mfree(c->capeff);
+
+        c->auditid = AUDIT_SESSION_INVALID;
+        c->loginuid = UID_INVALID;
+
+        c->cgroup = mfree(c->cgroup);
+        c->session = mfree(c->session);
+        c->owner_uid = UID_INVALID;
+
+        c->rate_limit_group = mfree(c->rate_limit_group);
+        c->rate_limit_id = 0;
+
+        c->unit = mfree(c->unit);
+        c->user_unit = mfree(c->user_unit);
+        c->slice = mfree(c->slice);
+
+        c->label = mfree(c->label);
+}
+
+static ClientContext* client_context_free(Server *s, ClientContext *c) {
+        assert(s);
+
+        if (!c)
+                return NULL;
+
+        assert_se(hashmap_remove(s->client_contexts, PID_TO_PTR(c->pid)) == c);
+
+        if (c->lru_index != PRIOQ_IDX_NULL)
+                assert_se(prioq_remove(s->client_contexts_lru, c, &c->lru_index) >= 0);
+
+        client_context_reset(c);
+
+        return mfree(c);
+}
+
+static int client_context_new(Server *s, pid_t pid, ClientContext **ret) {
+        ClientContext *c;
+        int r;
+
+        assert(s);
+        assert(pid > 0);
+        assert(ret);
+
+        r = hashmap_ensure_allocated(&s->client_contexts, NULL);
+        if (r < 0)
+                return r;
+
+        r = prioq_ensure_allocated(&s->client_contexts_lru, client_context_compare);
+        if (r < 0)
+                return r;
+
+        c = new0(ClientContext, 1);
+        if (!c)
+                return -ENOMEM;
+
+        c->pid = pid;
+        c->lru_index = PRIOQ_IDX_NULL;
+        client_context_reset(c);
+
+        r = hashmap_put(s->client_contexts, PID_TO_PTR(pid), c);
+        if (r < 0) {
+                free(c);
+                return r;
+        }
+
+        *ret = c;
+        return 0;
+}
+
+static void client_context_read_rate_limit_group(Server *s, ClientContext *c) {
+        _cleanup_free_ char *fs = NULL;
+        const char *p;
+        struct stat st;
+        char *e;
+
+        assert(s);
+        assert(c);
+        assert(c->cgroup);
+
+        /* example: /user/lennart/3/foobar
+         *          /system/dbus.service/foobar
+         *
+         * So let's cut of everything past the third /, since that is
+         * where user directories start */
+
+        c->rate_limit_group = strdup(c->cgroup);
+        if (!c->rate_limit_group)
+                return;
+
+        e = strchr(c->rate_limit_group, '/');
+        if (e) {
+                e = strchr(e+1, '/');
+                if (e) {
+                        e = strchr(e+1, '/');
+                        if (e)
+                                *e = 0;
+                }
+        }
+
+        /* Key the group by the inode of its cgroup directory, so
+         * that the rate limiter doesn't have to deal with strings */
+        p = streq(s->cgroup_root, "/") ? c->rate_limit_group : strjoina(s->cgroup_root, c->rate_limit_group);
+        if (cg_get_path(SYSTEMD_CGROUP_CONTROLLER, p, NULL, &fs) >= 0 &&
+            stat(fs, &st) >= 0 && st.st_ino != 0)
+                c->rate_limit_id = (uint64_t) st.st_ino;
+        else if (s->rate_limit)
+                c->rate_limit_id = journal_rate_limit_hash(s->rate_limit, c->rate_limit_group);
+}
+
+static void client_context_read(Server *s, ClientContext *c, const struct ucred *ucred, usec_t n) {
+        assert(s);
+        assert(c);
+
+        client_context_reset(c);
+
+        if (ucred) {
+                c->uid = ucred->uid;
+                c->gid = ucred->gid;
+        }
+
+        (void) get_process_starttime(c->pid, &c->starttime);
+        (void) get_process_comm(c->pid, &c->comm);
+        (void) get_process_exe(c->pid, &c->exe);
+        (void) get_process_cmdline(c->pid, 0, false, &c->cmdline);
+        (void) get_process_capeff(c->pid, &c->capeff);
+
+#ifdef HAVE_AUDIT
+        (void) audit_session_from_pid(c->pid, &c->auditid);
+        (void) audit_loginuid_from_pid(c->pid, &c->loginuid);
+#endif
+
+        if (cg_pid_get_path_shifted(c->pid, s->cgroup_root, &c->cgroup) >= 0) {
+                (void) cg_path_get_session(c->cgroup, &c->session);
+
+                if (cg_path_get_owner_uid(c->cgroup, &c->owner_uid) < 0)
+                        c->owner_uid = UID_INVALID;
+
+                (void) cg_path_get_unit(c->cgroup, &c->unit);
+                (void) cg_path_get_user_unit(c->cgroup, &c->user_unit);
+                (void) cg_path_get_slice(c->cgroup, &c->slice);
+
+                client_context_read_rate_limit_group(s, c);
+        }
+
+#ifdef HAVE_SELINUX
+        if (mac_selinux_have()) {
+                security_context_t con;
+
+                if (getpidcon(c->pid, &con) >= 0) {
+                        c->label = strdup(con);
+                        freecon(con);
+                }
+        }
+#endif
+
+        c->timestamp = c->validated = n;
+}
+
+static void client_context_try_shrink_to(Server *s, unsigned limit) {
+        assert(s);
+
+        while (hashmap_size(s->client_contexts) > limit) {
+                ClientContext *c;
+
+                c = prioq_peek(s->client_contexts_lru);
+                if (!c)
+                        break;
+
+                (void) client_context_free(s, c);
+        }
+}
+
+static bool client_context_is_valid(Server *s, ClientContext *c, const struct ucred *ucred, usec_t n) {
+        _cleanup_free_ char *cgroup = NULL;
+        uint64_t starttime;
+
+        assert(s);
+        assert(c);
+
+        if (c->timestamp == USEC_INFINITY)
+                return false;
+
+        if (c->timestamp + CLIENT_CONTEXT_MAX_AGE_USEC < n)
+                return false;
+
+        /* A different user sending from the same PID means the PID
+         * has been recycled since we collected the data */
+        if (ucred) {
+                if (uid_is_valid(c->uid) && c->uid != ucred->uid)
+                        return false;
+                if (gid_is_valid(c->gid) && c->gid != ucred->gid)
+                        return false;
+        }
+
+        if (c->validated != USEC_INFINITY && c->validated + CLIENT_CONTEXT_VALIDATE_USEC > n)
+                return true;
+
+        /* The same user might have gotten the PID though, hence
+         * check that it is still the same process */
+        if (c->starttime == 0 ||
+            get_process_starttime(c->pid, &starttime) < 0 ||
+            starttime != c->starttime)
+                return false;
+
+        /* The cgroup decides about the unit and session we attribute
+         * the message to, and processes may be moved around */
+        if (cg_pid_get_path_shifted(c->pid, s->cgroup_root, &cgroup) < 0)
+                cgroup = NULL;
+        if (!streq_ptr(cgroup, c->cgroup))
+                return false;
+
+        c->validated = n;
+        return true;
+}
+
+int client_context_get_at(Server *s, pid_t pid, const struct ucred *ucred, usec_t n, ClientContext **ret) {
+        ClientContext *c;
+        int r;
+
+        assert(s);
+        assert(ret);
+
+        if (pid <= 0)
+                return -EINVAL;
+
+        c = hashmap_get(s->client_contexts, PID_TO_PTR(pid));
+        if (c) {
+                if (client_context_is_valid(s, c, ucred, n)) {
+                        if (ucred && !uid_is_valid(c->uid)) {
+                                c->uid = ucred->uid;
+                                c->gid = ucred->gid;
+                        }
+
+                        s->n_client_context_hits++;
+                        *ret = c;
+                        return 0;
+                }
+        } else {
+                client_context_try_shrink_to(s, CLIENT_CONTEXT_CACHE_MAX - 1);
+
+                r = client_context_new(s, pid, &c);
+                if (r < 0)
+                        return r;
+        }
+
+        s->n_client_context_misses++;
+
+        client_context_read(s, c, ucred, n);
+
+        if (c->lru_index == PRIOQ_IDX_NULL) {
+                r = prioq_put(s->client_contexts_lru, c, &c->lru_index);
+                if (r < 0) {
+                        (void) client_context_free(s, c);
+                        return r;
+                }
+        } else
+                assert_se(prioq_reshuffle(s->client_contexts_lru, c, &c->lru_index) >= 0);
+
+        *ret = c;
+        return 0;
+}
+
+int client_context_get(Server *s, pid_t pid, const struct ucred *ucred, ClientContext **ret) {
+        return client_context_get_at(s, pid, ucred, now(CLOCK_MONOTONIC), ret);
+}
+
+int client_context_read_uncached(Server *s, pid_t pid, ClientContext **ret) {
+        ClientContext *c;
+
+        assert(s);
+        assert(ret);
+
+        /* Collects the metadata of a process without putting it into
+         * the cache, for processes messages are about rather than
+         * from, for which we have no credentials to check the cached
+         * data against */
+
+        if (pid <= 0)
+                return -EINVAL;
+
+        c = new0(ClientContext, 1);
+        if (!c)
+                return -ENOMEM;
+
+        c->pid = pid;
+        c->lru_index = PRIOQ_IDX_NULL;
+
+        client_context_read(s, c, NULL, now(CLOCK_MONOTONIC));
+
+        *ret = c;
+        return 0;
+}
+
+ClientContext* client_context_free_uncached(ClientContext *c) {
+        if (!c)
+                return NULL;
+
+        assert(c->lru_index == PRIOQ_IDX_NULL);
+
+        client_context_reset(c);
+
+        return mfree(c);
+}
+
+void client_context_flush_all(Server *s) {
+        assert(s);
+
+        client_context_try_shrink_to(s, 0);
+
+        s->client_contexts = hashmap_free(s->client_contexts);
+        s->client_contexts_lru = prioq_free(s->client_contexts_lru);
+}
+
+void client_context_send_stats(Server *s) {
+        uint64_t total;
+
+        assert(s);
+
+        total = s->n_client_context_hits + s->n_client_context_misses;
+        if (total == 0)
+                return;
+
+        server_driver_message(s, SD_ID128_NULL,
+                              LOG_MESSAGE("Client context cache: %u entries, %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 "%% hit rate.",
+                                          hashmap_size(s->client_contexts),
+                                          s->n_client_context_hits,
+                                          s->n_client_context_misses,
+                                          s->n_client_context_hits * 100 / total),
+                              "CLIENT_CONTEXT_ENTRIES=%u", hashmap_size(s->client_contexts),
+                              "CLIENT_CONTEXT_HITS=%" PRIu64, s->n_client_context_hits,
+                              "CLIENT_CONTEXT_MISSES=%" PRIu64, s->n_client_context_misses,
+                              NULL);
+}
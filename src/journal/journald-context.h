@@ -0,0 +1,90 @@
+#pragma once
+
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "time-util.h"
+
+typedef struct ClientContext ClientContext;
+
+/* How long to trust cached process metadata */
+#define CLIENT_CONTEXT_MAX_AGE_USEC (5*USEC_PER_SEC)
+
+/* How often to check that a cached PID still refers to the same process */
+#define CLIENT_CONTEXT_VALIDATE_USEC (1*USEC_PER_SEC)
+
+/* Maximum number of processes to cache metadata for */
+#define CLIENT_CONTEXT_CACHE_MAX 1024
+
+#include "journald-server.h"
+
+/* Per-process metadata we attach as trusted fields to each message
+ * a client sends us. Collecting this requires a dozen or so reads
+ * from /proc and cgroupfs, hence we cache it keyed by PID. */
+struct ClientContext {
+        pid_t pid;
+
+        /* The credentials the context was collected for, so that we
+         * can detect PID reuse by a different user */
+        uid_t uid;
+        gid_t gid;
+
+        /* The start time of the process, so that we can detect PID
+         * reuse in general */
+        uint64_t starttime;
+
+        usec_t timestamp;
+        usec_t validated;
+        unsigned lru_index;
+
+        char *comm;
+        char *exe;
+        char *cmdline;
+        char *capeff;
+
+        uint32_t auditid;
+        uid_t loginuid;
+
+        char *cgroup;
+        char *session;
+        uid_t owner_uid;
+
+        /* The group messages are rate limited in: the cgroup cut
+         * off after the third level, and a numeric ID for it */
+        char *rate_limit_group;
+        uint64_t rate_limit_id;
+
+        char *unit;
+        char *user_unit;
+        char *slice;
+
+        char *label;
+};
+
+int client_context_get(Server *s, pid_t pid, const struct ucred *ucred, ClientContext **ret);
+/* Like client_context_get(), but with the CLOCK_MONOTONIC timestamp passed in, for the tests */
+int client_context_get_at(Server *s, pid_t pid, const struct ucred *ucred, usec_t n, ClientContext **ret);
+int client_context_read_uncached(Server *s, pid_t pid, ClientContext **ret);
+ClientContext* client_context_free_uncached(ClientContext *c);
+void client_context_flush_all(Server *s);
+void client_context_send_stats(Server *s);
+
+DEFINE_TRIVIAL_CLEANUP_FUNC(ClientContext*, client_context_free_uncached);
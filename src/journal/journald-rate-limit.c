@@ -21,16 +21,27 @@
 #include <string.h>
 
 #include "alloc-util.h"
-#include "hashmap.h"
 #include "journald-rate-limit.h"
-#include "list.h"
 #include "random-util.h"
+#include "siphash24.h"
 #include "string-util.h"
 #include "util.h"
 
+/* Groups are kept in a fixed-size open addressing table, keyed by a
+ * numeric ID (usually the inode number of the cgroup). A group is
+ * looked for only within a short window of slots following its
+ * hash. Slots are never emptied again, if there's no free slot in
+ * the window the group that was used least recently is replaced.
+ * This bounds the work per message, and we never need to vacuum.
+ *
+ * If the replaced group was still active within the last interval,
+ * the new group takes over its buckets rather than starting with full
+ * ones. Otherwise a flood spread over more groups than we have slots
+ * for would never be limited. */
+
 #define POOLS_MAX 5
-#define BUCKETS_MAX 127
-#define GROUPS_MAX 2047
+#define GROUPS_SLOTS 2048U
+#define GROUPS_PROBE_MAX 16U
 
 static const int priority_map[] = {
         [LOG_EMERG]   = 0,
@@ -46,32 +57,38 @@ static const int priority_map[] = {
 typedef struct JournalRateLimitPool JournalRateLimitPool;
 typedef struct JournalRateLimitGroup JournalRateLimitGroup;
 
+/* A token bucket, refilled with burst tokens per interval */
 struct JournalRateLimitPool {
-        usec_t begin;
-        unsigned num;
+        usec_t refill;
+        unsigned tokens;
+
         unsigned suppressed;
+        usec_t suppressed_begin;
 };
 
 struct JournalRateLimitGroup {
-        JournalRateLimit *parent;
+        uint64_t id; /* 0 if the slot is unused */
+        char *name;
+        usec_t last;
 
-        char *id;
-        JournalRateLimitPool pools[POOLS_MAX];
-        uint64_t hash;
+        uint64_t n_passed;
+        uint64_t n_dropped;
 
-        LIST_FIELDS(JournalRateLimitGroup, bucket);
-        LIST_FIELDS(JournalRateLimitGroup, lru);
+        JournalRateLimitPool pools[POOLS_MAX];
 };
 
 struct JournalRateLimit {
         usec_t interval;
         unsigned burst;
 
-        JournalRateLimitGroup* buckets[BUCKETS_MAX];
-        JournalRateLimitGroup *lru, *lru_tail;
-
+        JournalRateLimitGroup groups[GROUPS_SLOTS];
         unsigned n_groups;
 
+        /* Totals, including the groups that were replaced */
+        uint64_t n_passed;
+        uint64_t n_dropped;
+        uint64_t n_evicted;
+
         uint8_t hash_key[16];
 };
 
@@ -92,90 +109,81 @@ JournalRateLimit *journal_rate_limit_new(usec_t interval, unsigned burst) {
         return r;
 }
 
-static void journal_rate_limit_group_free(JournalRateLimitGroup *g) {
-        assert(g);
-
-        if (g->parent) {
-                assert(g->parent->n_groups > 0);
-
-                if (g->parent->lru_tail == g)
-                        g->parent->lru_tail = g->lru_prev;
-
-                LIST_REMOVE(lru, g->parent->lru, g);
-                LIST_REMOVE(bucket, g->parent->buckets[g->hash % BUCKETS_MAX], g);
-
-                g->parent->n_groups--;
-        }
-
-        free(g->id);
-        free(g);
-}
-
 void journal_rate_limit_free(JournalRateLimit *r) {
+        unsigned i;
+
         assert(r);
 
-        while (r->lru)
-                journal_rate_limit_group_free(r->lru);
+        for (i = 0; i < GROUPS_SLOTS; i++)
+                free(r->groups[i].name);
 
         free(r);
 }
 
-_pure_ static bool journal_rate_limit_group_expired(JournalRateLimitGroup *g, usec_t ts) {
-        unsigned i;
+uint64_t journal_rate_limit_hash(JournalRateLimit *r, const char *name) {
+        uint64_t h;
 
-        assert(g);
+        assert(r);
+        assert(name);
 
-        for (i = 0; i < POOLS_MAX; i++)
-                if (g->pools[i].begin + g->parent->interval >= ts)
-                        return false;
+        /* For groups we don't know an ID for. Never returns 0, which
+         * marks unused slots. */
 
-        return true;
+        h = siphash24(name, strlen(name), r->hash_key);
+        return h != 0 ? h : 1;
 }
 
-static void journal_rate_limit_vacuum(JournalRateLimit *r, usec_t ts) {
+static JournalRateLimitGroup* journal_rate_limit_group_get(JournalRateLimit *r, uint64_t id, const char *name, usec_t ts) {
+        JournalRateLimitPool pools[POOLS_MAX];
+        JournalRateLimitGroup *g, *victim = NULL;
+        bool inherit = false;
+        uint64_t h;
+        unsigned i;
+
         assert(r);
+        assert(id != 0);
 
-        /* Makes room for at least one new item, but drop all
-         * expored items too. */
+        h = siphash24(&id, sizeof(id), r->hash_key);
 
-        while (r->n_groups >= GROUPS_MAX ||
-               (r->lru_tail && journal_rate_limit_group_expired(r->lru_tail, ts)))
-                journal_rate_limit_group_free(r->lru_tail);
-}
+        for (i = 0; i < GROUPS_PROBE_MAX; i++) {
+                g = r->groups + ((h + i) & (GROUPS_SLOTS - 1));
 
-static JournalRateLimitGroup* journal_rate_limit_group_new(JournalRateLimit *r, const char *id, usec_t ts) {
-        JournalRateLimitGroup *g;
-        struct siphash state;
+                if (g->id == id)
+                        return g;
 
-        assert(r);
-        assert(id);
+                if (g->id == 0) {
+                        r->n_groups++;
+                        victim = g;
+                        break;
+                }
 
-        g = new0(JournalRateLimitGroup, 1);
-        if (!g)
-                return NULL;
+                if (!victim || g->last < victim->last)
+                        victim = g;
+        }
 
-        g->id = strdup(id);
-        if (!g->id)
-                goto fail;
+        if (victim->id != 0 && victim->last + r->interval > ts) {
+                memcpy(pools, victim->pools, sizeof(pools));
+                inherit = true;
+                r->n_evicted++;
+        }
 
-        siphash24_init(&state, r->hash_key);
-        string_hash_func(g->id, &state);
-        g->hash = siphash24_finalize(&state);
+        free(victim->name);
+        zero(*victim);
 
-        journal_rate_limit_vacuum(r, ts);
+        victim->id = id;
 
-        LIST_PREPEND(bucket, r->buckets[g->hash % BUCKETS_MAX], g);
-        LIST_PREPEND(lru, r->lru, g);
-        if (!g->lru_next)
-                r->lru_tail = g;
-        r->n_groups++;
+        if (inherit)
+                for (i = 0; i < POOLS_MAX; i++) {
+                        victim->pools[i].refill = pools[i].refill;
+                        victim->pools[i].tokens = pools[i].tokens;
+                }
 
-        g->parent = r;
-        return g;
+        /* The name is only used for statistics, hence if we are out
+         * of memory we go on without it */
+        if (name)
+                victim->name = strdup(name);
 
-fail:
-        journal_rate_limit_group_free(g);
-        return NULL;
+        return victim;
 }
 
 static unsigned burst_modulate(unsigned burst, uint64_t available) {
@@ -206,15 +214,46 @@ static unsigned burst_modulate(unsigned burst, uint64_t available) {
         return burst;
 }
 
-int journal_rate_limit_test(JournalRateLimit *r, const char *id, int priority, uint64_t available) {
-        uint64_t h;
+static void journal_rate_limit_pool_refill(JournalRateLimit *r, JournalRateLimitPool *p, unsigned burst, usec_t ts) {
+        usec_t elapsed;
+        uint64_t n;
+
+        assert(r);
+        assert(p);
+
+        if (p->refill == 0 || ts >= p->refill + r->interval) {
+                p->tokens = burst;
+                p->refill = ts;
+                return;
+        }
+
+        if (ts <= p->refill)
+                return;
+
+        elapsed = ts - p->refill;
+        n = elapsed * burst / r->interval;
+        if (n == 0)
+                return;
+
+        /* Only account for the time the tokens we add took, so that
+         * we don't lose fractions of tokens */
+        if (p->tokens + n >= burst) {
+                p->tokens = burst;
+                p->refill = ts;
+        } else {
+                p->tokens += n;
+                p->refill += n * r->interval / burst;
+        }
+}
+
+int journal_rate_limit_test(JournalRateLimit *r, uint64_t id, const char *name, int priority, uint64_t available) {
+        return journal_rate_limit_test_at(r, id, name, priority, available, now(CLOCK_MONOTONIC));
+}
+
+int journal_rate_limit_test_at(JournalRateLimit *r, uint64_t id, const char *name, int priority, uint64_t available, usec_t ts) {
         JournalRateLimitGroup *g;
         JournalRateLimitPool *p;
-        struct siphash state;
-        unsigned burst;
-        usec_t ts;
-
-        assert(id);
+        unsigned burst, s;
 
         if (!r)
                 return 1;
@@ -224,48 +263,85 @@ int journal_rate_limit_test(JournalRateLimit *r, const char *id, int priority, u
 
         burst = burst_modulate(r->burst, available);
 
-        ts = now(CLOCK_MONOTONIC);
+        g = journal_rate_limit_group_get(r, id != 0 ? id : 1, name, ts);
+        g->last = ts;
 
-        siphash24_init(&state, r->hash_key);
-        string_hash_func(id, &state);
-        h = siphash24_finalize(&state);
-        g = r->buckets[h % BUCKETS_MAX];
+        p = &g->pools[priority_map[priority]];
+        journal_rate_limit_pool_refill(r, p, burst, ts);
 
-        LIST_FOREACH(bucket, g, g)
-                if (streq(g->id, id))
-                        break;
+        if (p->tokens == 0) {
+                if (p->suppressed == 0)
+                        p->suppressed_begin = ts;
 
-        if (!g) {
-                g = journal_rate_limit_group_new(r, id, ts);
-                if (!g)
-                        return -ENOMEM;
+                p->suppressed++;
+                g->n_dropped++;
+                r->n_dropped++;
+                return 0;
         }
 
-        p = &g->pools[priority_map[priority]];
+        p->tokens--;
+        g->n_passed++;
+        r->n_passed++;
 
-        if (p->begin <= 0) {
-                p->suppressed = 0;
-                p->num = 1;
-                p->begin = ts;
+        /* Report suppressed messages at most once per interval,
+         * otherwise a client logging just a bit faster than permitted
+         * would cause a report for almost every message */
+        if (p->suppressed == 0 || ts < p->suppressed_begin + r->interval)
                 return 1;
-        }
 
-        if (p->begin + r->interval < ts) {
-                unsigned s;
+        s = p->suppressed;
+        p->suppressed = 0;
+
+        return 1 + s;
+}
+
+int journal_rate_limit_get_stats(JournalRateLimit *r, JournalRateLimitStats **ret, size_t *ret_n) {
+        _cleanup_free_ JournalRateLimitStats *stats = NULL;
+        size_t n = 0;
+        unsigned i;
 
-                s = p->suppressed;
-                p->suppressed = 0;
-                p->num = 1;
-                p->begin = ts;
+        assert(ret);
+        assert(ret_n);
 
-                return 1 + s;
+        if (!r || r->n_groups == 0) {
+                *ret = NULL;
+                *ret_n = 0;
+                return 0;
         }
 
-        if (p->num <= burst) {
-                p->num++;
-                return 1;
+        stats = new(JournalRateLimitStats, r->n_groups);
+        if (!stats)
+                return -ENOMEM;
+
+        for (i = 0; i < GROUPS_SLOTS; i++) {
+                JournalRateLimitGroup *g = r->groups + i;
+
+                if (g->id == 0)
+                        continue;
+
+                assert(n < r->n_groups);
+
+                stats[n++] = (JournalRateLimitStats) {
+                        .id = g->id,
+                        .name = g->name,
+                        .n_passed = g->n_passed,
+                        .n_dropped = g->n_dropped,
+                };
         }
 
-        p->suppressed++;
+        *ret = stats;
+        *ret_n = n;
+        stats = NULL;
+
         return 0;
 }
+
+void journal_rate_limit_get_totals(JournalRateLimit *r, uint64_t *n_passed, uint64_t *n_dropped, uint64_t *n_evicted) {
+        assert(n_passed);
+        assert(n_dropped);
+        assert(n_evicted);
+
+        *n_passed = r ? r->n_passed : 0;
+        *n_dropped = r ? r->n_dropped : 0;
+        *n_evicted = r ? r->n_evicted : 0;
+}
@@ -23,6 +23,18 @@
 
 typedef struct JournalRateLimit JournalRateLimit;
 
+typedef struct JournalRateLimitStats {
+        uint64_t id;
+        const char *name; /* owned by the rate limiter, valid until the next journal_rate_limit_test() */
+        uint64_t n_passed;
+        uint64_t n_dropped;
+} JournalRateLimitStats;
+
 JournalRateLimit *journal_rate_limit_new(usec_t interval, unsigned burst);
 void journal_rate_limit_free(JournalRateLimit *r);
-int journal_rate_limit_test(JournalRateLimit *r, const char *id, int priority, uint64_t available);
+uint64_t journal_rate_limit_hash(JournalRateLimit *r, const char *name);
+int journal_rate_limit_test(JournalRateLimit *r, uint64_t id, const char *name, int priority, uint64_t available);
+/* Like journal_rate_limit_test(), but with the CLOCK_MONOTONIC timestamp passed in, for the tests */
+int journal_rate_limit_test_at(JournalRateLimit *r, uint64_t id, const char *name, int priority, uint64_t available, usec_t ts);
+int journal_rate_limit_get_stats(JournalRateLimit *r, JournalRateLimitStats **ret, size_t *ret_n);
+void journal_rate_limit_get_totals(JournalRateLimit *r, uint64_t *n_passed, uint64_t *n_dropped, uint64_t *n_evicted);
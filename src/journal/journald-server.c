@@ -46,10 +46,13 @@
 #include "hostname-util.h"
 #include "io-util.h"
 #include "journal-authenticate.h"
+#include "journal-boot-index.h"
 #include "journal-file.h"
 #include "journal-internal.h"
 #include "journal-vacuum.h"
 #include "journald-audit.h"
+#include "journald-compress.h"
+#include "journald-context.h"
 #include "journald-kmsg.h"
 #include "journald-native.h"
 #include "journald-rate-limit.h"
@@ -68,6 +71,7 @@
 #include "stdio-util.h"
 #include "string-table.h"
 #include "string-util.h"
+#include "strv.h"
 #include "user-util.h"
 #include "log.h"
 
@@ -76,12 +80,28 @@
 #define DEFAULT_SYNC_INTERVAL_USEC (5*USEC_PER_MINUTE)
 #define DEFAULT_RATE_LIMIT_INTERVAL (30*USEC_PER_SEC)
 #define DEFAULT_RATE_LIMIT_BURST 1000
+
+/* How many of the most throttled groups we report on SIGUSR2 */
+#define RATE_LIMIT_STATS_GROUPS_MAX 10
 #define DEFAULT_MAX_FILE_USEC USEC_PER_MONTH
 
 #define RECHECK_SPACE_USEC (30*USEC_PER_SEC)
 
 #define NOTIFY_SNDBUF_SIZE (8*1024*1024)
 
+/* The maximum number of datagrams to process per event loop iteration */
+#define DATAGRAM_BATCH_MAX 64
+
+/* The number of datagrams to receive with one recvmmsg() call */
+#define DATAGRAM_RECV_MAX 16U
+
+/* The size of each recvmmsg() slot, the same as the send buffer
+ * sd-journal asks for, so that its datagrams always fit */
+#define DATAGRAM_SLOT_SIZE ((size_t) 8U*1024U*1024U)
+
+/* How much memory of each slot to keep around after a large datagram */
+#define DATAGRAM_SLOT_KEEP ((size_t) 64U*1024U)
+
 /* The period to insert between posting changes for coalescing */
 #define POST_CHANGE_TIMER_INTERVAL_USEC (250*USEC_PER_MSEC)
 
@@ -378,6 +398,9 @@ void server_sync(Server *s) {
         Iterator i;
         int r;
 
+        /* Write out whatever is still being compressed first */
+        compress_queue_flush(s);
+
         if (s->system_journal) {
                 r = journal_file_set_offline(s->system_journal, false);
                 if (r < 0)
@@ -399,6 +422,65 @@ void server_sync(Server *s) {
         s->sync_scheduled = false;
 }
 
+static int boot_index_work(void *userdata) {
+        Server *s = userdata;
+        char **p;
+        int r;
+
+        /* Runs on a worker thread. boot_index_directories is not
+         * touched by anything else while the event source exists. */
+
+        STRV_FOREACH(p, s->boot_index_directories) {
+                r = boot_index_update(*p);
+                if (r < 0 && r != -ENOENT)
+                        log_debug_errno(r, "Failed to update boot index of %s, ignoring: %m", *p);
+        }
+
+        return 0;
+}
+
+static int boot_index_work_done(sd_event_source *es, int result, void *userdata) {
+        Server *s = userdata;
+
+        assert(s);
+
+        s->boot_index_event_source = sd_event_source_unref(s->boot_index_event_source);
+        s->boot_index_directories = strv_free(s->boot_index_directories);
+
+        return 0;
+}
+
+static void server_update_boot_index(Server *s, char ***directories) {
+        int r;
+
+        assert(s);
+        assert(directories);
+
+        /* Record the boots of the archived files, so that clients
+         * don't have to search through all of them. The first time
+         * this opens every archived file, hence keep it off the event
+         * loop. Files that are still being offlined after a rotation,
+         * or that are archived while an update is running, are picked
+         * up the next time we get here. */
+
+        if (strv_isempty(*directories))
+                return;
+
+        if (s->boot_index_event_source) {
+                log_debug("Boot index update still in progress, not starting another one.");
+                return;
+        }
+
+        s->boot_index_directories = *directories;
+        *directories = NULL;
+
+        r = sd_event_add_work(s->event, &s->boot_index_event_source, boot_index_work, boot_index_work_done, s);
+        if (r < 0) {
+                log_debug_errno(r, "Failed to start boot index update, ignoring: %m");
+                s->boot_index_directories = strv_free(s->boot_index_directories);
+        }
+}
+
 static void do_vacuum(
                 Server *s,
                 JournalFile *f,
@@ -406,7 +488,8 @@ static void do_vacuum(
                 const char *path,
                 const char *name,
                 bool verbose,
-                bool patch_min_use) {
+                bool patch_min_use,
+                char ***boot_index_directories) {
 
         const char *p;
         uint64_t limit;
@@ -428,17 +511,24 @@ static void do_vacuum(
         r = journal_directory_vacuum(p, limit, metrics->n_max_files, s->max_retention_usec, &s->oldest_file_usec,  verbose);
         if (r < 0 && r != -ENOENT)
                 log_warning_errno(r, "Failed to vacuum %s, ignoring: %m", p);
+
+        if (strv_extend(boot_index_directories, p) < 0)
+                log_oom();
 }
 
 int server_vacuum(Server *s, bool verbose, bool patch_min_use) {
+        _cleanup_strv_free_ char **boot_index_directories = NULL;
+
         assert(s);
 
         log_debug("Vacuuming...");
 
         s->oldest_file_usec = 0;
 
-        do_vacuum(s, s->system_journal, &s->system_metrics, "/var/log/journal/", "System journal", verbose, patch_min_use);
-        do_vacuum(s, s->runtime_journal, &s->runtime_metrics, "/run/log/journal/", "Runtime journal", verbose, patch_min_use);
+        do_vacuum(s, s->system_journal, &s->system_metrics, "/var/log/journal/", "System journal", verbose, patch_min_use, &boot_index_directories);
+        do_vacuum(s, s->runtime_journal, &s->runtime_metrics, "/run/log/journal/", "Runtime journal", verbose, patch_min_use, &boot_index_directories);
+
+        server_update_boot_index(s, &boot_index_directories);
 
         s->cached_space_limit = 0;
         s->cached_space_available = 0;
@@ -524,14 +614,27 @@ static bool shall_try_append_again(JournalFile *f, int r) {
         }
 }
 
-static void write_to_journal(Server *s, uid_t uid, struct iovec *iovec, unsigned n, int priority) {
+void server_write_entries(
+                Server *s,
+                uid_t uid,
+                const JournalEntry entries[],
+                unsigned n_entries,
+                int priority) {
+
         JournalFile *f;
-        bool vacuumed = false;
+        bool vacuumed = false, written = false;
         int r;
 
         assert(s);
-        assert(iovec);
-        assert(n > 0);
+        assert(entries || n_entries == 0);
+
+        /* Writes a batch of entries of the same user in one go. If
+         * writing fails half-way we rotate once and continue with the
+         * entries that weren't written yet. Entries that can't be
+         * written at all are dropped one by one. */
+
+        if (n_entries == 0)
+                return;
 
         f = find_journal(s, uid);
         if (!f)
@@ -548,36 +651,81 @@ static void write_to_journal(Server *s, uid_t uid, struct iovec *iovec, unsigned
                         return;
         }
 
-        r = journal_file_append_entry(f, NULL, iovec, n, &s->seqnum, NULL, NULL);
-        if (r >= 0) {
-                server_schedule_sync(s, priority);
-                return;
-        }
+        while (n_entries > 0) {
+                unsigned n_written = 0;
 
-        if (vacuumed || !shall_try_append_again(f, r)) {
-                log_error_errno(r, "Failed to write entry (%d items, %zu bytes), ignoring: %m", n, IOVEC_TOTAL_SIZE(iovec, n));
-                return;
+                r = journal_file_append_entries(f, entries, n_entries, &s->seqnum, &n_written);
+                if (n_written > 0)
+                        written = true;
+                if (r >= 0)
+                        break;
+
+                entries += n_written;
+                n_entries -= n_written;
+
+                if (!vacuumed && shall_try_append_again(f, r)) {
+                        server_rotate(s);
+                        server_vacuum(s, false, false);
+                        vacuumed = true;
+
+                        f = find_journal(s, uid);
+                        if (!f)
+                                return;
+
+                        log_debug("Retrying write.");
+                        continue;
+                }
+
+                log_error_errno(r, "Failed to write entry (%u items, %zu bytes)%s, ignoring: %m",
+                                entries->n_iovec, IOVEC_TOTAL_SIZE(entries->iovec, entries->n_iovec),
+                                vacuumed ? " despite vacuuming" : "");
+                entries++;
+                n_entries--;
         }
 
-        server_rotate(s);
-        server_vacuum(s, false, false);
+        if (written)
+                server_schedule_sync(s, priority);
+}
 
-        f = find_journal(s, uid);
-        if (!f)
+void server_write_entry(
+                Server *s,
+                uid_t uid,
+                const dual_timestamp *ts,
+                const struct iovec *iovec,
+                const JournalPrecompressed *precompressed,
+                unsigned n,
+                int priority) {
+
+        assert(s);
+        assert(iovec);
+        assert(n > 0);
+
+        server_write_entries(s, uid, &(JournalEntry) {
+                        .ts = ts,
+                        .iovec = iovec,
+                        .n_iovec = n,
+                        .precompressed = precompressed,
+                }, 1, priority);
+}
+
+static void write_to_journal(Server *s, uid_t uid, struct iovec *iovec, unsigned n, int priority) {
+        assert(s);
+        assert(iovec);
+        assert(n > 0);
+
+        /* Large payloads are compressed in a worker thread, in
+         * which case the entry is written once that's done */
+        if (compress_queue_offer(s, uid, iovec, n, priority) > 0)
                 return;
 
-        log_debug("Retrying write.");
-        r = journal_file_append_entry(f, NULL, iovec, n, &s->seqnum, NULL, NULL);
-        if (r < 0)
-                log_error_errno(r, "Failed to write entry (%d items, %zu bytes) despite vacuuming, ignoring: %m", n, IOVEC_TOTAL_SIZE(iovec, n));
-        else
-                server_schedule_sync(s, priority);
+        server_write_entry(s, uid, NULL, iovec, NULL, n, priority);
 }
 
 static void dispatch_message_real(
                 Server *s,
                 struct iovec *iovec, unsigned n, unsigned m,
                 const struct ucred *ucred,
+                ClientContext *c,
                 const struct timeval *tv,
                 const char *label, size_t label_len,
                 const char *unit_id,
@@ -596,7 +744,7 @@ static void dispatch_message_real(
         gid_t object_gid;
         char *x;
         int r;
-        char *t, *c;
+        _cleanup_(client_context_free_uncachedp) ClientContext *o = NULL;
         uid_t realuid = 0, owner = 0, journal_uid;
         bool owner_valid = false;
 #ifdef HAVE_AUDIT
@@ -604,9 +752,6 @@ static void dispatch_message_real(
                 audit_loginuid[sizeof("_AUDIT_LOGINUID=") + DECIMAL_STR_MAX(uid_t)],
                 o_audit_session[sizeof("OBJECT_AUDIT_SESSION=") + DECIMAL_STR_MAX(uint32_t)],
                 o_audit_loginuid[sizeof("OBJECT_AUDIT_LOGINUID=") + DECIMAL_STR_MAX(uid_t)];
-
-        uint32_t audit;
-        uid_t loginuid;
 #endif
 
         assert(s);
@@ -625,95 +770,78 @@ static void dispatch_message_real(
 
                 sprintf(gid, "_GID="GID_FMT, ucred->gid);
                 IOVEC_SET_STRING(iovec[n++], gid);
+        }
 
-                r = get_process_comm(ucred->pid, &t);
-                if (r >= 0) {
-                        x = strjoina("_COMM=", t);
-                        free(t);
+        if (c) {
+                if (c->comm) {
+                        x = strjoina("_COMM=", c->comm);
                         IOVEC_SET_STRING(iovec[n++], x);
                 }
 
-                r = get_process_exe(ucred->pid, &t);
-                if (r >= 0) {
-                        x = strjoina("_EXE=", t);
-                        free(t);
+                if (c->exe) {
+                        x = strjoina("_EXE=", c->exe);
                         IOVEC_SET_STRING(iovec[n++], x);
                 }
 
-                r = get_process_cmdline(ucred->pid, 0, false, &t);
-                if (r >= 0) {
-                        x = strjoina("_CMDLINE=", t);
-                        free(t);
+                if (c->cmdline) {
+                        x = strjoina("_CMDLINE=", c->cmdline);
                         IOVEC_SET_STRING(iovec[n++], x);
                 }
 
-                r = get_process_capeff(ucred->pid, &t);
-                if (r >= 0) {
-                        x = strjoina("_CAP_EFFECTIVE=", t);
-                        free(t);
+                if (c->capeff) {
+                        x = strjoina("_CAP_EFFECTIVE=", c->capeff);
                         IOVEC_SET_STRING(iovec[n++], x);
                 }
 
 #ifdef HAVE_AUDIT
-                r = audit_session_from_pid(ucred->pid, &audit);
-                if (r >= 0) {
-                        sprintf(audit_session, "_AUDIT_SESSION=%"PRIu32, audit);
+                if (c->auditid != AUDIT_SESSION_INVALID) {
+                        sprintf(audit_session, "_AUDIT_SESSION=%"PRIu32, c->auditid);
                         IOVEC_SET_STRING(iovec[n++], audit_session);
                 }
 
-                r = audit_loginuid_from_pid(ucred->pid, &loginuid);
-                if (r >= 0) {
-                        sprintf(audit_loginuid, "_AUDIT_LOGINUID="UID_FMT, loginuid);
+                if (uid_is_valid(c->loginuid)) {
+                        sprintf(audit_loginuid, "_AUDIT_LOGINUID="UID_FMT, c->loginuid);
                         IOVEC_SET_STRING(iovec[n++], audit_loginuid);
                 }
 #endif
 
-                r = cg_pid_get_path_shifted(ucred->pid, s->cgroup_root, &c);
-                if (r >= 0) {
-                        char *session = NULL;
-
-                        x = strjoina("_SYSTEMD_CGROUP=", c);
+                if (c->cgroup) {
+                        x = strjoina("_SYSTEMD_CGROUP=", c->cgroup);
                         IOVEC_SET_STRING(iovec[n++], x);
 
-                        r = cg_path_get_session(c, &t);
-                        if (r >= 0) {
-                                session = strjoina("_SYSTEMD_SESSION=", t);
-                                free(t);
-                                IOVEC_SET_STRING(iovec[n++], session);
+                        if (c->session) {
+                                x = strjoina("_SYSTEMD_SESSION=", c->session);
+                                IOVEC_SET_STRING(iovec[n++], x);
                         }
 
-                        if (cg_path_get_owner_uid(c, &owner) >= 0) {
+                        if (uid_is_valid(c->owner_uid)) {
+                                owner = c->owner_uid;
                                 owner_valid = true;
 
                                 sprintf(owner_uid, "_SYSTEMD_OWNER_UID="UID_FMT, owner);
                                 IOVEC_SET_STRING(iovec[n++], owner_uid);
                         }
 
-                        if (cg_path_get_unit(c, &t) >= 0) {
-                                x = strjoina("_SYSTEMD_UNIT=", t);
-                                free(t);
+                        if (c->unit) {
+                                x = strjoina("_SYSTEMD_UNIT=", c->unit);
                                 IOVEC_SET_STRING(iovec[n++], x);
-                        } else if (unit_id && !session) {
+                        } else if (unit_id && !c->session) {
                                 x = strjoina("_SYSTEMD_UNIT=", unit_id);
                                 IOVEC_SET_STRING(iovec[n++], x);
                         }
 
-                        if (cg_path_get_user_unit(c, &t) >= 0) {
-                                x = strjoina("_SYSTEMD_USER_UNIT=", t);
-                                free(t);
+                        if (c->user_unit) {
+                                x = strjoina("_SYSTEMD_USER_UNIT=", c->user_unit);
                                 IOVEC_SET_STRING(iovec[n++], x);
-                        } else if (unit_id && session) {
+                        } else if (unit_id && c->session) {
                                 x = strjoina("_SYSTEMD_USER_UNIT=", unit_id);
                                 IOVEC_SET_STRING(iovec[n++], x);
                         }
 
-                        if (cg_path_get_slice(c, &t) >= 0) {
-                                x = strjoina("_SYSTEMD_SLICE=", t);
-                                free(t);
+                        if (c->slice) {
+                                x = strjoina("_SYSTEMD_SLICE=", c->slice);
                                 IOVEC_SET_STRING(iovec[n++], x);
                         }
-
-                        free(c);
                 } else if (unit_id) {
                         x = strjoina("_SYSTEMD_UNIT=", unit_id);
                         IOVEC_SET_STRING(iovec[n++], x);
@@ -726,22 +854,19 @@ static void dispatch_message_real(
 
                                 *((char*) mempcpy(stpcpy(x, "_SELINUX_CONTEXT="), label, label_len)) = 0;
                                 IOVEC_SET_STRING(iovec[n++], x);
-                        } else {
-                                security_context_t con;
-
-                                if (getpidcon(ucred->pid, &con) >= 0) {
-                                        x = strjoina("_SELINUX_CONTEXT=", con);
-
-                                        freecon(con);
-                                        IOVEC_SET_STRING(iovec[n++], x);
-                                }
+                        } else if (c->label) {
+                                x = strjoina("_SELINUX_CONTEXT=", c->label);
+                                IOVEC_SET_STRING(iovec[n++], x);
                         }
                 }
 #endif
+        } else if (ucred && unit_id) {
+                x = strjoina("_SYSTEMD_UNIT=", unit_id);
+                IOVEC_SET_STRING(iovec[n++], x);
         }
         assert(n <= m);
 
-        if (object_pid) {
+        if (object_pid && client_context_read_uncached(s, object_pid, &o) >= 0) {
                 r = get_process_uid(object_pid, &object_uid);
                 if (r >= 0) {
                         sprintf(o_uid, "OBJECT_UID="UID_FMT, object_uid);
@@ -754,71 +879,56 @@ static void dispatch_message_real(
                         IOVEC_SET_STRING(iovec[n++], o_gid);
                 }
 
-                r = get_process_comm(object_pid, &t);
-                if (r >= 0) {
-                        x = strjoina("OBJECT_COMM=", t);
-                        free(t);
+                if (o->comm) {
+                        x = strjoina("OBJECT_COMM=", o->comm);
                         IOVEC_SET_STRING(iovec[n++], x);
                 }
 
-                r = get_process_exe(object_pid, &t);
-                if (r >= 0) {
-                        x = strjoina("OBJECT_EXE=", t);
-                        free(t);
+                if (o->exe) {
+                        x = strjoina("OBJECT_EXE=", o->exe);
                         IOVEC_SET_STRING(iovec[n++], x);
                 }
 
-                r = get_process_cmdline(object_pid, 0, false, &t);
-                if (r >= 0) {
-                        x = strjoina("OBJECT_CMDLINE=", t);
-                        free(t);
+                if (o->cmdline) {
+                        x = strjoina("OBJECT_CMDLINE=", o->cmdline);
                         IOVEC_SET_STRING(iovec[n++], x);
                 }
 
 #ifdef HAVE_AUDIT
-                r = audit_session_from_pid(object_pid, &audit);
-                if (r >= 0) {
-                        sprintf(o_audit_session, "OBJECT_AUDIT_SESSION=%"PRIu32, audit);
+                if (o->auditid != AUDIT_SESSION_INVALID) {
+                        sprintf(o_audit_session, "OBJECT_AUDIT_SESSION=%"PRIu32, o->auditid);
                         IOVEC_SET_STRING(iovec[n++], o_audit_session);
                 }
 
-                r = audit_loginuid_from_pid(object_pid, &loginuid);
-                if (r >= 0) {
-                        sprintf(o_audit_loginuid, "OBJECT_AUDIT_LOGINUID="UID_FMT, loginuid);
+                if (uid_is_valid(o->loginuid)) {
+                        sprintf(o_audit_loginuid, "OBJECT_AUDIT_LOGINUID="UID_FMT, o->loginuid);
                         IOVEC_SET_STRING(iovec[n++], o_audit_loginuid);
                 }
 #endif
 
-                r = cg_pid_get_path_shifted(object_pid, s->cgroup_root, &c);
-                if (r >= 0) {
-                        x = strjoina("OBJECT_SYSTEMD_CGROUP=", c);
+                if (o->cgroup) {
+                        x = strjoina("OBJECT_SYSTEMD_CGROUP=", o->cgroup);
                         IOVEC_SET_STRING(iovec[n++], x);
 
-                        r = cg_path_get_session(c, &t);
-                        if (r >= 0) {
-                                x = strjoina("OBJECT_SYSTEMD_SESSION=", t);
-                                free(t);
+                        if (o->session) {
+                                x = strjoina("OBJECT_SYSTEMD_SESSION=", o->session);
                                 IOVEC_SET_STRING(iovec[n++], x);
                         }
 
-                        if (cg_path_get_owner_uid(c, &owner) >= 0) {
-                                sprintf(o_owner_uid, "OBJECT_SYSTEMD_OWNER_UID="UID_FMT, owner);
+                        if (uid_is_valid(o->owner_uid)) {
+                                sprintf(o_owner_uid, "OBJECT_SYSTEMD_OWNER_UID="UID_FMT, o->owner_uid);
                                 IOVEC_SET_STRING(iovec[n++], o_owner_uid);
                         }
 
-                        if (cg_path_get_unit(c, &t) >= 0) {
-                                x = strjoina("OBJECT_SYSTEMD_UNIT=", t);
-                                free(t);
+                        if (o->unit) {
+                                x = strjoina("OBJECT_SYSTEMD_UNIT=", o->unit);
                                 IOVEC_SET_STRING(iovec[n++], x);
                         }
 
-                        if (cg_path_get_user_unit(c, &t) >= 0) {
-                                x = strjoina("OBJECT_SYSTEMD_USER_UNIT=", t);
-                                free(t);
+                        if (o->user_unit) {
+                                x = strjoina("OBJECT_SYSTEMD_USER_UNIT=", o->user_unit);
                                 IOVEC_SET_STRING(iovec[n++], x);
                         }
-
-                        free(c);
                 }
         }
         assert(n <= m);
@@ -865,6 +975,7 @@ void server_driver_message(Server *s, sd_id128_t message_id, const char *format,
         int r;
         va_list ap;
         struct ucred ucred = {};
+        ClientContext *c = NULL;
 
         assert(s);
         assert(format);
@@ -893,8 +1004,10 @@ void server_driver_message(Server *s, sd_id128_t message_id, const char *format,
         ucred.uid = getuid();
         ucred.gid = getgid();
 
+        (void) client_context_get(s, ucred.pid, &ucred, &c);
+
         if (r >= 0)
-                dispatch_message_real(s, iovec, n, ELEMENTSOF(iovec), &ucred, NULL, NULL, 0, NULL, LOG_INFO, 0);
+                dispatch_message_real(s, iovec, n, ELEMENTSOF(iovec), &ucred, c, NULL, NULL, 0, NULL, LOG_INFO, 0);
 
         while (m < n)
                 free(iovec[m++].iov_base);
@@ -908,7 +1021,7 @@ void server_driver_message(Server *s, sd_id128_t message_id, const char *format,
                 n = 3;
                 IOVEC_SET_STRING(iovec[n++], "PRIORITY=4");
                 IOVEC_SET_STRING(iovec[n++], buf);
-                dispatch_message_real(s, iovec, n, ELEMENTSOF(iovec), &ucred, NULL, NULL, 0, NULL, LOG_INFO, 0);
+                dispatch_message_real(s, iovec, n, ELEMENTSOF(iovec), &ucred, c, NULL, NULL, 0, NULL, LOG_INFO, 0);
         }
 }
 
@@ -922,10 +1035,9 @@ void server_dispatch_message(
                 int priority,
                 pid_t object_pid) {
 
-        int rl, r;
-        _cleanup_free_ char *path = NULL;
+        ClientContext *c = NULL;
         uint64_t available = 0;
-        char *c;
+        int rl;
 
         assert(s);
         assert(iovec || n == 0);
@@ -944,39 +1056,33 @@ void server_dispatch_message(
         if (!ucred)
                 goto finish;
 
-        r = cg_pid_get_path_shifted(ucred->pid, s->cgroup_root, &path);
-        if (r < 0)
+        (void) client_context_get(s, ucred->pid, ucred, &c);
+        if (!c || !c->rate_limit_group)
                 goto finish;
 
-        /* example: /user/lennart/3/foobar
-         *          /system/dbus.service/foobar
-         *
-         * So let's cut of everything past the third /, since that is
-         * where user directories start */
-
-        c = strchr(path, '/');
-        if (c) {
-                c = strchr(c+1, '/');
-                if (c) {
-                        c = strchr(c+1, '/');
-                        if (c)
-                                *c = 0;
-                }
-        }
-
         (void) determine_space(s, false, false, &available, NULL);
-        rl = journal_rate_limit_test(s->rate_limit, path, priority & LOG_PRIMASK, available);
+        rl = journal_rate_limit_test(s->rate_limit, c->rate_limit_id, c->rate_limit_group, priority & LOG_PRIMASK, available);
         if (rl == 0)
                 return;
 
         /* Write a suppression message if we suppressed something */
-        if (rl > 1)
+        if (rl > 1) {
+                const char *path;
+
+                /* Writing the driver message might evict our context
+                 * from the cache, hence copy the group name first */
+                path = strdupa(c->rate_limit_group);
+
                 server_driver_message(s, SD_MESSAGE_JOURNAL_DROPPED,
                                       LOG_MESSAGE("Suppressed %u messages from %s", rl - 1, path),
                                       NULL);
 
+                c = NULL;
+                (void) client_context_get(s, ucred->pid, ucred, &c);
+        }
+
 finish:
-        dispatch_message_real(s, iovec, n, m, ucred, tv, label, label_len, unit_id, priority, object_pid);
+        dispatch_message_real(s, iovec, n, m, ucred, c, tv, label, label_len, unit_id, priority, object_pid);
 }
 
 
@@ -1154,78 +1260,45 @@ finish:
         return r;
 }
 
-int server_process_datagram(sd_event_source *es, int fd, uint32_t revents, void *userdata) {
-        Server *s = userdata;
+/* We use NAME_MAX space for the SELinux label here. The kernel
+ * currently enforces no limit, but according to suggestions from the
+ * SELinux people this will change and it will probably be identical
+ * to NAME_MAX. For now we use that, but this should be updated one
+ * day when the final limit is known. */
+typedef union DatagramControl {
+        struct cmsghdr cmsghdr;
+        uint8_t buf[CMSG_SPACE(sizeof(struct ucred)) +
+                    CMSG_SPACE(sizeof(struct timeval)) +
+                    CMSG_SPACE(sizeof(int)) + /* fd */
+                    CMSG_SPACE(NAME_MAX)]; /* selinux label */
+} DatagramControl;
+
+struct DatagramBatch {
+        struct mmsghdr msgs[DATAGRAM_RECV_MAX];
+        struct iovec iovec[DATAGRAM_RECV_MAX];
+        DatagramControl control[DATAGRAM_RECV_MAX];
+        union sockaddr_union sa[DATAGRAM_RECV_MAX];
+
+        /* DATAGRAM_RECV_MAX slots of DATAGRAM_SLOT_SIZE each. This
+         * is only reserved address space, pages are allocated when
+         * a datagram is actually received into them. */
+        uint8_t *arena;
+};
+
+static void server_process_datagram_message(Server *s, int fd, char *buffer, size_t n, struct msghdr *msghdr) {
         struct ucred *ucred = NULL;
         struct timeval *tv = NULL;
         struct cmsghdr *cmsg;
         char *label = NULL;
-        size_t label_len = 0, m;
-        struct iovec iovec;
-        ssize_t n;
-        int *fds = NULL, v = 0;
+        size_t label_len = 0;
+        int *fds = NULL;
         unsigned n_fds = 0;
 
-        union {
-                struct cmsghdr cmsghdr;
-
-                /* We use NAME_MAX space for the SELinux label
-                 * here. The kernel currently enforces no
-                 * limit, but according to suggestions from
-                 * the SELinux people this will change and it
-                 * will probably be identical to NAME_MAX. For
-                 * now we use that, but this should be updated
-                 * one day when the final limit is known. */
-                uint8_t buf[CMSG_SPACE(sizeof(struct ucred)) +
-                            CMSG_SPACE(sizeof(struct timeval)) +
-                            CMSG_SPACE(sizeof(int)) + /* fd */
-                            CMSG_SPACE(NAME_MAX)]; /* selinux label */
-        } control = {};
-
-        union sockaddr_union sa = {};
-
-        struct msghdr msghdr = {
-                .msg_iov = &iovec,
-                .msg_iovlen = 1,
-                .msg_control = &control,
-                .msg_controllen = sizeof(control),
-                .msg_name = &sa,
-                .msg_namelen = sizeof(sa),
-        };
-
         assert(s);
-        assert(fd == s->native_fd || fd == s->syslog_fd || fd == s->audit_fd);
-
-        if (revents != EPOLLIN) {
-                log_error("Got invalid event from epoll for datagram fd: %"PRIx32, revents);
-                return -EIO;
-        }
-
-        /* Try to get the right size, if we can. (Not all
-         * sockets support SIOCINQ, hence we just try, but
-         * don't rely on it. */
-        (void) ioctl(fd, SIOCINQ, &v);
-
-        /* Fix it up, if it is too small. We use the same fixed value as auditd here. Awful! */
-        m = PAGE_ALIGN(MAX3((size_t) v + 1,
-                            (size_t) LINE_MAX,
-                            ALIGN(sizeof(struct nlmsghdr)) + ALIGN((size_t) MAX_AUDIT_MESSAGE_LENGTH)) + 1);
+        assert(buffer);
+        assert(msghdr);
 
-        if (!GREEDY_REALLOC(s->buffer, s->buffer_size, m))
-                return log_oom();
-
-        iovec.iov_base = s->buffer;
-        iovec.iov_len = s->buffer_size - 1; /* Leave room for trailing NUL we add later */
-
-        n = recvmsg(fd, &msghdr, MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
-        if (n < 0) {
-                if (errno == EINTR || errno == EAGAIN)
-                        return 0;
-
-                return log_error_errno(errno, "recvmsg() failed: %m");
-        }
-
-        CMSG_FOREACH(cmsg, &msghdr) {
+        CMSG_FOREACH(cmsg, msghdr) {
 
                 if (cmsg->cmsg_level == SOL_SOCKET &&
                     cmsg->cmsg_type == SCM_CREDENTIALS &&
@@ -1247,17 +1320,17 @@ int server_process_datagram(sd_event_source *es, int fd, uint32_t revents, void
         }
 
         /* And a trailing NUL, just in case */
-        s->buffer[n] = 0;
+        buffer[n] = 0;
 
         if (fd == s->syslog_fd) {
                 if (n > 0 && n_fds == 0)
-                        server_process_syslog_message(s, strstrip(s->buffer), ucred, tv, label, label_len);
+                        server_process_syslog_message(s, strstrip(buffer), ucred, tv, label, label_len);
                 else if (n_fds > 0)
                         log_warning("Got file descriptors via syslog socket. Ignoring.");
 
         } else if (fd == s->native_fd) {
                 if (n > 0 && n_fds == 0)
-                        server_process_native_message(s, s->buffer, n, ucred, tv, label, label_len);
+                        server_process_native_message(s, buffer, n, ucred, tv, label, label_len);
                 else if (n == 0 && n_fds == 1)
                         server_process_native_file(s, fds[0], ucred, tv, label, label_len);
                 else if (n_fds > 0)
@@ -1267,15 +1340,194 @@ int server_process_datagram(sd_event_source *es, int fd, uint32_t revents, void
                 assert(fd == s->audit_fd);
 
                 if (n > 0 && n_fds == 0)
-                        server_process_audit_message(s, s->buffer, n, ucred, &sa, msghdr.msg_namelen);
+                        server_process_audit_message(s, buffer, n, ucred, msghdr->msg_name, msghdr->msg_namelen);
                 else if (n_fds > 0)
                         log_warning("Got file descriptors via audit socket. Ignoring.");
         }
 
         close_many(fds, n_fds);
+}
+
+static int server_process_one_datagram(Server *s, int fd, size_t size) {
+        DatagramControl control = {};
+        union sockaddr_union sa = {};
+        struct iovec iovec;
+        size_t m;
+        ssize_t n;
+
+        struct msghdr msghdr = {
+                .msg_iov = &iovec,
+                .msg_iovlen = 1,
+                .msg_control = &control,
+                .msg_controllen = sizeof(control),
+                .msg_name = &sa,
+                .msg_namelen = sizeof(sa),
+        };
+
+        assert(s);
+
+        /* Fix the size up, if it is too small. We use the same fixed value as auditd here. Awful! */
+        m = PAGE_ALIGN(MAX3(size + 1,
+                            (size_t) LINE_MAX,
+                            ALIGN(sizeof(struct nlmsghdr)) + ALIGN((size_t) MAX_AUDIT_MESSAGE_LENGTH)) + 1);
+
+        if (!GREEDY_REALLOC(s->buffer, s->buffer_size, m))
+                return log_oom();
+
+        iovec.iov_base = s->buffer;
+        iovec.iov_len = s->buffer_size - 1; /* Leave room for trailing NUL we add later */
+
+        n = recvmsg(fd, &msghdr, MSG_DONTWAIT|MSG_CMSG_CLOEXEC);
+        if (n < 0) {
+                if (errno == EAGAIN)
+                        return 0;
+                if (errno == EINTR)
+                        return 1;
+
+                return log_error_errno(errno, "recvmsg() failed: %m");
+        }
+
+        server_process_datagram_message(s, fd, s->buffer, n, &msghdr);
+        return 1;
+}
+
+static int datagram_batch_new(DatagramBatch **ret) {
+        DatagramBatch *b;
+
+        assert(ret);
+
+        b = new0(DatagramBatch, 1);
+        if (!b)
+                return -ENOMEM;
+
+        b->arena = mmap(NULL, DATAGRAM_RECV_MAX * DATAGRAM_SLOT_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        if (b->arena == MAP_FAILED) {
+                free(b);
+                return -errno;
+        }
+
+        *ret = b;
         return 0;
 }
 
+static DatagramBatch* datagram_batch_free(DatagramBatch *b) {
+        if (!b)
+                return NULL;
+
+        munmap(b->arena, DATAGRAM_RECV_MAX * DATAGRAM_SLOT_SIZE);
+        return mfree(b);
+}
+
+static int server_process_datagrams(Server *s, int fd) {
+        DatagramBatch *b;
+        unsigned i;
+        int v = 0, n, r;
+
+        assert(s);
+
+        /* Find out how large the next datagram is, if we can. (Not
+         * all sockets support SIOCINQ, hence we just try, but don't
+         * rely on it.) A datagram that doesn't fit into a slot, which
+         * sd-journal never sends, is received on its own. */
+        (void) ioctl(fd, SIOCINQ, &v);
+        if ((size_t) v >= DATAGRAM_SLOT_SIZE)
+                return server_process_one_datagram(s, fd, v);
+
+        if (!s->datagram_batch) {
+                r = datagram_batch_new(&s->datagram_batch);
+                if (r < 0) {
+                        log_warning_errno(r, "Failed to allocate datagram slots, receiving one by one: %m");
+                        return server_process_one_datagram(s, fd, v);
+                }
+        }
+
+        b = s->datagram_batch;
+
+        for (i = 0; i < DATAGRAM_RECV_MAX; i++) {
+                b->iovec[i] = (struct iovec) {
+                        .iov_base = b->arena + i * DATAGRAM_SLOT_SIZE,
+                        .iov_len = DATAGRAM_SLOT_SIZE - 1, /* Leave room for trailing NUL we add later */
+                };
+
+                b->msgs[i] = (struct mmsghdr) {
+                        .msg_hdr = {
+                                .msg_iov = b->iovec + i,
+                                .msg_iovlen = 1,
+                                .msg_control = b->control + i,
+                                .msg_controllen = sizeof(DatagramControl),
+                                .msg_name = b->sa + i,
+                                .msg_namelen = sizeof(union sockaddr_union),
+                        },
+                };
+        }
+
+        n = recvmmsg(fd, b->msgs, DATAGRAM_RECV_MAX, MSG_DONTWAIT|MSG_CMSG_CLOEXEC, NULL);
+        if (n < 0) {
+                if (errno == EAGAIN)
+                        return 0;
+                if (errno == EINTR)
+                        return 1;
+
+                return log_error_errno(errno, "recvmmsg() failed: %m");
+        }
+
+        for (i = 0; i < (unsigned) n; i++) {
+                size_t l = b->msgs[i].msg_len;
+
+                if (b->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                        /* Only a client that raised its send buffer beyond what sd-journal uses can get here */
+                        struct cmsghdr *cmsg;
+
+                        log_warning("Got datagram larger than %zu bytes among others, dropping.", DATAGRAM_SLOT_SIZE - 1);
+
+                        CMSG_FOREACH(cmsg, &b->msgs[i].msg_hdr)
+                                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+                                        close_many((int*) CMSG_DATA(cmsg), (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+                } else
+                        server_process_datagram_message(s, fd, b->iovec[i].iov_base, l, &b->msgs[i].msg_hdr);
+
+                /* Give back the memory of large datagrams */
+                if (l > DATAGRAM_SLOT_KEEP)
+                        (void) madvise((uint8_t*) b->iovec[i].iov_base + DATAGRAM_SLOT_KEEP,
+                                       MIN(PAGE_ALIGN(l + 1), DATAGRAM_SLOT_SIZE) - DATAGRAM_SLOT_KEEP,
+                                       MADV_DONTNEED);
+        }
+
+        return n;
+}
+
+int server_process_datagram(sd_event_source *es, int fd, uint32_t revents, void *userdata) {
+        Server *s = userdata;
+        unsigned i = 0;
+        int r;
+
+        assert(s);
+        assert(fd == s->native_fd || fd == s->syslog_fd || fd == s->audit_fd);
+
+        if (revents != EPOLLIN) {
+                log_error("Got invalid event from epoll for datagram fd: %"PRIx32, revents);
+                return -EIO;
+        }
+
+        /* Process a couple of datagrams per wakeup, received in
+         * batches with recvmmsg(), so that a burst of small messages
+         * neither costs us one event loop iteration nor one system
+         * call each, and write the resulting entries together. The
+         * upper bound ensures we still give the other event sources a
+         * chance to run. */
+        compress_queue_batch_begin(s);
+
+        do {
+                r = server_process_datagrams(s, fd);
+                if (r > 0)
+                        i += r;
+        } while (r > 0 && i < DATAGRAM_BATCH_MAX);
+
+        compress_queue_batch_end(s);
+
+        return r < 0 ? r : 0;
+}
+
 static int dispatch_sigusr1(sd_event_source *es, const struct signalfd_siginfo *si, void *userdata) {
         Server *s = userdata;
         int r;
@@ -1295,6 +1547,58 @@ static int dispatch_sigusr1(sd_event_source *es, const struct signalfd_siginfo *
         return 0;
 }
 
+static int rate_limit_stats_compare(const void *a, const void *b) {
+        const JournalRateLimitStats *x = a, *y = b;
+
+        /* Most dropped messages first */
+        if (x->n_dropped > y->n_dropped)
+                return -1;
+        if (x->n_dropped < y->n_dropped)
+                return 1;
+
+        return 0;
+}
+
+static void server_send_rate_limit_stats(Server *s) {
+        _cleanup_free_ JournalRateLimitStats *stats = NULL;
+        uint64_t n_passed, n_dropped, n_evicted;
+        size_t n = 0, i;
+        int r;
+
+        assert(s);
+
+        journal_rate_limit_get_totals(s->rate_limit, &n_passed, &n_dropped, &n_evicted);
+        if (n_passed + n_dropped == 0)
+                return;
+
+        r = journal_rate_limit_get_stats(s->rate_limit, &stats, &n);
+        if (r < 0) {
+                log_debug_errno(r, "Failed to get rate limiting statistics, ignoring: %m");
+                return;
+        }
+
+        server_driver_message(s, SD_ID128_NULL,
+                              LOG_MESSAGE("Rate limiting: %zu groups, %" PRIu64 " messages passed, %" PRIu64 " dropped, %" PRIu64 " active groups replaced.",
+                                          n, n_passed, n_dropped, n_evicted),
+                              "RATE_LIMIT_GROUPS=%zu", n,
+                              "RATE_LIMIT_PASSED=%" PRIu64, n_passed,
+                              "RATE_LIMIT_DROPPED=%" PRIu64, n_dropped,
+                              "RATE_LIMIT_EVICTED=%" PRIu64, n_evicted,
+                              NULL);
+
+        /* And the groups that lost the most messages */
+        qsort_safe(stats, n, sizeof(JournalRateLimitStats), rate_limit_stats_compare);
+
+        for (i = 0; i < MIN(n, (size_t) RATE_LIMIT_STATS_GROUPS_MAX) && stats[i].n_dropped > 0; i++)
+                server_driver_message(s, SD_ID128_NULL,
+                                      LOG_MESSAGE("Rate limiting %s: %" PRIu64 " messages passed, %" PRIu64 " dropped.",
+                                                  strna(stats[i].name), stats[i].n_passed, stats[i].n_dropped),
+                                      "RATE_LIMIT_GROUP=%s", strna(stats[i].name),
+                                      "RATE_LIMIT_PASSED=%" PRIu64, stats[i].n_passed,
+                                      "RATE_LIMIT_DROPPED=%" PRIu64, stats[i].n_dropped,
+                                      NULL);
+}
+
 static int dispatch_sigusr2(sd_event_source *es, const struct signalfd_siginfo *si, void *userdata) {
         Server *s = userdata;
         int r;
@@ -1302,6 +1606,8 @@ static int dispatch_sigusr2(sd_event_source *es, const struct signalfd_siginfo *
         assert(s);
 
         log_info("Received request to rotate journal from PID " PID_FMT, si->ssi_pid);
+        client_context_send_stats(s);
+        server_send_rate_limit_stats(s);
         server_rotate(s);
         server_vacuum(s, true, true);
 
@@ -1927,6 +2233,8 @@ void server_done(Server *s) {
         JournalFile *f;
         assert(s);
 
+        compress_queue_free(s);
+
         if (s->deferred_closes) {
                 journal_file_close_set(s->deferred_closes);
                 set_free(s->deferred_closes);
@@ -1935,6 +2243,8 @@ void server_done(Server *s) {
         while (s->stdout_streams)
                 stdout_stream_free(s->stdout_streams);
 
+        client_context_flush_all(s);
+
         if (s->system_journal)
                 (void) journal_file_close(s->system_journal);
 
@@ -1960,6 +2270,11 @@ void server_done(Server *s) {
         sd_event_source_unref(s->hostname_event_source);
         sd_event_source_unref(s->notify_event_source);
         sd_event_source_unref(s->watchdog_event_source);
+
+        /* Waits for the boot index update, if it is running */
+        sd_event_source_unref(s->boot_index_event_source);
+        strv_free(s->boot_index_directories);
+
         sd_event_unref(s->event);
 
         safe_close(s->syslog_fd);
@@ -1976,6 +2291,7 @@ void server_done(Server *s) {
         if (s->kernel_seqnum)
                 munmap(s->kernel_seqnum, sizeof(uint64_t));
 
+        datagram_batch_free(s->datagram_batch);
         free(s->buffer);
         free(s->tty_path);
         free(s->cgroup_root);
@@ -25,12 +25,15 @@
 #include "sd-event.h"
 
 typedef struct Server Server;
+typedef struct DatagramBatch DatagramBatch;
 
 #include "hashmap.h"
 #include "journal-file.h"
+#include "journald-compress.h"
 #include "journald-rate-limit.h"
 #include "journald-stream.h"
 #include "list.h"
+#include "prioq.h"
 
 typedef enum Storage {
         STORAGE_AUTO,
@@ -75,6 +78,11 @@ struct Server {
         sd_event_source *notify_event_source;
         sd_event_source *watchdog_event_source;
 
+        /* The boot index is updated on a worker thread, these are the
+         * directories it is working on */
+        sd_event_source *boot_index_event_source;
+        char **boot_index_directories;
+
         JournalFile *runtime_journal;
         JournalFile *system_journal;
         OrderedHashmap *user_journals;
@@ -84,6 +92,9 @@ struct Server {
         char *buffer;
         size_t buffer_size;
 
+        /* Slots for receiving datagrams with recvmmsg() */
+        DatagramBatch *datagram_batch;
+
         JournalRateLimit *rate_limit;
         usec_t sync_interval_usec;
         usec_t rate_limit_interval;
@@ -148,6 +159,17 @@ struct Server {
         /* Cached cgroup root, so that we don't have to query that all the time */
         char *cgroup_root;
 
+        /* Cached per-process metadata, see journald-context.c */
+        Hashmap *client_contexts;
+        Prioq *client_contexts_lru;
+        uint64_t n_client_context_hits;
+        uint64_t n_client_context_misses;
+
+        /* Asynchronous compression of large payloads, and batched
+         * writes, see journald-compress.c */
+        CompressQueue *compress_queue;
+        unsigned write_batch;
+
         usec_t watchdog_usec;
 };
 
@@ -160,6 +182,8 @@ struct Server {
 #define N_IOVEC_PAYLOAD_FIELDS 15
 
 void server_dispatch_message(Server *s, struct iovec *iovec, unsigned n, unsigned m, const struct ucred *ucred, const struct timeval *tv, const char *label, size_t label_len, const char *unit_id, int priority, pid_t object_pid);
+void server_write_entries(Server *s, uid_t uid, const JournalEntry entries[], unsigned n_entries, int priority);
+void server_write_entry(Server *s, uid_t uid, const dual_timestamp *ts, const struct iovec *iovec, const JournalPrecompressed *precompressed, unsigned n, int priority);
 void server_driver_message(Server *s, sd_id128_t message_id, const char *format, ...) _printf_(3,0) _sentinel_;
 
 /* gperf lookup function */
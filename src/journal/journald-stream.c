@@ -49,6 +49,14 @@
 
 #define STDOUT_STREAMS_MAX 4096
 
+/* Lines longer than LINE_MAX are split, but we read more than that at
+ * once, so that a single read() usually yields many lines */
+#define STDOUT_STREAM_BUFFER_SIZE (4*LINE_MAX)
+
+/* Room kept in front of every line, so that MESSAGE= can be prefixed
+ * in place, without copying the line */
+#define STDOUT_STREAM_HEADROOM (sizeof("MESSAGE=")-1)
+
 typedef enum StdoutStreamState {
         STDOUT_STREAM_IDENTIFIER,
         STDOUT_STREAM_UNIT_ID,
@@ -79,8 +87,15 @@ struct StdoutStream {
         bool fdstore:1;
         bool in_notify_queue:1;
 
-        char buffer[LINE_MAX+1];
-        size_t length;
+        /* Unprocessed data is at buffer[offset] and following, for
+         * length bytes. A partial line is only moved back to the
+         * front when we run out of room behind it. */
+        char buffer[STDOUT_STREAM_HEADROOM + STDOUT_STREAM_BUFFER_SIZE + 1];
+        size_t offset, length;
+
+        /* Fields that are the same for every line, prepared once */
+        char *syslog_identifier;
+        size_t label_len;
 
         sd_event_source *event_source;
 
@@ -112,6 +127,7 @@ void stdout_stream_free(StdoutStream *s) {
         free(s->label);
         free(s->identifier);
         free(s->unit_id);
+        free(s->syslog_identifier);
         free(s->state_file);
 
         free(s);
@@ -225,17 +241,27 @@ fail:
         return log_error_errno(r, "Failed to save stream data %s: %m", s->state_file);
 }
 
+static void stdout_stream_prepare(StdoutStream *s) {
+        assert(s);
+
+        s->syslog_identifier = mfree(s->syslog_identifier);
+        if (s->identifier)
+                s->syslog_identifier = strappend("SYSLOG_IDENTIFIER=", s->identifier);
+
+        s->label_len = s->label ? strlen(s->label) : 0;
+}
+
 static int stdout_stream_log(StdoutStream *s, const char *p) {
         struct iovec iovec[N_IOVEC_META_FIELDS + 5];
         int priority;
         char syslog_priority[] = "PRIORITY=\0";
         char syslog_facility[sizeof("SYSLOG_FACILITY=")-1 + DECIMAL_STR_MAX(int) + 1];
-        _cleanup_free_ char *message = NULL, *syslog_identifier = NULL;
+        char *message;
         unsigned n = 0;
-        size_t label_len;
 
         assert(s);
         assert(p);
+        assert(p >= s->buffer + STDOUT_STREAM_HEADROOM);
 
         priority = s->priority;
 
@@ -267,18 +293,16 @@ static int stdout_stream_log(StdoutStream *s, const char *p) {
                 IOVEC_SET_STRING(iovec[n++], syslog_facility);
         }
 
-        if (s->identifier) {
-                syslog_identifier = strappend("SYSLOG_IDENTIFIER=", s->identifier);
-                if (syslog_identifier)
-                        IOVEC_SET_STRING(iovec[n++], syslog_identifier);
-        }
+        if (s->syslog_identifier)
+                IOVEC_SET_STRING(iovec[n++], s->syslog_identifier);
 
-        message = strappend("MESSAGE=", p);
-        if (message)
-                IOVEC_SET_STRING(iovec[n++], message);
+        /* The line is in our buffer, and whatever precedes it there
+         * has been processed already, hence we may overwrite it */
+        message = (char*) p - strlen("MESSAGE=");
+        memcpy(message, "MESSAGE=", strlen("MESSAGE="));
+        IOVEC_SET_STRING(iovec[n++], message);
 
-        label_len = s->label ? strlen(s->label) : 0;
-        server_dispatch_message(s->server, iovec, n, ELEMENTSOF(iovec), &s->ucred, NULL, s->label, label_len, s->unit_id, priority, 0);
+        server_dispatch_message(s->server, iovec, n, ELEMENTSOF(iovec), &s->ucred, NULL, s->label, s->label_len, s->unit_id, priority, 0);
         return 0;
 }
 
@@ -372,6 +396,7 @@ static int stdout_stream_line(StdoutStream *s, char *p) {
 
                 s->forward_to_console = !!r;
                 s->state = STDOUT_STREAM_RUNNING;
+                stdout_stream_prepare(s);
 
                 /* Try to save the stream, so that journald can be restarted and we can recover */
                 (void) stdout_stream_save(s);
@@ -391,24 +416,32 @@ static int stdout_stream_scan(StdoutStream *s, bool force_flush) {
 
         assert(s);
 
-        p = s->buffer;
+        p = s->buffer + s->offset;
         remaining = s->length;
         for (;;) {
-                char *end;
+                char *end, saved = 0;
                 size_t skip;
+                bool split = false;
 
-                end = memchr(p, '\n', remaining);
+                end = memchr(p, '\n', MIN(remaining, (size_t) LINE_MAX));
                 if (end)
                         skip = end - p + 1;
-                else if (remaining >= sizeof(s->buffer) - 1) {
-                        end = p + sizeof(s->buffer) - 1;
-                        skip = remaining;
+                else if (remaining >= LINE_MAX) {
+                        /* Overlong line, split it. The byte we
+                         * terminate the string with belongs to the
+                         * next part, hence restore it afterwards. */
+                        end = p + LINE_MAX;
+                        skip = LINE_MAX;
+                        saved = *end;
+                        split = true;
                 } else
                         break;
 
                 *end = 0;
 
                 r = stdout_stream_line(s, p);
+                if (split)
+                        *end = saved;
                 if (r < 0)
                         return r;
 
@@ -426,10 +459,8 @@ static int stdout_stream_scan(StdoutStream *s, bool force_flush) {
                 remaining = 0;
         }
 
-        if (p > s->buffer) {
-                memmove(s->buffer, p, remaining);
-                s->length = remaining;
-        }
+        s->offset = remaining > 0 ? (size_t) (p - s->buffer) : STDOUT_STREAM_HEADROOM;
+        s->length = remaining;
 
         return 0;
 }
@@ -446,7 +477,15 @@ static int stdout_stream_process(sd_event_source *es, int fd, uint32_t revents,
                 goto terminate;
         }
 
-        l = read(s->fd, s->buffer+s->length, sizeof(s->buffer)-1-s->length);
+        /* Only move the partial line we still have to the front if
+         * there's not enough room left behind it. This happens at
+         * most once every few reads, rather than after each one. */
+        if (sizeof(s->buffer) - 1 - s->offset - s->length < LINE_MAX) {
+                memmove(s->buffer + STDOUT_STREAM_HEADROOM, s->buffer + s->offset, s->length);
+                s->offset = STDOUT_STREAM_HEADROOM;
+        }
+
+        l = read(s->fd, s->buffer + s->offset + s->length, sizeof(s->buffer) - 1 - s->offset - s->length);
         if (l < 0) {
 
                 if (errno == EAGAIN)
@@ -456,13 +495,18 @@ static int stdout_stream_process(sd_event_source *es, int fd, uint32_t revents,
                 goto terminate;
         }
 
+        /* All lines we got from this read are written together */
+        compress_queue_batch_begin(s->server);
+
         if (l == 0) {
                 stdout_stream_scan(s, true);
+                compress_queue_batch_end(s->server);
                 goto terminate;
         }
 
         s->length += l;
         r = stdout_stream_scan(s, false);
+        compress_queue_batch_end(s->server);
         if (r < 0)
                 goto terminate;
 
@@ -473,7 +517,7 @@ terminate:
         return 0;
 }
 
-static int stdout_stream_install(Server *s, int fd, StdoutStream **ret) {
+int stdout_stream_install(Server *s, int fd, StdoutStream **ret) {
         _cleanup_(stdout_stream_freep) StdoutStream *stream = NULL;
         int r;
 
@@ -486,6 +530,7 @@ static int stdout_stream_install(Server *s, int fd, StdoutStream **ret) {
 
         stream->fd = -1;
         stream->priority = LOG_INFO;
+        stream->offset = STDOUT_STREAM_HEADROOM;
 
         r = getpeercred(fd, &stream->ucred);
         if (r < 0)
@@ -642,6 +687,8 @@ static int stdout_stream_restore(Server *s, const char *fname, int fd) {
         /* Ignore all parsing errors */
         (void) stdout_stream_load(stream, fname);
 
+        stdout_stream_prepare(stream);
+
         return 0;
 }
 
@@ -18,6 +18,7 @@
 ***/
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <sys/mman.h>
 
@@ -35,6 +36,28 @@ typedef struct Window Window;
 typedef struct Context Context;
 typedef struct FileDescriptor FileDescriptor;
 
+/* The SIGBUS queue is shared by all caches of the process, which may
+ * be used from different threads. Processing it is serialized, and
+ * each cache only ever looks at its own windows.
+ *
+ * Pages a cache doesn't find among its windows are moved to a pending
+ * list, numbered in the order they were found. Every cache remembers
+ * up to which number it looked at that list. Once all live caches
+ * looked at a page without claiming it, its window is gone, and the
+ * page is dropped. */
+static pthread_mutex_t sigbus_mutex = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(MMapCache, caches) = NULL;
+static unsigned n_caches = 0;
+
+typedef struct SigbusPage {
+        void *addr;
+        uint64_t serial;
+} SigbusPage;
+
+static SigbusPage sigbus_pending[SIGBUS_QUEUE_MAX];
+static unsigned n_sigbus_pending = 0;
+static uint64_t sigbus_serial = 0;
+
 struct Window {
         MMapCache *cache;
 
@@ -55,11 +78,25 @@ struct Window {
         LIST_HEAD(Context, contexts);
 };
 
+typedef enum AccessPattern {
+        ACCESS_UNKNOWN,
+        ACCESS_FORWARD,
+        ACCESS_BACKWARD,
+        ACCESS_RANDOM,
+} AccessPattern;
+
 struct Context {
         MMapCache *cache;
         unsigned id;
         Window *window;
 
+        /* The last window we mapped for this context, to detect
+         * sequential access */
+        int last_fd;
+        uint64_t last_offset, last_size;
+        AccessPattern pattern;
+        unsigned n_pattern;
+
         LIST_FIELDS(Context, by_window);
 };
 
@@ -74,13 +111,17 @@ struct MMapCache {
         int n_ref;
         unsigned n_windows;
 
-        unsigned n_hit, n_missed;
+        unsigned n_hit, n_missed, n_unmapped;
 
         Hashmap *fds;
         Context *contexts[MMAP_CACHE_MAX_CONTEXTS];
 
         LIST_HEAD(Window, unused);
         Window *last_unused;
+
+        /* The last pending SIGBUS page we looked at */
+        uint64_t sigbus_serial;
+        LIST_FIELDS(MMapCache, caches);
 };
 
 #define WINDOWS_MIN 64
@@ -88,10 +129,23 @@ struct MMapCache {
 #ifdef ENABLE_DEBUG_MMAP_CACHE
 /* Tiny windows increase mmap activity and the chance of exposing unsafe use. */
 # define WINDOW_SIZE (page_size())
+# define WINDOW_SIZE_MIN (page_size())
+# define WINDOW_SIZE_MAX (page_size())
 #else
 # define WINDOW_SIZE (8ULL*1024ULL*1024ULL)
+# define WINDOW_SIZE_MIN (1ULL*1024ULL*1024ULL)
+# if __SIZEOF_POINTER__ > 4
+#  define WINDOW_SIZE_MAX (64ULL*1024ULL*1024ULL)
+# else
+#  define WINDOW_SIZE_MAX (16ULL*1024ULL*1024ULL)
+# endif
 #endif
 
+/* How many misses in a row need to follow a pattern before we adjust
+ * window sizes to it */
+#define SEQUENTIAL_MISSES_MIN 2
+#define RANDOM_MISSES_MIN 8
+
 MMapCache* mmap_cache_new(void) {
         MMapCache *m;
 
@@ -100,6 +154,14 @@ MMapCache* mmap_cache_new(void) {
                 return NULL;
 
         m->n_ref = 1;
+
+        assert_se(pthread_mutex_lock(&sigbus_mutex) == 0);
+        /* Pages that are pending already can't be in our windows */
+        m->sigbus_serial = sigbus_serial;
+        LIST_PREPEND(caches, caches, m);
+        n_caches++;
+        assert_se(pthread_mutex_unlock(&sigbus_mutex) == 0);
+
         return m;
 }
 
@@ -116,8 +178,10 @@ static void window_unlink(Window *w) {
 
         assert(w);
 
-        if (w->ptr)
+        if (w->ptr) {
                 munmap(w->ptr, w->size);
+                w->cache->n_unmapped++;
+        }
 
         if (w->fd)
                 LIST_REMOVE(by_fd, w->fd->windows, w);
@@ -270,6 +334,7 @@ static Context *context_add(MMapCache *m, unsigned id) {
 
         c->cache = m;
         c->id = id;
+        c->last_fd = -1;
 
         assert(!m->contexts[id]);
         m->contexts[id] = c;
@@ -333,12 +398,24 @@ static FileDescriptor* fd_add(MMapCache *m, int fd) {
         return f;
 }
 
+static void mmap_cache_process_sigbus(MMapCache *m);
+
 static void mmap_cache_free(MMapCache *m) {
         FileDescriptor *f;
         int i;
 
         assert(m);
 
+        /* Don't leave SIGBUS entries of our windows behind for the
+         * other caches */
+        mmap_cache_process_sigbus(m);
+
+        assert_se(pthread_mutex_lock(&sigbus_mutex) == 0);
+        assert(n_caches > 0);
+        LIST_REMOVE(caches, caches, m);
+        n_caches--;
+        assert_se(pthread_mutex_unlock(&sigbus_mutex) == 0);
+
         for (i = 0; i < MMAP_CACHE_MAX_CONTEXTS; i++)
                 if (m->contexts[i])
                         context_free(m->contexts[i]);
@@ -494,6 +571,96 @@ static int mmap_try_harder(MMapCache *m, void *addr, int fd, int prot, int flags
         return 0;
 }
 
+static AccessPattern context_classify(Context *c, int fd, uint64_t offset, size_t size) {
+        AccessPattern p;
+
+        assert(c);
+
+        /* We are called whenever a request of this context couldn't
+         * be satisfied from an existing window. If the request is
+         * right behind (or in front of) the window we mapped for it
+         * last, it is probably scanning through the file. */
+
+        if (c->last_fd != fd)
+                p = ACCESS_UNKNOWN;
+        else if (offset + size > c->last_offset + c->last_size &&
+                 offset >= c->last_offset &&
+                 offset < c->last_offset + c->last_size + WINDOW_SIZE)
+                p = ACCESS_FORWARD;
+        else if (offset < c->last_offset &&
+                 offset + size <= c->last_offset + c->last_size &&
+                 offset + WINDOW_SIZE >= c->last_offset)
+                p = ACCESS_BACKWARD;
+        else
+                p = ACCESS_RANDOM;
+
+        if (p == c->pattern)
+                c->n_pattern++;
+        else {
+                c->pattern = p;
+                c->n_pattern = 1;
+        }
+
+        if (IN_SET(p, ACCESS_FORWARD, ACCESS_BACKWARD) && c->n_pattern >= SEQUENTIAL_MISSES_MIN)
+                return p;
+        if (p == ACCESS_RANDOM && c->n_pattern >= RANDOM_MISSES_MIN)
+                return p;
+
+        return ACCESS_UNKNOWN;
+}
+
+static uint64_t window_size_for(Context *c, AccessPattern p) {
+        unsigned shift;
+
+        assert(c);
+
+        switch (p) {
+
+        case ACCESS_FORWARD:
+        case ACCESS_BACKWARD:
+                /* Double the window size with every further miss,
+                 * so that long scans need fewer, larger maps */
+                shift = MIN(c->n_pattern - SEQUENTIAL_MISSES_MIN + 1, 3U);
+                return MIN(WINDOW_SIZE << shift, WINDOW_SIZE_MAX);
+
+        case ACCESS_RANDOM:
+                return WINDOW_SIZE_MIN;
+
+        default:
+                return WINDOW_SIZE;
+        }
+}
+
+static void window_advise(void *ptr, uint64_t woffset, uint64_t wsize, uint64_t offset, AccessPattern p) {
+        uint64_t skip;
+
+        /* Let the kernel know what to expect, so that it can read
+         * ahead for sequential scans, and doesn't waste time reading
+         * around pages we'll never look at otherwise. This is only an
+         * optimization, hence ignore errors. */
+
+        switch (p) {
+
+        case ACCESS_FORWARD:
+                (void) madvise(ptr, wsize, MADV_SEQUENTIAL);
+
+                skip = (offset - woffset) & ~((uint64_t) page_size() - 1ULL);
+                (void) madvise((uint8_t*) ptr + skip, wsize - skip, MADV_WILLNEED);
+                break;
+
+        case ACCESS_BACKWARD:
+                (void) madvise(ptr, wsize, MADV_WILLNEED);
+                break;
+
+        case ACCESS_RANDOM:
+                (void) madvise(ptr, wsize, MADV_RANDOM);
+                break;
+
+        default:
+                break;
+        }
+}
+
 static int add_mmap(
                 MMapCache *m,
                 int fd,
@@ -505,7 +672,8 @@ static int add_mmap(
                 struct stat *st,
                 void **ret) {
 
-        uint64_t woffset, wsize;
+        uint64_t woffset, wsize, window_size;
+        AccessPattern pattern = ACCESS_UNKNOWN;
         Context *c;
         FileDescriptor *f;
         Window *w;
@@ -518,21 +686,39 @@ static int add_mmap(
         assert(size > 0);
         assert(ret);
 
+        c = context_add(m, context);
+        if (!c)
+                return -ENOMEM;
+
+        /* Adapt the window size to how the file is accessed, but
+         * only when reading: writers always append close to the
+         * end of the file anyway */
+        if (!(prot & PROT_WRITE))
+                pattern = context_classify(c, fd, offset, size);
+        window_size = window_size_for(c, pattern);
+
         woffset = offset & ~((uint64_t) page_size() - 1ULL);
         wsize = size + (offset - woffset);
         wsize = PAGE_ALIGN(wsize);
 
-        if (wsize < WINDOW_SIZE) {
+        if (wsize < window_size) {
                 uint64_t delta;
 
-                delta = PAGE_ALIGN((WINDOW_SIZE - wsize) / 2);
+                if (pattern == ACCESS_FORWARD)
+                        /* Map what follows the request */
+                        delta = 0;
+                else if (pattern == ACCESS_BACKWARD)
+                        /* Map what precedes the request */
+                        delta = window_size - wsize;
+                else
+                        delta = PAGE_ALIGN((window_size - wsize) / 2);
 
                 if (delta > offset)
                         woffset = 0;
                 else
                         woffset -= delta;
 
-                wsize = WINDOW_SIZE;
+                wsize = window_size;
         }
 
         if (st) {
@@ -551,9 +737,7 @@ static int add_mmap(
         if (r < 0)
                 return r;
 
-        c = context_add(m, context);
-        if (!c)
-                goto outofmem;
+        window_advise(d, woffset, wsize, offset, pattern);
 
         f = fd_add(m, fd);
         if (!f)
@@ -567,6 +751,10 @@ static int add_mmap(
         c->window = w;
         LIST_PREPEND(by_window, w->contexts, c);
 
+        c->last_fd = fd;
+        c->last_offset = woffset;
+        c->last_size = wsize;
+
         *ret = (uint8_t*) w->ptr + (offset - w->offset);
         return 1;
 
@@ -627,18 +815,57 @@ unsigned mmap_cache_get_missed(MMapCache *m) {
         return m->n_missed;
 }
 
+unsigned mmap_cache_get_unmapped(MMapCache *m) {
+        assert(m);
+
+        return m->n_unmapped;
+}
+
+static bool mmap_cache_claim_sigbus(MMapCache *m, void *addr) {
+        FileDescriptor *f;
+        Iterator i;
+
+        assert(m);
+
+        HASHMAP_FOREACH(f, m->fds, i) {
+                Window *w;
+
+                LIST_FOREACH(by_fd, w, f->windows)
+                        if ((uint8_t*) addr >= (uint8_t*) w->ptr &&
+                            (uint8_t*) addr < (uint8_t*) w->ptr + w->size) {
+                                f->sigbus = true;
+                                return true;
+                        }
+        }
+
+        return false;
+}
+
 static void mmap_cache_process_sigbus(MMapCache *m) {
+        uint64_t seen;
         bool found = false;
         FileDescriptor *f;
+        MMapCache *c;
         Iterator i;
+        unsigned j, k;
         int r;
 
         assert(m);
 
+        assert_se(pthread_mutex_lock(&sigbus_mutex) == 0);
+
+        /* Look at the pages the other caches left for us */
+        for (j = 0; j < n_sigbus_pending; )
+                if (sigbus_pending[j].serial > m->sigbus_serial &&
+                    mmap_cache_claim_sigbus(m, sigbus_pending[j].addr)) {
+                        found = true;
+                        sigbus_pending[j] = sigbus_pending[--n_sigbus_pending];
+                } else
+                        j++;
+
         /* Iterate through all triggered pages and mark their files as
          * invalidated */
-        for (;;) {
-                bool ours;
+        while (n_sigbus_pending < ELEMENTSOF(sigbus_pending)) {
                 void *addr;
 
                 r = sigbus_pop(&addr);
@@ -649,30 +876,42 @@ static void mmap_cache_process_sigbus(MMapCache *m) {
                         abort();
                 }
 
-                ours = false;
-                HASHMAP_FOREACH(f, m->fds, i) {
-                        Window *w;
-
-                        LIST_FOREACH(by_fd, w, f->windows) {
-                                if ((uint8_t*) addr >= (uint8_t*) w->ptr &&
-                                    (uint8_t*) addr < (uint8_t*) w->ptr + w->size) {
-                                        found = ours = f->sigbus = true;
-                                        break;
-                                }
-                        }
-
-                        if (ours)
-                                break;
+                if (mmap_cache_claim_sigbus(m, addr)) {
+                        found = true;
+                        continue;
                 }
 
-                /* Didn't find a matching window, give up */
-                if (!ours) {
+                /* Didn't find a matching window, give up, unless it
+                 * might belong to another cache */
+                if (n_caches <= 1) {
                         log_error("Unknown SIGBUS page, aborting.");
                         abort();
                 }
+
+                /* Leave the page for the other caches to find */
+                sigbus_pending[n_sigbus_pending++] = (SigbusPage) {
+                        .addr = addr,
+                        .serial = ++sigbus_serial,
+                };
         }
 
-        /* The list of triggered pages is now empty. Now, let's remap
+        m->sigbus_serial = sigbus_serial;
+
+        /* Drop the pages every live cache looked at already */
+        seen = sigbus_serial;
+        LIST_FOREACH(caches, c, caches)
+                seen = MIN(seen, c->sigbus_serial);
+
+        for (k = 0; k < n_sigbus_pending; )
+                if (sigbus_pending[k].serial <= seen) {
+                        log_debug("SIGBUS page %p belongs to no cache, ignoring.", sigbus_pending[k].addr);
+                        sigbus_pending[k] = sigbus_pending[--n_sigbus_pending];
+                } else
+                        k++;
+
+        assert_se(pthread_mutex_unlock(&sigbus_mutex) == 0);
+
+        /* No triggered page of ours is queued anymore. Now, let's remap
          * all windows of the triggered file to anonymous maps, so
          * that no page of the file in question is triggered again, so
          * that we can be sure not to hit the queue size limit. */
@@ -23,7 +23,7 @@
 #include <sys/stat.h>
 
 /* One context per object type, plus one of the header, plus one "additional" one */
-#define MMAP_CACHE_MAX_CONTEXTS 9
+#define MMAP_CACHE_MAX_CONTEXTS 10
 
 typedef struct MMapCache MMapCache;
 
@@ -45,5 +45,6 @@ void mmap_cache_close_fd(MMapCache *m, int fd);
 
 unsigned mmap_cache_get_hit(MMapCache *m);
 unsigned mmap_cache_get_missed(MMapCache *m);
+unsigned mmap_cache_get_unmapped(MMapCache *m);
 
 bool mmap_cache_got_sigbus(MMapCache *m, int fd);
@@ -40,6 +40,7 @@
 #include "hashmap.h"
 #include "hostname-util.h"
 #include "io-util.h"
+#include "journal-boot-index.h"
 #include "journal-def.h"
 #include "journal-file.h"
 #include "journal-internal.h"
@@ -62,6 +63,8 @@
 #define DEFAULT_DATA_THRESHOLD (64*1024)
 
 static void remove_file_real(sd_journal *j, JournalFile *f);
+static void unique_values_flush(sd_journal *j);
+static void unique_values_drop_file(sd_journal *j, JournalFile *f);
 
 static bool journal_pid_changed(sd_journal *j) {
         assert(j);
@@ -114,6 +117,16 @@ static int journal_put_error(sd_journal *j, int r, const char *path) {
         return 0;
 }
 
+static void invalidate_files_prioq(sd_journal *j) {
+        assert(j);
+
+        /* Forget how the files are ordered, the next iteration step
+         * will look at all of them again */
+
+        j->files_prioq = prioq_free(j->files_prioq);
+        set_clear(j->files_at_tail);
+}
+
 static void detach_location(sd_journal *j) {
         Iterator i;
         JournalFile *f;
@@ -125,6 +138,8 @@ static void detach_location(sd_journal *j) {
 
         ORDERED_HASHMAP_FOREACH(f, j->files, i)
                 journal_file_reset_location(f);
+
+        invalidate_files_prioq(j);
 }
 
 static void reset_location(sd_journal *j) {
@@ -752,6 +767,23 @@ static int next_with_matches(
                               direction, ret, offset);
 }
 
+static bool beyond_location(sd_journal *j, JournalFile *f, direction_t direction) {
+        int k;
+
+        assert(j);
+        assert(f);
+
+        /* Checks whether the candidate entry of f lies beyond the
+         * entry we are currently looking at, in the given direction */
+
+        if (j->current_location.type != LOCATION_DISCRETE)
+                return true;
+
+        k = compare_with_location(f, &j->current_location);
+
+        return direction == DIRECTION_DOWN ? k > 0 : k < 0;
+}
+
 static int next_beyond_location(sd_journal *j, JournalFile *f, direction_t direction) {
         Object *c;
         uint64_t cp, n_entries;
@@ -798,18 +830,7 @@ static int next_beyond_location(sd_journal *j, JournalFile *f, direction_t direc
          * suppressed but one. */
 
         for (;;) {
-                bool found;
-
-                if (j->current_location.type == LOCATION_DISCRETE) {
-                        int k;
-
-                        k = compare_with_location(f, &j->current_location);
-
-                        found = direction == DIRECTION_DOWN ? k > 0 : k < 0;
-                } else
-                        found = true;
-
-                if (found)
+                if (beyond_location(j, f, direction))
                         return 1;
 
                 r = next_with_matches(j, f, direction, &c, &cp);
@@ -820,50 +841,154 @@ static int next_beyond_location(sd_journal *j, JournalFile *f, direction_t direc
         }
 }
 
-static int real_journal_next(sd_journal *j, direction_t direction) {
-        JournalFile *f, *new_file = NULL;
+static int compare_files_down(const void *a, const void *b) {
+        return journal_file_compare_locations((JournalFile*) a, (JournalFile*) b);
+}
+
+static int compare_files_up(const void *a, const void *b) {
+        return journal_file_compare_locations((JournalFile*) b, (JournalFile*) a);
+}
+
+static int files_prioq_put_next(sd_journal *j, JournalFile *f, direction_t direction) {
+        int r;
+
+        assert(j);
+        assert(f);
+
+        /* Moves f on to its next candidate entry, and puts it into
+         * the priority queue, or aside if it has none. */
+
+        r = next_beyond_location(j, f, direction);
+        if (r < 0) {
+                log_debug_errno(r, "Can't iterate through %s, ignoring: %m", f->path);
+                remove_file_real(j, f);
+                return 0;
+        } else if (r == 0) {
+                f->location_type = LOCATION_TAIL;
+
+                /* Archived files never grow again, hence there's
+                 * no point in looking at them again */
+                if (f->header->state == STATE_ARCHIVED)
+                        return 0;
+
+                r = set_ensure_allocated(&j->files_at_tail, NULL);
+                if (r < 0)
+                        return r;
+
+                r = set_put(j->files_at_tail, f);
+                return r < 0 ? r : 0;
+        }
+
+        (void) set_remove(j->files_at_tail, f);
+
+        return prioq_put(j->files_prioq, f, &f->prioq_idx);
+}
+
+static int files_prioq_rebuild(sd_journal *j, direction_t direction) {
+        JournalFile *f;
         Iterator i;
-        Object *o;
         int r;
 
-        assert_return(j, -EINVAL);
-        assert_return(!journal_pid_changed(j), -ECHILD);
+        assert(j);
+
+        invalidate_files_prioq(j);
+
+        j->files_prioq = prioq_new(direction == DIRECTION_DOWN ? compare_files_down : compare_files_up);
+        if (!j->files_prioq)
+                return -ENOMEM;
+
+        j->files_prioq_direction = direction;
 
         ORDERED_HASHMAP_FOREACH(f, j->files, i) {
-                bool found;
+                f->prioq_idx = PRIOQ_IDX_NULL;
 
-                r = next_beyond_location(j, f, direction);
+                r = files_prioq_put_next(j, f, direction);
                 if (r < 0) {
-                        log_debug_errno(r, "Can't iterate through %s, ignoring: %m", f->path);
-                        remove_file_real(j, f);
-                        continue;
-                } else if (r == 0) {
-                        f->location_type = LOCATION_TAIL;
-                        continue;
+                        invalidate_files_prioq(j);
+                        return r;
                 }
+        }
 
-                if (!new_file)
-                        found = true;
-                else {
-                        int k;
+        return 0;
+}
 
-                        k = journal_file_compare_locations(f, new_file);
+static int files_prioq_advance(sd_journal *j, direction_t direction) {
+        JournalFile *f;
+        Iterator i;
+        int r;
 
-                        found = direction == DIRECTION_DOWN ? k < 0 : k > 0;
-                }
+        assert(j);
+        assert(j->current_file);
 
-                if (found)
-                        new_file = f;
+        /* The file the current entry came from was taken out of the
+         * queue, move it on and put it back. */
+        r = files_prioq_put_next(j, j->current_file, direction);
+        if (r < 0)
+                return r;
+
+        /* Other files might contain the same entry, in which case
+         * they need to move on, too. */
+        while ((f = prioq_peek(j->files_prioq)) && !beyond_location(j, f, direction)) {
+                assert_se(prioq_pop(j->files_prioq) == f);
+                f->prioq_idx = PRIOQ_IDX_NULL;
+
+                r = files_prioq_put_next(j, f, direction);
+                if (r < 0)
+                        return r;
+        }
+
+        /* And files that hit their end before might have grown */
+        SET_FOREACH(f, j->files_at_tail, i) {
+                r = files_prioq_put_next(j, f, direction);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+static int real_journal_next(sd_journal *j, direction_t direction) {
+        JournalFile *f;
+        Object *o;
+        int r;
+
+        assert_return(j, -EINVAL);
+        assert_return(!journal_pid_changed(j), -ECHILD);
+
+        /* We keep the files ordered by their next candidate entry.
+         * When we continue in the same direction from an entry we
+         * returned before, only the file that entry came from needs
+         * to move on. Otherwise, e.g. after seeking, we need to look
+         * at all files. */
+
+        if (j->files_prioq &&
+            j->files_prioq_direction == direction &&
+            j->current_location.type == LOCATION_DISCRETE &&
+            j->current_file)
+                r = files_prioq_advance(j, direction);
+        else
+                r = files_prioq_rebuild(j, direction);
+        if (r < 0) {
+                invalidate_files_prioq(j);
+                return r;
         }
 
-        if (!new_file)
+        f = prioq_peek(j->files_prioq);
+        if (!f)
                 return 0;
 
-        r = journal_file_move_to_object(new_file, OBJECT_ENTRY, new_file->current_offset, &o);
-        if (r < 0)
+        r = journal_file_move_to_object(f, OBJECT_ENTRY, f->current_offset, &o);
+        if (r < 0) {
+                invalidate_files_prioq(j);
                 return r;
+        }
 
-        set_location(j, new_file, o);
+        /* The current file is kept out of the queue, as its location
+         * is no longer comparable */
+        assert_se(prioq_pop(j->files_prioq) == f);
+        f->prioq_idx = PRIOQ_IDX_NULL;
+
+        set_location(j, f, o);
 
         return 1;
 }
@@ -1255,6 +1380,22 @@ static const char *skip_slash(const char *p) {
         return p;
 }
 
+static bool file_outside_realtime_range(sd_journal *j, JournalFile *f) {
+        assert(j);
+        assert(f);
+
+        /* Files that are still written to might still get entries
+         * in the range, hence only archived files are checked */
+        if (f->header->state != STATE_ARCHIVED)
+                return false;
+
+        if (le64toh(f->header->n_entries) == 0)
+                return true;
+
+        return le64toh(f->header->tail_entry_realtime) < j->realtime_since ||
+               le64toh(f->header->head_entry_realtime) > j->realtime_until;
+}
+
 static int add_any_file(sd_journal *j, int fd, const char *path) {
         JournalFile *f = NULL;
         bool close_fd = false;
@@ -1296,6 +1437,13 @@ static int add_any_file(sd_journal *j, int fd, const char *path) {
 
         /* journal_file_dump(f); */
 
+        if (file_outside_realtime_range(j, f)) {
+                log_debug("File %s contains no entries in the requested time range, ignoring.", f->path);
+                f->close_fd = close_fd;
+                (void) journal_file_close(f);
+                return 0;
+        }
+
         r = ordered_hashmap_put(j->files, f->path, f);
         if (r < 0) {
                 f->close_fd = close_fd;
@@ -1312,6 +1460,9 @@ static int add_any_file(sd_journal *j, int fd, const char *path) {
 
         check_network(j, f->fd);
 
+        /* The new file needs to be considered in the next iteration step */
+        invalidate_files_prioq(j);
+
         j->current_invalidate_counter++;
 
         return 0;
@@ -1361,15 +1512,8 @@ static void remove_file_real(sd_journal *j, JournalFile *f) {
         assert(j);
         assert(f);
 
-        ordered_hashmap_remove(j->files, f->path);
-
-        log_debug("File %s removed.", f->path);
-
-        if (j->current_file == f) {
-                j->current_file = NULL;
-                j->current_field = 0;
-        }
-
+        /* Find the files following this one while it is still
+         * around, they are looked up by its path */
         if (j->unique_file == f) {
                 /* Jump to the next unique_file or NULL if that one was last */
                 j->unique_file = ordered_hashmap_next(j->files, j->unique_file->path);
@@ -1385,6 +1529,20 @@ static void remove_file_real(sd_journal *j, JournalFile *f) {
                         j->fields_file_lost = true;
         }
 
+        ordered_hashmap_remove(j->files, f->path);
+
+        (void) prioq_remove(j->files_prioq, f, &f->prioq_idx);
+        (void) set_remove(j->files_at_tail, f);
+
+        log_debug("File %s removed.", f->path);
+
+        if (j->current_file == f) {
+                j->current_file = NULL;
+                j->current_field = 0;
+        }
+
+        unique_values_drop_file(j, f);
+
         (void) journal_file_close(f);
 
         j->current_invalidate_counter++;
@@ -1717,6 +1875,7 @@ static sd_journal *journal_new(int flags, const char *path) {
         j->inotify_fd = -1;
         j->flags = flags;
         j->data_threshold = DEFAULT_DATA_THRESHOLD;
+        j->realtime_until = USEC_INFINITY;
 
         if (path) {
                 j->path = strdup(path);
@@ -1966,6 +2125,9 @@ _public_ void sd_journal_close(sd_journal *j) {
 
         ordered_hashmap_free(j->files);
 
+        prioq_free(j->files_prioq);
+        set_free(j->files_at_tail);
+
         while ((d = hashmap_first(j->directories_by_path)))
                 remove_directory(j, d);
 
@@ -1978,7 +2140,8 @@ _public_ void sd_journal_close(sd_journal *j) {
         safe_close(j->inotify_fd);
 
         if (j->mmap) {
-                log_debug("mmap cache statistics: %u hit, %u miss", mmap_cache_get_hit(j->mmap), mmap_cache_get_missed(j->mmap));
+                log_debug("mmap cache statistics: %u hit, %u miss, %u unmapped",
+                          mmap_cache_get_hit(j->mmap), mmap_cache_get_missed(j->mmap), mmap_cache_get_unmapped(j->mmap));
                 mmap_cache_unref(j->mmap);
         }
 
@@ -1986,6 +2149,9 @@ _public_ void sd_journal_close(sd_journal *j) {
                 free(p);
         hashmap_free(j->errors);
 
+        unique_values_flush(j);
+        hashmap_free(j->unique_values);
+
         free(j->path);
         free(j->prefix);
         free(j->unique_field);
@@ -2109,31 +2275,33 @@ _public_ int sd_journal_get_data(sd_journal *j, const char *field, const void **
 
         field_length = strlen(field);
 
-        n = journal_file_entry_n_items(o);
+        n = journal_file_entry_n_items(f, o);
         for (i = 0; i < n; i++) {
                 uint64_t p, l;
-                le64_t le_hash;
+                le64_t le_hash = 0;
                 size_t t;
                 int compression;
 
-                p = le64toh(o->entry.items[i].object_offset);
-                le_hash = o->entry.items[i].hash;
+                p = journal_file_entry_item_object_offset(f, o, i);
+                if (!f->compact)
+                        le_hash = o->entry.items.regular[i].hash;
                 r = journal_file_move_to_object(f, OBJECT_DATA, p, &o);
                 if (r < 0)
                         return r;
 
-                if (le_hash != o->data.hash)
+                if (!f->compact && le_hash != o->data.hash)
                         return -EBADMSG;
 
                 l = le64toh(o->object.size) - offsetof(Object, data.payload);
 
                 compression = o->object.flags & OBJECT_COMPRESSION_MASK;
                 if (compression) {
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
                         r = decompress_startswith(compression,
                                                   o->data.payload, l,
                                                   &f->compress_buffer, &f->compress_buffer_size,
-                                                  field, field_length, '=');
+                                                  field, field_length, '=',
+                                                  journal_file_compress_dictionary(f));
                         if (r < 0)
                                 log_debug_errno(r, "Cannot decompress %s object of length %"PRIu64" at offset "OFSfmt": %m",
                                                 object_compressed_to_string(compression), l, p);
@@ -2144,7 +2312,7 @@ _public_ int sd_journal_get_data(sd_journal *j, const char *field, const void **
                                 r = decompress_blob(compression,
                                                     o->data.payload, l,
                                                     &f->compress_buffer, &f->compress_buffer_size, &rsize,
-                                                    j->data_threshold);
+                                                    j->data_threshold, journal_file_compress_dictionary(f));
                                 if (r < 0)
                                         return r;
 
@@ -2193,13 +2361,14 @@ static int return_data(sd_journal *j, JournalFile *f, Object *o, const void **da
 
         compression = o->object.flags & OBJECT_COMPRESSION_MASK;
         if (compression) {
-#if defined(HAVE_XZ) || defined(HAVE_LZ4)
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
                 size_t rsize;
                 int r;
 
                 r = decompress_blob(compression,
                                     o->data.payload, l, &f->compress_buffer,
-                                    &f->compress_buffer_size, &rsize, j->data_threshold);
+                                    &f->compress_buffer_size, &rsize, j->data_threshold,
+                                    journal_file_compress_dictionary(f));
                 if (r < 0)
                         return r;
 
@@ -2219,7 +2388,7 @@ static int return_data(sd_journal *j, JournalFile *f, Object *o, const void **da
 _public_ int sd_journal_enumerate_data(sd_journal *j, const void **data, size_t *size) {
         JournalFile *f;
         uint64_t p, n;
-        le64_t le_hash;
+        le64_t le_hash = 0;
         int r;
         Object *o;
 
@@ -2239,17 +2408,18 @@ _public_ int sd_journal_enumerate_data(sd_journal *j, const void **data, size_t
         if (r < 0)
                 return r;
 
-        n = journal_file_entry_n_items(o);
+        n = journal_file_entry_n_items(f, o);
         if (j->current_field >= n)
                 return 0;
 
-        p = le64toh(o->entry.items[j->current_field].object_offset);
-        le_hash = o->entry.items[j->current_field].hash;
+        p = journal_file_entry_item_object_offset(f, o, j->current_field);
+        if (!f->compact)
+                le_hash = o->entry.items.regular[j->current_field].hash;
         r = journal_file_move_to_object(f, OBJECT_DATA, p, &o);
         if (r < 0)
                 return r;
 
-        if (le_hash != o->data.hash)
+        if (!f->compact && le_hash != o->data.hash)
                 return -EBADMSG;
 
         r = return_data(j, f, o, data, size);
@@ -2549,6 +2719,170 @@ _public_ int sd_journal_get_cutoff_monotonic_usec(sd_journal *j, sd_id128_t boot
         return found;
 }
 
+void journal_restrict_realtime(sd_journal *j, usec_t since, usec_t until) {
+        Iterator i;
+        JournalFile *f;
+
+        assert(j);
+
+        /* Drops archived files which cannot contain any entries in
+         * the specified range, so that we don't have to look at
+         * them at all when iterating, and ignores such files if they
+         * show up later on. This is useful when only a short time
+         * range is shown out of a large journal. */
+
+        j->realtime_since = since;
+        j->realtime_until = until;
+
+        ORDERED_HASHMAP_FOREACH(f, j->files, i)
+                if (file_outside_realtime_range(j, f)) {
+                        log_debug("File %s contains no entries in the requested time range, ignoring.", f->path);
+                        remove_file_real(j, f);
+                }
+}
+
+static int journal_boot_compare_id(const void *a, const void *b) {
+        const JournalBoot *x = a, *y = b;
+
+        return memcmp(&x->id, &y->id, sizeof(x->id));
+}
+
+static int journal_boot_compare_realtime(const void *a, const void *b) {
+        const JournalBoot *x = a, *y = b;
+
+        if (x->first_realtime < y->first_realtime)
+                return -1;
+        if (x->first_realtime > y->first_realtime)
+                return 1;
+
+        return memcmp(&x->id, &y->id, sizeof(x->id));
+}
+
+static int get_file_boots(JournalFile *f, Hashmap *indexes, JournalBoot **boots, size_t *n_allocated, size_t *n_boots) {
+        _cleanup_free_ char *d = NULL;
+        BootIndex *b;
+        int r;
+
+        assert(f);
+        assert(indexes);
+
+        /* Archived files never change, hence we can use the boot
+         * index journald maintains for their directory, if there is
+         * one. Everything else is looked at directly. */
+
+        if (f->header->state != STATE_ARCHIVED)
+                return journal_file_get_boots(f, boots, n_allocated, n_boots);
+
+        d = dirname_malloc(f->path);
+        if (!d)
+                return -ENOMEM;
+
+        if (hashmap_contains(indexes, d))
+                b = hashmap_get(indexes, d);
+        else {
+                r = boot_index_load(d, &b);
+                if (r < 0) {
+                        if (r != -ENOENT)
+                                log_debug_errno(r, "Failed to load boot index of %s, ignoring: %m", d);
+                        b = NULL;
+                }
+
+                r = hashmap_put(indexes, d, b);
+                if (r < 0) {
+                        boot_index_free(b);
+                        return r;
+                }
+
+                d = NULL;
+        }
+
+        if (b) {
+                r = boot_index_get(b, f->header->file_id, boots, n_allocated, n_boots);
+                if (r != 0)
+                        return r;
+        }
+
+        return journal_file_get_boots(f, boots, n_allocated, n_boots);
+}
+
+int journal_get_boots(sd_journal *j, JournalBoot **ret, size_t *ret_n) {
+        _cleanup_free_ JournalBoot *boots = NULL;
+        size_t n_boots = 0, n_allocated = 0, i, k;
+        Hashmap *indexes;
+        JournalFile *f;
+        Iterator it;
+        BootIndex *b;
+        char *d;
+        int r = 0;
+
+        assert(j);
+        assert(ret);
+        assert(ret_n);
+
+        /* Determines all boots in the journal together with their
+         * first and last timestamps, ordered by their first
+         * entry. Instead of iterating through the entire journal we
+         * only look at the _BOOT_ID= data objects of every file,
+         * which directly reference the first and last entry of each
+         * boot. */
+
+        indexes = hashmap_new(&string_hash_ops);
+        if (!indexes)
+                return -ENOMEM;
+
+        ORDERED_HASHMAP_FOREACH(f, j->files, it) {
+                size_t n = n_boots;
+
+                r = get_file_boots(f, indexes, &boots, &n_allocated, &n_boots);
+                if (r == -ENOMEM)
+                        goto finish;
+                if (r < 0) {
+                        log_debug_errno(r, "Failed to determine boots of %s, ignoring: %m", f->path);
+                        n_boots = n;
+                }
+        }
+
+        r = 0;
+
+        /* The same boot may show up in many files, merge them */
+        qsort_safe(boots, n_boots, sizeof(JournalBoot), journal_boot_compare_id);
+
+        for (i = 0, k = 0; i < n_boots; i++) {
+                if (k > 0 && sd_id128_equal(boots[k-1].id, boots[i].id)) {
+                        JournalBoot *m = boots + k - 1;
+
+                        if (boots[i].first_realtime < m->first_realtime) {
+                                m->first_realtime = boots[i].first_realtime;
+                                m->first_monotonic = boots[i].first_monotonic;
+                        }
+
+                        if (boots[i].last_realtime > m->last_realtime) {
+                                m->last_realtime = boots[i].last_realtime;
+                                m->last_monotonic = boots[i].last_monotonic;
+                        }
+
+                        continue;
+                }
+
+                boots[k++] = boots[i];
+        }
+
+        qsort_safe(boots, k, sizeof(JournalBoot), journal_boot_compare_realtime);
+
+        *ret = boots;
+        *ret_n = k;
+        boots = NULL;
+
+finish:
+        HASHMAP_FOREACH_KEY(b, d, indexes, it) {
+                boot_index_free(b);
+                free(d);
+        }
+        hashmap_free(indexes);
+
+        return r;
+}
+
 void journal_print_header(sd_journal *j) {
         Iterator i;
         JournalFile *f;
@@ -2564,6 +2898,17 @@ void journal_print_header(sd_journal *j) {
 
                 journal_file_print_header(f);
         }
+
+        /* The files above were opened and read through this cache */
+        if (j->mmap)
+                printf("%s"
+                       "MMap Cache Hits: %u\n"
+                       "MMap Cache Misses: %u\n"
+                       "MMap Cache Unmapped Windows: %u\n",
+                       newline ? "\n" : "",
+                       mmap_cache_get_hit(j->mmap),
+                       mmap_cache_get_missed(j->mmap),
+                       mmap_cache_get_unmapped(j->mmap));
 }
 
 _public_ int sd_journal_get_usage(sd_journal *j, uint64_t *bytes) {
@@ -2588,6 +2933,228 @@ _public_ int sd_journal_get_usage(sd_journal *j, uint64_t *bytes) {
         return 0;
 }
 
+struct UniqueValue {
+        uint64_t hash;
+
+        /* Number of entries referencing the value, in all files */
+        uint64_t n_entries;
+
+        /* The data object of the first file the value was found in */
+        JournalFile *file;
+        uint64_t offset;
+
+        /* Different values with the same hash, should there ever be any */
+        UniqueValue *same_hash_next;
+
+        LIST_FIELDS(UniqueValue, values);
+};
+
+static void unique_values_flush(sd_journal *j) {
+        UniqueValue *v;
+
+        assert(j);
+
+        hashmap_clear(j->unique_values);
+
+        while ((v = j->unique_values_list)) {
+                LIST_REMOVE(values, j->unique_values_list, v);
+                free(v);
+        }
+
+        j->unique_values_tail = j->unique_values_next = NULL;
+        j->unique_values_complete = false;
+}
+
+/* Looks for the value v of the file f in the remaining files, and
+ * refers to it there instead. Returns 0 if there is no such file. */
+static int unique_value_relocate(sd_journal *j, UniqueValue *v, JournalFile *f) {
+        JournalFile *of;
+        Iterator i;
+        const void *data;
+        size_t size;
+        Object *o;
+        int r;
+
+        r = journal_file_move_to_object(f, OBJECT_UNUSED, v->offset, &o);
+        if (r < 0)
+                return r;
+
+        r = return_data(j, f, o, &data, &size);
+        if (r < 0)
+                return r;
+
+        ORDERED_HASHMAP_FOREACH(of, j->files, i) {
+                uint64_t offset;
+
+                r = journal_file_find_data_object_with_hash(of, data, size, v->hash, NULL, &offset);
+                if (r < 0)
+                        return r;
+                if (r > 0) {
+                        v->file = of;
+                        v->offset = offset;
+                        return 1;
+                }
+        }
+
+        return 0;
+}
+
+static void unique_values_drop_file(sd_journal *j, JournalFile *f) {
+        UniqueValue *v, *n;
+
+        assert(j);
+        assert(f);
+
+        /* The values are referenced by their data object in the file
+         * they were first found in. When that file goes away, refer
+         * to another one with the value, or forget the value. */
+
+        LIST_FOREACH_SAFE(values, v, n, j->unique_values_list) {
+                UniqueValue *head;
+
+                if (v->file != f)
+                        continue;
+
+                if (unique_value_relocate(j, v, f) > 0)
+                        continue;
+
+                head = hashmap_get(j->unique_values, &v->hash);
+                if (head == v) {
+                        if (v->same_hash_next)
+                                assert_se(hashmap_replace(j->unique_values, &v->same_hash_next->hash, v->same_hash_next) >= 0);
+                        else
+                                hashmap_remove(j->unique_values, &v->hash);
+                } else {
+                        UniqueValue **p;
+
+                        for (p = &head->same_hash_next; *p != v; p = &(*p)->same_hash_next)
+                                assert(*p);
+
+                        *p = v->same_hash_next;
+                }
+
+                if (j->unique_values_tail == v)
+                        j->unique_values_tail = v->values_prev;
+                if (j->unique_values_next == v)
+                        j->unique_values_next = v->values_next;
+
+                LIST_REMOVE(values, j->unique_values_list, v);
+                free(v);
+        }
+}
+
+/* Looks for the data object o of j->unique_file among the values seen
+ * so far, and adds it if it is not there yet. Returns > 0 if the value
+ * is new, and 0 if it was seen before, in which case its count is
+ * increased. */
+static int unique_values_add(sd_journal *j, Object *o, const void *data, size_t size) {
+        UniqueValue *head, *v;
+        uint64_t hash, n_entries;
+        int r;
+
+        assert(j);
+        assert(o);
+
+        hash = le64toh(o->data.hash);
+        n_entries = le64toh(o->data.n_entries);
+
+        head = hashmap_get(j->unique_values, &hash);
+
+        for (v = head; v; v = v->same_hash_next) {
+                Object *d;
+
+                /* Data objects are unique within a file, so a
+                 * different object in the same file is a different
+                 * value with a colliding hash */
+                if (v->file == j->unique_file) {
+                        if (v->offset != j->unique_offset)
+                                continue;
+
+                        v->n_entries += n_entries;
+                        return 0;
+                }
+
+                r = journal_file_move_to_object(v->file, OBJECT_DATA, v->offset, &d);
+                if (r < 0)
+                        return r;
+
+                /* If both are stored uncompressed we can compare
+                 * them directly, otherwise let the lookup do it */
+                if (((o->object.flags | d->object.flags) & OBJECT_COMPRESSION_MASK) == 0) {
+                        if (d->object.size != o->object.size ||
+                            memcmp(d->data.payload, o->data.payload, le64toh(o->object.size) - offsetof(Object, data.payload)) != 0)
+                                continue;
+                } else {
+                        r = journal_file_find_data_object_with_hash(v->file, data, size, hash, NULL, NULL);
+                        if (r < 0)
+                                return r;
+                        if (r == 0)
+                                continue;
+                }
+
+                v->n_entries += n_entries;
+                return 0;
+        }
+
+        r = hashmap_ensure_allocated(&j->unique_values, &uint64_hash_ops);
+        if (r < 0)
+                return r;
+
+        v = new0(UniqueValue, 1);
+        if (!v)
+                return -ENOMEM;
+
+        v->hash = hash;
+        v->n_entries = n_entries;
+        v->file = j->unique_file;
+        v->offset = j->unique_offset;
+
+        if (head) {
+                v->same_hash_next = head->same_hash_next;
+                head->same_hash_next = v;
+        } else {
+                r = hashmap_put(j->unique_values, &v->hash, v);
+                if (r < 0) {
+                        free(v);
+                        return r;
+                }
+        }
+
+        LIST_INSERT_AFTER(values, j->unique_values_list, j->unique_values_tail, v);
+        j->unique_values_tail = v;
+
+        return 1;
+}
+
+/* Checks whether the data object o of j->unique_file is in none of the
+ * files traversed before. Unlike unique_values_add() this needs no
+ * memory, but cannot count the entries. */
+static int unique_is_new(sd_journal *j, Object *o, const void *data, size_t size) {
+        JournalFile *of;
+        Iterator i;
+        int r;
+
+        assert(j);
+        assert(o);
+
+        ORDERED_HASHMAP_FOREACH(of, j->files, i) {
+                if (of == j->unique_file)
+                        break;
+
+                /* Skip this file it didn't have any fields indexed */
+                if (JOURNAL_HEADER_CONTAINS(of->header, n_fields) && le64toh(of->header->n_fields) <= 0)
+                        continue;
+
+                r = journal_file_find_data_object_with_hash(of, data, size, le64toh(o->data.hash), NULL, NULL);
+                if (r < 0)
+                        return r;
+                if (r > 0)
+                        return 0;
+        }
+
+        return 1;
+}
+
 _public_ int sd_journal_query_unique(sd_journal *j, const char *field) {
         char *f;
 
@@ -2606,17 +3173,19 @@ _public_ int sd_journal_query_unique(sd_journal *j, const char *field) {
         j->unique_offset = 0;
         j->unique_file_lost = false;
 
+        unique_values_flush(j);
+
         return 0;
 }
 
-_public_ int sd_journal_enumerate_unique(sd_journal *j, const void **data, size_t *l) {
+/* Moves to the next value of the unique field that was not seen yet,
+ * going through the data objects of the field in one file after the
+ * other. Returns 0 when there are no more. */
+static int unique_next(sd_journal *j, Object **ret) {
         size_t k;
 
-        assert_return(j, -EINVAL);
-        assert_return(!journal_pid_changed(j), -ECHILD);
-        assert_return(data, -EINVAL);
-        assert_return(l, -EINVAL);
-        assert_return(j->unique_field, -EINVAL);
+        assert(j);
+        assert(ret);
 
         k = strlen(j->unique_field);
 
@@ -2632,12 +3201,9 @@ _public_ int sd_journal_enumerate_unique(sd_journal *j, const void **data, size_
         }
 
         for (;;) {
-                JournalFile *of;
-                Iterator i;
                 Object *o;
                 const void *odata;
                 size_t ol;
-                bool found;
                 int r;
 
                 /* Proceed to next data object in the field's linked list */
@@ -2699,35 +3265,95 @@ _public_ int sd_journal_enumerate_unique(sd_journal *j, const void **data, size_
                 }
 
                 /* OK, now let's see if we already returned this data
-                 * object by checking if it exists in the earlier
-                 * traversed files. */
-                found = false;
-                ORDERED_HASHMAP_FOREACH(of, j->files, i) {
-                        if (of == j->unique_file)
-                                break;
+                 * object, from one of the earlier traversed files. Only
+                 * keep track of the values if we need to count them. */
+                if (j->unique_counted)
+                        r = unique_values_add(j, o, odata, ol);
+                else
+                        r = unique_is_new(j, o, odata, ol);
+                if (r < 0)
+                        return r;
+                if (r == 0)
+                        continue;
 
-                        /* Skip this file it didn't have any fields indexed */
-                        if (JOURNAL_HEADER_CONTAINS(of->header, n_fields) && le64toh(of->header->n_fields) <= 0)
-                                continue;
+                *ret = o;
+                return 1;
+        }
+}
 
-                        r = journal_file_find_data_object_with_hash(of, odata, ol, le64toh(o->data.hash), NULL, NULL);
+_public_ int sd_journal_enumerate_unique(sd_journal *j, const void **data, size_t *l) {
+        Object *o;
+        int r;
+
+        assert_return(j, -EINVAL);
+        assert_return(!journal_pid_changed(j), -ECHILD);
+        assert_return(data, -EINVAL);
+        assert_return(l, -EINVAL);
+        assert_return(j->unique_field, -EINVAL);
+
+        if (j->unique_counted) {
+                sd_journal_restart_unique(j);
+                j->unique_counted = false;
+        }
+
+        r = unique_next(j, &o);
+        if (r <= 0)
+                return r;
+
+        r = return_data(j, j->unique_file, o, data, l);
+        if (r < 0)
+                return r;
+
+        return 1;
+}
+
+_public_ int sd_journal_enumerate_unique_counted(sd_journal *j, const void **data, size_t *l, uint64_t *count) {
+        UniqueValue *v;
+        Object *o;
+        int r;
+
+        assert_return(j, -EINVAL);
+        assert_return(!journal_pid_changed(j), -ECHILD);
+        assert_return(data, -EINVAL);
+        assert_return(l, -EINVAL);
+        assert_return(j->unique_field, -EINVAL);
+
+        if (!j->unique_counted) {
+                sd_journal_restart_unique(j);
+                j->unique_counted = true;
+        }
+
+        /* A value may show up in any of the files, hence go through
+         * all of them before returning the first one with its count */
+        if (!j->unique_values_complete) {
+                do {
+                        r = unique_next(j, &o);
                         if (r < 0)
                                 return r;
-                        if (r > 0) {
-                                found = true;
-                                break;
-                        }
-                }
+                } while (r > 0);
 
-                if (found)
-                        continue;
+                j->unique_values_next = j->unique_values_list;
+                j->unique_values_complete = true;
+        }
 
-                r = return_data(j, j->unique_file, o, data, l);
-                if (r < 0)
-                        return r;
+        v = j->unique_values_next;
+        if (!v)
+                return 0;
 
-                return 1;
-        }
+        r = journal_file_move_to_object(v->file, OBJECT_DATA, v->offset, &o);
+        if (r < 0)
+                return r;
+
+        r = return_data(j, v->file, o, data, l);
+        if (r < 0)
+                return r;
+
+        if (count)
+                *count = v->n_entries;
+
+        j->unique_values_next = v->values_next;
+
+        return 1;
 }
 
 _public_ void sd_journal_restart_unique(sd_journal *j) {
@@ -2737,6 +3363,8 @@ _public_ void sd_journal_restart_unique(sd_journal *j) {
         j->unique_file = NULL;
         j->unique_offset = 0;
         j->unique_file_lost = false;
+
+        unique_values_flush(j);
 }
 
 _public_ int sd_journal_enumerate_fields(sd_journal *j, const char **field) {
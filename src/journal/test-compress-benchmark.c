@@ -23,6 +23,7 @@
 #include "parse-util.h"
 #include "random-util.h"
 #include "string-util.h"
+#include "strv.h"
 #include "util.h"
 
 typedef int (compress_t)(const void *src, uint64_t src_size, void *dst,
@@ -36,6 +37,23 @@ static size_t arg_start;
 #define MAX_SIZE (1024*1024LU)
 #define PRIME 1048571  /* A prime close enough to one megabyte that mod 4 == 3 */
 
+#define N_FIELDS 20000U
+#define DICTIONARY_SIZE (16*1024LU)
+
+#ifdef HAVE_ZSTD
+static CompressDictionary *dictionary = NULL;
+
+static int compress_zstd(const void *src, uint64_t src_size, void *dst,
+                         size_t dst_alloc_size, size_t *dst_size) {
+        return compress_blob_zstd(src, src_size, dst, dst_alloc_size, dst_size, dictionary);
+}
+
+static int decompress_zstd(const void *src, uint64_t src_size,
+                           void **dst, size_t *dst_alloc_size, size_t* dst_size, size_t dst_max) {
+        return decompress_blob_zstd(src, src_size, dst, dst_alloc_size, dst_size, dst_max, dictionary);
+}
+#endif
+
 static size_t _permute(size_t x) {
         size_t residue;
 
@@ -152,6 +170,151 @@ static void test_compress_decompress(const char* label, const char* type,
                  skipped);
 }
 
+static char** make_fields(unsigned n) {
+        static const char* const units[] = {
+                "sshd", "cron", "NetworkManager", "systemd-logind", "dbus",
+                "polkit", "gdm", "cups", "avahi-daemon", "udisks2",
+        };
+        char **l;
+        unsigned i;
+
+        /* Synthetic data objects, modelled on what typically ends up
+         * in a journal file: unique, short and very similar to each
+         * other. Real journals may compress better or worse. */
+
+        l = new0(char*, n + 1);
+        assert_se(l);
+
+        for (i = 0; i < n; i++) {
+                const char *u = units[random_u32() % ELEMENTSOF(units)];
+                int r;
+
+                switch (i % 5) {
+
+                case 0:
+                        r = asprintf(&l[i], "MESSAGE=Accepted publickey for user%u from 10.%u.%u.%u port %u ssh2: RSA SHA256:%016" PRIx64,
+                                     random_u32() % 100, random_u32() % 256, random_u32() % 256, random_u32() % 256,
+                                     1024 + random_u32() % 60000, random_u64());
+                        break;
+
+                case 1:
+                        r = asprintf(&l[i], "MESSAGE=%s[%u]: Started session %u of user user%u.",
+                                     u, random_u32() % 32768, random_u32() % 10000, random_u32() % 100);
+                        break;
+
+                case 2:
+                        r = asprintf(&l[i], "_CMDLINE=/usr/sbin/%s --no-daemon --log-level=info --config=/etc/%s/%s.conf --pid=%u",
+                                     u, u, u, random_u32() % 32768);
+                        break;
+
+                case 3:
+                        r = asprintf(&l[i], "_SYSTEMD_CGROUP=/system.slice/%s.service/%u", u, random_u32() % 32768);
+                        break;
+
+                default:
+                        r = asprintf(&l[i], "_SOURCE_REALTIME_TIMESTAMP=%" PRIu64, now(CLOCK_REALTIME) + random_u32());
+                        break;
+                }
+
+                assert_se(r >= 0);
+        }
+
+        return l;
+}
+
+static void test_compress_fields(const char *label, char **fields,
+                                 compress_t compress, decompress_t decompress) {
+        _cleanup_free_ void *buf2 = NULL;
+        size_t buf2_allocated = 0;
+        size_t total = 0, stored = 0, skipped = 0;
+        char buf[4096];
+        usec_t n;
+        float dt;
+        char **f;
+
+        n = now(CLOCK_MONOTONIC);
+
+        STRV_FOREACH(f, fields) {
+                size_t size, j = 0, k = 0;
+                int r;
+
+                size = strlen(*f);
+                assert_se(size <= sizeof(buf));
+
+                /* Like the journal we only keep the result if it is
+                 * actually smaller */
+                r = compress(*f, size, buf, size - 1, &j);
+                if (r < 0) {
+                        skipped++;
+                        stored += size;
+                } else {
+                        r = decompress(buf, j, &buf2, &buf2_allocated, &k, 0);
+                        assert_se(r == 0);
+                        assert_se(k == size);
+                        assert_se(memcmp(*f, buf2, size) == 0);
+
+                        stored += j;
+                }
+
+                total += size;
+        }
+
+        dt = (now(CLOCK_MONOTONIC) - n) / 1e6;
+
+        log_info("%s/fields: compressed & decompressed %u fields of %zu bytes in %.2fs (%.2fMiB/s), "
+                 "stored %.2f%% of the original size, %zu fields left uncompressed",
+                 label, strv_length(fields), total, dt,
+                 total / 1024. / 1024 / dt,
+                 stored * 100. / total,
+                 skipped);
+}
+
+static void test_fields(void) {
+        _cleanup_strv_free_ char **fields = NULL;
+        char **l;
+
+        /* Train on the first half, and measure on the second half,
+         * the same way the journal trains dictionaries on the file
+         * it replaces */
+        fields = make_fields(N_FIELDS);
+        l = fields + N_FIELDS / 2;
+
+#ifdef HAVE_XZ
+        test_compress_fields("XZ", l, compress_blob_xz, decompress_blob_xz);
+#endif
+#ifdef HAVE_LZ4
+        test_compress_fields("LZ4", l, compress_blob_lz4, decompress_blob_lz4);
+#endif
+#ifdef HAVE_ZSTD
+        test_compress_fields("ZSTD", l, compress_zstd, decompress_zstd);
+
+        {
+                _cleanup_free_ char *samples = NULL, *dict = NULL;
+                size_t sample_sizes[N_FIELDS / 2], n = 0, dict_size;
+                unsigned i;
+
+                samples = malloc(MAX_SIZE);
+                dict = malloc(DICTIONARY_SIZE);
+                assert_se(samples && dict);
+
+                for (i = 0; i < N_FIELDS / 2; i++) {
+                        sample_sizes[i] = strlen(fields[i]);
+                        assert_se(n + sample_sizes[i] <= MAX_SIZE);
+                        memcpy(samples + n, fields[i], sample_sizes[i]);
+                        n += sample_sizes[i];
+                }
+
+                assert_se(compress_dictionary_train(samples, sample_sizes, N_FIELDS / 2,
+                                                    dict, DICTIONARY_SIZE, &dict_size) == 0);
+                assert_se(compress_dictionary_new(dict, dict_size, &dictionary) == 0);
+
+                test_compress_fields("ZSTD+dictionary", l, compress_zstd, decompress_zstd);
+
+                dictionary = compress_dictionary_free(dictionary);
+        }
+#endif
+}
+
 int main(int argc, char *argv[]) {
         const char *i;
 
@@ -174,7 +337,13 @@ int main(int argc, char *argv[]) {
 #endif
 #ifdef HAVE_LZ4
                 test_compress_decompress("LZ4", i, compress_blob_lz4, decompress_blob_lz4);
+#endif
+#ifdef HAVE_ZSTD
+                test_compress_decompress("ZSTD", i, compress_zstd, decompress_zstd);
 #endif
         }
+
+        test_fields();
+
         return 0;
 }
@@ -27,6 +27,7 @@
 #include "fileio.h"
 #include "macro.h"
 #include "random-util.h"
+#include "stdio-util.h"
 #include "util.h"
 
 #ifdef HAVE_XZ
@@ -54,6 +55,26 @@ typedef int (decompress_sw_t)(const void *src, uint64_t src_size,
 typedef int (compress_stream_t)(int fdf, int fdt, uint64_t max_bytes);
 typedef int (decompress_stream_t)(int fdf, int fdt, uint64_t max_size);
 
+#ifdef HAVE_ZSTD
+static int compress_blob_zstd_plain(const void *src, uint64_t src_size,
+                                    void *dst, size_t dst_alloc_size, size_t *dst_size) {
+        return compress_blob_zstd(src, src_size, dst, dst_alloc_size, dst_size, NULL);
+}
+
+static int decompress_blob_zstd_plain(const void *src, uint64_t src_size,
+                                      void **dst, size_t *dst_alloc_size,
+                                      size_t* dst_size, size_t dst_max) {
+        return decompress_blob_zstd(src, src_size, dst, dst_alloc_size, dst_size, dst_max, NULL);
+}
+
+static int decompress_startswith_zstd_plain(const void *src, uint64_t src_size,
+                                            void **buffer, size_t *buffer_size,
+                                            const void *prefix, size_t prefix_len,
+                                            uint8_t extra) {
+        return decompress_startswith_zstd(src, src_size, buffer, buffer_size, prefix, prefix_len, extra, NULL);
+}
+#endif
+
 static void test_compress_decompress(int compression,
                                      compress_blob_t compress,
                                      decompress_blob_t decompress,
@@ -242,6 +263,90 @@ static void test_lz4_decompress_partial(void) {
 }
 #endif
 
+#ifdef HAVE_ZSTD
+static void test_zstd_dictionary(void) {
+        _cleanup_free_ char *samples = NULL, *dict = NULL;
+        _cleanup_free_ void *decompressed = NULL;
+        CompressDictionary *d = NULL;
+        size_t sample_sizes[1000], n = 0, dict_size, plain_size, dict_csize, usize = 0, k;
+        char plain[256], with_dict[256];
+        const char *line = "MESSAGE=Accepted publickey for admin from 10.0.0.1 port 4711 ssh2";
+        unsigned i;
+
+        log_info("/* testing ZSTD dictionary compression */");
+
+        samples = malloc(ELEMENTSOF(sample_sizes) * 128);
+        dict = malloc(16 * 1024);
+        assert_se(samples && dict);
+
+        for (i = 0; i < ELEMENTSOF(sample_sizes); i++) {
+                char buf[128];
+
+                xsprintf(buf, "MESSAGE=Accepted publickey for user%u from 10.0.%u.%u port %u ssh2",
+                         i % 37, i % 13, i % 251, 1024 + i * 7);
+                sample_sizes[i] = strlen(buf);
+                memcpy(samples + n, buf, sample_sizes[i]);
+                n += sample_sizes[i];
+        }
+
+        assert_se(compress_dictionary_train(samples, sample_sizes, ELEMENTSOF(sample_sizes),
+                                            dict, 16 * 1024, &dict_size) == 0);
+        assert_se(dict_size > 0);
+        assert_se(compress_dictionary_new(dict, dict_size, &d) == 0);
+
+        assert_se(compress_blob_zstd(line, strlen(line), with_dict, sizeof(with_dict), &dict_csize, d) == 0);
+        assert_se(compress_blob_zstd(line, strlen(line), plain, sizeof(plain), &plain_size, NULL) == 0);
+        log_info("Compressed %zu bytes to %zu with dictionary, %zu without", strlen(line), dict_csize, plain_size);
+        assert_se(dict_csize < plain_size);
+        assert_se(dict_csize < strlen(line));
+
+        assert_se(decompress_blob_zstd(with_dict, dict_csize, &decompressed, &usize, &k, 0, d) == 0);
+        assert_se(k == strlen(line));
+        assert_se(memcmp(decompressed, line, k) == 0);
+
+        assert_se(decompress_startswith_zstd(with_dict, dict_csize, &decompressed, &usize,
+                                             "MESSAGE", strlen("MESSAGE"), '=', d) > 0);
+
+        /* Partial decompression uses the dictionary too */
+        assert_se(decompress_blob_zstd(with_dict, dict_csize, &decompressed, &usize, &k, 16, d) == 0);
+        assert_se(k == 16);
+        assert_se(memcmp(decompressed, line, k) == 0);
+
+        /* Without the dictionary the data cannot be recovered */
+        assert_se(decompress_blob_zstd(with_dict, dict_csize, &decompressed, &usize, &k, 0, NULL) < 0);
+
+        compress_dictionary_free(d);
+}
+
+static void test_zstd_decompress_max(const char *data, size_t data_len) {
+        _cleanup_free_ char *compressed = NULL;
+        _cleanup_free_ void *decompressed = NULL;
+        size_t csize, usize = 0, k;
+
+        log_info("/* testing ZSTD decompression with a size limit */");
+
+        compressed = malloc(data_len);
+        assert_se(compressed);
+
+        assert_se(compress_blob_zstd(data, data_len, compressed, data_len, &csize, NULL) == 0);
+
+        /* Only the beginning is decompressed, and we don't allocate
+         * space for the rest */
+        assert_se(decompress_blob_zstd(compressed, csize, &decompressed, &usize, &k, 1024, NULL) == 0);
+        assert_se(k == 1024);
+        assert_se(usize < data_len);
+        assert_se(memcmp(decompressed, data, k) == 0);
+
+        /* A limit beyond the size changes nothing */
+        assert_se(decompress_blob_zstd(compressed, csize, &decompressed, &usize, &k, data_len * 2, NULL) == 0);
+        assert_se(k == data_len);
+        assert_se(memcmp(decompressed, data, k) == 0);
+
+        /* A cut off frame is noticed */
+        assert_se(decompress_blob_zstd(compressed, csize / 2, &decompressed, &usize, &k, data_len - 1, NULL) == -EBADMSG);
+}
+#endif
+
 int main(int argc, char *argv[]) {
         const char text[] =
                 "text\0foofoofoofoo AAAA aaaaaaaaa ghost busters barbarbar FFF"
@@ -304,5 +409,27 @@ int main(int argc, char *argv[]) {
         log_info("/* LZ4 test skipped */");
 #endif
 
+#ifdef HAVE_ZSTD
+        test_compress_decompress(OBJECT_COMPRESSED_ZSTD, compress_blob_zstd_plain, decompress_blob_zstd_plain,
+                                 text, sizeof(text), false);
+        test_compress_decompress(OBJECT_COMPRESSED_ZSTD, compress_blob_zstd_plain, decompress_blob_zstd_plain,
+                                 data, sizeof(data), true);
+
+        test_decompress_startswith(OBJECT_COMPRESSED_ZSTD,
+                                   compress_blob_zstd_plain, decompress_startswith_zstd_plain,
+                                   text, sizeof(text), false);
+        test_decompress_startswith(OBJECT_COMPRESSED_ZSTD,
+                                   compress_blob_zstd_plain, decompress_startswith_zstd_plain,
+                                   data, sizeof(data), true);
+        test_decompress_startswith(OBJECT_COMPRESSED_ZSTD,
+                                   compress_blob_zstd_plain, decompress_startswith_zstd_plain,
+                                   huge, sizeof(huge), true);
+
+        test_zstd_dictionary();
+        test_zstd_decompress_max(huge, sizeof(huge));
+#else
+        log_info("/* ZSTD test skipped */");
+#endif
+
         return 0;
 }
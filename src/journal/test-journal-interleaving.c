@@ -25,10 +25,13 @@
 
 #include "alloc-util.h"
 #include "journal-file.h"
+#include "journal-internal.h"
 #include "journal-vacuum.h"
 #include "log.h"
 #include "parse-util.h"
 #include "rm-rf.h"
+#include "stdio-util.h"
+#include "time-util.h"
 #include "util.h"
 
 /* This program tests skipping around in a multi-file journal.
@@ -60,11 +63,12 @@ static void test_close(JournalFile *f) {
         (void) journal_file_close (f);
 }
 
-static void append_number(JournalFile *f, int n, uint64_t *seqnum) {
+static void append_number_with(JournalFile *f, int n, const char *extra, uint64_t *seqnum) {
         char *p;
         dual_timestamp ts;
         static dual_timestamp previous_ts = {};
-        struct iovec iovec[1];
+        struct iovec iovec[2];
+        unsigned k = 0;
 
         dual_timestamp_get(&ts);
 
@@ -77,12 +81,20 @@ static void append_number(JournalFile *f, int n, uint64_t *seqnum) {
         previous_ts = ts;
 
         assert_se(asprintf(&p, "NUMBER=%d", n) >= 0);
-        iovec[0].iov_base = p;
-        iovec[0].iov_len = strlen(p);
-        assert_ret(journal_file_append_entry(f, &ts, iovec, 1, seqnum, NULL, NULL));
+        iovec[k].iov_base = p;
+        iovec[k++].iov_len = strlen(p);
+        if (extra) {
+                iovec[k].iov_base = (char*) extra;
+                iovec[k++].iov_len = strlen(extra);
+        }
+        assert_ret(journal_file_append_entry(f, &ts, iovec, k, seqnum, NULL, NULL));
         free(p);
 }
 
+static void append_number(JournalFile *f, int n, uint64_t *seqnum) {
+        append_number_with(f, n, NULL, seqnum);
+}
+
 static void test_check_number (sd_journal *j, int n) {
         const void *d;
         _cleanup_free_ char *k;
@@ -289,6 +301,271 @@ static void test_sequence_numbers(void) {
         }
 }
 
+static int get_number(sd_journal *j) {
+        const void *d;
+        size_t l;
+        char k[DECIMAL_STR_MAX(int)];
+        int x;
+
+        assert_ret(sd_journal_get_data(j, "NUMBER", &d, &l));
+        assert_se(l > 7 && l - 7 < sizeof(k));
+
+        memcpy(k, (const char*) d + 7, l - 7);
+        k[l - 7] = 0;
+
+        assert_se(safe_atoi(k, &x) >= 0);
+        return x;
+}
+
+#define N_FILES 200
+#define N_ROUNDS 25
+
+static void test_many_files(void) {
+        char t[] = "/tmp/journal-many-XXXXXX";
+        JournalFile *files[N_FILES];
+        sd_journal *j;
+        usec_t n;
+        int i, k, r;
+
+        /* Iterates through many interleaved files, which is what
+         * journalctl has to do with lots of archived user journals,
+         * and reports how long that took. */
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        for (i = 0; i < N_FILES; i++) {
+                char name[sizeof("many-.journal") + DECIMAL_STR_MAX(int)];
+
+                xsprintf(name, "many-%i.journal", i);
+                files[i] = test_open(name);
+        }
+
+        for (k = 0; k < N_ROUNDS; k++)
+                for (i = 0; i < N_FILES; i++)
+                        append_number(files[i], k * N_FILES + i + 1, NULL);
+
+        /* All but the last file are archived, like after rotation */
+        for (i = 0; i < N_FILES - 1; i++) {
+                files[i]->archive = true;
+                test_close(files[i]);
+        }
+
+        assert_ret(sd_journal_open_directory(&j, t, 0));
+
+        n = now(CLOCK_MONOTONIC);
+        assert_ret(sd_journal_seek_head(j));
+        for (i = 1; i <= N_FILES * N_ROUNDS; i++) {
+                assert_ret(r = sd_journal_next(j));
+                assert_se(r == 1);
+                assert_se(get_number(j) == i);
+        }
+        assert_ret(r = sd_journal_next(j));
+        assert_se(r == 0);
+        log_info("Iterated down through %i entries in %i files in %s",
+                 N_FILES * N_ROUNDS, N_FILES, format_timespan((char[FORMAT_TIMESPAN_MAX]) {}, FORMAT_TIMESPAN_MAX, now(CLOCK_MONOTONIC) - n, USEC_PER_MSEC));
+
+        /* The live file may grow while we are at the end */
+        append_number(files[N_FILES - 1], N_FILES * N_ROUNDS + 1, NULL);
+        assert_ret(r = sd_journal_next(j));
+        assert_se(r == 1);
+        assert_se(get_number(j) == N_FILES * N_ROUNDS + 1);
+        assert_ret(r = sd_journal_next(j));
+        assert_se(r == 0);
+
+        n = now(CLOCK_MONOTONIC);
+        assert_ret(sd_journal_seek_tail(j));
+        for (i = N_FILES * N_ROUNDS + 1; i >= 1; i--) {
+                assert_ret(r = sd_journal_previous(j));
+                assert_se(r == 1);
+                assert_se(get_number(j) == i);
+        }
+        assert_ret(r = sd_journal_previous(j));
+        assert_se(r == 0);
+        log_info("Iterated up through %i entries in %i files in %s",
+                 N_FILES * N_ROUNDS + 1, N_FILES, format_timespan((char[FORMAT_TIMESPAN_MAX]) {}, FORMAT_TIMESPAN_MAX, now(CLOCK_MONOTONIC) - n, USEC_PER_MSEC));
+
+        /* Turn around in the middle */
+        for (i = 2; i <= N_FILES; i++) {
+                assert_ret(r = sd_journal_next(j));
+                assert_se(r == 1);
+                assert_se(get_number(j) == i);
+        }
+        for (i = N_FILES - 1; i >= 1; i--) {
+                assert_ret(r = sd_journal_previous(j));
+                assert_se(r == 1);
+                assert_se(get_number(j) == i);
+        }
+
+        sd_journal_close(j);
+        test_close(files[N_FILES - 1]);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
+static void test_restrict_realtime(void) {
+        char t[] = "/tmp/journal-restrict-XXXXXX";
+        JournalFile *f;
+        sd_journal *j;
+        uint64_t since, until;
+        int i, k, r;
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        /* Ten files with ten entries each, one after the other. All
+         * but the last one are archived. */
+        for (i = 0; i < 10; i++) {
+                char name[sizeof("restrict-.journal") + DECIMAL_STR_MAX(int)];
+
+                xsprintf(name, "restrict-%i.journal", i);
+                f = test_open(name);
+
+                for (k = 1; k <= 10; k++)
+                        append_number(f, i * 10 + k, NULL);
+
+                f->archive = i < 9;
+                test_close(f);
+        }
+
+        assert_ret(sd_journal_open_directory(&j, t, 0));
+        assert_se(ordered_hashmap_size(j->files) == 10);
+
+        assert_ret(sd_journal_seek_head(j));
+        for (i = 1; i <= 100; i++) {
+                assert_ret(sd_journal_next(j));
+                if (i == 35)
+                        assert_ret(sd_journal_get_realtime_usec(j, &since));
+                if (i == 64)
+                        assert_ret(sd_journal_get_realtime_usec(j, &until));
+        }
+        sd_journal_close(j);
+
+        assert_ret(sd_journal_open_directory(&j, t, 0));
+        journal_restrict_realtime(j, since, until);
+
+        /* 31..40 to 61..70, plus the last file, which is still online */
+        assert_se(ordered_hashmap_size(j->files) == 5);
+
+        assert_ret(sd_journal_seek_realtime_usec(j, since));
+        for (i = 35; i <= 100; i++) {
+                assert_ret(r = sd_journal_next(j));
+                assert_se(r == 1);
+                assert_se(get_number(j) == i);
+
+                if (i == 70)
+                        i = 90;
+        }
+        assert_ret(r = sd_journal_next(j));
+        assert_se(r == 0);
+
+        sd_journal_close(j);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
+static void test_boots(void) {
+        char t[] = "/tmp/journal-boots-XXXXXX";
+        _cleanup_free_ JournalBoot *boots = NULL, *indexed = NULL;
+        _cleanup_(boot_index_freep) BootIndex *b = NULL;
+        sd_id128_t ids[3], file_ids[3];
+        size_t n_boots, n, n_allocated = 0;
+        JournalFile *f;
+        sd_journal *j;
+        int i, k;
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        for (i = 0; i < 3; i++)
+                assert_ret(sd_id128_randomize(&ids[i]));
+
+        /* Boot 0 spans the first two files, boot 1 starts in the
+         * second and ends in the third, boot 2 is only in the last,
+         * online file. */
+        for (i = 0; i < 4; i++) {
+                char name[sizeof("boots-.journal") + DECIMAL_STR_MAX(int)];
+
+                xsprintf(name, "boots-%i.journal", i);
+                f = test_open(name);
+
+                for (k = 0; k < 10; k++) {
+                        char field[sizeof("_BOOT_ID=") + 32];
+
+                        f->header->boot_id = ids[(i * 10 + k) / 15];
+
+                        /* The online file lacks the _BOOT_ID= field,
+                         * so that the boot ID is taken from the
+                         * entry headers */
+                        if (i < 3) {
+                                xsprintf(field, "_BOOT_ID=" SD_ID128_FORMAT_STR, SD_ID128_FORMAT_VAL(f->header->boot_id));
+                                append_number_with(f, i * 10 + k, field, NULL);
+                        } else
+                                append_number(f, i * 10 + k, NULL);
+                }
+
+                if (i < 3)
+                        file_ids[i] = f->header->file_id;
+
+                f->archive = i < 3;
+                test_close(f);
+        }
+
+        assert_ret(sd_journal_open_directory(&j, t, 0));
+        assert_ret(journal_get_boots(j, &boots, &n_boots));
+        sd_journal_close(j);
+
+        assert_se(n_boots == 3);
+        for (i = 0; i < 3; i++) {
+                assert_se(sd_id128_equal(boots[i].id, ids[i]));
+                assert_se(boots[i].first_realtime < boots[i].last_realtime);
+                assert_se(boots[i].first_monotonic < boots[i].last_monotonic);
+                if (i > 0)
+                        assert_se(boots[i-1].last_realtime < boots[i].first_realtime);
+        }
+
+        /* The index only covers the archived files */
+        assert_ret(boot_index_update(t));
+        assert_ret(boot_index_load(t, &b));
+
+        n = 0;
+        assert_se(boot_index_get(b, file_ids[1], &indexed, &n_allocated, &n) == 1);
+        assert_se(n == 2);
+        assert_se(sd_id128_equal(indexed[0].id, ids[0]));
+        assert_se(indexed[0].last_realtime == boots[0].last_realtime);
+        assert_se(sd_id128_equal(indexed[1].id, ids[1]));
+        assert_se(indexed[1].first_realtime == boots[1].first_realtime);
+
+        n = 0;
+        assert_se(boot_index_get(b, SD_ID128_NULL, &indexed, &n_allocated, &n) == 0);
+
+        /* Listing the boots using the index gives the same result */
+        indexed = mfree(indexed);
+        assert_ret(sd_journal_open_directory(&j, t, 0));
+        assert_ret(journal_get_boots(j, &indexed, &n));
+        sd_journal_close(j);
+
+        assert_se(n == n_boots);
+        assert_se(memcmp(indexed, boots, n * sizeof(JournalBoot)) == 0);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
 int main(int argc, char *argv[]) {
         log_set_max_level(LOG_DEBUG);
 
@@ -303,5 +580,9 @@ int main(int argc, char *argv[]) {
 
         test_sequence_numbers();
 
+        test_many_files();
+        test_restrict_realtime();
+        test_boots();
+
         return 0;
 }
@@ -0,0 +1,140 @@
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "sd-journal.h"
+
+#include "alloc-util.h"
+#include "fd-util.h"
+#include "io-util.h"
+#include "journal-file.h"
+#include "log.h"
+#include "logs-show.h"
+#include "macro.h"
+#include "parse-util.h"
+#include "rm-rf.h"
+#include "stdio-util.h"
+#include "string-util.h"
+#include "util.h"
+
+/* Writes a journal file with the given number of entries (default:
+ * 20000), and reports how many entries per second each of the
+ * machine-readable output modes formats from it. */
+
+static const OutputMode modes[] = {
+        OUTPUT_EXPORT,
+        OUTPUT_JSON,
+        OUTPUT_JSON_PRETTY,
+        OUTPUT_JSON_SSE,
+        OUTPUT_SHORT,
+};
+
+static void make_journal(const char *fn, unsigned n_entries) {
+        dual_timestamp ts;
+        JournalFile *f;
+        unsigned i;
+
+        assert_se(journal_file_open(-1, fn, O_RDWR|O_CREAT, 0644, true, false, NULL, NULL, NULL, NULL, &f) == 0);
+
+        dual_timestamp_get(&ts);
+
+        for (i = 0; i < n_entries; i++) {
+                char message[64], priority[16], pid[16], unit[64];
+                struct iovec iovec[8];
+                unsigned n = 0;
+
+                xsprintf(message, "MESSAGE=Entry number %u of the benchmark", i);
+                xsprintf(priority, "PRIORITY=%u", i % 8);
+                xsprintf(pid, "_PID=%u", 100 + i % 1000);
+                xsprintf(unit, "_SYSTEMD_UNIT=benchmark-%u.service", i % 64);
+
+                IOVEC_SET_STRING(iovec[n++], message);
+                IOVEC_SET_STRING(iovec[n++], priority);
+                IOVEC_SET_STRING(iovec[n++], pid);
+                IOVEC_SET_STRING(iovec[n++], unit);
+                IOVEC_SET_STRING(iovec[n++], "_COMM=benchmark");
+                IOVEC_SET_STRING(iovec[n++], "_TRANSPORT=syslog");
+                IOVEC_SET_STRING(iovec[n++], "SYSLOG_IDENTIFIER=benchmark");
+
+                /* Now and then something that needs escaping */
+                if (i % 16 == 0)
+                        IOVEC_SET_STRING(iovec[n++], "CODE_FUNC=\"quoted\"\nand a second line");
+
+                ts.realtime++;
+                ts.monotonic++;
+
+                assert_se(journal_file_append_entry(f, &ts, iovec, n, NULL, NULL, NULL) == 0);
+        }
+
+        (void) journal_file_close(f);
+}
+
+int main(int argc, char *argv[]) {
+        char t[] = "/tmp/journal-output-XXXXXX";
+        _cleanup_fclose_ FILE *null = NULL;
+        unsigned n_entries = 20000, i;
+
+        /* journal_file_open requires a valid machine id */
+        if (access("/etc/machine-id", F_OK) != 0)
+                return EXIT_TEST_SKIP;
+
+        log_set_max_level(LOG_INFO);
+
+        if (argc >= 2)
+                assert_se(safe_atou(argv[1], &n_entries) >= 0);
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        make_journal("benchmark.journal", n_entries);
+
+        null = fopen("/dev/null", "we");
+        assert_se(null);
+
+        for (i = 0; i < ELEMENTSOF(modes); i++) {
+                _cleanup_(sd_journal_closep) sd_journal *j = NULL;
+                char b[FORMAT_TIMESPAN_MAX];
+                unsigned n = 0;
+                usec_t start, d;
+
+                assert_se(sd_journal_open_directory(&j, t, 0) >= 0);
+
+                start = now(CLOCK_MONOTONIC);
+
+                SD_JOURNAL_FOREACH(j) {
+                        assert_se(output_journal(null, j, modes[i], 0, OUTPUT_FULL_WIDTH, NULL) >= 0);
+                        n++;
+                }
+
+                d = now(CLOCK_MONOTONIC) - start;
+
+                assert_se(n == n_entries);
+
+                log_info("%-12s %u entries in %s: %.0f entries/s",
+                         output_mode_to_string(modes[i]),
+                         n,
+                         format_timespan(b, sizeof(b), d, USEC_PER_MSEC),
+                         (double) n * USEC_PER_SEC / MAX(d, 1U));
+        }
+
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        return 0;
+}
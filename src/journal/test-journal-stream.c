@@ -33,6 +33,9 @@
 
 #define N_ENTRIES 200
 
+/* How many of the files entry i is written to, see main() */
+#define COPIES(i) ((i) % 10 != 0 && (i) % 3 == 0 ? 2U : 1U)
+
 static void verify_contents(sd_journal *j, unsigned skip) {
         unsigned i;
 
@@ -73,6 +76,56 @@ static void verify_contents(sd_journal *j, unsigned skip) {
                 assert_se(i == N_ENTRIES);
 }
 
+static void verify_unique(sd_journal *j) {
+        uint64_t count, n_quux = 0, n_waldo = 0;
+        const void *data;
+        size_t l;
+        unsigned i, n = 0;
+
+        assert_se(sd_journal_query_unique(j, "NUMBER") >= 0);
+        SD_JOURNAL_FOREACH_UNIQUE(j, data, l)
+                n++;
+        assert_se(n == N_ENTRIES);
+
+        /* Some entries are in two files, they are counted once in
+         * each of them, but their values are still only returned
+         * once */
+        n = 0;
+        sd_journal_restart_unique(j);
+        while (sd_journal_enumerate_unique_counted(j, &data, &l, &count) > 0) {
+                _cleanup_free_ char *v = NULL;
+
+                assert_se(l > strlen("NUMBER=") && memcmp(data, "NUMBER=", strlen("NUMBER=")) == 0);
+                assert_se(v = strndup((const char*) data + strlen("NUMBER="), l - strlen("NUMBER=")));
+                assert_se(safe_atou(v, &i) >= 0);
+                assert_se(count == COPIES(i));
+                n++;
+        }
+        assert_se(n == N_ENTRIES);
+
+        for (i = 0; i < N_ENTRIES; i++)
+                if (i % 5 == 0)
+                        n_quux += COPIES(i);
+                else
+                        n_waldo += COPIES(i);
+
+        n = 0;
+        assert_se(sd_journal_query_unique(j, "MAGIC") >= 0);
+        while (sd_journal_enumerate_unique_counted(j, &data, &l, &count) > 0) {
+                printf("%.*s: %"PRIu64"\n", (int) l, (const char*) data, count);
+
+                if (l == strlen("MAGIC=quux") && memcmp(data, "MAGIC=quux", l) == 0)
+                        assert_se(count == n_quux);
+                else {
+                        assert_se(l == strlen("MAGIC=waldo") && memcmp(data, "MAGIC=waldo", l) == 0);
+                        assert_se(count == n_waldo);
+                }
+
+                n++;
+        }
+        assert_se(n == 2);
+}
+
 int main(int argc, char *argv[]) {
         JournalFile *one, *two, *three;
         char t[] = "/tmp/journal-stream-XXXXXX";
@@ -190,6 +243,8 @@ int main(int argc, char *argv[]) {
         SD_JOURNAL_FOREACH_UNIQUE(j, data, l)
                 printf("%.*s\n", (int) l, (const char*) data);
 
+        verify_unique(j);
+
         assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
 
         return 0;
@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <unistd.h>
 
+#include "dirent-util.h"
 #include "fd-util.h"
 #include "journal-file.h"
 #include "journal-verify.h"
@@ -51,6 +52,20 @@ static void bit_toggle(const char *fn, uint64_t p) {
         safe_close(fd);
 }
 
+static unsigned n_open_fds(void) {
+        _cleanup_closedir_ DIR *d = NULL;
+        struct dirent *de;
+        unsigned n = 0;
+
+        d = opendir("/proc/self/fd");
+        assert_se(d);
+
+        FOREACH_DIRENT(de, d, assert_se(false))
+                n++;
+
+        return n;
+}
+
 static int raw_verify(const char *fn, const char *verification_key) {
         JournalFile *f;
         int r;
@@ -76,6 +91,7 @@ int main(int argc, char *argv[]) {
         char c[FORMAT_TIMESPAN_MAX];
         struct stat st;
         uint64_t p;
+        unsigned n_fds;
 
         /* journal_file_open requires a valid machine id */
         if (access("/etc/machine-id", F_OK) != 0)
@@ -111,6 +127,8 @@ int main(int argc, char *argv[]) {
 
         log_info("Verifying...");
 
+        n_fds = n_open_fds();
+
         assert_se(journal_file_open(-1, "test.journal", O_RDONLY, 0666, true, !!verification_key, NULL, NULL, NULL, NULL, &f) == 0);
         /* journal_file_print_header(f); */
         journal_file_dump(f);
@@ -125,6 +143,9 @@ int main(int argc, char *argv[]) {
 
         (void) journal_file_close(f);
 
+        /* Nothing may be left open after verification */
+        assert_se(n_open_fds() == n_fds);
+
         if (verification_key) {
                 log_info("Toggling bits...");
 
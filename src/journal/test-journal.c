@@ -20,11 +20,15 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include "alloc-util.h"
+#include "io-util.h"
 #include "journal-authenticate.h"
 #include "journal-file.h"
 #include "journal-vacuum.h"
+#include "journal-verify.h"
 #include "log.h"
 #include "rm-rf.h"
+#include "stdio-util.h"
 
 static bool arg_keep = false;
 
@@ -164,6 +168,398 @@ static void test_empty(void) {
         (void) journal_file_close(f4);
 }
 
+static void test_append_entries(void) {
+        JournalEntry entries[100];
+        struct iovec iovec[ELEMENTSOF(entries)][2];
+        char payload[ELEMENTSOF(entries)][sizeof("NUMBER=") + DECIMAL_STR_MAX(unsigned)];
+        dual_timestamp ts;
+        JournalFile *f;
+        Object *o;
+        uint64_t p, seqnum = 0;
+        unsigned i, j, n;
+        char t[] = "/tmp/journal-XXXXXX";
+
+        log_set_max_level(LOG_DEBUG);
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, true, false, NULL, NULL, NULL, NULL, &f) == 0);
+
+        dual_timestamp_get(&ts);
+
+        assert_se(journal_file_append_entries(f, NULL, 0, &seqnum, &n) == 0);
+        assert_se(n == 0);
+
+        for (j = 0; j < 10; j++) {
+                for (i = 0; i < ELEMENTSOF(entries); i++) {
+                        xsprintf(payload[i], "NUMBER=%u", j * (unsigned) ELEMENTSOF(entries) + i);
+
+                        IOVEC_SET_STRING(iovec[i][0], payload[i]);
+                        IOVEC_SET_STRING(iovec[i][1], "BATCH=1");
+
+                        entries[i] = (JournalEntry) {
+                                .ts = &ts,
+                                .iovec = iovec[i],
+                                .n_iovec = 2,
+                        };
+                }
+
+                assert_se(journal_file_append_entries(f, entries, ELEMENTSOF(entries), &seqnum, &n) == 0);
+                assert_se(n == ELEMENTSOF(entries));
+        }
+
+        assert_se(seqnum == 10 * ELEMENTSOF(entries));
+        assert_se(le64toh(f->header->n_entries) == 10 * ELEMENTSOF(entries));
+
+        p = 0;
+        for (i = 1; i <= 10 * ELEMENTSOF(entries); i++) {
+                assert_se(journal_file_next_entry(f, p, DIRECTION_DOWN, &o, &p) == 1);
+                assert_se(le64toh(o->entry.seqnum) == i);
+        }
+        assert_se(journal_file_next_entry(f, p, DIRECTION_DOWN, &o, &p) == 0);
+
+        assert_se(journal_file_move_to_entry_by_seqnum(f, 777, DIRECTION_DOWN, &o, NULL) == 1);
+        assert_se(le64toh(o->entry.seqnum) == 777);
+
+        assert_se(journal_file_find_data_object(f, "BATCH=1", strlen("BATCH=1"), &o, &p) == 1);
+        assert_se(le64toh(o->data.n_entries) == 10 * ELEMENTSOF(entries));
+
+        /* Seek around in a non-sequential order, so that we exercise
+         * jumping back and forth in the entry array chains */
+        for (i = 0; i < 10 * ELEMENTSOF(entries); i++) {
+                uint64_t k = (i * 389) % (10 * ELEMENTSOF(entries)) + 1;
+
+                assert_se(journal_file_move_to_entry_by_seqnum(f, k, DIRECTION_DOWN, &o, NULL) == 1);
+                assert_se(le64toh(o->entry.seqnum) == k);
+
+                assert_se(journal_file_move_to_entry_by_seqnum(f, k, DIRECTION_UP, &o, NULL) == 1);
+                assert_se(le64toh(o->entry.seqnum) == k);
+
+                assert_se(journal_file_move_to_entry_by_seqnum_for_data(f, p, k, DIRECTION_DOWN, &o, NULL) == 1);
+                assert_se(le64toh(o->entry.seqnum) == k);
+        }
+
+        (void) journal_file_close(f);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
+static void append_numbered(JournalFile *f, unsigned n) {
+        char number[sizeof("NUMBER=") + DECIMAL_STR_MAX(unsigned)];
+        char parity[sizeof("PARITY=") + DECIMAL_STR_MAX(unsigned)];
+        struct iovec iovec[4];
+        dual_timestamp ts;
+        unsigned i;
+
+        for (i = 0; i < n; i++) {
+                xsprintf(number, "NUMBER=%u", i);
+                xsprintf(parity, "PARITY=%u", i % 2);
+
+                IOVEC_SET_STRING(iovec[0], number);
+                IOVEC_SET_STRING(iovec[1], parity);
+                IOVEC_SET_STRING(iovec[2], "MESSAGE=foo");
+                IOVEC_SET_STRING(iovec[3], "PRIORITY=6");
+
+                dual_timestamp_get(&ts);
+                assert_se(journal_file_append_entry(f, &ts, iovec, ELEMENTSOF(iovec), NULL, NULL, NULL) == 0);
+        }
+}
+
+static void test_compact(void) {
+        JournalFile *regular, *compact, *copy;
+        Object *o;
+        uint64_t p, q;
+        unsigned i;
+        char t[] = "/tmp/journal-XXXXXX";
+
+        log_set_max_level(LOG_DEBUG);
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        assert_se(unsetenv("SYSTEMD_JOURNAL_COMPACT") >= 0);
+        assert_se(journal_file_open(-1, "regular.journal", O_RDWR|O_CREAT, 0666, false, false, NULL, NULL, NULL, NULL, &regular) == 0);
+        assert_se(!regular->compact);
+        assert_se(!JOURNAL_HEADER_COMPACT(regular->header));
+
+        assert_se(setenv("SYSTEMD_JOURNAL_COMPACT", "1", 1) >= 0);
+        assert_se(journal_file_open(-1, "compact.journal", O_RDWR|O_CREAT, 0666, false, false, NULL, NULL, NULL, NULL, &compact) == 0);
+        assert_se(compact->compact);
+        assert_se(JOURNAL_HEADER_COMPACT(compact->header));
+
+        append_numbered(regular, 1000);
+        append_numbered(compact, 1000);
+
+        /* Same objects, but the index takes up less space */
+        assert_se(regular->header->n_objects == compact->header->n_objects);
+        assert_se(le64toh(compact->header->tail_object_offset) < le64toh(regular->header->tail_object_offset));
+
+        assert_se(journal_file_verify(regular, NULL, NULL, NULL, NULL, false) >= 0);
+        assert_se(journal_file_verify(compact, NULL, NULL, NULL, NULL, false) >= 0);
+
+        assert_se(journal_file_find_data_object(compact, "PARITY=1", strlen("PARITY=1"), NULL, &p) == 1);
+        assert_se(journal_file_move_to_entry_by_seqnum_for_data(compact, p, 500, DIRECTION_DOWN, &o, NULL) == 1);
+        assert_se(le64toh(o->entry.seqnum) == 500);
+        assert_se(journal_file_entry_n_items(compact, o) == 4);
+
+        /* Copy from the compact into a regular file, which needs to
+         * recover the hashes the compact file doesn't store */
+        assert_se(unsetenv("SYSTEMD_JOURNAL_COMPACT") >= 0);
+        assert_se(journal_file_open(-1, "copy.journal", O_RDWR|O_CREAT, 0666, false, false, NULL, NULL, NULL, NULL, &copy) == 0);
+        assert_se(!copy->compact);
+
+        p = 0;
+        for (i = 0; i < 1000; i++) {
+                assert_se(journal_file_next_entry(compact, p, DIRECTION_DOWN, &o, &p) == 1);
+                assert_se(journal_file_copy_entry(compact, copy, o, p, NULL, NULL, NULL) == 0);
+        }
+
+        assert_se(copy->header->n_objects == regular->header->n_objects);
+        assert_se(journal_file_verify(copy, NULL, NULL, NULL, NULL, false) >= 0);
+
+        p = q = 0;
+        for (i = 0; i < 1000; i++) {
+                Object *u;
+
+                assert_se(journal_file_next_entry(regular, p, DIRECTION_DOWN, &o, &p) == 1);
+                assert_se(journal_file_next_entry(copy, q, DIRECTION_DOWN, &u, &q) == 1);
+                assert_se(o->entry.xor_hash == u->entry.xor_hash);
+        }
+
+        (void) journal_file_close(regular);
+        (void) journal_file_close(compact);
+        (void) journal_file_close(copy);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
+static void append_messages(JournalFile *f, unsigned n) {
+        char message[LINE_MAX];
+        struct iovec iovec[2];
+        dual_timestamp ts;
+        unsigned i;
+
+        for (i = 0; i < n; i++) {
+                xsprintf(message, "MESSAGE=Accepted publickey for user%u from 10.0.%u.%u port %u ssh2",
+                         i % 37, i % 13, i % 251, 1024 + i * 7);
+
+                IOVEC_SET_STRING(iovec[0], message);
+                IOVEC_SET_STRING(iovec[1], "_SYSTEMD_UNIT=sshd.service");
+
+                dual_timestamp_get(&ts);
+                assert_se(journal_file_append_entry(f, &ts, iovec, ELEMENTSOF(iovec), NULL, NULL, NULL) == 0);
+        }
+}
+
+#ifdef HAVE_ZSTD
+static void test_dictionary(void) {
+        JournalFile *f, *g;
+        Object *o;
+        uint64_t p;
+        char t[] = "/tmp/journal-XXXXXX";
+
+        log_set_max_level(LOG_DEBUG);
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, true, false, NULL, NULL, NULL, NULL, &f) == 0);
+        assert_se(f->compress_zstd);
+        assert_se(!f->compress_dictionary);
+
+        append_messages(f, 1000);
+
+        /* The new file gets a dictionary trained on what we wrote
+         * into the old one, once the training is done */
+        assert_se(journal_file_rotate(&f, true, false, NULL) >= 0);
+        assert_se(journal_file_open(-1, "test.journal", O_RDONLY, 0666, true, false, NULL, NULL, NULL, NULL, &g) == 0);
+        assert_se(journal_file_wait_for_dictionary(f) >= 0);
+        assert_se(f->compress_dictionary);
+        assert_se(le64toh(f->header->dictionary_offset) > 0);
+
+        append_messages(f, 1000);
+
+        assert_se(journal_file_find_data_object(f, "MESSAGE=Accepted publickey for user3 from 10.0.3.3 port 1045 ssh2",
+                                                strlen("MESSAGE=Accepted publickey for user3 from 10.0.3.3 port 1045 ssh2"),
+                                                &o, &p) == 1);
+        assert_se(o->object.flags & OBJECT_COMPRESSED_ZSTD);
+
+        /* Readers that opened the file before pick it up later */
+        assert_se(!g->compress_dictionary);
+        assert_se(journal_file_find_data_object(g, "MESSAGE=Accepted publickey for user3 from 10.0.3.3 port 1045 ssh2",
+                                                strlen("MESSAGE=Accepted publickey for user3 from 10.0.3.3 port 1045 ssh2"),
+                                                &o, &p) == 1);
+        assert_se(g->compress_dictionary);
+        (void) journal_file_close(g);
+
+        assert_se(journal_file_verify(f, NULL, NULL, NULL, NULL, false) >= 0);
+
+        journal_file_print_header(f);
+        (void) journal_file_close(f);
+
+        /* And it is picked up again when the file is opened again */
+        assert_se(journal_file_open(-1, "test.journal", O_RDONLY, 0666, true, false, NULL, NULL, NULL, NULL, &f) == 0);
+        assert_se(f->compress_dictionary);
+        assert_se(journal_file_find_data_object(f, "MESSAGE=Accepted publickey for user3 from 10.0.3.3 port 1045 ssh2",
+                                                strlen("MESSAGE=Accepted publickey for user3 from 10.0.3.3 port 1045 ssh2"),
+                                                &o, &p) == 1);
+        (void) journal_file_close(f);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+#endif
+
+static void test_precompressed(void) {
+        JournalPrecompressed pc[2] = {};
+        struct iovec iovec[2];
+        _cleanup_free_ char *big = NULL;
+        JournalFile *f;
+        Object *o;
+        uint64_t p, seqnum = 0;
+        size_t i, n = 64 * 1024;
+        unsigned written;
+        char t[] = "/tmp/journal-XXXXXX";
+
+        log_set_max_level(LOG_DEBUG);
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, true, false, NULL, NULL, NULL, NULL, &f) == 0);
+
+        /* Make sure there's a dictionary, if we support them, as
+         * precompressed payloads don't use it */
+        append_messages(f, 1000);
+        assert_se(journal_file_rotate(&f, true, false, NULL) >= 0);
+
+        big = new(char, n + 1);
+        assert_se(big);
+        memcpy(big, "MESSAGE=", strlen("MESSAGE="));
+        for (i = strlen("MESSAGE="); i < n; i++)
+                big[i] = "#0 frame in foo.c\n"[i % 18];
+        big[n] = 0;
+
+        IOVEC_SET_STRING(iovec[0], big);
+        IOVEC_SET_STRING(iovec[1], "PRECOMPRESSED=1");
+
+        assert_se(journal_precompress(big, n, &pc[0]) >= 0);
+        assert_se(pc[0].valid);
+#if defined(HAVE_XZ) || defined(HAVE_LZ4) || defined(HAVE_ZSTD)
+        assert_se(pc[0].compression > 0);
+        assert_se(pc[0].size < n);
+#endif
+
+        assert_se(journal_file_append_entries(f, &(JournalEntry) {
+                                .iovec = iovec,
+                                .n_iovec = 2,
+                                .precompressed = pc,
+                        }, 1, &seqnum, &written) == 0);
+        assert_se(written == 1);
+
+        assert_se(journal_file_find_data_object(f, big, n, &o, &p) == 1);
+        assert_se((o->object.flags & OBJECT_COMPRESSION_MASK) == pc[0].compression);
+        assert_se(journal_file_find_data_object(f, "PRECOMPRESSED=1", strlen("PRECOMPRESSED=1"), &o, &p) == 1);
+
+        assert_se(journal_file_verify(f, NULL, NULL, NULL, NULL, false) >= 0);
+
+        journal_precompressed_done(&pc[0]);
+        assert_se(!pc[0].payload);
+
+        (void) journal_file_close(f);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
+static void test_existing_codec(uint32_t header_flag, int compression) {
+        JournalPrecompressed pc[2] = {};
+        struct iovec iovec[2];
+        _cleanup_free_ char *big = NULL, *other = NULL;
+        JournalFile *f;
+        Object *o;
+        uint64_t p;
+        size_t i, n = 4096;
+        unsigned written;
+        char t[] = "/tmp/journal-XXXXXX";
+
+        log_set_max_level(LOG_DEBUG);
+
+        assert_se(mkdtemp(t));
+        assert_se(chdir(t) >= 0);
+
+        /* Fake a file created by a writer that used another codec */
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR|O_CREAT, 0666, false, false, NULL, NULL, NULL, NULL, &f) == 0);
+        f->header->incompatible_flags = htole32(le32toh(f->header->incompatible_flags) | header_flag);
+        (void) journal_file_close(f);
+
+        /* Appending to it sticks to the codec of the file, whatever
+         * new files would be compressed with */
+        assert_se(journal_file_open(-1, "test.journal", O_RDWR, 0666, true, false, NULL, NULL, NULL, NULL, &f) == 0);
+        assert_se(JOURNAL_FILE_COMPRESS(f));
+        assert_se(le32toh(f->header->incompatible_flags) == header_flag);
+
+        big = new(char, n + 1);
+        assert_se(big);
+        memcpy(big, "MESSAGE=", strlen("MESSAGE="));
+        for (i = strlen("MESSAGE="); i < n; i++)
+                big[i] = "#0 frame in foo.c\n"[i % 18];
+        big[n] = 0;
+        assert_se(other = strdup(big));
+        memcpy(other, "PRECOMPRESSED=", strlen("PRECOMPRESSED="));
+
+        IOVEC_SET_STRING(iovec[0], big);
+        IOVEC_SET_STRING(iovec[1], other);
+        assert_se(journal_file_append_entry(f, NULL, iovec, 1, NULL, NULL, NULL) == 0);
+
+        /* Payloads compressed ahead of time with the default codec
+         * are compressed again */
+        assert_se(journal_precompress(other, n, &pc[1]) >= 0);
+        assert_se(journal_file_append_entries(f, &(JournalEntry) {
+                                .iovec = iovec,
+                                .n_iovec = 2,
+                                .precompressed = pc,
+                        }, 1, NULL, &written) == 0);
+        assert_se(written == 1);
+
+        assert_se(journal_file_find_data_object(f, big, n, &o, &p) == 1);
+        assert_se((o->object.flags & OBJECT_COMPRESSION_MASK) == compression);
+        assert_se(journal_file_find_data_object(f, other, n, &o, &p) == 1);
+        assert_se((o->object.flags & OBJECT_COMPRESSION_MASK) == compression);
+
+        assert_se(le32toh(f->header->incompatible_flags) == header_flag);
+        assert_se(journal_file_verify(f, NULL, NULL, NULL, NULL, false) >= 0);
+
+        journal_precompressed_done(&pc[1]);
+        (void) journal_file_close(f);
+
+        if (arg_keep)
+                log_info("Not removing %s", t);
+        else
+                assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+
+        puts("------------------------------------------------------------");
+}
+
 int main(int argc, char *argv[]) {
         arg_keep = argc > 1;
 
@@ -172,6 +568,18 @@ int main(int argc, char *argv[]) {
                 return EXIT_TEST_SKIP;
 
         test_non_empty();
+        test_append_entries();
+        test_compact();
+#ifdef HAVE_ZSTD
+        test_dictionary();
+#endif
+        test_precompressed();
+#ifdef HAVE_LZ4
+        test_existing_codec(HEADER_INCOMPATIBLE_COMPRESSED_LZ4, OBJECT_COMPRESSED_LZ4);
+#endif
+#ifdef HAVE_XZ
+        test_existing_codec(HEADER_INCOMPATIBLE_COMPRESSED_XZ, OBJECT_COMPRESSED_XZ);
+#endif
         test_empty();
 
         return 0;
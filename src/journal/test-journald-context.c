@@ -0,0 +1,172 @@
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <unistd.h>
+
+#include "alloc-util.h"
+#include "cgroup-util.h"
+#include "hashmap.h"
+#include "journald-context.h"
+#include "journald-server.h"
+#include "log.h"
+#include "macro.h"
+#include "process-util.h"
+#include "string-util.h"
+
+/* PIDs above the kernel's PID_MAX_LIMIT, which never exist */
+#define FAKE_PID_BASE 5000000
+
+static void server_setup(Server *s) {
+        zero(*s);
+
+        if (cg_get_root_path(&s->cgroup_root) < 0)
+                assert_se(s->cgroup_root = strdup("/"));
+}
+
+static void server_teardown(Server *s) {
+        client_context_flush_all(s);
+        s->cgroup_root = mfree(s->cgroup_root);
+}
+
+static void test_hit(void) {
+        Server s;
+        struct ucred ucred = {
+                .pid = getpid(),
+                .uid = getuid(),
+                .gid = getgid(),
+        };
+        ClientContext *c, *d;
+        usec_t n = 100 * USEC_PER_SEC;
+
+        server_setup(&s);
+
+        assert_se(client_context_get_at(&s, ucred.pid, &ucred, n, &c) >= 0);
+        assert_se(c->pid == ucred.pid);
+        assert_se(c->uid == ucred.uid);
+        assert_se(c->starttime > 0);
+        assert_se(c->comm);
+        assert_se(s.n_client_context_hits == 0);
+        assert_se(s.n_client_context_misses == 1);
+
+        assert_se(client_context_get_at(&s, ucred.pid, &ucred, n + 1, &d) >= 0);
+        assert_se(c == d);
+        assert_se(s.n_client_context_hits == 1);
+        assert_se(s.n_client_context_misses == 1);
+
+        /* Validating against /proc keeps the entry if nothing changed */
+        assert_se(client_context_get_at(&s, ucred.pid, &ucred, n + CLIENT_CONTEXT_VALIDATE_USEC + 1, &d) >= 0);
+        assert_se(c == d);
+        assert_se(s.n_client_context_hits == 2);
+        assert_se(s.n_client_context_misses == 1);
+
+        server_teardown(&s);
+}
+
+static void test_expiry(void) {
+        Server s;
+        ClientContext *c, *d;
+        usec_t n = 100 * USEC_PER_SEC;
+
+        server_setup(&s);
+
+        assert_se(client_context_get_at(&s, getpid(), NULL, n, &c) >= 0);
+        assert_se(c->timestamp == n);
+
+        assert_se(client_context_get_at(&s, getpid(), NULL, n + CLIENT_CONTEXT_MAX_AGE_USEC + 1, &d) >= 0);
+        assert_se(c == d);
+        assert_se(d->timestamp == n + CLIENT_CONTEXT_MAX_AGE_USEC + 1);
+        assert_se(s.n_client_context_hits == 0);
+        assert_se(s.n_client_context_misses == 2);
+
+        server_teardown(&s);
+}
+
+static void test_pid_reuse(void) {
+        Server s;
+        struct ucred ucred = {
+                .pid = getpid(),
+                .uid = getuid(),
+                .gid = getgid(),
+        };
+        ClientContext *c;
+        uint64_t starttime;
+        usec_t n = 100 * USEC_PER_SEC;
+
+        server_setup(&s);
+
+        assert_se(client_context_get_at(&s, ucred.pid, &ucred, n, &c) >= 0);
+        starttime = c->starttime;
+
+        /* A different user on the same PID is noticed right away */
+        ucred.uid++;
+        assert_se(client_context_get_at(&s, ucred.pid, &ucred, n + 1, &c) >= 0);
+        assert_se(c->uid == ucred.uid);
+        assert_se(s.n_client_context_misses == 2);
+
+        /* Pretend the PID was reused by a process of the same user.
+         * That is only noticed once the entry is due for validation. */
+        c->starttime = starttime + 1;
+        assert_se(client_context_get_at(&s, ucred.pid, &ucred, n + 2, &c) >= 0);
+        assert_se(c->starttime == starttime + 1);
+        assert_se(s.n_client_context_hits == 1);
+        assert_se(s.n_client_context_misses == 2);
+
+        assert_se(client_context_get_at(&s, ucred.pid, &ucred, n + 1 + CLIENT_CONTEXT_VALIDATE_USEC, &c) >= 0);
+        assert_se(c->starttime == starttime);
+        assert_se(s.n_client_context_hits == 1);
+        assert_se(s.n_client_context_misses == 3);
+
+        server_teardown(&s);
+}
+
+static void test_eviction(void) {
+        Server s;
+        ClientContext *c;
+        usec_t n = 100 * USEC_PER_SEC;
+        unsigned i;
+
+        server_setup(&s);
+
+        for (i = 0; i < CLIENT_CONTEXT_CACHE_MAX; i++)
+                assert_se(client_context_get_at(&s, FAKE_PID_BASE + i, NULL, n + i, &c) >= 0);
+        assert_se(hashmap_size(s.client_contexts) == CLIENT_CONTEXT_CACHE_MAX);
+
+        /* Refresh the oldest entry, so that the second one is now
+         * the one collected longest ago */
+        assert_se(client_context_get_at(&s, FAKE_PID_BASE, NULL, n + CLIENT_CONTEXT_MAX_AGE_USEC + 1, &c) >= 0);
+
+        assert_se(client_context_get_at(&s, FAKE_PID_BASE + CLIENT_CONTEXT_CACHE_MAX, NULL, n + CLIENT_CONTEXT_MAX_AGE_USEC + 2, &c) >= 0);
+        assert_se(hashmap_size(s.client_contexts) == CLIENT_CONTEXT_CACHE_MAX);
+
+        assert_se(hashmap_get(s.client_contexts, PID_TO_PTR(FAKE_PID_BASE)));
+        assert_se(!hashmap_get(s.client_contexts, PID_TO_PTR(FAKE_PID_BASE + 1)));
+        assert_se(hashmap_get(s.client_contexts, PID_TO_PTR(FAKE_PID_BASE + 2)));
+        assert_se(hashmap_get(s.client_contexts, PID_TO_PTR(FAKE_PID_BASE + CLIENT_CONTEXT_CACHE_MAX)));
+
+        server_teardown(&s);
+}
+
+int main(int argc, char *argv[]) {
+        log_set_max_level(LOG_DEBUG);
+
+        test_hit();
+        test_expiry();
+        test_pid_reuse();
+        test_eviction();
+
+        return 0;
+}
@@ -0,0 +1,119 @@
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <linux/sockios.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "alloc-util.h"
+#include "fd-util.h"
+#include "journal-file.h"
+#include "journald-server.h"
+#include "log.h"
+#include "macro.h"
+#include "parse-util.h"
+#include "rm-rf.h"
+#include "socket-util.h"
+#include "stdio-util.h"
+#include "string-util.h"
+
+/* Measures how many native protocol datagrams per second journald
+ * receives, parses and writes to a journal file */
+
+static usec_t arg_duration = 1 * USEC_PER_SEC;
+
+#define BURST 256U
+
+static void test_native_datagrams(size_t payload) {
+        char t[] = "/tmp/journal-datagram-XXXXXX";
+        _cleanup_free_ char *x = NULL, *message = NULL, *fn = NULL;
+        int pair[2];
+        Server s = {};
+        usec_t total = 0;
+        uint64_t n_messages = 0;
+
+        assert_se(mkdtemp(t));
+        assert_se(fn = strappend(t, "/test.journal"));
+
+        assert_se(socketpair(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0, pair) >= 0);
+        assert_se(setsockopt(pair[0], SOL_SOCKET, SO_PASSCRED, &(int) { 1 }, sizeof(int)) >= 0);
+
+        s.syslog_fd = s.stdout_fd = s.dev_kmsg_fd = s.audit_fd = s.hostname_fd = s.notify_fd = -1;
+        s.native_fd = pair[0];
+        assert_se(sd_event_default(&s.event) >= 0);
+        s.storage = STORAGE_VOLATILE;
+        s.max_level_store = LOG_DEBUG;
+        assert_se(s.rate_limit = journal_rate_limit_new(0, 0));
+        assert_se(s.cgroup_root = strdup("/"));
+        assert_se(journal_file_open(-1, fn, O_RDWR|O_CREAT, 0644, true, false, NULL, NULL, NULL, NULL, &s.runtime_journal) >= 0);
+
+        assert_se(x = malloc(payload + 1));
+        *((char*) mempset(x, 'x', payload)) = 0;
+        assert_se(message = strjoin("MESSAGE=", x, "\nPRIORITY=6\n", NULL));
+
+        while (total < arg_duration) {
+                unsigned i;
+                usec_t start;
+                int v;
+
+                for (i = 0; i < BURST; i++)
+                        if (send(pair[1], message, strlen(message), MSG_DONTWAIT) < 0) {
+                                assert_se(errno == EAGAIN);
+                                break;
+                        }
+
+                n_messages += i;
+
+                start = now(CLOCK_MONOTONIC);
+                do
+                        assert_se(server_process_datagram(NULL, pair[0], EPOLLIN, &s) >= 0);
+                while (ioctl(pair[0], SIOCINQ, &v) >= 0 && v > 0);
+                total += now(CLOCK_MONOTONIC) - start;
+        }
+
+        log_info("%6zu byte payloads: %8" PRIu64 " messages in %s, %8.0f msgs/s",
+                 payload, n_messages,
+                 format_timespan((char[FORMAT_TIMESPAN_MAX]) {}, FORMAT_TIMESPAN_MAX, total, USEC_PER_MSEC),
+                 (double) n_messages * USEC_PER_SEC / total);
+
+        /* Everything we sent ended up in the journal */
+        assert_se(le64toh(s.runtime_journal->header->n_entries) == n_messages);
+
+        s.native_fd = -1;
+        server_done(&s);
+        safe_close_pair(pair);
+        assert_se(rm_rf(t, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+}
+
+int main(int argc, char *argv[]) {
+        log_set_max_level(LOG_INFO);
+
+        if (argc >= 2) {
+                unsigned x;
+
+                assert_se(safe_atou(argv[1], &x) >= 0);
+                arg_duration = x * USEC_PER_SEC;
+        }
+
+        test_native_datagrams(16);
+        test_native_datagrams(256);
+        test_native_datagrams(4096);
+
+        return 0;
+}
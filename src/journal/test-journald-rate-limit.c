@@ -0,0 +1,183 @@
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <stdio.h>
+#include <syslog.h>
+
+#include "alloc-util.h"
+#include "journald-rate-limit.h"
+#include "macro.h"
+#include "string-util.h"
+#include "time-util.h"
+
+static void test_burst(void) {
+        JournalRateLimit *r;
+        unsigned i;
+
+        assert_se(r = journal_rate_limit_new(30 * USEC_PER_SEC, 10));
+
+        for (i = 0; i < 10; i++)
+                assert_se(journal_rate_limit_test(r, 1, "/one", LOG_INFO, 0) == 1);
+        assert_se(journal_rate_limit_test(r, 1, "/one", LOG_INFO, 0) == 0);
+        assert_se(journal_rate_limit_test(r, 1, "/one", LOG_NOTICE, 0) == 0);
+
+        /* Other groups and priorities are not affected */
+        assert_se(journal_rate_limit_test(r, 2, "/two", LOG_INFO, 0) == 1);
+        assert_se(journal_rate_limit_test(r, 1, "/one", LOG_ERR, 0) == 1);
+
+        /* More disk space, larger burst */
+        for (i = 0; i < 10; i++)
+                assert_se(journal_rate_limit_test(r, 3, "/three", LOG_INFO, UINT64_C(1) << 32) == 1);
+        assert_se(journal_rate_limit_test(r, 3, "/three", LOG_INFO, UINT64_C(1) << 32) == 1);
+
+        journal_rate_limit_free(r);
+
+        /* Turned off */
+        assert_se(r = journal_rate_limit_new(0, 0));
+        for (i = 0; i < 100; i++)
+                assert_se(journal_rate_limit_test(r, 1, "/one", LOG_INFO, 0) == 1);
+        journal_rate_limit_free(r);
+}
+
+static void test_refill(void) {
+        JournalRateLimit *r;
+        unsigned i;
+        usec_t ts = 100 * USEC_PER_SEC;
+
+        assert_se(r = journal_rate_limit_new(100 * USEC_PER_MSEC, 10));
+
+        for (i = 0; i < 10; i++)
+                assert_se(journal_rate_limit_test_at(r, 1, "/one", LOG_INFO, 0, ts) == 1);
+        for (i = 0; i < 5; i++)
+                assert_se(journal_rate_limit_test_at(r, 1, "/one", LOG_INFO, 0, ts) == 0);
+
+        /* After a full interval the bucket is full again, and we
+         * learn how many messages were dropped */
+        ts += 110 * USEC_PER_MSEC;
+
+        assert_se(journal_rate_limit_test_at(r, 1, "/one", LOG_INFO, 0, ts) == 6);
+        for (i = 0; i < 9; i++)
+                assert_se(journal_rate_limit_test_at(r, 1, "/one", LOG_INFO, 0, ts) == 1);
+        assert_se(journal_rate_limit_test_at(r, 1, "/one", LOG_INFO, 0, ts) == 0);
+
+        /* After half of the interval we get half of the tokens back,
+         * but the drop isn't reported yet */
+        ts += 50 * USEC_PER_MSEC;
+
+        for (i = 0; i < 5; i++)
+                assert_se(journal_rate_limit_test_at(r, 1, "/one", LOG_INFO, 0, ts) == 1);
+        assert_se(journal_rate_limit_test_at(r, 1, "/one", LOG_INFO, 0, ts) == 0);
+
+        journal_rate_limit_free(r);
+}
+
+static void test_many_groups(void) {
+        _cleanup_free_ JournalRateLimitStats *stats = NULL;
+        JournalRateLimit *r;
+        uint64_t dropped = 0, passed = 0;
+        size_t n, i;
+        unsigned k, j;
+        usec_t ts;
+
+        assert_se(r = journal_rate_limit_new(30 * USEC_PER_SEC, 100));
+
+        /* A thousand noisy groups, each logging twice as much as it may */
+        ts = now(CLOCK_MONOTONIC);
+        for (j = 0; j < 200; j++)
+                for (k = 1; k <= 1000; k++)
+                        assert_se(journal_rate_limit_test(r, k, "/noisy", LOG_INFO, 0) >= 0);
+        ts = now(CLOCK_MONOTONIC) - ts;
+
+        log_info("Rate limited 200000 messages of 1000 groups in %s.",
+                 format_timespan((char[FORMAT_TIMESPAN_MAX]) {}, FORMAT_TIMESPAN_MAX, ts, 0));
+
+        assert_se(journal_rate_limit_get_stats(r, &stats, &n) >= 0);
+        assert_se(n > 0 && n <= 1000);
+
+        for (i = 0; i < n; i++) {
+                assert_se(streq(stats[i].name, "/noisy"));
+                assert_se(stats[i].n_passed <= 100);
+                passed += stats[i].n_passed;
+                dropped += stats[i].n_dropped;
+        }
+
+        log_info("%zu groups, %" PRIu64 " messages passed, %" PRIu64 " dropped.", n, passed, dropped);
+
+        /* Many more groups than we have room for. Groups are replaced,
+         * but we never fail. */
+        for (j = 0; j < 10; j++)
+                for (k = 1; k <= 10000; k++)
+                        assert_se(journal_rate_limit_test(r, k, "/many", LOG_INFO, 0) >= 0);
+
+        stats = mfree(stats);
+        assert_se(journal_rate_limit_get_stats(r, &stats, &n) >= 0);
+        assert_se(n > 0 && n <= 2048);
+
+        journal_rate_limit_free(r);
+}
+
+static void test_flood(void) {
+        JournalRateLimit *r;
+        uint64_t passed = 0, n_passed, n_dropped, n_evicted;
+        unsigned j, k;
+        usec_t ts = 100 * USEC_PER_SEC;
+        int v;
+
+        assert_se(r = journal_rate_limit_new(USEC_PER_SEC, 10));
+
+        /* A flood spread over many more groups than fit into the
+         * table. Replaced groups hand their drained buckets on,
+         * hence no more than a burst per slot gets through. */
+        for (k = 1; k <= 20000; k++)
+                for (j = 0; j < 10; j++) {
+                        v = journal_rate_limit_test_at(r, k, "/flood", LOG_INFO, 0, ts);
+                        assert_se(v >= 0);
+                        passed += v > 0;
+                }
+
+        log_info("Flood of 20000 groups: %" PRIu64 " of 200000 messages passed.", passed);
+        assert_se(passed <= 2048 * 10);
+
+        journal_rate_limit_get_totals(r, &n_passed, &n_dropped, &n_evicted);
+        assert_se(n_passed == passed);
+        assert_se(n_dropped == 200000 - passed);
+        assert_se(n_evicted > 0);
+
+        /* Once the replaced groups have been quiet for an interval, new
+         * groups get full buckets */
+        ts += USEC_PER_SEC;
+        for (j = 0; j < 10; j++)
+                assert_se(journal_rate_limit_test_at(r, 30000, "/new", LOG_INFO, 0, ts) == 1);
+        assert_se(journal_rate_limit_test_at(r, 30000, "/new", LOG_INFO, 0, ts) == 0);
+
+        journal_rate_limit_get_totals(r, &n_passed, &n_dropped, &n_evicted);
+        assert_se(n_passed == passed + 10);
+        assert_se(n_dropped == 200000 - passed + 1);
+
+        journal_rate_limit_free(r);
+}
+
+int main(int argc, char *argv[]) {
+        log_set_max_level(LOG_DEBUG);
+
+        test_burst();
+        test_refill();
+        test_many_groups();
+        test_flood();
+
+        return 0;
+}
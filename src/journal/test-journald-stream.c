@@ -0,0 +1,213 @@
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "sd-event.h"
+#include "sd-journal.h"
+
+#include "alloc-util.h"
+#include "fd-util.h"
+#include "io-util.h"
+#include "journal-file.h"
+#include "journald-server.h"
+#include "journald-stream.h"
+#include "log.h"
+#include "macro.h"
+#include "rm-rf.h"
+#include "string-util.h"
+#include "strv.h"
+
+/* Feeds data into a stdout stream in pieces, and checks which
+ * MESSAGE= fields end up in the journal */
+
+typedef struct Test {
+        char dir[sizeof("/tmp/journald-stream-XXXXXX")];
+        Server server;
+        int fd;
+} Test;
+
+static void test_setup(Test *t) {
+        _cleanup_free_ char *fn = NULL;
+        int pair[2];
+
+        zero(*t);
+        strcpy(t->dir, "/tmp/journald-stream-XXXXXX");
+        assert_se(mkdtemp(t->dir));
+        assert_se(fn = strappend(t->dir, "/test.journal"));
+
+        t->server.syslog_fd = t->server.native_fd = t->server.stdout_fd = t->server.dev_kmsg_fd =
+                t->server.audit_fd = t->server.hostname_fd = t->server.notify_fd = -1;
+        t->server.storage = STORAGE_VOLATILE;
+        t->server.max_level_store = LOG_DEBUG;
+        assert_se(t->server.rate_limit = journal_rate_limit_new(0, 0));
+        assert_se(t->server.cgroup_root = strdup("/"));
+        assert_se(sd_event_default(&t->server.event) >= 0);
+        assert_se(journal_file_open(-1, fn, O_RDWR|O_CREAT, 0644, false, false, NULL, NULL, NULL, NULL, &t->server.runtime_journal) >= 0);
+
+        assert_se(socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0, pair) >= 0);
+        assert_se(stdout_stream_install(&t->server, pair[0], NULL) >= 0);
+        t->fd = pair[1];
+
+        /* Identifier, unit, priority, level prefix, and no forwarding */
+        assert_se(loop_write(t->fd, "test\n\n6\n0\n0\n0\n0\n", strlen("test\n\n6\n0\n0\n0\n0\n"), false) >= 0);
+}
+
+static void test_feed(Test *t, const char *data, size_t size) {
+        if (size > 0)
+                assert_se(loop_write(t->fd, data, size, false) >= 0);
+
+        while (sd_event_run(t->server.event, 0) > 0)
+                ;
+}
+
+static void test_close(Test *t) {
+        t->fd = safe_close(t->fd);
+
+        while (sd_event_run(t->server.event, 0) > 0)
+                ;
+
+        assert_se(t->server.n_stdout_streams == 0);
+}
+
+static void test_check(Test *t, char **expected) {
+        sd_journal *j;
+        char **l = NULL;
+
+        assert_se(sd_journal_open_directory(&j, t->dir, 0) >= 0);
+
+        SD_JOURNAL_FOREACH(j) {
+                const void *d;
+                size_t k;
+                char *m;
+
+                assert_se(sd_journal_get_data(j, "MESSAGE", &d, &k) >= 0);
+                assert_se(m = strndup((const char*) d + strlen("MESSAGE="), k - strlen("MESSAGE=")));
+                assert_se(strv_consume(&l, m) >= 0);
+        }
+
+        sd_journal_close(j);
+
+        assert_se(strv_equal(l, expected));
+        strv_free(l);
+}
+
+static void test_teardown(Test *t) {
+        safe_close(t->fd);
+        server_done(&t->server);
+        assert_se(rm_rf(t->dir, REMOVE_ROOT|REMOVE_PHYSICAL) >= 0);
+}
+
+static void test_multiple_lines(void) {
+        Test t;
+
+        test_setup(&t);
+
+        /* Several lines in one read are written as one batch */
+        test_feed(&t, "one\ntwo\nthree\n", strlen("one\ntwo\nthree\n"));
+        assert_se(le64toh(t.server.runtime_journal->header->n_entries) == 3);
+
+        test_close(&t);
+        test_check(&t, STRV_MAKE("one", "two", "three"));
+        test_teardown(&t);
+}
+
+static void test_partial_lines(void) {
+        Test t;
+
+        test_setup(&t);
+
+        test_feed(&t, "par", 3);
+        assert_se(le64toh(t.server.runtime_journal->header->n_entries) == 0);
+
+        test_feed(&t, "tial\nsec", 8);
+        assert_se(le64toh(t.server.runtime_journal->header->n_entries) == 1);
+
+        test_feed(&t, "ond\nno newline at the end", strlen("ond\nno newline at the end"));
+        assert_se(le64toh(t.server.runtime_journal->header->n_entries) == 2);
+
+        /* The remainder is written when the stream is closed */
+        test_close(&t);
+        test_check(&t, STRV_MAKE("partial", "second", "no newline at the end"));
+        test_teardown(&t);
+}
+
+static void test_long_lines(void) {
+        _cleanup_free_ char *data = NULL, *a = NULL, *b = NULL, *c = NULL;
+        Test t;
+
+        test_setup(&t);
+
+        /* A line of exactly LINE_MAX is split off, and the newline
+         * following it makes an empty line, which is dropped. A line
+         * longer than that is split at LINE_MAX. */
+        assert_se(a = malloc(LINE_MAX + 1));
+        *((char*) mempset(a, 'a', LINE_MAX)) = 0;
+        assert_se(b = malloc(LINE_MAX + 1));
+        *((char*) mempset(b, 'b', LINE_MAX)) = 0;
+        assert_se(c = strdup("bbbbbbbbbb"));
+        assert_se(data = strjoin(a, "\n", b, c, "\nshort\n", NULL));
+
+        /* Feed it in small pieces, so that the partial line has to be
+         * moved within the buffer a couple of times */
+        test_feed(&t, data, 1000);
+        test_feed(&t, data + 1000, strlen(data) - 1000);
+
+        test_close(&t);
+        test_check(&t, STRV_MAKE(a, b, c, "short"));
+        test_teardown(&t);
+}
+
+static void test_many_lines(void) {
+        _cleanup_strv_free_ char **expected = NULL;
+        _cleanup_free_ char *data = NULL;
+        size_t size = 0, allocated = 0, i;
+        unsigned k;
+        Test t;
+
+        test_setup(&t);
+
+        /* Lines of varying length, much more than fits into the
+         * buffer, fed in pieces that don't end at line boundaries */
+        for (k = 0; k < 2000; k++) {
+                char *line;
+
+                assert_se(asprintf(&line, "line %u:%.*s", k, (int) (k % 97), "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx") >= 0);
+                assert_se(GREEDY_REALLOC(data, allocated, size + strlen(line) + 2));
+                size = stpcpy(stpcpy(data + size, line), "\n") - data;
+                assert_se(strv_consume(&expected, line) >= 0);
+        }
+
+        for (i = 0; i < size; i += 1777)
+                test_feed(&t, data + i, MIN(size - i, (size_t) 1777));
+
+        test_close(&t);
+        test_check(&t, expected);
+        test_teardown(&t);
+}
+
+int main(int argc, char *argv[]) {
+        log_set_max_level(LOG_DEBUG);
+
+        test_multiple_lines();
+        test_partial_lines();
+        test_long_lines();
+        test_many_lines();
+
+        return 0;
+}
@@ -24,10 +24,159 @@
 
 #include "fd-util.h"
 #include "fileio.h"
+#include "log.h"
 #include "macro.h"
 #include "mmap-cache.h"
+#include "sigbus.h"
 #include "util.h"
 
+static void test_sequential(void) {
+        char pt[] = "/tmp/testmmapSXXXXXX";
+        MMapCache *m;
+        struct stat st;
+        uint64_t offset;
+        unsigned missed, missed_max;
+        void *p;
+        int fd;
+
+        /* Scanning through a large file should need few maps, since
+         * windows grow when we notice the scan */
+
+        assert_se(m = mmap_cache_new());
+
+        fd = mkostemp_safe(pt, O_RDWR|O_CLOEXEC);
+        assert_se(fd >= 0);
+        unlink(pt);
+
+        assert_se(ftruncate(fd, 256ULL*1024ULL*1024ULL) >= 0);
+        assert_se(fstat(fd, &st) >= 0);
+
+#ifdef ENABLE_DEBUG_MMAP_CACHE
+        /* Windows are a single page then and never grow, hence all
+         * we can check is that we don't need more than one map per
+         * page */
+        missed_max = st.st_size / page_size() + 1;
+#else
+        missed_max = 10;
+#endif
+
+        for (offset = 0; offset < (uint64_t) st.st_size; offset += 4096)
+                assert_se(mmap_cache_get(m, fd, PROT_READ, 2, false, offset, 64, &st, &p) >= 0);
+
+        missed = mmap_cache_get_missed(m);
+        log_info("Forward scan: %u hit, %u missed, %u unmapped.", mmap_cache_get_hit(m), missed, mmap_cache_get_unmapped(m));
+        assert_se(missed <= missed_max);
+
+        mmap_cache_unref(m);
+        assert_se(m = mmap_cache_new());
+
+        for (offset = st.st_size; offset >= 4096; offset -= 4096)
+                assert_se(mmap_cache_get(m, fd, PROT_READ, 2, false, offset - 64, 64, &st, &p) >= 0);
+
+        missed = mmap_cache_get_missed(m);
+        log_info("Backward scan: %u hit, %u missed, %u unmapped.", mmap_cache_get_hit(m), missed, mmap_cache_get_unmapped(m));
+        assert_se(missed <= missed_max);
+
+        mmap_cache_unref(m);
+        safe_close(fd);
+}
+
+static void test_sigbus_two_caches(void) {
+        char pt[] = "/tmp/testmmapBXXXXXX";
+        MMapCache *a, *b;
+        struct stat st;
+        void *p;
+        int fd;
+
+        /* A SIGBUS in a window of one cache must neither confuse
+         * nor get lost in another cache of the same process, for
+         * example one used by another thread */
+
+        sigbus_install();
+
+        assert_se(a = mmap_cache_new());
+        assert_se(b = mmap_cache_new());
+
+        fd = mkostemp_safe(pt, O_RDWR|O_CLOEXEC);
+        assert_se(fd >= 0);
+        unlink(pt);
+
+        assert_se(ftruncate(fd, 4 * page_size()) >= 0);
+        assert_se(fstat(fd, &st) >= 0);
+
+        assert_se(mmap_cache_get(a, fd, PROT_READ, 0, false, 0, 64, &st, &p) >= 0);
+        assert_se(mmap_cache_get(b, fd, PROT_READ, 0, false, 2 * page_size(), 64, &st, &p) >= 0);
+
+        /* Reading the page after the file got truncated triggers
+         * SIGBUS, which replaces it with a zeroed page */
+        assert_se(ftruncate(fd, 0) >= 0);
+        assert_se(*(volatile uint8_t*) p == 0);
+
+        assert_se(!mmap_cache_got_sigbus(a, fd));
+        assert_se(mmap_cache_got_sigbus(b, fd));
+
+        mmap_cache_unref(a);
+        mmap_cache_unref(b);
+        safe_close(fd);
+
+        sigbus_reset();
+}
+
+static void test_sigbus_unowned(void) {
+        char pt[] = "/tmp/testmmapUXXXXXX";
+        MMapCache *a, *b;
+        struct stat st;
+        void *p, *gone;
+        unsigned i, j;
+        int fd;
+
+        /* SIGBUS pages whose window was unmapped before any cache
+         * looked at them belong to nobody. They must not pile up in
+         * the queue until it overflows. */
+
+        sigbus_install();
+
+        assert_se(a = mmap_cache_new());
+        assert_se(b = mmap_cache_new());
+
+        fd = mkostemp_safe(pt, O_RDWR|O_CLOEXEC);
+        assert_se(fd >= 0);
+        unlink(pt);
+
+        assert_se(ftruncate(fd, 4 * page_size()) >= 0);
+        assert_se(fstat(fd, &st) >= 0);
+
+        assert_se(mmap_cache_get(a, fd, PROT_READ, 0, false, 0, 64, &st, &p) >= 0);
+        assert_se(mmap_cache_get(b, fd, PROT_READ, 0, false, 2 * page_size(), 64, &st, &p) >= 0);
+
+        gone = mmap(NULL, page_size(), PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        assert_se(gone != MAP_FAILED);
+        assert_se(munmap(gone, page_size()) >= 0);
+
+        /* Many more than fit into the queue, over time */
+        for (i = 0; i < 4 * SIGBUS_QUEUE_MAX; i += SIGBUS_QUEUE_MAX / 2) {
+                for (j = 0; j < SIGBUS_QUEUE_MAX / 2; j++)
+                        sigbus_push(gone);
+
+                assert_se(!mmap_cache_got_sigbus(a, fd));
+                assert_se(!mmap_cache_got_sigbus(b, fd));
+        }
+
+        /* Pages that do belong to a cache are still found */
+        assert_se(ftruncate(fd, 0) >= 0);
+        assert_se(*(volatile uint8_t*) p == 0);
+        sigbus_push(gone);
+
+        assert_se(!mmap_cache_got_sigbus(a, fd));
+        assert_se(mmap_cache_got_sigbus(b, fd));
+
+        mmap_cache_unref(a);
+        mmap_cache_unref(b);
+        safe_close(fd);
+
+        sigbus_reset();
+}
+
 int main(int argc, char *argv[]) {
         int x, y, z, r;
         char px[] = "/tmp/testmmapXXXXXXX", py[] = "/tmp/testmmapYXXXXXX", pz[] = "/tmp/testmmapZXXXXXX";
@@ -75,5 +224,9 @@ int main(int argc, char *argv[]) {
         safe_close(y);
         safe_close(z);
 
+        test_sequential();
+        test_sigbus_two_caches();
+        test_sigbus_unowned();
+
         return 0;
 }
@@ -219,7 +219,10 @@ struct sd_bus {
         unsigned rqueue_size;
         size_t rqueue_allocated;
 
+        /* A ring buffer, wqueue_first is the index of the oldest
+         * entry, windex how much of it was written already */
         sd_bus_message **wqueue;
+        unsigned wqueue_first;
         unsigned wqueue_size;
         size_t windex;
         size_t wqueue_allocated;
@@ -366,6 +369,12 @@ int bus_seal_synthetic_message(sd_bus *b, sd_bus_message *m);
 
 int bus_rqueue_make_room(sd_bus *bus);
 
+static inline sd_bus_message *bus_wqueue_peek(sd_bus *bus, unsigned i) {
+        assert(i < bus->wqueue_size);
+
+        return bus->wqueue[(bus->wqueue_first + i) % bus->wqueue_allocated];
+}
+
 bool bus_pid_changed(sd_bus *bus);
 
 char *bus_address_escape(const char *v);
@@ -18,6 +18,7 @@
 ***/
 
 #include <endian.h>
+#include <limits.h>
 #include <poll.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -766,9 +767,55 @@ int bus_socket_take_fd(sd_bus *b) {
         return bus_socket_start_auth(b);
 }
 
+static int bus_socket_write_iovec(
+                sd_bus *bus,
+                struct iovec *iov,
+                unsigned n_iov,
+                const int *fds,
+                unsigned n_fds,
+                size_t *idx) {
+
+        ssize_t k;
+
+        assert(bus);
+        assert(iov || n_iov == 0);
+        assert(fds || n_fds == 0);
+        assert(idx);
+
+        if (bus->prefer_writev)
+                k = writev(bus->output_fd, iov, n_iov);
+        else {
+                struct msghdr mh = {
+                        .msg_iov = iov,
+                        .msg_iovlen = n_iov,
+                };
+
+                if (n_fds > 0) {
+                        struct cmsghdr *control;
+
+                        mh.msg_control = control = alloca(CMSG_SPACE(sizeof(int) * n_fds));
+                        mh.msg_controllen = control->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+                        control->cmsg_level = SOL_SOCKET;
+                        control->cmsg_type = SCM_RIGHTS;
+                        memcpy(CMSG_DATA(control), fds, sizeof(int) * n_fds);
+                }
+
+                k = sendmsg(bus->output_fd, &mh, MSG_DONTWAIT|MSG_NOSIGNAL);
+                if (k < 0 && errno == ENOTSOCK) {
+                        bus->prefer_writev = true;
+                        k = writev(bus->output_fd, iov, n_iov);
+                }
+        }
+
+        if (k < 0)
+                return errno == EAGAIN ? 0 : -errno;
+
+        *idx += (size_t) k;
+        return 1;
+}
+
 int bus_socket_write_message(sd_bus *bus, sd_bus_message *m, size_t *idx) {
         struct iovec *iov;
-        ssize_t k;
         size_t n;
         unsigned j;
         int r;
@@ -792,36 +839,67 @@ int bus_socket_write_message(sd_bus *bus, sd_bus_message *m, size_t *idx) {
         j = 0;
         iovec_advance(iov, &j, *idx);
 
-        if (bus->prefer_writev)
-                k = writev(bus->output_fd, iov, m->n_iovec);
-        else {
-                struct msghdr mh = {
-                        .msg_iov = iov,
-                        .msg_iovlen = m->n_iovec,
-                };
+        /* The fds went out with the first part of the message
+         * already, if this is a continuation */
+        return bus_socket_write_iovec(bus, iov + j, m->n_iovec - j, m->fds, *idx == 0 ? m->n_fds : 0, idx);
+}
 
-                if (m->n_fds > 0) {
-                        struct cmsghdr *control;
+int bus_socket_write_wqueue(sd_bus *bus) {
+        struct iovec *iov;
+        sd_bus_message *m;
+        unsigned i, j, n, n_iov = 0;
+        int r;
 
-                        mh.msg_control = control = alloca(CMSG_SPACE(sizeof(int) * m->n_fds));
-                        mh.msg_controllen = control->cmsg_len = CMSG_LEN(sizeof(int) * m->n_fds);
-                        control->cmsg_level = SOL_SOCKET;
-                        control->cmsg_type = SCM_RIGHTS;
-                        memcpy(CMSG_DATA(control), m->fds, sizeof(int) * m->n_fds);
-                }
+        assert(bus);
+        assert(bus->state == BUS_RUNNING || bus->state == BUS_HELLO);
+        assert(bus->wqueue_size > 0);
+
+        /* Writes as many of the queued messages as possible with a
+         * single sendmsg(), and increases bus->windex by the number
+         * of bytes written, counting from the start of the first
+         * queued message.
+         *
+         * Passed fds are attached to the first byte of a write, and
+         * the reading side assigns all fds it received to the message
+         * that is being read. Hence a message with fds may only start
+         * a batch, never be appended to one. */
+
+        for (n = 0; n < bus->wqueue_size; n++) {
+                m = bus_wqueue_peek(bus, n);
+
+                if (n > 0 && m->n_fds > 0)
+                        break;
+
+                r = bus_message_setup_iovec(m);
+                if (r < 0) {
+                        /* Send what we have, and fail when we get
+                         * to this one */
+                        if (n > 0)
+                                break;
 
-                k = sendmsg(bus->output_fd, &mh, MSG_DONTWAIT|MSG_NOSIGNAL);
-                if (k < 0 && errno == ENOTSOCK) {
-                        bus->prefer_writev = true;
-                        k = writev(bus->output_fd, iov, m->n_iovec);
+                        return r;
                 }
+
+                if (n > 0 && n_iov + m->n_iovec > IOV_MAX)
+                        break;
+
+                n_iov += m->n_iovec;
         }
 
-        if (k < 0)
-                return errno == EAGAIN ? 0 : -errno;
+        iov = alloca(n_iov * sizeof(struct iovec));
 
-        *idx += (size_t) k;
-        return 1;
+        for (i = 0, j = 0; i < n; i++) {
+                m = bus_wqueue_peek(bus, i);
+
+                memcpy_safe(iov + j, m->iovec, m->n_iovec * sizeof(struct iovec));
+                j += m->n_iovec;
+        }
+
+        j = 0;
+        iovec_advance(iov, &j, bus->windex);
+
+        m = bus_wqueue_peek(bus, 0);
+        return bus_socket_write_iovec(bus, iov + j, n_iov - j, m->fds, bus->windex == 0 ? m->n_fds : 0, &bus->windex);
 }
 
 static int bus_socket_read_message_need(sd_bus *bus, size_t *need) {
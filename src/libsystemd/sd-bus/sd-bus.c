@@ -95,11 +95,14 @@ static void bus_reset_queues(sd_bus *b) {
         b->rqueue = mfree(b->rqueue);
         b->rqueue_allocated = 0;
 
-        while (b->wqueue_size > 0)
-                sd_bus_message_unref(b->wqueue[--b->wqueue_size]);
+        while (b->wqueue_size > 0) {
+                sd_bus_message_unref(bus_wqueue_peek(b, b->wqueue_size - 1));
+                b->wqueue_size--;
+        }
 
         b->wqueue = mfree(b->wqueue);
         b->wqueue_allocated = 0;
+        b->wqueue_first = 0;
 }
 
 static void bus_free(sd_bus *b) {
@@ -1611,6 +1614,21 @@ int bus_seal_synthetic_message(sd_bus *b, sd_bus_message *m) {
         return bus_message_seal(m, 0xFFFFFFFFULL, 0);
 }
 
+static void bus_log_sent_message(sd_bus_message *m) {
+        assert(m);
+
+        log_debug("Sent message type=%s sender=%s destination=%s object=%s interface=%s member=%s cookie=%" PRIu64 " reply_cookie=%" PRIu64 " error=%s",
+                  bus_message_type_to_string(m->header->type),
+                  strna(sd_bus_message_get_sender(m)),
+                  strna(sd_bus_message_get_destination(m)),
+                  strna(sd_bus_message_get_path(m)),
+                  strna(sd_bus_message_get_interface(m)),
+                  strna(sd_bus_message_get_member(m)),
+                  BUS_MESSAGE_COOKIE(m),
+                  m->reply_cookie,
+                  strna(m->error.message));
+}
+
 static int bus_write_message(sd_bus *bus, sd_bus_message *m, bool hint_sync_call, size_t *idx) {
         int r;
 
@@ -1626,20 +1644,51 @@ static int bus_write_message(sd_bus *bus, sd_bus_message *m, bool hint_sync_call
                 return r;
 
         if (bus->is_kernel || *idx >= BUS_MESSAGE_SIZE(m))
-                log_debug("Sent message type=%s sender=%s destination=%s object=%s interface=%s member=%s cookie=%" PRIu64 " reply_cookie=%" PRIu64 " error=%s",
-                          bus_message_type_to_string(m->header->type),
-                          strna(sd_bus_message_get_sender(m)),
-                          strna(sd_bus_message_get_destination(m)),
-                          strna(sd_bus_message_get_path(m)),
-                          strna(sd_bus_message_get_interface(m)),
-                          strna(sd_bus_message_get_member(m)),
-                          BUS_MESSAGE_COOKIE(m),
-                          m->reply_cookie,
-                          strna(m->error.message));
+                bus_log_sent_message(m);
 
         return r;
 }
 
+static int bus_wqueue_push(sd_bus *bus, sd_bus_message *m) {
+        assert(bus);
+        assert(m);
+
+        if (bus->wqueue_size >= BUS_WQUEUE_MAX)
+                return -ENOBUFS;
+
+        if (bus->wqueue_size >= bus->wqueue_allocated) {
+                sd_bus_message **q;
+                size_t n;
+
+                /* Grow the ring, and move the entries that wrapped
+                 * around to the start of the array behind the
+                 * others again */
+                n = MAX(bus->wqueue_allocated * 2, 8U);
+                q = realloc_multiply(bus->wqueue, sizeof(sd_bus_message*), n);
+                if (!q)
+                        return -ENOMEM;
+
+                memcpy(q + bus->wqueue_allocated, q, sizeof(sd_bus_message*) * bus->wqueue_first);
+                bus->wqueue = q;
+                bus->wqueue_allocated = n;
+        }
+
+        bus->wqueue[(bus->wqueue_first + bus->wqueue_size) % bus->wqueue_allocated] = sd_bus_message_ref(m);
+        bus->wqueue_size++;
+
+        return 0;
+}
+
+static void bus_wqueue_pop(sd_bus *bus) {
+        assert(bus);
+        assert(bus->wqueue_size > 0);
+
+        sd_bus_message_unref(bus->wqueue[bus->wqueue_first]);
+
+        bus->wqueue_first = (bus->wqueue_first + 1) % bus->wqueue_allocated;
+        bus->wqueue_size--;
+}
+
 static int dispatch_wqueue(sd_bus *bus) {
         int r, ret = 0;
 
@@ -1648,28 +1697,35 @@ static int dispatch_wqueue(sd_bus *bus) {
 
         while (bus->wqueue_size > 0) {
 
-                r = bus_write_message(bus, bus->wqueue[0], false, &bus->windex);
+                if (bus->is_kernel)
+                        r = bus_write_message(bus, bus_wqueue_peek(bus, 0), false, &bus->windex);
+                else
+                        /* Write as many of the queued messages as we
+                         * can in one go */
+                        r = bus_socket_write_wqueue(bus);
                 if (r < 0)
                         return r;
                 else if (r == 0)
                         /* Didn't do anything this time */
                         return ret;
-                else if (bus->is_kernel || bus->windex >= BUS_MESSAGE_SIZE(bus->wqueue[0])) {
+
+                if (bus->is_kernel) {
                         /* Fully written. Let's drop the entry from
-                         * the queue.
-                         *
-                         * This isn't particularly optimized, but
-                         * well, this is supposed to be our worst-case
-                         * buffer only, and the socket buffer is
-                         * supposed to be our primary buffer, and if
-                         * it got full, then all bets are off
-                         * anyway. */
-
-                        bus->wqueue_size--;
-                        sd_bus_message_unref(bus->wqueue[0]);
-                        memmove(bus->wqueue, bus->wqueue + 1, sizeof(sd_bus_message*) * bus->wqueue_size);
-                        bus->windex = 0;
+                         * the queue. */
+                        bus_wqueue_pop(bus);
+                        ret = 1;
+                        continue;
+                }
+
+                /* A single write might have completed several
+                 * entries, drop them all from the queue. */
+                while (bus->wqueue_size > 0 && bus->windex >= BUS_MESSAGE_SIZE(bus_wqueue_peek(bus, 0))) {
+                        sd_bus_message *m = bus_wqueue_peek(bus, 0);
 
+                        bus->windex -= BUS_MESSAGE_SIZE(m);
+                        bus_log_sent_message(m);
+
+                        bus_wqueue_pop(bus);
                         ret = 1;
                 }
         }
@@ -1793,6 +1849,7 @@ static int bus_send_internal(sd_bus *bus, sd_bus_message *_m, uint64_t *cookie,
                          * that we always can remember how much was
                          * written. */
                         bus->wqueue[0] = sd_bus_message_ref(m);
+                        bus->wqueue_first = 0;
                         bus->wqueue_size = 1;
                         bus->windex = idx;
                 }
@@ -1800,13 +1857,9 @@ static int bus_send_internal(sd_bus *bus, sd_bus_message *_m, uint64_t *cookie,
         } else {
                 /* Just append it to the queue. */
 
-                if (bus->wqueue_size >= BUS_WQUEUE_MAX)
-                        return -ENOBUFS;
-
-                if (!GREEDY_REALLOC(bus->wqueue, bus->wqueue_allocated, bus->wqueue_size + 1))
-                        return -ENOMEM;
-
-                bus->wqueue[bus->wqueue_size++] = sd_bus_message_ref(m);
+                r = bus_wqueue_push(bus, m);
+                if (r < 0)
+                        return r;
         }
 
 finish:
@@ -31,6 +31,8 @@
 #include "util.h"
 
 #define MAX_SIZE (2*1024*1024)
+#define SIGNAL_SIZE_MAX (64*1024)
+#define SIGNAL_BURST (BUS_WQUEUE_MAX/2)
 
 static usec_t arg_loop_usec = 100 * USEC_PER_MSEC;
 
@@ -40,7 +42,7 @@ typedef enum Type {
         TYPE_DIRECT,
 } Type;
 
-static void server(sd_bus *b, size_t *result) {
+static void server(sd_bus *b, size_t *result, size_t *n_signals) {
         int r;
 
         for (;;) {
@@ -72,7 +74,9 @@ static void server(sd_bus *b, size_t *result) {
                         *result = res;
                         return;
 
-                } else if (!sd_bus_message_is_signal(m, NULL, NULL))
+                } else if (sd_bus_message_is_signal(m, "benchmark.server", "Signal"))
+                        (*n_signals)++;
+                else if (!sd_bus_message_is_signal(m, NULL, NULL))
                         assert_not_reached("Unknown method");
         }
 }
@@ -163,9 +167,7 @@ static void client_bisect(const char *address, const char *server_name) {
         sd_bus_unref(b);
 }
 
-static void client_chart(Type type, const char *address, const char *server_name, int fd) {
-        _cleanup_(sd_bus_message_unrefp) sd_bus_message *x = NULL;
-        size_t csize;
+static sd_bus *client_connect(Type type, const char *address, const char *server_name, int fd) {
         sd_bus *b;
         int r;
 
@@ -189,6 +191,16 @@ static void client_chart(Type type, const char *address, const char *server_name
         r = sd_bus_call_method(b, server_name, "/", "benchmark.server", "Ping", NULL, NULL, NULL);
         assert_se(r >= 0);
 
+        return b;
+}
+
+static void client_chart(Type type, const char *address, const char *server_name, int fd) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *x = NULL;
+        size_t csize;
+        sd_bus *b;
+
+        b = client_connect(type, address, server_name, fd);
+
         switch (type) {
         case TYPE_KDBUS:
                 printf("SIZE\tCOPY\tMEMFD\n");
@@ -240,10 +252,70 @@ static void client_chart(Type type, const char *address, const char *server_name
         sd_bus_unref(b);
 }
 
+static void client_signals(Type type, const char *address, const char *server_name, int fd) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *x = NULL;
+        size_t csize, n_total = 0;
+        sd_bus *b;
+
+        /* Emits signals in bursts, so that they pile up in the write
+         * queue once the socket buffer is full, and measures how
+         * many of them make it to the server per second. */
+
+        b = client_connect(type, address, server_name, fd);
+
+        printf("SIZE\tSIGNALS\n");
+
+        for (csize = 1; csize <= SIGNAL_SIZE_MAX; csize *= 4) {
+                unsigned n_signals = 0;
+                usec_t t;
+
+                printf("%zu\t", csize);
+
+                t = now(CLOCK_MONOTONIC);
+                for (;;) {
+                        unsigned i;
+
+                        for (i = 0; i < SIGNAL_BURST; i++) {
+                                _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+                                uint8_t *p;
+
+                                assert_se(sd_bus_message_new_signal(b, &m, "/", "benchmark.server", "Signal") >= 0);
+                                if (server_name)
+                                        assert_se(sd_bus_message_set_destination(m, server_name) >= 0);
+                                assert_se(sd_bus_message_append_array_space(m, 'y', csize, (void**) &p) >= 0);
+                                memset(p, 0x80, csize);
+
+                                assert_se(sd_bus_send(b, m, NULL) >= 0);
+                        }
+
+                        assert_se(sd_bus_flush(b) >= 0);
+                        n_signals += SIGNAL_BURST;
+
+                        if (now(CLOCK_MONOTONIC) >= t + arg_loop_usec)
+                                break;
+                }
+
+                /* Messages are processed in order, hence once the
+                 * server replied all signals have been received */
+                assert_se(sd_bus_call_method(b, server_name, "/", "benchmark.server", "Ping", NULL, NULL, NULL) >= 0);
+
+                printf("%u\n", (unsigned) ((n_signals * USEC_PER_SEC) / (now(CLOCK_MONOTONIC) - t)));
+                n_total += n_signals;
+        }
+
+        assert_se(sd_bus_message_new_method_call(b, &x, server_name, "/", "benchmark.server", "Exit") >= 0);
+        assert_se(sd_bus_message_append(x, "t", (uint64_t) n_total) >= 0);
+        assert_se(sd_bus_send(b, x, NULL) >= 0);
+        assert_se(sd_bus_flush(b) >= 0);
+
+        sd_bus_unref(b);
+}
+
 int main(int argc, char *argv[]) {
         enum {
                 MODE_BISECT,
                 MODE_CHART,
+                MODE_SIGNALS,
         } mode = MODE_BISECT;
         Type type = TYPE_KDBUS;
         int i, pair[2] = { -1, -1 };
@@ -251,7 +323,7 @@ int main(int argc, char *argv[]) {
         _cleanup_close_ int bus_ref = -1;
         const char *unique;
         cpu_set_t cpuset;
-        size_t result;
+        size_t result, n_signals = 0;
         sd_bus *b;
         pid_t pid;
         int r;
@@ -260,6 +332,9 @@ int main(int argc, char *argv[]) {
                 if (streq(argv[i], "chart")) {
                         mode = MODE_CHART;
                         continue;
+                } else if (streq(argv[i], "signals")) {
+                        mode = MODE_SIGNALS;
+                        continue;
                 } else if (streq(argv[i], "legacy")) {
                         type = TYPE_LEGACY;
                         continue;
@@ -348,8 +423,13 @@ int main(int argc, char *argv[]) {
                 case MODE_CHART:
                         client_chart(type, address, server_name, pair[1]);
                         break;
+
+                case MODE_SIGNALS:
+                        client_signals(type, address, server_name, pair[1]);
+                        break;
                 }
 
+                fflush(stdout);
                 _exit(0);
         }
 
@@ -357,10 +437,12 @@ int main(int argc, char *argv[]) {
         CPU_SET(1, &cpuset);
         pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
 
-        server(b, &result);
+        server(b, &result, &n_signals);
 
         if (mode == MODE_BISECT)
                 printf("Copying/memfd are equally fast at %zu bytes\n", result);
+        else if (mode == MODE_SIGNALS)
+                assert_se(n_signals == result);
 
         assert_se(waitpid(pid, NULL, 0) == pid);
 
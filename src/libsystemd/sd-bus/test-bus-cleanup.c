@@ -18,12 +18,14 @@
 ***/
 
 #include <stdio.h>
+#include <sys/socket.h>
 
 #include "sd-bus.h"
 
 #include "bus-internal.h"
 #include "bus-message.h"
 #include "bus-util.h"
+#include "fd-util.h"
 #include "refcnt.h"
 
 static void test_bus_new(void) {
@@ -75,6 +77,36 @@ static void test_bus_new_signal(void) {
         printf("after bus_flush_close_unref: refcount %u\n", m->n_ref);
 }
 
+static void test_bus_close_queued(void) {
+        _cleanup_(sd_bus_message_unrefp) sd_bus_message *m = NULL;
+        _cleanup_close_pair_ int pair[2] = { -1, -1 };
+        sd_bus *bus = NULL;
+        unsigned i;
+
+        assert_se(socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, pair) >= 0);
+
+        assert_se(sd_bus_new(&bus) >= 0);
+        assert_se(sd_bus_set_fd(bus, pair[0], pair[0]) >= 0);
+        pair[0] = -1;
+        assert_se(sd_bus_start(bus) >= 0);
+
+        assert_se(sd_bus_message_new_signal(bus, &m, "/an/object/path", "an.interface.name", "Name") >= 0);
+
+        /* The peer never answers the authentication, hence all of
+         * these stay in the write queue */
+        for (i = 0; i < 10; i++)
+                assert_se(sd_bus_send(bus, m, NULL) >= 0);
+
+        assert_se(bus->wqueue_size == 10);
+        assert_se(m->n_ref == 11);
+
+        sd_bus_close(bus);
+        assert_se(bus->wqueue_size == 0);
+        assert_se(m->n_ref == 1);
+
+        sd_bus_unref(bus);
+}
+
 int main(int argc, char **argv) {
         int r;
 
@@ -82,6 +114,7 @@ int main(int argc, char **argv) {
         log_open();
 
         test_bus_new();
+        test_bus_close_queued();
         r = test_bus_open();
         if (r < 0) {
                 log_info("Failed to connect to bus, skipping tests.");
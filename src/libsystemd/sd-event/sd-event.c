@@ -17,7 +17,11 @@
   along with systemd; If not, see <http://www.gnu.org/licenses/>.
 ***/
 
+#include <pthread.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
 #include <sys/timerfd.h>
 #include <sys/wait.h>
 
@@ -38,10 +42,17 @@
 #include "string-table.h"
 #include "string-util.h"
 #include "time-util.h"
+#include "timer-wheel.h"
 #include "util.h"
 
 #define DEFAULT_ACCURACY_USEC (250 * USEC_PER_MSEC)
 
+/* Upper bound for the number of events to fetch with a single
+ * epoll_wait() call */
+#define EPOLL_QUEUE_MAX 512U
+
+#define WORKER_THREADS_MAX 64U
+
 typedef enum EventSourceType {
         SOURCE_IO,
         SOURCE_TIME_REALTIME,
@@ -54,6 +65,7 @@ typedef enum EventSourceType {
         SOURCE_DEFER,
         SOURCE_POST,
         SOURCE_EXIT,
+        SOURCE_WORK,
         SOURCE_WATCHDOG,
         _SOURCE_EVENT_SOURCE_TYPE_MAX,
         _SOURCE_EVENT_SOURCE_TYPE_INVALID = -1
@@ -71,6 +83,7 @@ static const char* const event_source_type_table[_SOURCE_EVENT_SOURCE_TYPE_MAX]
         [SOURCE_DEFER] = "defer",
         [SOURCE_POST] = "post",
         [SOURCE_EXIT] = "exit",
+        [SOURCE_WORK] = "work",
         [SOURCE_WATCHDOG] = "watchdog",
 };
 
@@ -83,12 +96,22 @@ typedef enum WakeupType {
         WAKEUP_EVENT_SOURCE,
         WAKEUP_CLOCK_DATA,
         WAKEUP_SIGNAL_DATA,
+        WAKEUP_WORKER_POOL,
         _WAKEUP_TYPE_MAX,
         _WAKEUP_TYPE_INVALID = -1,
 } WakeupType;
 
 #define EVENT_SOURCE_IS_TIME(t) IN_SET((t), SOURCE_TIME_REALTIME, SOURCE_TIME_BOOTTIME, SOURCE_TIME_MONOTONIC, SOURCE_TIME_REALTIME_ALARM, SOURCE_TIME_BOOTTIME_ALARM)
 
+/* Child sources that only wait for the child to exit are watched via
+ * a pidfd if the kernel supports it, instead of via SIGCHLD */
+#define EVENT_SOURCE_WATCH_PIDFD(s) ((s)->type == SOURCE_CHILD && (s)->child.pidfd >= 0)
+
+/* Sources that only ever become pending in sd_event_wait() */
+#define EVENT_SOURCE_CAN_BATCH(t) (IN_SET((t), SOURCE_IO, SOURCE_SIGNAL, SOURCE_CHILD, SOURCE_WORK) || EVENT_SOURCE_IS_TIME(t))
+
+typedef struct WorkItem WorkItem;
+
 struct sd_event_source {
         WakeupType wakeup;
 
@@ -127,6 +150,8 @@ struct sd_event_source {
                         usec_t next, accuracy;
                         unsigned earliest_index;
                         unsigned latest_index;
+                        TimerWheelEntry earliest_entry;
+                        TimerWheelEntry latest_entry;
                 } time;
                 struct {
                         sd_event_signal_handler_t callback;
@@ -138,6 +163,8 @@ struct sd_event_source {
                         siginfo_t siginfo;
                         pid_t pid;
                         int options;
+                        int pidfd;
+                        bool registered:1;
                 } child;
                 struct {
                         sd_event_handler_t callback;
@@ -149,6 +176,11 @@ struct sd_event_source {
                         sd_event_handler_t callback;
                         unsigned prioq_index;
                 } exit;
+                struct {
+                        sd_event_work_done_handler_t callback;
+                        WorkItem *item;
+                        int result;
+                } work;
         };
 };
 
@@ -161,10 +193,14 @@ struct clock_data {
          * dispatched, and one ordered by the latest times they must
          * have been dispatched. The range between the top entries in
          * the two prioqs is the time window we can freely schedule
-         * wakeups in */
+         * wakeups in. If timer wheels are enabled for the event loop,
+         * a pair of those is used instead, which only contains the
+         * event sources that are enabled and not pending yet. */
 
         Prioq *earliest;
         Prioq *latest;
+        TimerWheel *earliest_wheel;
+        TimerWheel *latest_wheel;
         usec_t next;
 
         bool needs_rearm:1;
@@ -183,6 +219,50 @@ struct signal_data {
         sd_event_source *current;
 };
 
+typedef enum WorkState {
+        WORK_QUEUED,
+        WORK_RUNNING,
+        WORK_DONE,
+} WorkState;
+
+/* The part of a work event source the worker threads look at. Only
+ * accessed with the pool mutex held, except for callback and userdata,
+ * which never change. */
+struct WorkItem {
+        sd_event_work_handler_t callback;
+        void *userdata;
+
+        WorkState state;
+        int result;
+
+        /* NULL if the event source went away before the work item
+         * was done */
+        sd_event_source *source;
+
+        LIST_FIELDS(WorkItem, items);
+};
+
+struct worker_pool {
+        WakeupType wakeup;
+
+        /* Signalled by the worker threads when the done list stops
+         * being empty */
+        int fd;
+
+        pthread_mutex_t mutex;
+        pthread_cond_t queued_cond;
+        pthread_cond_t done_cond;
+
+        LIST_HEAD(WorkItem, queued);
+        WorkItem *queued_tail;
+        LIST_HEAD(WorkItem, done);
+
+        pthread_t threads[WORKER_THREADS_MAX];
+        unsigned n_threads, n_threads_max, n_idle;
+
+        bool dead;
+};
+
 struct sd_event {
         unsigned n_ref;
 
@@ -207,7 +287,8 @@ struct sd_event {
         Hashmap *signal_data; /* indexed by priority */
 
         Hashmap *child_sources;
-        unsigned n_enabled_child_sources;
+        unsigned n_enabled_child_sources; /* not counting the ones watched via pidfd */
+        unsigned n_child_pidfds;
 
         Set *post_sources;
 
@@ -224,6 +305,8 @@ struct sd_event {
         bool need_process_child:1;
         bool watchdog:1;
         bool profile_delays:1;
+        bool dispatch_batch:1;
+        bool timer_wheel:1;
 
         int exit_code;
 
@@ -236,11 +319,20 @@ struct sd_event {
 
         LIST_HEAD(sd_event_source, sources);
 
+        struct epoll_event *event_queue;
+        size_t event_queue_allocated;
+
+        struct worker_pool *worker_pool;
+        unsigned n_worker_threads;
+
         usec_t last_run, last_log;
         unsigned delays[sizeof(usec_t) * 8];
 };
 
 static void source_disconnect(sd_event_source *s);
+static void worker_pool_free(struct worker_pool *p);
+static void worker_pool_abandon(struct worker_pool *p);
+static bool event_pid_changed(sd_event *e);
 
 static int pending_prioq_compare(const void *a, const void *b) {
         const sd_event_source *x = a, *y = b;
@@ -384,6 +476,8 @@ static void free_clock_data(struct clock_data *d) {
         safe_close(d->fd);
         prioq_free(d->earliest);
         prioq_free(d->latest);
+        timer_wheel_free(d->earliest_wheel);
+        timer_wheel_free(d->latest_wheel);
 }
 
 static void event_free(sd_event *e) {
@@ -420,6 +514,13 @@ static void event_free(sd_event *e) {
 
         hashmap_free(e->child_sources);
         set_free(e->post_sources);
+
+        if (event_pid_changed(e))
+                worker_pool_abandon(e->worker_pool);
+        else
+                worker_pool_free(e->worker_pool);
+
+        free(e->event_queue);
         free(e);
 }
 
@@ -547,6 +648,53 @@ static int source_io_register(
         return 0;
 }
 
+static void source_child_pidfd_unregister(sd_event_source *s) {
+        int r;
+
+        assert(s);
+        assert(EVENT_SOURCE_WATCH_PIDFD(s));
+
+        if (event_pid_changed(s->event))
+                return;
+
+        if (!s->child.registered)
+                return;
+
+        r = epoll_ctl(s->event->epoll_fd, EPOLL_CTL_DEL, s->child.pidfd, NULL);
+        if (r < 0)
+                log_debug_errno(errno, "Failed to remove source %s (type %s) from epoll: %m",
+                                strna(s->description), event_source_type_to_string(s->type));
+
+        s->child.registered = false;
+}
+
+static int source_child_pidfd_register(sd_event_source *s) {
+        struct epoll_event ev = {
+                /* The pidfd stays readable once the child exited,
+                 * but one wakeup is all we need, until the child
+                 * source is dispatched. Otherwise every exited child
+                 * waiting to be dispatched would be reported again
+                 * on each iteration. */
+                .events = EPOLLIN|EPOLLONESHOT,
+                .data.ptr = s,
+        };
+        int r;
+
+        assert(s);
+        assert(EVENT_SOURCE_WATCH_PIDFD(s));
+
+        if (s->child.registered)
+                r = epoll_ctl(s->event->epoll_fd, EPOLL_CTL_MOD, s->child.pidfd, &ev);
+        else
+                r = epoll_ctl(s->event->epoll_fd, EPOLL_CTL_ADD, s->child.pidfd, &ev);
+        if (r < 0)
+                return -errno;
+
+        s->child.registered = true;
+
+        return 0;
+}
+
 static clockid_t event_source_type_to_clock(EventSourceType t) {
 
         switch (t) {
@@ -620,6 +768,31 @@ static struct clock_data* event_get_clock_data(sd_event *e, EventSourceType t) {
         }
 }
 
+static void event_source_time_reshuffle(sd_event_source *s) {
+        struct clock_data *d;
+
+        assert(s);
+        assert(EVENT_SOURCE_IS_TIME(s->type));
+
+        d = event_get_clock_data(s->event, s->type);
+        assert(d);
+
+        if (d->earliest_wheel) {
+                if (s->enabled == SD_EVENT_OFF || s->pending || s->time.next == USEC_INFINITY) {
+                        timer_wheel_remove(d->earliest_wheel, &s->time.earliest_entry);
+                        timer_wheel_remove(d->latest_wheel, &s->time.latest_entry);
+                } else {
+                        timer_wheel_put(d->earliest_wheel, &s->time.earliest_entry, s->time.next);
+                        timer_wheel_put(d->latest_wheel, &s->time.latest_entry, time_event_source_latest(s));
+                }
+        } else {
+                prioq_reshuffle(d->earliest, s, &s->time.earliest_index);
+                prioq_reshuffle(d->latest, s, &s->time.latest_index);
+        }
+
+        d->needs_rearm = true;
+}
+
 static int event_make_signal_data(
                 sd_event *e,
                 int sig,
@@ -789,6 +962,253 @@ static void event_gc_signal_data(sd_event *e, const int64_t *priority, int sig)
                 event_unmask_signal_data(e, d, sig);
 }
 
+static void* worker_thread(void *userdata) {
+        struct worker_pool *p = userdata;
+
+        /* Assign a pretty name to this thread */
+        (void) prctl(PR_SET_NAME, (unsigned long) "sd-event-work");
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        for (;;) {
+                WorkItem *i;
+                int r;
+
+                while (!p->dead && !p->queued) {
+                        p->n_idle++;
+                        assert_se(pthread_cond_wait(&p->queued_cond, &p->mutex) == 0);
+                        p->n_idle--;
+                }
+
+                if (p->dead)
+                        break;
+
+                i = p->queued;
+                if (i == p->queued_tail)
+                        p->queued_tail = NULL;
+                LIST_REMOVE(items, p->queued, i);
+                i->state = WORK_RUNNING;
+
+                assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+                r = i->callback(i->userdata);
+                assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+                i->result = r;
+                i->state = WORK_DONE;
+
+                /* The event loop collects everything that is done at
+                 * once, hence only wake it up for the first one */
+                if (!p->done)
+                        (void) eventfd_write(p->fd, 1);
+
+                LIST_PREPEND(items, p->done, i);
+
+                /* Somebody might wait for this one to finish */
+                assert_se(pthread_cond_broadcast(&p->done_cond) == 0);
+        }
+
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        return NULL;
+}
+
+static void worker_pool_free(struct worker_pool *p) {
+        WorkItem *i;
+        unsigned k;
+
+        if (!p)
+                return;
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+        p->dead = true;
+        assert_se(pthread_cond_broadcast(&p->queued_cond) == 0);
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        for (k = 0; k < p->n_threads; k++)
+                (void) pthread_join(p->threads[k], NULL);
+
+        /* All event sources are gone at this point, and have taken
+         * their queued work items with them */
+        assert(!p->queued);
+
+        while ((i = p->done)) {
+                assert(!i->source);
+
+                LIST_REMOVE(items, p->done, i);
+                free(i);
+        }
+
+        safe_close(p->fd);
+
+        assert_se(pthread_cond_destroy(&p->done_cond) == 0);
+        assert_se(pthread_cond_destroy(&p->queued_cond) == 0);
+        assert_se(pthread_mutex_destroy(&p->mutex) == 0);
+
+        free(p);
+}
+
+static void worker_pool_abandon(struct worker_pool *p) {
+        if (!p)
+                return;
+
+        /* Called instead of worker_pool_free() in a child process.
+         * The worker threads didn't survive the fork(), and one of
+         * them might have held the mutex at that moment, hence we
+         * must neither join nor lock anything. Only release what we
+         * can without looking at the lists, and leak the rest. */
+
+        safe_close(p->fd);
+        free(p);
+}
+
+static unsigned worker_threads_default(void) {
+        long n;
+
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+        if (n <= 0)
+                return 1;
+
+        return MIN((unsigned long) n, WORKER_THREADS_MAX);
+}
+
+static int event_setup_worker_pool(sd_event *e) {
+        struct epoll_event ev = {};
+        struct worker_pool *p;
+        int r;
+
+        assert(e);
+
+        if (e->worker_pool)
+                return 0;
+
+        p = new0(struct worker_pool, 1);
+        if (!p)
+                return -ENOMEM;
+
+        p->wakeup = WAKEUP_WORKER_POOL;
+        p->n_threads_max = e->n_worker_threads > 0 ? e->n_worker_threads : worker_threads_default();
+
+        assert_se(pthread_mutex_init(&p->mutex, NULL) == 0);
+        assert_se(pthread_cond_init(&p->queued_cond, NULL) == 0);
+        assert_se(pthread_cond_init(&p->done_cond, NULL) == 0);
+
+        p->fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        if (p->fd < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = p;
+
+        if (epoll_ctl(e->epoll_fd, EPOLL_CTL_ADD, p->fd, &ev) < 0) {
+                r = -errno;
+                goto fail;
+        }
+
+        e->worker_pool = p;
+        return 0;
+
+fail:
+        worker_pool_free(p);
+        return r;
+}
+
+static int worker_pool_start_thread(struct worker_pool *p) {
+        sigset_t ss, saved;
+        int r;
+
+        assert(p);
+        assert(p->n_threads < p->n_threads_max);
+
+        /* No signals in the worker threads please, they are for the
+         * event loop */
+        assert_se(sigfillset(&ss) >= 0);
+
+        r = pthread_sigmask(SIG_BLOCK, &ss, &saved);
+        if (r > 0)
+                return -r;
+
+        r = pthread_create(&p->threads[p->n_threads], NULL, worker_thread, p);
+        assert_se(pthread_sigmask(SIG_SETMASK, &saved, NULL) == 0);
+        if (r > 0)
+                return -r;
+
+        p->n_threads++;
+        return 0;
+}
+
+static int worker_pool_queue(struct worker_pool *p, WorkItem *i) {
+        unsigned n_queued = 0;
+        WorkItem *j;
+        int r = 0;
+
+        assert(p);
+        assert(i);
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        i->state = WORK_QUEUED;
+        LIST_INSERT_AFTER(items, p->queued, p->queued_tail, i);
+        p->queued_tail = i;
+
+        /* Start threads as they are needed, until we hit the limit.
+         * Don't bother counting the queue if there are no more to
+         * start anyway. */
+        if (p->n_threads < p->n_threads_max) {
+                LIST_FOREACH(items, j, p->queued)
+                        if (++n_queued > p->n_idle)
+                                break;
+
+                if (n_queued > p->n_idle) {
+                        r = worker_pool_start_thread(p);
+
+                        /* Without a single thread nothing would ever get done */
+                        if (r < 0 && p->n_threads == 0) {
+                                p->queued_tail = i->items_prev;
+                                LIST_REMOVE(items, p->queued, i);
+                                goto finish;
+                        }
+
+                        r = 0;
+                }
+        }
+
+        assert_se(pthread_cond_signal(&p->queued_cond) == 0);
+
+finish:
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+        return r;
+}
+
+static void worker_pool_cancel(struct worker_pool *p, WorkItem *i) {
+        assert(p);
+        assert(i);
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+
+        if (i->state == WORK_QUEUED) {
+                if (i == p->queued_tail)
+                        p->queued_tail = i->items_prev;
+                LIST_REMOVE(items, p->queued, i);
+        } else {
+                /* A worker thread picked it up already, which we
+                 * cannot interrupt. Wait for it, so that the work
+                 * function is not running anymore once the event
+                 * source is gone, and leave it to the event loop to
+                 * clean up. */
+                while (i->state == WORK_RUNNING)
+                        assert_se(pthread_cond_wait(&p->done_cond, &p->mutex) == 0);
+
+                i->source = NULL;
+                i = NULL;
+        }
+
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        free(i);
+}
+
 static void source_disconnect(sd_event_source *s) {
         sd_event *event;
 
@@ -817,8 +1237,13 @@ static void source_disconnect(sd_event_source *s) {
                 d = event_get_clock_data(s->event, s->type);
                 assert(d);
 
-                prioq_remove(d->earliest, s, &s->time.earliest_index);
-                prioq_remove(d->latest, s, &s->time.latest_index);
+                if (d->earliest_wheel) {
+                        timer_wheel_remove(d->earliest_wheel, &s->time.earliest_entry);
+                        timer_wheel_remove(d->latest_wheel, &s->time.latest_entry);
+                } else {
+                        prioq_remove(d->earliest, s, &s->time.earliest_index);
+                        prioq_remove(d->latest, s, &s->time.latest_index);
+                }
                 d->needs_rearm = true;
                 break;
         }
@@ -836,7 +1261,9 @@ static void source_disconnect(sd_event_source *s) {
 
         case SOURCE_CHILD:
                 if (s->child.pid > 0) {
-                        if (s->enabled != SD_EVENT_OFF) {
+                        if (EVENT_SOURCE_WATCH_PIDFD(s))
+                                source_child_pidfd_unregister(s);
+                        else if (s->enabled != SD_EVENT_OFF) {
                                 assert(s->event->n_enabled_child_sources > 0);
                                 s->event->n_enabled_child_sources--;
                         }
@@ -845,6 +1272,11 @@ static void source_disconnect(sd_event_source *s) {
                         event_gc_signal_data(s->event, &s->priority, SIGCHLD);
                 }
 
+                if (s->child.pidfd >= 0) {
+                        assert(s->event->n_child_pidfds > 0);
+                        s->event->n_child_pidfds--;
+                        s->child.pidfd = safe_close(s->child.pidfd);
+                }
                 break;
 
         case SOURCE_DEFER:
@@ -859,6 +1291,14 @@ static void source_disconnect(sd_event_source *s) {
                 prioq_remove(s->event->exit, s, &s->exit.prioq_index);
                 break;
 
+        case SOURCE_WORK:
+                /* In a child the item is leaked with the pool, see
+                 * worker_pool_abandon() */
+                if (s->work.item && !event_pid_changed(s->event))
+                        worker_pool_cancel(s->event->worker_pool, s->work.item);
+                s->work.item = NULL;
+                break;
+
         default:
                 assert_not_reached("Wut? I shouldn't exist.");
         }
@@ -910,16 +1350,8 @@ static int source_set_pending(sd_event_source *s, bool b) {
         } else
                 assert_se(prioq_remove(s->event->pending, s, &s->pending_index));
 
-        if (EVENT_SOURCE_IS_TIME(s->type)) {
-                struct clock_data *d;
-
-                d = event_get_clock_data(s->event, s->type);
-                assert(d);
-
-                prioq_reshuffle(d->earliest, s, &s->time.earliest_index);
-                prioq_reshuffle(d->latest, s, &s->time.latest_index);
-                d->needs_rearm = true;
-        }
+        if (EVENT_SOURCE_IS_TIME(s->type))
+                event_source_time_reshuffle(s);
 
         if (s->type == SOURCE_SIGNAL && !b) {
                 struct signal_data *d;
@@ -1047,6 +1479,27 @@ static int event_setup_timer_fd(
         return 0;
 }
 
+static int event_setup_timer_wheels(struct clock_data *d, clockid_t clock) {
+        usec_t n;
+
+        assert(d);
+
+        if (d->earliest_wheel)
+                return 0;
+
+        n = now(clock);
+
+        d->earliest_wheel = timer_wheel_new(n);
+        d->latest_wheel = timer_wheel_new(n);
+        if (!d->earliest_wheel || !d->latest_wheel) {
+                d->earliest_wheel = timer_wheel_free(d->earliest_wheel);
+                d->latest_wheel = timer_wheel_free(d->latest_wheel);
+                return -ENOMEM;
+        }
+
+        return 0;
+}
+
 static int time_exit_callback(sd_event_source *s, uint64_t usec, void *userdata) {
         assert(s);
 
@@ -1085,13 +1538,19 @@ _public_ int sd_event_add_time(
         d = event_get_clock_data(e, type);
         assert(d);
 
-        r = prioq_ensure_allocated(&d->earliest, earliest_time_prioq_compare);
-        if (r < 0)
-                return r;
+        if (e->timer_wheel) {
+                r = event_setup_timer_wheels(d, clock);
+                if (r < 0)
+                        return r;
+        } else {
+                r = prioq_ensure_allocated(&d->earliest, earliest_time_prioq_compare);
+                if (r < 0)
+                        return r;
 
-        r = prioq_ensure_allocated(&d->latest, latest_time_prioq_compare);
-        if (r < 0)
-                return r;
+                r = prioq_ensure_allocated(&d->latest, latest_time_prioq_compare);
+                if (r < 0)
+                        return r;
+        }
 
         if (d->fd < 0) {
                 r = event_setup_timer_fd(e, d, clock);
@@ -1107,18 +1566,24 @@ _public_ int sd_event_add_time(
         s->time.accuracy = accuracy == 0 ? DEFAULT_ACCURACY_USEC : accuracy;
         s->time.callback = callback;
         s->time.earliest_index = s->time.latest_index = PRIOQ_IDX_NULL;
+        timer_wheel_entry_init(&s->time.earliest_entry);
+        timer_wheel_entry_init(&s->time.latest_entry);
         s->userdata = userdata;
         s->enabled = SD_EVENT_ONESHOT;
 
         d->needs_rearm = true;
 
-        r = prioq_put(d->earliest, s, &s->time.earliest_index);
-        if (r < 0)
-                goto fail;
+        if (d->earliest_wheel)
+                event_source_time_reshuffle(s);
+        else {
+                r = prioq_put(d->earliest, s, &s->time.earliest_index);
+                if (r < 0)
+                        goto fail;
 
-        r = prioq_put(d->latest, s, &s->time.latest_index);
-        if (r < 0)
-                goto fail;
+                r = prioq_put(d->latest, s, &s->time.latest_index);
+                if (r < 0)
+                        goto fail;
+        }
 
         if (ret)
                 *ret = s;
@@ -1196,6 +1661,21 @@ _public_ int sd_event_add_signal(
         return 0;
 }
 
+static bool event_may_open_pidfd(sd_event *e) {
+        struct rlimit rl;
+
+        assert(e);
+
+        /* Every pidfd takes up a file descriptor. Leave most of them
+         * to the program (and to the signalfd we need for the
+         * SIGCHLD fallback), and watch all further children via
+         * SIGCHLD instead. */
+        if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+                return false;
+
+        return rl.rlim_cur == RLIM_INFINITY || e->n_child_pidfds < rl.rlim_cur / 4;
+}
+
 _public_ int sd_event_add_child(
                 sd_event *e,
                 sd_event_source **ret,
@@ -1229,26 +1709,48 @@ _public_ int sd_event_add_child(
         s->child.pid = pid;
         s->child.options = options;
         s->child.callback = callback;
+        s->child.pidfd = -1;
+        s->wakeup = WAKEUP_EVENT_SOURCE;
         s->userdata = userdata;
         s->enabled = SD_EVENT_ONESHOT;
 
+        /* If we only wait for the child to exit, let the kernel tell
+         * us when that happens via a pidfd, so that we do not have to
+         * look at every child on each SIGCHLD. A pidfd does not tell
+         * about stopped or continued children, though, and older
+         * kernels do not have it, so fall back to SIGCHLD then. */
+        if (options == WEXITED && event_may_open_pidfd(e)) {
+                s->child.pidfd = pidfd_open(pid, 0);
+                if (s->child.pidfd >= 0)
+                        e->n_child_pidfds++;
+        }
+
         r = hashmap_put(e->child_sources, PID_TO_PTR(pid), s);
         if (r < 0) {
                 source_free(s);
                 return r;
         }
 
-        e->n_enabled_child_sources++;
+        if (EVENT_SOURCE_WATCH_PIDFD(s)) {
+                r = source_child_pidfd_register(s);
+                if (r < 0) {
+                        source_free(s);
+                        return r;
+                }
+        } else {
+                e->n_enabled_child_sources++;
+
+                r = event_make_signal_data(e, SIGCHLD, NULL);
+                if (r < 0) {
+                        /* source_free() drops it from
+                         * n_enabled_child_sources again */
+                        source_free(s);
+                        return r;
+                }
 
-        r = event_make_signal_data(e, SIGCHLD, NULL);
-        if (r < 0) {
-                e->n_enabled_child_sources--;
-                source_free(s);
-                return r;
+                e->need_process_child = true;
         }
 
-        e->need_process_child = true;
-
         if (ret)
                 *ret = s;
 
@@ -1366,6 +1868,60 @@ _public_ int sd_event_add_exit(
         return 0;
 }
 
+_public_ int sd_event_add_work(
+                sd_event *e,
+                sd_event_source **ret,
+                sd_event_work_handler_t work,
+                sd_event_work_done_handler_t done,
+                void *userdata) {
+
+        sd_event_source *s;
+        WorkItem *i;
+        int r;
+
+        assert_return(e, -EINVAL);
+        assert_return(work, -EINVAL);
+        assert_return(done, -EINVAL);
+        assert_return(e->state != SD_EVENT_FINISHED, -ESTALE);
+        assert_return(!event_pid_changed(e), -ECHILD);
+
+        r = event_setup_worker_pool(e);
+        if (r < 0)
+                return r;
+
+        i = new0(WorkItem, 1);
+        if (!i)
+                return -ENOMEM;
+
+        s = source_new(e, !ret, SOURCE_WORK);
+        if (!s) {
+                free(i);
+                return -ENOMEM;
+        }
+
+        s->work.callback = done;
+        s->userdata = userdata;
+        s->enabled = SD_EVENT_ONESHOT;
+
+        i->callback = work;
+        i->userdata = userdata;
+        i->source = s;
+
+        r = worker_pool_queue(e->worker_pool, i);
+        if (r < 0) {
+                free(i);
+                source_free(s);
+                return r;
+        }
+
+        s->work.item = i;
+
+        if (ret)
+                *ret = s;
+
+        return 0;
+}
+
 _public_ sd_event_source* sd_event_source_ref(sd_event_source *s) {
 
         if (!s)
@@ -1622,18 +2178,10 @@ _public_ int sd_event_source_set_enabled(sd_event_source *s, int m) {
                 case SOURCE_TIME_BOOTTIME:
                 case SOURCE_TIME_MONOTONIC:
                 case SOURCE_TIME_REALTIME_ALARM:
-                case SOURCE_TIME_BOOTTIME_ALARM: {
-                        struct clock_data *d;
-
+                case SOURCE_TIME_BOOTTIME_ALARM:
                         s->enabled = m;
-                        d = event_get_clock_data(s->event, s->type);
-                        assert(d);
-
-                        prioq_reshuffle(d->earliest, s, &s->time.earliest_index);
-                        prioq_reshuffle(d->latest, s, &s->time.latest_index);
-                        d->needs_rearm = true;
+                        event_source_time_reshuffle(s);
                         break;
-                }
 
                 case SOURCE_SIGNAL:
                         s->enabled = m;
@@ -1644,6 +2192,11 @@ _public_ int sd_event_source_set_enabled(sd_event_source *s, int m) {
                 case SOURCE_CHILD:
                         s->enabled = m;
 
+                        if (EVENT_SOURCE_WATCH_PIDFD(s)) {
+                                source_child_pidfd_unregister(s);
+                                break;
+                        }
+
                         assert(s->event->n_enabled_child_sources > 0);
                         s->event->n_enabled_child_sources--;
 
@@ -1657,6 +2210,7 @@ _public_ int sd_event_source_set_enabled(sd_event_source *s, int m) {
 
                 case SOURCE_DEFER:
                 case SOURCE_POST:
+                case SOURCE_WORK:
                         s->enabled = m;
                         break;
 
@@ -1679,18 +2233,10 @@ _public_ int sd_event_source_set_enabled(sd_event_source *s, int m) {
                 case SOURCE_TIME_BOOTTIME:
                 case SOURCE_TIME_MONOTONIC:
                 case SOURCE_TIME_REALTIME_ALARM:
-                case SOURCE_TIME_BOOTTIME_ALARM: {
-                        struct clock_data *d;
-
+                case SOURCE_TIME_BOOTTIME_ALARM:
                         s->enabled = m;
-                        d = event_get_clock_data(s->event, s->type);
-                        assert(d);
-
-                        prioq_reshuffle(d->earliest, s, &s->time.earliest_index);
-                        prioq_reshuffle(d->latest, s, &s->time.latest_index);
-                        d->needs_rearm = true;
+                        event_source_time_reshuffle(s);
                         break;
-                }
 
                 case SOURCE_SIGNAL:
 
@@ -1707,6 +2253,15 @@ _public_ int sd_event_source_set_enabled(sd_event_source *s, int m) {
 
                 case SOURCE_CHILD:
 
+                        if (EVENT_SOURCE_WATCH_PIDFD(s)) {
+                                r = source_child_pidfd_register(s);
+                                if (r < 0)
+                                        return r;
+
+                                s->enabled = m;
+                                break;
+                        }
+
                         if (s->enabled == SD_EVENT_OFF)
                                 s->event->n_enabled_child_sources++;
 
@@ -1729,6 +2284,7 @@ _public_ int sd_event_source_set_enabled(sd_event_source *s, int m) {
 
                 case SOURCE_DEFER:
                 case SOURCE_POST:
+                case SOURCE_WORK:
                         s->enabled = m;
                         break;
 
@@ -1757,8 +2313,6 @@ _public_ int sd_event_source_get_time(sd_event_source *s, uint64_t *usec) {
 }
 
 _public_ int sd_event_source_set_time(sd_event_source *s, uint64_t usec) {
-        struct clock_data *d;
-
         assert_return(s, -EINVAL);
         assert_return(EVENT_SOURCE_IS_TIME(s->type), -EDOM);
         assert_return(s->event->state != SD_EVENT_FINISHED, -ESTALE);
@@ -1767,13 +2321,7 @@ _public_ int sd_event_source_set_time(sd_event_source *s, uint64_t usec) {
         s->time.next = usec;
 
         source_set_pending(s, false);
-
-        d = event_get_clock_data(s->event, s->type);
-        assert(d);
-
-        prioq_reshuffle(d->earliest, s, &s->time.earliest_index);
-        prioq_reshuffle(d->latest, s, &s->time.latest_index);
-        d->needs_rearm = true;
+        event_source_time_reshuffle(s);
 
         return 0;
 }
@@ -1789,8 +2337,6 @@ _public_ int sd_event_source_get_time_accuracy(sd_event_source *s, uint64_t *use
 }
 
 _public_ int sd_event_source_set_time_accuracy(sd_event_source *s, uint64_t usec) {
-        struct clock_data *d;
-
         assert_return(s, -EINVAL);
         assert_return(usec != (uint64_t) -1, -EINVAL);
         assert_return(EVENT_SOURCE_IS_TIME(s->type), -EDOM);
@@ -1803,12 +2349,7 @@ _public_ int sd_event_source_set_time_accuracy(sd_event_source *s, uint64_t usec
         s->time.accuracy = usec;
 
         source_set_pending(s, false);
-
-        d = event_get_clock_data(s->event, s->type);
-        assert(d);
-
-        prioq_reshuffle(d->latest, s, &s->time.latest_index);
-        d->needs_rearm = true;
+        event_source_time_reshuffle(s);
 
         return 0;
 }
@@ -1967,8 +2508,7 @@ static int event_arm_timer(
                 struct clock_data *d) {
 
         struct itimerspec its = {};
-        sd_event_source *a, *b;
-        usec_t t;
+        usec_t t, earliest, latest;
         int r;
 
         assert(e);
@@ -1979,8 +2519,26 @@ static int event_arm_timer(
         else
                 d->needs_rearm = false;
 
-        a = prioq_peek(d->earliest);
-        if (!a || a->enabled == SD_EVENT_OFF || a->time.next == USEC_INFINITY) {
+        if (d->earliest_wheel) {
+                earliest = timer_wheel_peek(d->earliest_wheel);
+                latest = timer_wheel_peek(d->latest_wheel);
+        } else {
+                sd_event_source *a, *b;
+
+                a = prioq_peek(d->earliest);
+                if (!a || a->enabled == SD_EVENT_OFF)
+                        earliest = USEC_INFINITY;
+                else
+                        earliest = a->time.next;
+
+                b = prioq_peek(d->latest);
+                if (!b || b->enabled == SD_EVENT_OFF)
+                        latest = USEC_INFINITY;
+                else
+                        latest = time_event_source_latest(b);
+        }
+
+        if (earliest == USEC_INFINITY) {
 
                 if (d->fd < 0)
                         return 0;
@@ -1997,10 +2555,7 @@ static int event_arm_timer(
                 return 0;
         }
 
-        b = prioq_peek(d->latest);
-        assert_se(b && b->enabled != SD_EVENT_OFF);
-
-        t = sleep_between(e, a->time.next, time_event_source_latest(b));
+        t = sleep_between(e, earliest, latest);
         if (d->next == t)
                 return 0;
 
@@ -2077,6 +2632,27 @@ static int process_timer(
         assert(e);
         assert(d);
 
+        if (d->earliest_wheel) {
+                TimerWheelEntry *entry;
+
+                while ((entry = timer_wheel_pop(d->earliest_wheel, n))) {
+                        s = container_of(entry, sd_event_source, time.earliest_entry);
+
+                        r = source_set_pending(s, true);
+                        if (r < 0) {
+                                event_source_time_reshuffle(s);
+                                return r;
+                        }
+                }
+
+                /* Whatever reached its latest time reached its
+                 * earliest time too, and has been taken care of
+                 * above. This just moves the other wheel on. */
+                assert_se(!timer_wheel_pop(d->latest_wheel, n));
+
+                return 0;
+        }
+
         for (;;) {
                 s = prioq_peek(d->earliest);
                 if (!s ||
@@ -2122,11 +2698,17 @@ static int process_child(sd_event *e) {
            We do not reap the children here (by using WNOWAIT), this
            is only done after the event source is dispatched so that
            the callback still sees the process as a zombie.
+
+           Children we only wait for to exit are usually watched via
+           a pidfd, see process_pidfd(), and are skipped here.
         */
 
         HASHMAP_FOREACH(s, e->child_sources, i) {
                 assert(s->type == SOURCE_CHILD);
 
+                if (EVENT_SOURCE_WATCH_PIDFD(s))
+                        continue;
+
                 if (s->pending)
                         continue;
 
@@ -2164,6 +2746,32 @@ static int process_child(sd_event *e) {
         return 0;
 }
 
+static int process_pidfd(sd_event *e, sd_event_source *s, uint32_t revents) {
+        assert(e);
+        assert(s);
+        assert(EVENT_SOURCE_WATCH_PIDFD(s));
+
+        if (s->pending)
+                return 0;
+
+        if (s->enabled == SD_EVENT_OFF)
+                return 0;
+
+        /* The pidfd became readable, hence the child exited. As in
+         * process_child() we leave it around as a zombie for the
+         * callback to look at. */
+
+        zero(s->child.siginfo);
+        if (waitid(P_PID, s->child.pid, &s->child.siginfo, WNOHANG | WNOWAIT | s->child.options) < 0)
+                return -errno;
+
+        /* Nothing there after all? Then wait for the next wakeup */
+        if (s->child.siginfo.si_pid == 0)
+                return source_child_pidfd_register(s);
+
+        return source_set_pending(s, true);
+}
+
 static int process_signal(sd_event *e, struct signal_data *d, uint32_t events) {
         bool read_one = false;
         int r;
@@ -2225,6 +2833,45 @@ static int process_signal(sd_event *e, struct signal_data *d, uint32_t events) {
         }
 }
 
+static int process_work(sd_event *e, struct worker_pool *p, uint32_t events) {
+        WorkItem *done, *i, *n;
+        eventfd_t x;
+        int r = 0;
+
+        assert(e);
+        assert(p);
+
+        assert_return(events == EPOLLIN, -EIO);
+
+        /* Reset the eventfd first, so that nothing that is done
+         * while we collect the items goes unnoticed */
+        (void) eventfd_read(p->fd, &x);
+
+        assert_se(pthread_mutex_lock(&p->mutex) == 0);
+        done = p->done;
+        p->done = NULL;
+        assert_se(pthread_mutex_unlock(&p->mutex) == 0);
+
+        LIST_FOREACH_SAFE(items, i, n, done) {
+                sd_event_source *s = i->source;
+
+                if (s) {
+                        int k;
+
+                        s->work.item = NULL;
+                        s->work.result = i->result;
+
+                        k = source_set_pending(s, true);
+                        if (k < 0 && r == 0)
+                                r = k;
+                }
+
+                free(i);
+        }
+
+        return r;
+}
+
 static int source_dispatch(sd_event_source *s) {
         int r = 0;
 
@@ -2290,9 +2937,15 @@ static int source_dispatch(sd_event_source *s) {
                 r = s->child.callback(s, &s->child.siginfo, s->userdata);
 
                 /* Now, reap the PID for good. */
-                if (zombie)
+                if (zombie) {
                         waitid(P_PID, s->child.pid, &s->child.siginfo, WNOHANG|WEXITED);
 
+                        /* The pidfd stays readable after that,
+                         * there's nothing to watch anymore */
+                        if (EVENT_SOURCE_WATCH_PIDFD(s))
+                                source_child_pidfd_unregister(s);
+                }
+
                 break;
         }
 
@@ -2308,6 +2961,10 @@ static int source_dispatch(sd_event_source *s) {
                 r = s->exit.callback(s, s->userdata);
                 break;
 
+        case SOURCE_WORK:
+                r = s->work.callback(s, s->work.result, s->userdata);
+                break;
+
         case SOURCE_WATCHDOG:
         case _SOURCE_EVENT_SOURCE_TYPE_MAX:
         case _SOURCE_EVENT_SOURCE_TYPE_INVALID:
@@ -2502,7 +3159,7 @@ pending:
 
 _public_ int sd_event_wait(sd_event *e, uint64_t timeout) {
         struct epoll_event *ev_queue;
-        unsigned ev_queue_max;
+        size_t ev_queue_max;
         int r, m, i;
 
         assert_return(e, -EINVAL);
@@ -2515,8 +3172,15 @@ _public_ int sd_event_wait(sd_event *e, uint64_t timeout) {
                 return 1;
         }
 
-        ev_queue_max = MAX(e->n_sources, 1u);
-        ev_queue = newa(struct epoll_event, ev_queue_max);
+        /* The queue is kept around between iterations, and does not
+         * grow beyond EPOLL_QUEUE_MAX. Whatever does not fit is
+         * reported by the next epoll_wait() call. */
+        ev_queue_max = CLAMP(e->n_sources, 1u, EPOLL_QUEUE_MAX);
+        if (!GREEDY_REALLOC(e->event_queue, e->event_queue_allocated, ev_queue_max))
+                return -ENOMEM;
+
+        ev_queue = e->event_queue;
+        ev_queue_max = MIN(e->event_queue_allocated, EPOLL_QUEUE_MAX);
 
         m = epoll_wait(e->epoll_fd, ev_queue, ev_queue_max,
                        timeout == (uint64_t) -1 ? -1 : (int) ((timeout + USEC_PER_MSEC - 1) / USEC_PER_MSEC));
@@ -2543,9 +3207,15 @@ _public_ int sd_event_wait(sd_event *e, uint64_t timeout) {
 
                         switch (*t) {
 
-                        case WAKEUP_EVENT_SOURCE:
-                                r = process_io(e, ev_queue[i].data.ptr, ev_queue[i].events);
+                        case WAKEUP_EVENT_SOURCE: {
+                                sd_event_source *s = ev_queue[i].data.ptr;
+
+                                if (s->type == SOURCE_CHILD)
+                                        r = process_pidfd(e, s, ev_queue[i].events);
+                                else
+                                        r = process_io(e, s, ev_queue[i].events);
                                 break;
+                        }
 
                         case WAKEUP_CLOCK_DATA: {
                                 struct clock_data *d = ev_queue[i].data.ptr;
@@ -2557,6 +3227,10 @@ _public_ int sd_event_wait(sd_event *e, uint64_t timeout) {
                                 r = process_signal(e, ev_queue[i].data.ptr, ev_queue[i].events);
                                 break;
 
+                        case WAKEUP_WORKER_POOL:
+                                r = process_work(e, ev_queue[i].data.ptr, ev_queue[i].events);
+                                break;
+
                         default:
                                 assert_not_reached("Invalid wake-up pointer");
                         }
@@ -2623,10 +3297,30 @@ _public_ int sd_event_dispatch(sd_event *e) {
 
         p = event_next_pending(e);
         if (p) {
+                int64_t priority = p->priority;
+                bool batch;
+
                 sd_event_ref(e);
 
+                /* In batch mode, dispatch everything else that is
+                 * pending on the same priority right away, as long as
+                 * it can only become pending again in
+                 * sd_event_wait(). Defer, post and exit sources are
+                 * left to the next iteration, so that they cannot
+                 * starve anything. */
+                batch = e->dispatch_batch && EVENT_SOURCE_CAN_BATCH(p->type);
+
                 e->state = SD_EVENT_RUNNING;
                 r = source_dispatch(p);
+
+                while (batch && r >= 0 && !e->exit_requested) {
+                        p = event_next_pending(e);
+                        if (!p || p->priority != priority || !EVENT_SOURCE_CAN_BATCH(p->type))
+                                break;
+
+                        r = source_dispatch(p);
+                }
+
                 e->state = SD_EVENT_INITIAL;
 
                 sd_event_unref(e);
@@ -2896,3 +3590,85 @@ _public_ int sd_event_get_watchdog(sd_event *e) {
 
         return e->watchdog;
 }
+
+_public_ int sd_event_set_dispatch_batch(sd_event *e, int b) {
+        assert_return(e, -EINVAL);
+        assert_return(!event_pid_changed(e), -ECHILD);
+
+        e->dispatch_batch = !!b;
+        return e->dispatch_batch;
+}
+
+_public_ int sd_event_get_dispatch_batch(sd_event *e) {
+        assert_return(e, -EINVAL);
+        assert_return(!event_pid_changed(e), -ECHILD);
+
+        return e->dispatch_batch;
+}
+
+_public_ int sd_event_set_timer_wheel(sd_event *e, int b) {
+        sd_event_source *s;
+
+        assert_return(e, -EINVAL);
+        assert_return(e->state != SD_EVENT_FINISHED, -ESTALE);
+        assert_return(!event_pid_changed(e), -ECHILD);
+
+        if (e->timer_wheel == !!b)
+                return e->timer_wheel;
+
+        /* Time sources stay where they have been added to */
+        LIST_FOREACH(sources, s, e->sources)
+                if (EVENT_SOURCE_IS_TIME(s->type))
+                        return -EBUSY;
+
+        if (!b) {
+                struct clock_data *clocks[] = {
+                        &e->realtime,
+                        &e->boottime,
+                        &e->monotonic,
+                        &e->realtime_alarm,
+                        &e->boottime_alarm,
+                };
+                unsigned i;
+
+                for (i = 0; i < ELEMENTSOF(clocks); i++) {
+                        clocks[i]->earliest_wheel = timer_wheel_free(clocks[i]->earliest_wheel);
+                        clocks[i]->latest_wheel = timer_wheel_free(clocks[i]->latest_wheel);
+                }
+        }
+
+        e->timer_wheel = !!b;
+        return e->timer_wheel;
+}
+
+_public_ int sd_event_get_timer_wheel(sd_event *e) {
+        assert_return(e, -EINVAL);
+        assert_return(!event_pid_changed(e), -ECHILD);
+
+        return e->timer_wheel;
+}
+
+_public_ int sd_event_set_worker_threads(sd_event *e, unsigned n) {
+        assert_return(e, -EINVAL);
+        assert_return(n <= WORKER_THREADS_MAX, -ERANGE);
+        assert_return(!event_pid_changed(e), -ECHILD);
+
+        if (e->worker_pool)
+                return -EBUSY;
+
+        e->n_worker_threads = n;
+        return 0;
+}
+
+_public_ int sd_event_get_worker_threads(sd_event *e, unsigned *ret) {
+        assert_return(e, -EINVAL);
+        assert_return(ret, -EINVAL);
+        assert_return(!event_pid_changed(e), -ECHILD);
+
+        if (e->worker_pool)
+                *ret = e->worker_pool->n_threads_max;
+        else
+                *ret = e->n_worker_threads > 0 ? e->n_worker_threads : worker_threads_default();
+
+        return 0;
+}
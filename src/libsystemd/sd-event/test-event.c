@@ -17,12 +17,22 @@
   along with systemd; If not, see <http://www.gnu.org/licenses/>.
 ***/
 
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include "sd-event.h"
 
+#include "alloc-util.h"
 #include "fd-util.h"
 #include "log.h"
 #include "macro.h"
+#include "parse-util.h"
+#include "process-util.h"
 #include "signal-util.h"
+#include "time-util.h"
 #include "util.h"
 
 static int prepare_handler(sd_event_source *s, void *userdata) {
@@ -348,14 +358,538 @@ static void test_rtqueue(void) {
         sd_event_unref(e);
 }
 
+typedef struct Children {
+        unsigned n_children, n_exited;
+        int fd[2];
+} Children;
+
+static void children_release_one(Children *c) {
+        assert_se(write(c->fd[1], "x", 1) == 1);
+}
+
+static int children_handler(sd_event_source *s, const siginfo_t *si, void *userdata) {
+        Children *c = userdata;
+
+        assert_se(si->si_code == CLD_EXITED);
+        assert_se(si->si_status == EXIT_SUCCESS);
+
+        if (++c->n_exited >= c->n_children)
+                assert_se(sd_event_exit(sd_event_source_get_event(s), 0) >= 0);
+        else
+                children_release_one(c);
+
+        sd_event_source_unref(s);
+
+        return 1;
+}
+
+static void test_children(unsigned n_children, int options) {
+        Children c = {
+                .n_children = n_children,
+        };
+        sd_event *e = NULL;
+        char b[FORMAT_TIMESPAN_MAX];
+        _cleanup_free_ pid_t *pids = NULL;
+        usec_t start, t;
+        unsigned i;
+
+        /* Forks the given number of children, which then exit one
+         * after the other, as a supervisor would see it, and measures
+         * how long it takes to deliver all their exits. Pass
+         * WSTOPPED in options to watch them via SIGCHLD instead of
+         * pidfds. */
+
+        assert_se(sd_event_new(&e) >= 0);
+        assert_se(sigprocmask_many(SIG_BLOCK, NULL, SIGCHLD, -1) >= 0);
+        assert_se(pipe2(c.fd, O_CLOEXEC) >= 0);
+
+        pids = new(pid_t, n_children);
+        assert_se(pids);
+
+        /* Fork all children before watching any of them, so that
+         * they do not inherit the pidfds of their siblings */
+        for (i = 0; i < n_children; i++) {
+                char x;
+
+                pids[i] = fork();
+                assert_se(pids[i] >= 0);
+
+                if (pids[i] == 0) {
+                        safe_close(c.fd[1]);
+                        (void) read(c.fd[0], &x, 1);
+                        _exit(EXIT_SUCCESS);
+                }
+        }
+
+        for (i = 0; i < n_children; i++)
+                assert_se(sd_event_add_child(e, NULL, pids[i], options, children_handler, &c) >= 0);
+
+        start = now(CLOCK_MONOTONIC);
+
+        children_release_one(&c);
+        assert_se(sd_event_loop(e) >= 0);
+
+        t = now(CLOCK_MONOTONIC) - start;
+
+        assert_se(c.n_exited == n_children);
+
+        log_info("%u children watched for %s exited in %s: %.0f children/s",
+                 n_children,
+                 options & WSTOPPED ? "via SIGCHLD" : "via pidfd",
+                 format_timespan(b, sizeof(b), t, USEC_PER_MSEC),
+                 (double) n_children * USEC_PER_SEC / MAX(t, 1U));
+
+        safe_close_pair(c.fd);
+        sd_event_unref(e);
+}
+
+static unsigned io_events_max, io_events_dispatched;
+
+static int io_events_handler(sd_event_source *s, int fd, uint32_t revents, void *userdata) {
+        unsigned *count = userdata;
+
+        /* The eventfd is not read, and hence stays readable */
+        assert_se(revents == EPOLLIN);
+
+        (*count)++;
+
+        if (++io_events_dispatched == io_events_max)
+                assert_se(sd_event_exit(sd_event_source_get_event(s), 0) >= 0);
+
+        return 1;
+}
+
+static void test_io_events(unsigned n_sources, unsigned n_events, bool batch) {
+        _cleanup_free_ sd_event_source **sources = NULL;
+        _cleanup_free_ unsigned *counts = NULL;
+        _cleanup_free_ int *fds = NULL;
+        sd_event *e = NULL;
+        char b[FORMAT_TIMESPAN_MAX];
+        unsigned i, n_iterations = 0, min = UINT_MAX, max = 0;
+        usec_t start, t;
+
+        /* Keeps the given number of I/O sources permanently ready,
+         * and measures how many events per second the event loop
+         * dispatches from them, with and without batching. */
+
+        assert_se(sd_event_new(&e) >= 0);
+        assert_se(sd_event_set_dispatch_batch(e, batch) == batch);
+        assert_se(sd_event_get_dispatch_batch(e) == batch);
+
+        sources = new0(sd_event_source*, n_sources);
+        counts = new0(unsigned, n_sources);
+        fds = new(int, n_sources);
+        assert_se(sources && counts && fds);
+
+        for (i = 0; i < n_sources; i++) {
+                fds[i] = eventfd(1, EFD_CLOEXEC|EFD_NONBLOCK);
+                assert_se(fds[i] >= 0);
+
+                assert_se(sd_event_add_io(e, &sources[i], fds[i], EPOLLIN, io_events_handler, &counts[i]) >= 0);
+        }
+
+        io_events_max = n_events;
+        io_events_dispatched = 0;
+
+        start = now(CLOCK_MONOTONIC);
+
+        while (sd_event_get_state(e) != SD_EVENT_FINISHED) {
+                assert_se(sd_event_run(e, (uint64_t) -1) >= 0);
+                n_iterations++;
+        }
+
+        t = now(CLOCK_MONOTONIC) - start;
+
+        assert_se(io_events_dispatched == n_events);
+
+        /* Either way, the sources take turns. When they do not all
+         * fit into one epoll_wait() call, the order epoll reports them
+         * in may put some of them one round ahead. */
+        for (i = 0; i < n_sources; i++) {
+                min = MIN(min, counts[i]);
+                max = MAX(max, counts[i]);
+        }
+        assert_se(max - min <= 2);
+
+        log_info("%u events from %u sources %s in %s, %u iterations: %.0f events/s",
+                 n_events,
+                 n_sources,
+                 batch ? "batched" : "one by one",
+                 format_timespan(b, sizeof(b), t, USEC_PER_MSEC),
+                 n_iterations,
+                 (double) n_events * USEC_PER_SEC / MAX(t, 1U));
+
+        for (i = 0; i < n_sources; i++) {
+                sd_event_source_unref(sources[i]);
+                safe_close(fds[i]);
+        }
+
+        sd_event_unref(e);
+}
+
+typedef struct Timer {
+        sd_event_source *source;
+        usec_t usec;
+        unsigned n_fired;
+        bool enabled;
+} Timer;
+
+static unsigned timers_left;
+
+static int timer_handler(sd_event_source *s, uint64_t usec, void *userdata) {
+        Timer *t = userdata;
+        usec_t n;
+
+        assert_se(t->enabled);
+        assert_se(usec == t->usec);
+        assert_se(sd_event_now(sd_event_source_get_event(s), CLOCK_MONOTONIC, &n) >= 0);
+        assert_se(n >= usec);
+
+        t->n_fired++;
+
+        if (--timers_left == 0)
+                assert_se(sd_event_exit(sd_event_source_get_event(s), 0) >= 0);
+
+        return 0;
+}
+
+static void test_timers(bool wheel) {
+        Timer timers[200] = {};
+        sd_event *e = NULL;
+        unsigned i, n_enabled = 0;
+        usec_t start;
+
+        /* Timers of various accuracies that are moved around and
+         * disabled before they elapse, all of which must fire exactly
+         * once, and no earlier than asked for. */
+
+        srand(0);
+
+        assert_se(sd_event_new(&e) >= 0);
+        assert_se(sd_event_set_timer_wheel(e, wheel) == wheel);
+        assert_se(sd_event_get_timer_wheel(e) == wheel);
+
+        start = now(CLOCK_MONOTONIC);
+
+        for (i = 0; i < ELEMENTSOF(timers); i++) {
+                timers[i].usec = start + (usec_t) rand() % (200 * USEC_PER_MSEC);
+                timers[i].enabled = true;
+
+                assert_se(sd_event_add_time(e, &timers[i].source, CLOCK_MONOTONIC, timers[i].usec,
+                                            i % 2 ? 1 : (usec_t) rand() % (50 * USEC_PER_MSEC),
+                                            timer_handler, timers + i) >= 0);
+        }
+
+        /* Switching is refused while there are time sources */
+        assert_se(sd_event_set_timer_wheel(e, !wheel) == -EBUSY);
+
+        for (i = 0; i < ELEMENTSOF(timers); i++) {
+                Timer *t = timers + rand() % ELEMENTSOF(timers);
+
+                if (rand() % 4 == 0) {
+                        t->enabled = false;
+                        assert_se(sd_event_source_set_enabled(t->source, SD_EVENT_OFF) >= 0);
+                } else {
+                        t->usec = start + (usec_t) rand() % (300 * USEC_PER_MSEC);
+                        assert_se(sd_event_source_set_time(t->source, t->usec) >= 0);
+                }
+        }
+
+        for (i = 0; i < ELEMENTSOF(timers); i++)
+                n_enabled += timers[i].enabled;
+
+        timers_left = n_enabled;
+        assert_se(n_enabled > 0);
+        assert_se(sd_event_loop(e) >= 0);
+
+        for (i = 0; i < ELEMENTSOF(timers); i++) {
+                assert_se(timers[i].n_fired == timers[i].enabled);
+                sd_event_source_unref(timers[i].source);
+        }
+
+        sd_event_unref(e);
+}
+
+static int timer_rearm_handler(sd_event_source *s, uint64_t usec, void *userdata) {
+        assert_not_reached("Timer fired during benchmark");
+}
+
+static void test_timer_rearm(unsigned n_sources, unsigned n_rearms, bool wheel) {
+        _cleanup_free_ sd_event_source **sources = NULL;
+        sd_event *e = NULL;
+        char b[FORMAT_TIMESPAN_MAX];
+        usec_t start, base, t;
+        unsigned i;
+
+        /* Keeps pushing out the timeouts of many time sources, as a
+         * server with many connections would, running an event loop
+         * iteration every now and then, and measures how many times
+         * per second a timeout can be re-armed. */
+
+        srand(0);
+
+        assert_se(sd_event_new(&e) >= 0);
+        assert_se(sd_event_set_timer_wheel(e, wheel) == wheel);
+
+        sources = new0(sd_event_source*, n_sources);
+        assert_se(sources);
+
+        base = now(CLOCK_MONOTONIC) + 30 * USEC_PER_SEC;
+
+        for (i = 0; i < n_sources; i++)
+                assert_se(sd_event_add_time(e, &sources[i], CLOCK_MONOTONIC,
+                                            base + (usec_t) rand() % (30 * USEC_PER_SEC), 0,
+                                            timer_rearm_handler, NULL) >= 0);
+
+        start = now(CLOCK_MONOTONIC);
+
+        for (i = 0; i < n_rearms; i++) {
+                assert_se(sd_event_source_set_time(sources[rand() % n_sources],
+                                                   base + i + (usec_t) rand() % (30 * USEC_PER_SEC)) >= 0);
+
+                if (i % 64 == 0)
+                        assert_se(sd_event_run(e, 0) >= 0);
+        }
+
+        t = now(CLOCK_MONOTONIC) - start;
+
+        log_info("%u re-arms of %u time sources %s in %s: %.0f re-arms/s",
+                 n_rearms,
+                 n_sources,
+                 wheel ? "in timer wheels" : "in prioqs",
+                 format_timespan(b, sizeof(b), t, USEC_PER_MSEC),
+                 (double) n_rearms * USEC_PER_SEC / MAX(t, 1U));
+
+        for (i = 0; i < n_sources; i++)
+                sd_event_source_unref(sources[i]);
+
+        sd_event_unref(e);
+}
+
+typedef struct Work {
+        sd_event_source *source;
+        unsigned input;
+        unsigned n_run, n_done;
+        bool cancelled;
+} Work;
+
+static unsigned work_left;
+
+static int work_compute(unsigned input) {
+        uint64_t x = input;
+        unsigned i;
+
+        /* Something to keep the CPU busy for a bit */
+        for (i = 0; i < 10000; i++)
+                x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+
+        if (input % 100 == 0)
+                return -EBADMSG;
+
+        return (int) (x >> 33);
+}
+
+static int work_handler(void *userdata) {
+        Work *w = userdata;
+
+        __sync_fetch_and_add(&w->n_run, 1);
+
+        return work_compute(w->input);
+}
+
+static int work_done_handler(sd_event_source *s, int result, void *userdata) {
+        Work *w = userdata;
+
+        assert_se(s == w->source);
+        assert_se(!w->cancelled);
+        assert_se(__sync_fetch_and_add(&w->n_run, 0) == 1);
+        assert_se(result == work_compute(w->input));
+
+        w->n_done++;
+
+        if (--work_left == 0)
+                assert_se(sd_event_exit(sd_event_source_get_event(s), 0) >= 0);
+
+        return 0;
+}
+
+static void test_work(unsigned n_items, unsigned n_threads) {
+        _cleanup_free_ Work *work = NULL;
+        sd_event *e = NULL;
+        char b[FORMAT_TIMESPAN_MAX];
+        unsigned i, n;
+        usec_t start, t;
+
+        /* Hands lots of work items to the worker threads at once,
+         * cancels some of them again right away, while they are
+         * queued or running, and checks that the others are done
+         * exactly once and reported back to the event loop. */
+
+        assert_se(sd_event_new(&e) >= 0);
+        assert_se(sd_event_set_worker_threads(e, 65) == -ERANGE);
+        assert_se(sd_event_set_worker_threads(e, n_threads) >= 0);
+        assert_se(sd_event_get_worker_threads(e, &n) >= 0);
+        assert_se(n_threads == 0 ? n > 0 : n == n_threads);
+
+        work = new0(Work, n_items);
+        assert_se(work);
+
+        start = now(CLOCK_MONOTONIC);
+
+        for (i = 0; i < n_items; i++) {
+                work[i].input = i;
+                assert_se(sd_event_add_work(e, &work[i].source, work_handler, work_done_handler, work + i) >= 0);
+        }
+
+        assert_se(sd_event_set_worker_threads(e, 1) == -EBUSY);
+
+        work_left = n_items;
+        for (i = 0; i < n_items; i += 7) {
+                work[i].cancelled = true;
+                work[i].source = sd_event_source_unref(work[i].source);
+                work_left--;
+        }
+
+        assert_se(sd_event_loop(e) >= 0);
+
+        t = now(CLOCK_MONOTONIC) - start;
+
+        for (i = 0; i < n_items; i++) {
+                assert_se(work[i].n_done == !work[i].cancelled);
+                assert_se(work[i].n_run <= 1);
+                assert_se(work[i].cancelled || work[i].n_run == 1);
+
+                sd_event_source_unref(work[i].source);
+        }
+
+        log_info("%u work items on %u threads done in %s: %.0f items/s",
+                 n_items,
+                 n,
+                 format_timespan(b, sizeof(b), t, USEC_PER_MSEC),
+                 (double) n_items * USEC_PER_SEC / MAX(t, 1U));
+
+        sd_event_unref(e);
+}
+
+static int work_block_handler(void *userdata) {
+        int *fds = userdata;
+        char c = 'x';
+
+        /* Tell the test we are running, and wait until it lets us go */
+        assert_se(write(fds[1], &c, 1) == 1);
+        assert_se(read(fds[2], &c, 1) == 1);
+
+        return 0;
+}
+
+static int work_block_done_handler(sd_event_source *s, int result, void *userdata) {
+        assert_se(result == 0);
+
+        return sd_event_exit(sd_event_source_get_event(s), 0);
+}
+
+static void test_work_fork(void) {
+        sd_event_source *running, *queued;
+        sd_event *e = NULL;
+        int fds[4];
+        siginfo_t si;
+        pid_t pid;
+        char c;
+
+        /* A child may free the event loop it inherited, including the
+         * work sources, although the worker threads didn't come
+         * along. That must neither wait for them nor touch the pool. */
+
+        assert_se(pipe2(fds, O_CLOEXEC) >= 0);
+        assert_se(pipe2(fds + 2, O_CLOEXEC) >= 0);
+
+        assert_se(sd_event_new(&e) >= 0);
+        assert_se(sd_event_set_worker_threads(e, 1) >= 0);
+        assert_se(sd_event_add_work(e, &running, work_block_handler, work_block_done_handler, fds) >= 0);
+        assert_se(sd_event_add_work(e, &queued, work_handler, work_done_handler, NULL) >= 0);
+
+        assert_se(read(fds[0], &c, 1) == 1);
+
+        pid = fork();
+        assert_se(pid >= 0);
+
+        if (pid == 0) {
+                alarm(10);
+
+                sd_event_source_unref(running);
+                sd_event_source_unref(queued);
+                sd_event_unref(e);
+
+                _exit(EXIT_SUCCESS);
+        }
+
+        assert_se(wait_for_terminate(pid, &si) >= 0);
+        assert_se(si.si_code == CLD_EXITED);
+        assert_se(si.si_status == EXIT_SUCCESS);
+
+        /* The parent is unaffected */
+        queued = sd_event_source_unref(queued);
+        assert_se(write(fds[3], &c, 1) == 1);
+        assert_se(sd_event_loop(e) >= 0);
+
+        sd_event_source_unref(running);
+        sd_event_unref(e);
+        safe_close_pair(fds);
+        safe_close_pair(fds + 2);
+}
+
+static void test_children_rlimit(unsigned n_children) {
+        struct rlimit rl, saved;
+
+        /* With few fds available only some children may be watched
+         * via pidfd, the others need to fall back to SIGCHLD */
+
+        assert_se(getrlimit(RLIMIT_NOFILE, &saved) >= 0);
+
+        rl = saved;
+        rl.rlim_cur = MIN((rlim_t) 64, saved.rlim_cur);
+        assert_se(setrlimit(RLIMIT_NOFILE, &rl) >= 0);
+
+        test_children(n_children, WEXITED);
+
+        assert_se(setrlimit(RLIMIT_NOFILE, &saved) >= 0);
+}
+
 int main(int argc, char *argv[]) {
+        unsigned n_children = 200;
 
         log_set_max_level(LOG_DEBUG);
         log_parse_environment();
 
+        if (argc >= 2)
+                assert_se(safe_atou(argv[1], &n_children) >= 0);
+
         test_basic();
         test_sd_event_now();
         test_rtqueue();
 
+        log_set_max_level(LOG_INFO);
+
+        /* Pass a larger number of children as argument to use this
+         * as benchmark. Each SIGCHLD means looking at all children,
+         * hence don't wait for too many that way. */
+        test_children(n_children, WEXITED);
+        test_children(MIN(n_children, 1000U), WEXITED|WSTOPPED);
+        test_children_rlimit(MIN(n_children, 200U));
+
+        test_io_events(200, 100000, false);
+        test_io_events(200, 100000, true);
+
+        test_timers(false);
+        test_timers(true);
+
+        test_timer_rearm(50000, 1000000, false);
+        test_timer_rearm(50000, 1000000, true);
+
+        test_work(10000, 0);
+        test_work(10000, 1);
+        test_work(10000, 16);
+        test_work_fork();
+
         return 0;
 }
@@ -20,6 +20,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -516,6 +517,166 @@ static int output_verbose(
         return 0;
 }
 
+/* Entries are serialized into a buffer first, which starts out on the
+ * stack, and are then written out with a single fwrite(). This is a lot
+ * cheaper than lots of small stdio calls for each field. */
+typedef struct OutputBuffer {
+        char *data;
+        size_t size, allocated;
+        bool on_heap, oom;
+} OutputBuffer;
+
+#define OUTPUT_BUFFER_STACK 4096
+
+static void output_buffer_init(OutputBuffer *b, char *stack, size_t size) {
+        *b = (OutputBuffer) {
+                .data = stack,
+                .allocated = size,
+        };
+}
+
+static void output_buffer_done(OutputBuffer *b) {
+        if (b->on_heap)
+                free(b->data);
+}
+
+static char* output_buffer_reserve(OutputBuffer *b, size_t n) {
+        if (b->oom)
+                return NULL;
+
+        if (b->size + n > b->allocated) {
+                size_t a;
+                char *d;
+
+                a = MAX(b->size + n, b->allocated * 2);
+
+                if (b->on_heap)
+                        d = realloc(b->data, a);
+                else {
+                        d = malloc(a);
+                        if (d)
+                                memcpy(d, b->data, b->size);
+                }
+                if (!d) {
+                        b->oom = true;
+                        return NULL;
+                }
+
+                b->data = d;
+                b->allocated = a;
+                b->on_heap = true;
+        }
+
+        return b->data + b->size;
+}
+
+static void output_buffer_append(OutputBuffer *b, const void *p, size_t n) {
+        char *d;
+
+        d = output_buffer_reserve(b, n);
+        if (!d)
+                return;
+
+        memcpy(d, p, n);
+        b->size += n;
+}
+
+static void output_buffer_putc(OutputBuffer *b, char c) {
+        output_buffer_append(b, &c, 1);
+}
+
+static void output_buffer_puts(OutputBuffer *b, const char *s) {
+        output_buffer_append(b, s, strlen(s));
+}
+
+static void output_buffer_printf(OutputBuffer *b, const char *format, ...) _printf_(2, 3);
+
+static void output_buffer_printf(OutputBuffer *b, const char *format, ...) {
+        va_list ap;
+        char *d;
+        int k;
+
+        d = output_buffer_reserve(b, 64);
+        if (!d)
+                return;
+
+        va_start(ap, format);
+        k = vsnprintf(d, b->allocated - b->size, format, ap);
+        va_end(ap);
+
+        if (k < 0) {
+                b->oom = true;
+                return;
+        }
+
+        if ((size_t) k >= b->allocated - b->size) {
+                d = output_buffer_reserve(b, k + 1);
+                if (!d)
+                        return;
+
+                va_start(ap, format);
+                vsnprintf(d, k + 1, format, ap);
+                va_end(ap);
+        }
+
+        b->size += k;
+}
+
+static int output_buffer_flush(OutputBuffer *b, FILE *f) {
+        if (b->oom)
+                return log_oom();
+
+        fwrite(b->data, 1, b->size, f);
+        return 0;
+}
+
+#define BYTES_ONES  UINT64_C(0x0101010101010101)
+#define BYTES_HIGHS UINT64_C(0x8080808080808080)
+
+/* Non-zero if any byte in x is smaller than n (n <= 128) */
+#define BYTES_HAS_LESS(x, n) (((x) - BYTES_ONES * (n)) & ~(x) & BYTES_HIGHS)
+/* Non-zero if any byte in x equals c */
+#define BYTES_HAS(x, c) BYTES_HAS_LESS((x) ^ (BYTES_ONES * (c)), 1)
+
+static inline bool char_is_plain(char c, bool json) {
+        if (json && IN_SET(c, '"', '\\'))
+                return false;
+
+        return (uint8_t) c >= ' ' && (uint8_t) c < 127;
+}
+
+/* Returns the length of the prefix of p that is printable ASCII and
+ * can be passed on as is, in JSON strings additionally excluding '"'
+ * and '\\'. Looks at eight bytes at a time, since most fields consist
+ * of nothing else. */
+static size_t plain_prefix(const char *p, size_t l, bool json) {
+        size_t i = 0;
+
+        for (;;) {
+                size_t end;
+
+                for (; i + 8 <= l; i += 8) {
+                        uint64_t x, t;
+
+                        memcpy(&x, p + i, 8);
+
+                        t = BYTES_HAS_LESS(x, ' ') | BYTES_HAS(x, 127) | (x & BYTES_HIGHS);
+                        if (json)
+                                t |= BYTES_HAS(x, '"') | BYTES_HAS(x, '\\');
+                        if (t)
+                                break;
+                }
+
+                end = MIN(i + 8, l);
+                for (; i < end; i++)
+                        if (!char_is_plain(p[i], json))
+                                return i;
+
+                if (i >= l)
+                        return l;
+        }
+}
+
 static int output_export(
                 FILE *f,
                 sd_journal *j,
@@ -530,6 +691,8 @@ static int output_export(
         _cleanup_free_ char *cursor = NULL;
         const void *data;
         size_t length;
+        char stack[OUTPUT_BUFFER_STACK];
+        OutputBuffer b;
 
         assert(j);
 
@@ -547,15 +710,17 @@ static int output_export(
         if (r < 0)
                 return log_error_errno(r, "Failed to get cursor: %m");
 
-        fprintf(f,
-                "__CURSOR=%s\n"
-                "__REALTIME_TIMESTAMP="USEC_FMT"\n"
-                "__MONOTONIC_TIMESTAMP="USEC_FMT"\n"
-                "_BOOT_ID=%s\n",
-                cursor,
-                realtime,
-                monotonic,
-                sd_id128_to_string(boot_id, sid));
+        output_buffer_init(&b, stack, sizeof(stack));
+
+        output_buffer_printf(&b,
+                             "__CURSOR=%s\n"
+                             "__REALTIME_TIMESTAMP="USEC_FMT"\n"
+                             "__MONOTONIC_TIMESTAMP="USEC_FMT"\n"
+                             "_BOOT_ID=%s\n",
+                             cursor,
+                             realtime,
+                             monotonic,
+                             sd_id128_to_string(boot_id, sid));
 
         JOURNAL_FOREACH_DATA_RETVAL(j, data, length, r) {
 
@@ -565,8 +730,9 @@ static int output_export(
                     startswith(data, "_BOOT_ID="))
                         continue;
 
-                if (utf8_is_printable_newline(data, length, false))
-                        fwrite(data, length, 1, f);
+                if (plain_prefix(data, length, false) == length ||
+                    utf8_is_printable_newline(data, length, false))
+                        output_buffer_append(&b, data, length);
                 else {
                         const char *c;
                         uint64_t le64;
@@ -574,138 +740,149 @@ static int output_export(
                         c = memchr(data, '=', length);
                         if (!c) {
                                 log_error("Invalid field.");
-                                return -EINVAL;
+                                r = -EINVAL;
+                                goto finish;
                         }
 
-                        fwrite(data, c - (const char*) data, 1, f);
-                        fputc('\n', f);
+                        output_buffer_append(&b, data, c - (const char*) data);
+                        output_buffer_putc(&b, '\n');
                         le64 = htole64(length - (c - (const char*) data) - 1);
-                        fwrite(&le64, sizeof(le64), 1, f);
-                        fwrite(c + 1, length - (c - (const char*) data) - 1, 1, f);
+                        output_buffer_append(&b, &le64, sizeof(le64));
+                        output_buffer_append(&b, c + 1, length - (c - (const char*) data) - 1);
                 }
 
-                fputc('\n', f);
+                output_buffer_putc(&b, '\n');
         }
 
         if (r < 0)
-                return r;
+                goto finish;
 
-        fputc('\n', f);
+        output_buffer_putc(&b, '\n');
 
-        return 0;
+        r = output_buffer_flush(&b, f);
+
+finish:
+        output_buffer_done(&b);
+        return r;
 }
 
-void json_escape(
-                FILE *f,
+static void json_escape_buffer(
+                OutputBuffer *b,
                 const char* p,
                 size_t l,
                 OutputFlags flags) {
 
-        assert(f);
+        size_t k;
+
+        assert(b);
         assert(p);
 
-        if (!(flags & OUTPUT_SHOW_ALL) && l >= JSON_THRESHOLD)
-                fputs("null", f);
+        if (!(flags & OUTPUT_SHOW_ALL) && l >= JSON_THRESHOLD) {
+                output_buffer_puts(b, "null");
+                return;
+        }
+
+        /* The common case: nothing to escape */
+        k = plain_prefix(p, l, true);
+        if (k == l) {
+                char *d;
+
+                d = output_buffer_reserve(b, l + 2);
+                if (!d)
+                        return;
+
+                d[0] = '"';
+                memcpy(d + 1, p, l);
+                d[l + 1] = '"';
+                b->size += l + 2;
+
+                return;
+        }
 
-        else if (!utf8_is_printable(p, l)) {
+        if (!utf8_is_printable(p, l)) {
                 bool not_first = false;
 
-                fputs("[ ", f);
+                output_buffer_puts(b, "[ ");
 
                 while (l > 0) {
                         if (not_first)
-                                fprintf(f, ", %u", (uint8_t) *p);
+                                output_buffer_printf(b, ", %u", (uint8_t) *p);
                         else {
                                 not_first = true;
-                                fprintf(f, "%u", (uint8_t) *p);
+                                output_buffer_printf(b, "%u", (uint8_t) *p);
                         }
 
                         p++;
                         l--;
                 }
 
-                fputs(" ]", f);
-        } else {
-                fputc('\"', f);
+                output_buffer_puts(b, " ]");
+                return;
+        }
 
-                while (l > 0) {
-                        if (*p == '"' || *p == '\\') {
-                                fputc('\\', f);
-                                fputc(*p, f);
-                        } else if (*p == '\n')
-                                fputs("\\n", f);
-                        else if ((uint8_t) *p < ' ')
-                                fprintf(f, "\\u%04x", (uint8_t) *p);
-                        else
-                                fputc(*p, f);
+        output_buffer_putc(b, '\"');
 
-                        p++;
-                        l--;
-                }
+        for (;;) {
+                output_buffer_append(b, p, k);
+                p += k;
+                l -= k;
+
+                if (l == 0)
+                        break;
+
+                if (*p == '"' || *p == '\\') {
+                        output_buffer_putc(b, '\\');
+                        output_buffer_putc(b, *p);
+                } else if (*p == '\n')
+                        output_buffer_puts(b, "\\n");
+                else if ((uint8_t) *p < ' ')
+                        output_buffer_printf(b, "\\u%04x", (uint8_t) *p);
+                else
+                        output_buffer_putc(b, *p);
 
-                fputc('\"', f);
+                p++;
+                l--;
+
+                k = plain_prefix(p, l, true);
         }
+
+        output_buffer_putc(b, '\"');
 }
 
-static int output_json(
+void json_escape(
                 FILE *f,
+                const char* p,
+                size_t l,
+                OutputFlags flags) {
+
+        char stack[OUTPUT_BUFFER_STACK];
+        OutputBuffer b;
+
+        assert(f);
+        assert(p);
+
+        output_buffer_init(&b, stack, sizeof(stack));
+        json_escape_buffer(&b, p, l, flags);
+        (void) output_buffer_flush(&b, f);
+        output_buffer_done(&b);
+}
+
+/* Prints fields that appear more than once in an entry as arrays.
+ * This needs a second pass over the entry for each such field, and
+ * is only used for the few entries that have any. */
+static int output_json_fields_merged(
+                OutputBuffer *b,
                 sd_journal *j,
                 OutputMode mode,
-                unsigned n_columns,
                 OutputFlags flags) {
 
-        uint64_t realtime, monotonic;
-        _cleanup_free_ char *cursor = NULL;
         const void *data;
         size_t length;
-        sd_id128_t boot_id;
-        char sid[33], *k;
+        char *k;
         int r;
         Hashmap *h = NULL;
         bool done, separator;
 
-        assert(j);
-
-        sd_journal_set_data_threshold(j, flags & OUTPUT_SHOW_ALL ? 0 : JSON_THRESHOLD);
-
-        r = sd_journal_get_realtime_usec(j, &realtime);
-        if (r < 0)
-                return log_error_errno(r, "Failed to get realtime timestamp: %m");
-
-        r = sd_journal_get_monotonic_usec(j, &monotonic, &boot_id);
-        if (r < 0)
-                return log_error_errno(r, "Failed to get monotonic timestamp: %m");
-
-        r = sd_journal_get_cursor(j, &cursor);
-        if (r < 0)
-                return log_error_errno(r, "Failed to get cursor: %m");
-
-        if (mode == OUTPUT_JSON_PRETTY)
-                fprintf(f,
-                        "{\n"
-                        "\t\"__CURSOR\" : \"%s\",\n"
-                        "\t\"__REALTIME_TIMESTAMP\" : \""USEC_FMT"\",\n"
-                        "\t\"__MONOTONIC_TIMESTAMP\" : \""USEC_FMT"\",\n"
-                        "\t\"_BOOT_ID\" : \"%s\"",
-                        cursor,
-                        realtime,
-                        monotonic,
-                        sd_id128_to_string(boot_id, sid));
-        else {
-                if (mode == OUTPUT_JSON_SSE)
-                        fputs("data: ", f);
-
-                fprintf(f,
-                        "{ \"__CURSOR\" : \"%s\", "
-                        "\"__REALTIME_TIMESTAMP\" : \""USEC_FMT"\", "
-                        "\"__MONOTONIC_TIMESTAMP\" : \""USEC_FMT"\", "
-                        "\"_BOOT_ID\" : \"%s\"",
-                        cursor,
-                        realtime,
-                        monotonic,
-                        sd_id128_to_string(boot_id, sid));
-        }
-
         h = hashmap_new(&string_hash_ops);
         if (!h)
                 return log_oom();
@@ -749,7 +926,7 @@ static int output_json(
         }
 
         if (r < 0)
-                return r;
+                goto finish;
 
         separator = true;
         do {
@@ -773,9 +950,9 @@ static int output_json(
 
                         if (separator) {
                                 if (mode == OUTPUT_JSON_PRETTY)
-                                        fputs(",\n\t", f);
+                                        output_buffer_puts(b, ",\n\t");
                                 else
-                                        fputs(", ", f);
+                                        output_buffer_puts(b, ", ");
                         }
 
                         m = eq - (const char*) data;
@@ -796,10 +973,10 @@ static int output_json(
                         } else if (u == 1) {
                                 /* Field only appears once, output it directly */
 
-                                json_escape(f, data, m, flags);
-                                fputs(" : ", f);
+                                json_escape_buffer(b, data, m, flags);
+                                output_buffer_puts(b, " : ");
 
-                                json_escape(f, eq + 1, length - m - 1, flags);
+                                json_escape_buffer(b, eq + 1, length - m - 1, flags);
 
                                 hashmap_remove(h, n);
                                 free(kk);
@@ -811,9 +988,9 @@ static int output_json(
 
                         } else {
                                 /* Field appears multiple times, output it as array */
-                                json_escape(f, data, m, flags);
-                                fputs(" : [ ", f);
-                                json_escape(f, eq + 1, length - m - 1, flags);
+                                json_escape_buffer(b, data, m, flags);
+                                output_buffer_puts(b, " : [ ");
+                                json_escape_buffer(b, eq + 1, length - m - 1, flags);
 
                                 /* Iterate through the end of the list */
 
@@ -827,11 +1004,11 @@ static int output_json(
                                         if (((const char*) data)[m] != '=')
                                                 continue;
 
-                                        fputs(", ", f);
-                                        json_escape(f, (const char*) data + m + 1, length - m - 1, flags);
+                                        output_buffer_puts(b, ", ");
+                                        json_escape_buffer(b, (const char*) data + m + 1, length - m - 1, flags);
                                 }
 
-                                fputs(" ]", f);
+                                output_buffer_puts(b, " ]");
 
                                 hashmap_remove(h, n);
                                 free(kk);
@@ -847,13 +1024,6 @@ static int output_json(
 
         } while (!done);
 
-        if (mode == OUTPUT_JSON_PRETTY)
-                fputs("\n}\n", f);
-        else if (mode == OUTPUT_JSON_SSE)
-                fputs("}\n\n", f);
-        else
-                fputs(" }\n", f);
-
         r = 0;
 
 finish:
@@ -865,6 +1035,161 @@ finish:
         return r;
 }
 
+/* Entries with more fields than this are handled by the slow path */
+#define JSON_FIELDS_MAX 128
+
+static int output_json(
+                FILE *f,
+                sd_journal *j,
+                OutputMode mode,
+                unsigned n_columns,
+                OutputFlags flags) {
+
+        uint64_t realtime, monotonic;
+        _cleanup_free_ char *cursor = NULL;
+        const void *data;
+        size_t length;
+        sd_id128_t boot_id;
+        char sid[33];
+        int r;
+        char stack[OUTPUT_BUFFER_STACK];
+        OutputBuffer b;
+        struct {
+                size_t offset, length;
+        } names[JSON_FIELDS_MAX];
+        size_t n_names = 0, header_size;
+        bool merge = false;
+
+        assert(j);
+
+        sd_journal_set_data_threshold(j, flags & OUTPUT_SHOW_ALL ? 0 : JSON_THRESHOLD);
+
+        r = sd_journal_get_realtime_usec(j, &realtime);
+        if (r < 0)
+                return log_error_errno(r, "Failed to get realtime timestamp: %m");
+
+        r = sd_journal_get_monotonic_usec(j, &monotonic, &boot_id);
+        if (r < 0)
+                return log_error_errno(r, "Failed to get monotonic timestamp: %m");
+
+        r = sd_journal_get_cursor(j, &cursor);
+        if (r < 0)
+                return log_error_errno(r, "Failed to get cursor: %m");
+
+        output_buffer_init(&b, stack, sizeof(stack));
+
+        if (mode == OUTPUT_JSON_PRETTY)
+                output_buffer_printf(&b,
+                                     "{\n"
+                                     "\t\"__CURSOR\" : \"%s\",\n"
+                                     "\t\"__REALTIME_TIMESTAMP\" : \""USEC_FMT"\",\n"
+                                     "\t\"__MONOTONIC_TIMESTAMP\" : \""USEC_FMT"\",\n"
+                                     "\t\"_BOOT_ID\" : \"%s\"",
+                                     cursor,
+                                     realtime,
+                                     monotonic,
+                                     sd_id128_to_string(boot_id, sid));
+        else {
+                if (mode == OUTPUT_JSON_SSE)
+                        output_buffer_puts(&b, "data: ");
+
+                output_buffer_printf(&b,
+                                     "{ \"__CURSOR\" : \"%s\", "
+                                     "\"__REALTIME_TIMESTAMP\" : \""USEC_FMT"\", "
+                                     "\"__MONOTONIC_TIMESTAMP\" : \""USEC_FMT"\", "
+                                     "\"_BOOT_ID\" : \"%s\"",
+                                     cursor,
+                                     realtime,
+                                     monotonic,
+                                     sd_id128_to_string(boot_id, sid));
+        }
+
+        header_size = b.size;
+
+        /* Print the fields in a single pass, and remember the names
+         * printed so far. Should a name show up a second time, start
+         * over and collect the values of such fields into arrays. */
+        JOURNAL_FOREACH_DATA_RETVAL(j, data, length, r) {
+                const char *eq;
+                size_t m, i, start;
+
+                /* We already printed the boot id, from the data in
+                 * the header, hence let's suppress it here */
+                if (length >= 9 &&
+                    memcmp(data, "_BOOT_ID=", 9) == 0)
+                        continue;
+
+                eq = memchr(data, '=', length);
+                if (!eq)
+                        continue;
+
+                m = eq - (const char*) data;
+
+                if (n_names >= JSON_FIELDS_MAX) {
+                        merge = true;
+                        break;
+                }
+
+                for (i = 0; i < n_names; i++)
+                        if (names[i].length == m &&
+                            memcmp(b.data + names[i].offset, data, m) == 0)
+                                break;
+                if (i < n_names) {
+                        merge = true;
+                        break;
+                }
+
+                if (mode == OUTPUT_JSON_PRETTY)
+                        output_buffer_puts(&b, ",\n\t");
+                else
+                        output_buffer_puts(&b, ", ");
+
+                start = b.size;
+                json_escape_buffer(&b, data, m, flags);
+                if (b.oom)
+                        break;
+
+                /* Field names are plain ASCII virtually always, and
+                 * then end up unmodified right behind the opening
+                 * quote. If not, take the slow path to be safe. */
+                if (b.size - start != m + 2 || b.data[start] != '"') {
+                        merge = true;
+                        break;
+                }
+
+                names[n_names].offset = start + 1;
+                names[n_names].length = m;
+                n_names++;
+
+                output_buffer_puts(&b, " : ");
+                json_escape_buffer(&b, eq + 1, length - m - 1, flags);
+        }
+
+        if (r < 0)
+                goto finish;
+
+        if (merge) {
+                b.size = header_size;
+
+                r = output_json_fields_merged(&b, j, mode, flags);
+                if (r < 0)
+                        goto finish;
+        }
+
+        if (mode == OUTPUT_JSON_PRETTY)
+                output_buffer_puts(&b, "\n}\n");
+        else if (mode == OUTPUT_JSON_SSE)
+                output_buffer_puts(&b, "}\n\n");
+        else
+                output_buffer_puts(&b, " }\n");
+
+        r = output_buffer_flush(&b, f);
+
+finish:
+        output_buffer_done(&b);
+        return r;
+}
+
 static int output_cat(
                 FILE *f,
                 sd_journal *j,
@@ -74,6 +74,8 @@ typedef int (*sd_event_child_handler_t)(sd_event_source *s, const siginfo_t *si,
 #else
 typedef void* sd_event_child_handler_t;
 #endif
+typedef int (*sd_event_work_handler_t)(void *userdata);
+typedef int (*sd_event_work_done_handler_t)(sd_event_source *s, int result, void *userdata);
 
 int sd_event_default(sd_event **e);
 
@@ -88,6 +90,7 @@ int sd_event_add_child(sd_event *e, sd_event_source **s, pid_t pid, int options,
 int sd_event_add_defer(sd_event *e, sd_event_source **s, sd_event_handler_t callback, void *userdata);
 int sd_event_add_post(sd_event *e, sd_event_source **s, sd_event_handler_t callback, void *userdata);
 int sd_event_add_exit(sd_event *e, sd_event_source **s, sd_event_handler_t callback, void *userdata);
+int sd_event_add_work(sd_event *e, sd_event_source **s, sd_event_work_handler_t work, sd_event_work_done_handler_t done, void *userdata);
 
 int sd_event_prepare(sd_event *e);
 int sd_event_wait(sd_event *e, uint64_t usec);
@@ -104,6 +107,12 @@ int sd_event_get_tid(sd_event *e, pid_t *tid);
 int sd_event_get_exit_code(sd_event *e, int *code);
 int sd_event_set_watchdog(sd_event *e, int b);
 int sd_event_get_watchdog(sd_event *e);
+int sd_event_set_dispatch_batch(sd_event *e, int b);
+int sd_event_get_dispatch_batch(sd_event *e);
+int sd_event_set_timer_wheel(sd_event *e, int b);
+int sd_event_get_timer_wheel(sd_event *e);
+int sd_event_set_worker_threads(sd_event *e, unsigned n);
+int sd_event_get_worker_threads(sd_event *e, unsigned *n);
 
 sd_event_source* sd_event_source_ref(sd_event_source *s);
 sd_event_source* sd_event_source_unref(sd_event_source *s);
@@ -42,6 +42,7 @@ static void test_get_process_comm(void) {
         uid_t u;
         gid_t g;
         dev_t h;
+        uint64_t t;
         int r;
         pid_t me;
 
@@ -61,6 +62,9 @@ static void test_get_process_comm(void) {
         log_info("pid1 ppid: "PID_FMT, e);
         assert_se(e == 0);
 
+        assert_se(get_process_starttime(1, &t) >= 0);
+        log_info("pid1 starttime: %"PRIu64, t);
+
         assert_se(is_kernel_thread(1) == 0);
 
         r = get_process_exe(1, &f);
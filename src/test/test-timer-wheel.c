@@ -0,0 +1,166 @@
+/***
+  This file is part of systemd.
+
+  systemd is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  systemd is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with systemd; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <stdlib.h>
+
+#include "macro.h"
+#include "timer-wheel.h"
+#include "util.h"
+
+#define N_ENTRIES 1024
+
+static usec_t random_key(usec_t now) {
+        static const usec_t spread[] = {
+                10,
+                USEC_PER_MSEC,
+                100 * USEC_PER_MSEC,
+                10 * USEC_PER_SEC,
+                USEC_PER_HOUR,
+                USEC_PER_WEEK,
+                USEC_PER_YEAR * 100,
+        };
+
+        /* Mostly in the future, but some in the past as well */
+        return now - 20 * USEC_PER_MSEC + (usec_t) rand() % spread[rand() % ELEMENTSOF(spread)];
+}
+
+static usec_t brute_force_min(TimerWheelEntry *entries, bool *queued) {
+        usec_t m = USEC_INFINITY;
+        unsigned i;
+
+        for (i = 0; i < N_ENTRIES; i++)
+                if (queued[i])
+                        m = MIN(m, entries[i].key);
+
+        return m;
+}
+
+static void test_random(void) {
+        TimerWheelEntry entries[N_ENTRIES];
+        bool queued[N_ENTRIES] = {};
+        usec_t now = 1460000000 * USEC_PER_SEC;
+        unsigned i, n = 0, n_popped = 0;
+        TimerWheel *w;
+
+        srand(0);
+
+        w = timer_wheel_new(now);
+        assert_se(w);
+        assert_se(timer_wheel_isempty(w));
+        assert_se(timer_wheel_peek(w) == USEC_INFINITY);
+
+        for (i = 0; i < N_ENTRIES; i++)
+                timer_wheel_entry_init(entries + i);
+
+        for (i = 0; i < 200000; i++) {
+                unsigned k = rand() % N_ENTRIES;
+                TimerWheelEntry *e;
+
+                switch (rand() % 4) {
+
+                case 0:
+                case 1:
+                        timer_wheel_put(w, entries + k, random_key(now));
+                        n += !queued[k];
+                        queued[k] = true;
+                        break;
+
+                case 2:
+                        timer_wheel_remove(w, entries + k);
+                        n -= queued[k];
+                        queued[k] = false;
+                        break;
+
+                case 3:
+                        /* Usually a little, sometimes a lot */
+                        now += rand() % 8 == 0 ? (usec_t) rand() % USEC_PER_DAY : (usec_t) rand() % (50 * USEC_PER_MSEC);
+
+                        while ((e = timer_wheel_pop(w, now))) {
+                                unsigned j = e - entries;
+
+                                assert_se(j < N_ENTRIES);
+                                assert_se(queued[j]);
+                                assert_se(e->key <= now);
+                                assert_se(e->slot == TIMER_WHEEL_IDX_NULL);
+
+                                queued[j] = false;
+                                n--;
+                                n_popped++;
+                        }
+
+                        /* Nothing that is due may be left behind */
+                        assert_se(brute_force_min(entries, queued) > now);
+                        break;
+                }
+
+                assert_se(timer_wheel_size(w) == n);
+                assert_se(timer_wheel_peek(w) == brute_force_min(entries, queued));
+        }
+
+        assert_se(n_popped > 0);
+
+        for (i = 0; i < N_ENTRIES; i++)
+                timer_wheel_remove(w, entries + i);
+
+        assert_se(timer_wheel_isempty(w));
+        assert_se(timer_wheel_pop(w, USEC_INFINITY - 1) == NULL);
+
+        timer_wheel_free(w);
+}
+
+static void test_order(void) {
+        TimerWheelEntry entries[N_ENTRIES];
+        usec_t now = 0, last = 0;
+        unsigned i, n = 0;
+        TimerWheel *w;
+
+        srand(1);
+
+        w = timer_wheel_new(now);
+        assert_se(w);
+
+        for (i = 0; i < N_ENTRIES; i++) {
+                timer_wheel_entry_init(entries + i);
+                timer_wheel_put(w, entries + i, 1 + (usec_t) rand() % USEC_PER_HOUR);
+        }
+
+        /* Popping with the minimum as time returns entries in order */
+        while (!timer_wheel_isempty(w)) {
+                TimerWheelEntry *e;
+
+                now = timer_wheel_peek(w);
+                assert_se(now >= last);
+
+                e = timer_wheel_pop(w, now);
+                assert_se(e);
+                assert_se(e->key == now);
+
+                last = now;
+                n++;
+        }
+
+        assert_se(n == N_ENTRIES);
+
+        timer_wheel_free(w);
+}
+
+int main(int argc, char **argv) {
+        test_random();
+        test_order();
+
+        return 0;
+}